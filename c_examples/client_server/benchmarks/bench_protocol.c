@@ -0,0 +1,165 @@
+/*
+ * Measures the per-message cost of the protocol layer: ns/op and allocations/op of
+ *
+ * - encode header: `encode_header`
+ * - decode header: `extract_header`
+ * - build message: `create_message` + `destroy_message`
+ * - parse message: `parse_message` + `destroy_response`
+ *
+ * for payload sizes from empty to MAX_PAYLOAD_SIZE. The process is pinned to one CPU, each benchmark
+ * is warmed up, and the median, minimum and maximum of SAMPLES timed batches are reported, so that a
+ * change in the per-chunk cost shows up as a shift in the median rather than noise.
+ *
+ * Allocations are counted by wrapping malloc/calloc/realloc at link time (`-Wl,--wrap=malloc`), which
+ * only affects calls made by this program and the statically linked protocol library.
+ */
+#include "protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+
+#define SAMPLES 21
+#define ITERATIONS 100000
+
+static unsigned long _allocations = 0;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* pointer, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    _allocations++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    _allocations++;
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* pointer, size_t size) {
+    _allocations++;
+    return __real_realloc(pointer, size);
+}
+
+// results are folded into this so the compiler can't drop the work being measured
+static volatile uint32_t _sink;
+
+static uint8_t _payload[MAX_PAYLOAD_SIZE];
+static uint8_t _message[MAX_MESSAGE_SIZE];
+
+typedef struct {
+    const char* name;
+    void (*run)(uint32_t payload_size, long iterations);
+} Benchmark;
+
+static double _now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+static int _compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void _encode_header(uint32_t payload_size, long iterations) {
+    Header header = {MESSAGE_RESPONSE_CHUNK, COMMAND_REQUEST_FILE, payload_size, 0, STATUS_OK, 1};
+    uint8_t data[HEADER_SIZE];
+    for (long i = 0; i < iterations; i++) {
+        header.chunk_index = i;
+        encode_header(&header, data);
+        _sink += data[HEADER_OFFSET_CHUNK_INDEX + 3];
+    }
+}
+
+static void _decode_header(uint32_t payload_size, long iterations) {
+    Header header;
+    for (long i = 0; i < iterations; i++) {
+        extract_header(_message, HEADER_SIZE + payload_size, &header);
+        _sink += header.payload_size;
+    }
+}
+
+static void _build_message(uint32_t payload_size, long iterations) {
+    Header header = {MESSAGE_RESPONSE_CHUNK, COMMAND_REQUEST_FILE, payload_size, 0, STATUS_OK, 1};
+    Message message;
+    for (long i = 0; i < iterations; i++) {
+        header.chunk_index = i;
+        create_message(&header, _payload, &message);
+        _sink += message.data[message.size - 1];
+        destroy_message(&message);
+    }
+}
+
+static void _parse_message(uint32_t payload_size, long iterations) {
+    Response response;
+    for (long i = 0; i < iterations; i++) {
+        parse_message(_message, HEADER_SIZE + payload_size, &response);
+        _sink += response.header.payload_size;
+        destroy_response(&response);
+    }
+}
+
+/**
+ * Pins the process to the CPU it is running on, so that samples aren't skewed by migrations.
+ */
+static void _pin_cpu(void) {
+    int cpu = sched_getcpu();
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (cpu == -1 || sched_setaffinity(0, sizeof(cpus), &cpus) == -1) {
+        perror("warning: could not pin the CPU");
+        return;
+    }
+    printf("pinned to CPU %d; %d samples of %d iterations\n\n", cpu, SAMPLES, ITERATIONS);
+}
+
+static void _run_benchmark(const Benchmark* benchmark, uint32_t payload_size) {
+    Header header = {MESSAGE_RESPONSE_CHUNK, COMMAND_REQUEST_FILE, payload_size, 0, STATUS_OK, 1};
+    encode_header(&header, _message);
+    memcpy(_message + HEADER_SIZE, _payload, payload_size);
+
+    // warm up caches, branch predictors and the allocator's free lists
+    benchmark->run(payload_size, ITERATIONS);
+
+    double samples[SAMPLES];
+    unsigned long allocations = _allocations;
+    for (int i = 0; i < SAMPLES; i++) {
+        double start = _now_ns();
+        benchmark->run(payload_size, ITERATIONS);
+        samples[i] = (_now_ns() - start) / ITERATIONS;
+    }
+    double allocations_per_op = (double)(_allocations - allocations) / ((double)SAMPLES * ITERATIONS);
+    qsort(samples, SAMPLES, sizeof(double), _compare_doubles);
+    printf("%-16s %8u %12.1f %10.1f %10.1f %12.2f\n", benchmark->name, payload_size, samples[SAMPLES / 2],
+        samples[0], samples[SAMPLES - 1], allocations_per_op);
+}
+
+int main(void) {
+    _pin_cpu();
+    for (size_t i = 0; i < sizeof(_payload); i++) {
+        _payload[i] = (uint8_t)i;
+    }
+    Benchmark benchmarks[] = {
+        {"encode header", _encode_header},
+        {"decode header", _decode_header},
+        {"build message", _build_message},
+        {"parse message", _parse_message},
+    };
+    uint32_t payload_sizes[] = {0, 64, 256, MAX_PAYLOAD_SIZE};
+    printf("%-16s %8s %12s %10s %10s %12s\n", "benchmark", "payload", "median ns/op", "min", "max", "allocs/op");
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+        // the header benchmarks don't depend on the payload size
+        size_t sizes = i < 2 ? 1 : sizeof(payload_sizes) / sizeof(payload_sizes[0]);
+        for (size_t j = 0; j < sizes; j++) {
+            _run_benchmark(&benchmarks[i], payload_sizes[j]);
+        }
+    }
+    return 0;
+}
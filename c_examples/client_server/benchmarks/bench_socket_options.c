@@ -0,0 +1,207 @@
+/*
+ * Measures the latency and throughput effect of each SocketOptions setting on loopback.
+ *
+ * For each configuration a server thread is started with the options applied to the listening and
+ * accepted sockets, and the client connects with the same options. Three things are measured:
+ *
+ * - connect: time to connect, send one request and receive the response on a fresh connection
+ * - round trip: request/response latency on an established connection (median and p99)
+ * - throughput: MAX_MESSAGE_SIZE messages streamed to the server, acknowledged once at the end
+ *
+ * The last configuration uses a unix domain socket instead of TCP for comparison.
+ */
+#include "sockets.h"
+#include "protocol.h"
+#include "file_transfer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define PORT 9102
+#define ADDRESS "127.0.0.1"
+#define UNIX_SOCKET_PATH "/tmp/client_server_bench.sock"
+
+#define CONNECT_ITERATIONS 200
+#define ROUND_TRIP_ITERATIONS 5000
+#define THROUGHPUT_BYTES (256L * 1024 * 1024)
+#define SMALL_PAYLOAD_SIZE 64
+
+// the benchmark reuses the protocol framing; the commands below are only understood by this benchmark
+#define BENCH_COMMAND_PING 100
+#define BENCH_COMMAND_BULK 101
+#define BENCH_COMMAND_BULK_END 102
+#define BENCH_COMMAND_STOP 103
+
+typedef struct {
+    const char* name;
+    SocketOptions options;
+    int use_unix_socket;
+} BenchConfig;
+
+typedef struct {
+    int server_socket;
+    const SocketOptions* options;
+} ServerArgs;
+
+static double _now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+static int _compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static int _send_bench_message(int socket, uint8_t message_type, uint8_t command, const uint8_t* payload, uint32_t payload_size) {
+    Header header = {message_type, command, payload_size, 0, STATUS_OK};
+    Message message;
+    if (create_message(&header, payload, &message) != STATUS_OK) {
+        return -1;
+    }
+    ssize_t bytes_sent = send_all(socket, message.data, message.size);
+    destroy_message(&message);
+    return bytes_sent == -1 ? -1 : 0;
+}
+
+/**
+ * Serves connections one at a time until a BENCH_COMMAND_STOP message is received.
+ */
+static void* _server_worker(void* arg) {
+    ServerArgs* args = (ServerArgs*)arg;
+    uint8_t buffer[MAX_MESSAGE_SIZE];
+    uint8_t payload[SMALL_PAYLOAD_SIZE] = {0};
+    int running = 1;
+    while (running) {
+        int client_socket = accept_or_die(args->server_socket, args->options);
+        ssize_t bytes_received;
+        while ((bytes_received = receive_message(client_socket, buffer, sizeof(buffer))) > 0) {
+            Header header;
+            extract_header(buffer, bytes_received, &header);
+            if (header.command == BENCH_COMMAND_STOP) {
+                running = 0;
+                break;
+            }
+            if (header.command == BENCH_COMMAND_PING || header.command == BENCH_COMMAND_BULK_END) {
+                _send_bench_message(client_socket, MESSAGE_RESPONSE, header.command, payload, sizeof(payload));
+                socket_flush(client_socket);
+            }
+            // TCP_QUICKACK is reset by the kernel, so re-arm it after each receive like a real server would
+            if (args->options->tcp_quickack) {
+                apply_socket_options(client_socket, &(SocketOptions){.tcp_quickack = 1}, 0);
+            }
+        }
+        socket_cleanup(client_socket);
+    }
+    return NULL;
+}
+
+static int _ping(int socket, const SocketOptions* options) {
+    uint8_t buffer[MAX_MESSAGE_SIZE];
+    uint8_t payload[SMALL_PAYLOAD_SIZE] = {0};
+    if (_send_bench_message(socket, MESSAGE_REQUEST, BENCH_COMMAND_PING, payload, sizeof(payload)) == -1) {
+        return -1;
+    }
+    socket_flush(socket);
+    if (receive_message(socket, buffer, sizeof(buffer)) <= 0) {
+        return -1;
+    }
+    if (options->tcp_quickack) {
+        apply_socket_options(socket, &(SocketOptions){.tcp_quickack = 1}, 0);
+    }
+    return 0;
+}
+
+static void _run_config(const BenchConfig* config) {
+    const char* address = config->use_unix_socket ? UNIX_ADDRESS_PREFIX UNIX_SOCKET_PATH : ADDRESS;
+    int server_socket = config->use_unix_socket ? bind_unix_or_die(UNIX_SOCKET_PATH, &config->options) : bind_or_die(PORT, &config->options);
+    listen_or_die(server_socket, config->options.backlog);
+    ServerArgs args = {server_socket, &config->options};
+    pthread_t server_thread;
+    if (pthread_create(&server_thread, NULL, _server_worker, &args) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+
+    // connection setup + first request
+    double start = _now_us();
+    for (int i = 0; i < CONNECT_ITERATIONS; i++) {
+        int socket = connect_with_retry_or_die(address, PORT, 3, 1, &config->options);
+        _ping(socket, &config->options);
+        socket_cleanup(socket);
+    }
+    double connect_us = (_now_us() - start) / CONNECT_ITERATIONS;
+
+    // round trips on an established connection
+    int socket = connect_with_retry_or_die(address, PORT, 3, 1, &config->options);
+    double* samples = malloc(sizeof(double) * ROUND_TRIP_ITERATIONS);
+    if (samples == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < ROUND_TRIP_ITERATIONS; i++) {
+        double round_trip_start = _now_us();
+        _ping(socket, &config->options);
+        samples[i] = _now_us() - round_trip_start;
+    }
+    qsort(samples, ROUND_TRIP_ITERATIONS, sizeof(double), _compare_doubles);
+    double median_us = samples[ROUND_TRIP_ITERATIONS / 2];
+    double p99_us = samples[(int)(ROUND_TRIP_ITERATIONS * 0.99)];
+    free(samples);
+
+    // bulk throughput; chunks are pre-built so that we measure the socket rather than create_message
+    Message chunk;
+    uint8_t payload[MAX_PAYLOAD_SIZE];
+    memset(payload, 'a', sizeof(payload));
+    Header header = {MESSAGE_REQUEST, BENCH_COMMAND_BULK, MAX_PAYLOAD_SIZE, 0, STATUS_OK};
+    create_message(&header, payload, &chunk);
+    long total_chunks = THROUGHPUT_BYTES / MAX_PAYLOAD_SIZE;
+    start = _now_us();
+    for (long i = 0; i < total_chunks; i++) {
+        send_all(socket, chunk.data, chunk.size);
+    }
+    uint8_t buffer[MAX_MESSAGE_SIZE];
+    _send_bench_message(socket, MESSAGE_REQUEST, BENCH_COMMAND_BULK_END, NULL, 0);
+    socket_flush(socket);
+    receive_message(socket, buffer, sizeof(buffer));
+    double throughput_mb_s = (THROUGHPUT_BYTES / (1024.0 * 1024.0)) / ((_now_us() - start) / 1e6);
+    destroy_message(&chunk);
+
+    _send_bench_message(socket, MESSAGE_REQUEST, BENCH_COMMAND_STOP, NULL, 0);
+    socket_flush(socket);
+    socket_cleanup(socket);
+    pthread_join(server_thread, NULL);
+    socket_cleanup(server_socket);
+    if (config->use_unix_socket) {
+        unlink(UNIX_SOCKET_PATH);
+    }
+
+    printf("%-22s %12.1f %12.1f %12.1f %14.1f\n", config->name, connect_us, median_us, p99_us, throughput_mb_s);
+}
+
+int main(void) {
+    BenchConfig configs[] = {
+        {"default", SOCKET_OPTIONS_INIT},
+        {"nodelay", {.tcp_nodelay = 1, .backlog = 1}},
+        {"cork", {.tcp_cork = 1, .backlog = 1}},
+        {"sndbuf/rcvbuf 64K", {.send_buffer_size = 64 * 1024, .receive_buffer_size = 64 * 1024, .backlog = 1}},
+        {"sndbuf/rcvbuf 4M", {.send_buffer_size = 4 * 1024 * 1024, .receive_buffer_size = 4 * 1024 * 1024, .backlog = 1}},
+        {"quickack", {.tcp_quickack = 1, .backlog = 1}},
+        {"fastopen", {.tcp_fastopen = 16, .backlog = 1}},
+        {"busy_poll 50us", {.busy_poll = 50, .backlog = 1}},
+        {"notsent_lowat 16K", {.notsent_lowat = 16 * 1024, .backlog = 1}},
+        {"backlog 128", {.backlog = 128}},
+        {"nodelay+quickack", {.tcp_nodelay = 1, .tcp_quickack = 1, .backlog = 1}},
+        {"unix socket", SOCKET_OPTIONS_INIT, 1},
+    };
+    printf("%-22s %12s %12s %12s %14s\n", "config", "connect(us)", "rtt p50(us)", "rtt p99(us)", "throughput MB/s");
+    for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+        _run_config(&configs[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * Bulk download of many files: the client's batch mode.
+ *
+ * The file names are read from a manifest (one per line, e.g. stdin), and `concurrency` threads fetch
+ * them in parallel over keep-alive connections from a connection pool, so a list of 50k files costs
+ * a handful of connections instead of 50k processes and handshakes. Each file is streamed into the
+ * output directory (under its own name, subdirectories included) and only appears there once it is
+ * complete.
+ */
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "connection_pool.h"
+#include "shard.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define BATCH_DEFAULT_CONCURRENCY 8
+
+/**
+ * @brief What a batch fetches from where.
+ *
+ * pool: the connections to the server
+ * address: the address of the server (IP address or `unix:<path>`)
+ * port: the port of the server
+ * output_directory: the directory the files are written to
+ * concurrency: the number of files fetched at once
+ * sink_flags: the flags for `request_file_to_fd` (SINK_PREALLOCATE, SINK_DROP_BEHIND)
+ * verbose: non-zero to print a line per file fetched (failures are always printed, to stderr)
+ * shards: if set, each file is fetched from the server it is placed on instead of `address`/`port`
+ */
+typedef struct {
+    ConnectionPool* pool;
+    const char* address;
+    in_addr_t port;
+    const char* output_directory;
+    size_t concurrency;
+    int sink_flags;
+    int verbose;
+    const ShardMap* shards;
+} BatchOptions;
+
+/**
+ * @brief The outcome of a batch.
+ *
+ * files: the number of file names read from the manifest
+ * fetched: the number of files written to the output directory
+ * failed: the number of files that could not be fetched or written
+ * bytes: the total size of the fetched files
+ * elapsed_ms: the duration of the batch
+ */
+typedef struct {
+    size_t files;
+    size_t fetched;
+    size_t failed;
+    uint64_t bytes;
+    uint64_t elapsed_ms;
+} BatchStats;
+
+/**
+ * @brief Fetches the files named in `manifest` (one name per line; empty lines are skipped) into the
+ * output directory.
+ *
+ * A file that fails (e.g. ERROR_FILE_NOT_FOUND, or an invalid name) is counted in `stats->failed` and
+ * doesn't stop the batch.
+ *
+ * @return STATUS_OK if the whole manifest was processed (check `stats->failed`), or
+ * ERROR_MEMORY_ALLOCATION_FAILED if the fetching threads could not be started.
+ */
+int batch_fetch(const BatchOptions* options, FILE* manifest, BatchStats* stats);
+
+#endif // BATCH_H
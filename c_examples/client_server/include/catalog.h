@@ -0,0 +1,157 @@
+/*
+ * File catalog: a memory-mapped, on-disk hash table from file name to size, modification time, inode
+ * and content hash.
+ *
+ * Without it a server knows nothing about its files when it starts, so the first requests pay for
+ * cold lookups, and every metadata request costs at least an `fstatat`. The catalog persists between
+ * runs: opening it is one `mmap`, and a lookup is a hash and a few loads from the mapping, with no
+ * lock and no file system access.
+ *
+ * Layout (host byte order; the catalog is a local cache, not an exchange format):
+ *
+ *     header:  CATALOG_HEADER_SIZE bytes: magic (CATALOG_MAGIC) | slot size | capacity | reserved |
+ *              used slots (including tombstones) | cataloged files | dirty flag | reserved
+ *     slots:   `capacity` (a power of two) slots of CATALOG_SLOT_SIZE bytes, open addressing with
+ *              linear probing on the FNV-1a hash of the name
+ *
+ * Each slot is a sequence word followed by the fields of the file (state, size, mtime, inode, content
+ * hash, a reserved word, and the name). The catalog has one writer at a time,
+ * the scanner (see `catalog_scan`), which updates a slot like a seqlock: it makes the sequence odd,
+ * stores the fields and makes it even again. A reader copies the fields and retries if the sequence
+ * was odd or changed in the meantime, so readers never block the scanner and never see a half
+ * written entry. Removed files leave a tombstone (probing continues past it) that a new file can
+ * reuse; the table is never resized, and files that don't fit are simply not cataloged.
+ *
+ * A scan only writes the slots of files that were added, changed or removed; which files it found is
+ * kept in a bitmap in the scanner's memory, so scanning an unchanged directory dirties no pages of the
+ * catalog.
+ *
+ * The catalog is only as fresh as its last scan: between scans a lookup may return the previous size
+ * and mtime of a file that was just written, and a file that was just removed is still found, with
+ * its old metadata. Callers that need the live file must fall back to the file system (e.g. on
+ * ERROR_FILE_NOT_FOUND, which also covers files that aren't cataloged).
+ *
+ * Several processes may map the same catalog (e.g. the old and the new server during an upgrade);
+ * an advisory lock on the file ensures that only one of them scans.
+ */
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define CATALOG_MAGIC "CSCAT001"
+#define CATALOG_HEADER_SIZE 64
+#define CATALOG_SLOT_SIZE 256
+// including the null terminator; longer names are not cataloged
+#define CATALOG_MAX_NAME 192
+#define CATALOG_DEFAULT_CAPACITY 65536
+#define CATALOG_DEFAULT_SCAN_INTERVAL_MS 5000
+// shorter intervals are raised to this, so that the scanner never rescans in a busy loop
+#define CATALOG_MIN_SCAN_INTERVAL_MS 10
+
+/**
+ * @brief A cataloged file.
+ *
+ * size: the size of the file
+ * mtime: the modification time of the file
+ * inode: the inode of the file
+ * hash: the 64-bit FNV-1a hash of the contents
+ */
+typedef struct {
+    uint64_t size;
+    struct timespec mtime;
+    ino_t inode;
+    uint64_t hash;
+} CatalogEntry;
+
+/**
+ * @brief An open (memory-mapped) catalog.
+ *
+ * fd: the catalog file
+ * data: the mapping of the whole catalog
+ * size: the size of the catalog
+ * capacity: the number of slots
+ * writer: non-zero while this process holds the write lock (only used by the scanning thread)
+ * seen: during a scan, one bit per slot, set if the scan found the file of the slot (only used by the
+ * scanning thread)
+ * root: the directory the scanner thread scans (NULL while it isn't running)
+ * interval_ms: the time between two scans of the scanner thread
+ * scanner: the scanner thread
+ * stop: set to stop the scanner thread
+ * mutex, wakeup: wake the scanner thread up early when it is stopped
+ */
+typedef struct {
+    int fd;
+    uint8_t* data;
+    size_t size;
+    uint64_t capacity;
+    int writer;
+    uint8_t* seen;
+    char* root;
+    uint64_t interval_ms;
+    pthread_t scanner;
+    int stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t wakeup;
+} Catalog;
+
+/**
+ * @brief Maps the catalog at `path`. A missing catalog, or one that isn't valid or doesn't have
+ * `capacity` slots, is (re)created empty.
+ *
+ * @param capacity the number of slots; rounded up to a power of two. About three quarters of them can
+ * be used.
+ * @return STATUS_OK, or ERROR_FILE_OPEN_FAILED if the catalog could not be opened, created or mapped
+ * (then `catalog` must not be closed).
+ */
+int catalog_open(Catalog* catalog, const char* path, uint64_t capacity);
+
+/**
+ * @brief Stops the scanner thread (if it was started), then unmaps and closes the catalog.
+ */
+void catalog_close(Catalog* catalog);
+
+/**
+ * @brief Looks up a file by name (relative to the scanned directory). Lock free; safe to call from any
+ * number of threads, also while the catalog is being scanned.
+ *
+ * @return STATUS_OK, or ERROR_FILE_NOT_FOUND if the file isn't cataloged.
+ */
+int catalog_lookup(const Catalog* catalog, const char* name, CatalogEntry* entry);
+
+/**
+ * @brief Brings the catalog up to date with the regular files below `root` (recursively; symbolic
+ * links are skipped). Only files whose inode, size or mtime changed since the last scan are read to
+ * hash their contents; files that are gone are removed, unless the directory could not be read
+ * completely.
+ *
+ * Must not be called from several threads at once (the scanner thread calls it).
+ *
+ * @return STATUS_OK, ERROR_FILE_OPEN_FAILED if `root` could not be read completely or another
+ * process is scanning the catalog, or ERROR_MEMORY_ALLOCATION_FAILED.
+ */
+int catalog_scan(Catalog* catalog, const char* root);
+
+/**
+ * @brief Starts a thread that scans `root` right away and then every `interval_ms` milliseconds (at
+ * least CATALOG_MIN_SCAN_INTERVAL_MS).
+ *
+ * @return 0 on success, or -1 if the thread could not be started (or is already running).
+ */
+int catalog_start_scanner(Catalog* catalog, const char* root, uint64_t interval_ms);
+
+/**
+ * @brief Stops the scanner thread and waits for it to finish (does nothing if it isn't running).
+ */
+void catalog_stop_scanner(Catalog* catalog);
+
+/**
+ * @brief Returns the number of cataloged files.
+ */
+size_t catalog_size(const Catalog* catalog);
+
+#endif // CATALOG_H
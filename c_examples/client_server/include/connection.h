@@ -0,0 +1,99 @@
+/*
+ * Serving client connections on the server.
+ *
+ * Each accepted connection is served by its own thread, which handles the requests sent on it until the
+ * client closes it or it is idle for longer than the keep-alive timeout. The connections are
+ * registered, so that a graceful upgrade can drain them: once the listening sockets have been handed
+ * to the new server, `connections_drain` wakes up every connection. A connection that is handling a
+ * request (or sending the chunks of multiplexed transfers) finishes it first; an idle connection
+ * still handles a request that is already on its way (received within CONNECTION_DRAIN_GRACE_MS).
+ * Then the connection is closed, and its client reconnects to the new server.
+ */
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include "protocol.h"
+#include "scheduler.h"
+#include "subscription.h"
+#include <pthread.h>
+
+// an idle client is disconnected after this long
+#define CONNECTION_KEEP_ALIVE_TIMEOUT_SECONDS 60
+// while draining, an idle connection waits this long for a request that was already sent
+#define CONNECTION_DRAIN_GRACE_MS 200
+
+struct ClientConnection;
+
+/**
+ * @brief The connections being served, and what they are served with.
+ *
+ * scheduler: decides which requests run when there are too many at once (see scheduler.h)
+ * notifier: takes over the connections that subscribe (see subscription.h); NULL if subscriptions
+ * are not available
+ * wakeup_fd: an eventfd that is signaled (and stays signaled) once draining starts
+ * mutex: protects `connections` and `connection_count`
+ * drained: signaled when a connection is unregistered
+ * connections: the registered connections
+ * connection_count: the number of registered connections
+ */
+typedef struct {
+    Scheduler* scheduler;
+    Notifier* notifier;
+    int wakeup_fd;
+    pthread_mutex_t mutex;
+    pthread_cond_t drained;
+    struct ClientConnection* connections;
+    int connection_count;
+} Connections;
+
+/**
+ * @brief A client connection that is being served by a worker thread.
+ *
+ * connections: the connections it is registered with
+ * socket: the client socket file descriptor
+ * next: the next registered connection
+ */
+typedef struct ClientConnection {
+    Connections* connections;
+    int socket;
+    struct ClientConnection* next;
+} ClientConnection;
+
+/**
+ * @brief Initializes `connections`, with no connections registered.
+ *
+ * @return STATUS_OK, or ERROR_FILE_OPEN_FAILED if the eventfd could not be created.
+ */
+int connections_init(Connections* connections, Scheduler* scheduler, Notifier* notifier);
+
+/**
+ * @brief Releases `connections`; all connections must have been unregistered.
+ */
+void connections_destroy(Connections* connections);
+
+/**
+ * @brief Registers a connection that is about to be served. Returns NULL if memory runs out.
+ */
+ClientConnection* connection_register(Connections* connections, int client_socket);
+
+/**
+ * @brief Unregisters (and frees) a connection that is no longer served.
+ */
+void connection_unregister(ClientConnection* connection);
+
+/**
+ * @brief Serves a registered connection until it is closed, then closes the socket (unless a
+ * subscription took it over) and unregisters the connection. A thread entry point: `arg` is the
+ * ClientConnection.
+ */
+void* connection_serve(void* arg);
+
+/**
+ * @brief Wakes up all connections to close them once their current request is handled, and waits
+ * until they are closed, for up to `timeout_seconds`.
+ *
+ * @return The number of connections still open.
+ */
+int connections_drain(Connections* connections, int timeout_seconds);
+
+#endif // CONNECTION_H
@@ -0,0 +1,108 @@
+#ifndef CONNECTION_POOL_H
+#define CONNECTION_POOL_H
+
+#include "sockets.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define POOL_ADDRESS_SIZE 128
+
+/**
+ * @brief An idle connection kept open by the pool.
+ *
+ * socket: the socket file descriptor of the server connection
+ * address: the address the connection was made to (IP address or `unix:<path>`)
+ * port: the port the connection was made to
+ * last_used_ms: `monotonic_time_ms` when the connection was checked in
+ * next: the next idle connection in the list
+ */
+typedef struct IdleConnection {
+    int socket;
+    char address[POOL_ADDRESS_SIZE];
+    in_addr_t port;
+    uint64_t last_used_ms;
+    struct IdleConnection* next;
+} IdleConnection;
+
+/**
+ * @brief A thread-safe pool of keep-alive connections to one or more servers.
+ *
+ * Requests check out a connection to a server address, use it, and check it back in so that the
+ * next request to the same address can skip the TCP handshake. Idle connections are health-checked
+ * on checkout and evicted after `idle_timeout_ms`.
+ *
+ * mutex: protects `idle` and `idle_count`
+ * idle: list of idle connections, most recently used first
+ * idle_count: number of connections in `idle`
+ * max_idle_per_address: maximum number of idle connections kept per address/port
+ * idle_timeout_ms: idle connections older than this are closed
+ * options: socket options applied to new connections
+ * retry_policy: how new connections are retried (RETRY_POLICY_INIT by default; may be changed after `connection_pool_init`)
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    IdleConnection* idle;
+    size_t idle_count;
+    size_t max_idle_per_address;
+    uint64_t idle_timeout_ms;
+    SocketOptions options;
+    RetryPolicy retry_policy;
+} ConnectionPool;
+
+/**
+ * @brief Initializes an empty pool.
+ *
+ * @param pool The pool to initialize. The caller is responsible for releasing it via `connection_pool_destroy`.
+ * @param max_idle_per_address The maximum number of idle connections kept per address/port.
+ * @param idle_timeout_ms Idle connections older than this are closed rather than reused.
+ * @param options The socket options for new connections; NULL uses the kernel defaults.
+ * @return 0 on success, or -1 if the pool could not be initialized.
+ */
+int connection_pool_init(ConnectionPool* pool, size_t max_idle_per_address, uint64_t idle_timeout_ms, const SocketOptions* options);
+
+/**
+ * @brief Closes all idle connections and releases the pool's resources.
+ *
+ * Connections that are checked out at this point are not tracked by the pool; the caller must close them.
+ */
+void connection_pool_destroy(ConnectionPool* pool);
+
+/**
+ * @brief Checks out a connection to a server, reusing a healthy idle connection if one is available.
+ *
+ * New connections are made with `connect_with_deadline` using the pool's retry policy.
+ *
+ * @param pool The pool.
+ * @param address The IP address of the server, or UNIX_ADDRESS_PREFIX followed by a unix domain socket path.
+ * @param port The port of the server.
+ * @return The socket file descriptor of the server connection, or -1 if no connection could be made.
+ */
+int connection_pool_checkout(ConnectionPool* pool, const char* address, in_addr_t port);
+
+/**
+ * @brief Returns a connection to the pool after a request.
+ *
+ * @param pool The pool.
+ * @param address The address passed to `connection_pool_checkout`.
+ * @param port The port passed to `connection_pool_checkout`.
+ * @param socket The socket returned by `connection_pool_checkout`.
+ * @param reusable Non-zero if the connection is at a message boundary and can be used for another
+ * request (see `connection_pool_is_reusable`); otherwise the connection is closed.
+ */
+void connection_pool_checkin(ConnectionPool* pool, const char* address, in_addr_t port, int socket, int reusable);
+
+/**
+ * @brief Returns non-zero if a connection can be reused after a request that returned `status`.
+ *
+ * Errors reported by the server (e.g. ERROR_FILE_NOT_FOUND) leave the connection at a message
+ * boundary; transport errors (e.g. ERROR_RECEIVE_FAILED) can leave partial messages on the socket.
+ */
+int connection_pool_is_reusable(int status);
+
+/**
+ * @brief Returns the number of idle connections in the pool.
+ */
+size_t connection_pool_idle_count(ConnectionPool* pool);
+
+#endif // CONNECTION_POOL_H
@@ -0,0 +1,137 @@
+/*
+ * rsync-style delta encoding.
+ *
+ * The side that has an old copy of a file (the basis) splits it into fixed size blocks and computes a
+ * signature for each block. The side that has the new version finds blocks of the basis in the new
+ * version, at any offset, using a rolling checksum, and describes the new version as a list of
+ * instructions: "copy basis blocks N..N+k" and "literal bytes". Only the literal bytes need to be sent.
+ */
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DELTA_MIN_BLOCK_SIZE 512
+#define DELTA_MAX_BLOCK_SIZE (64 * 1024)
+
+// size of a serialized BlockSignature (weak and strong hash in network byte order)
+#define DELTA_SIGNATURE_SIZE 12
+// size of the hash of the whole new version (SHA-256) that is sent after the instructions
+#define DELTA_FILE_HASH_SIZE 32
+
+// instruction types; a COPY is followed by the first block index and the number of blocks (uint32_t
+// each, network byte order), a LITERAL by the number of bytes (uint32_t) and the bytes themselves
+#define DELTA_INSTRUCTION_COPY 1
+#define DELTA_INSTRUCTION_LITERAL 2
+#define DELTA_COPY_INSTRUCTION_SIZE 9
+#define DELTA_LITERAL_HEADER_SIZE 5
+
+/**
+ * @brief The signature of one block of the basis file.
+ *
+ * weak: rolling checksum (`delta_weak_checksum`); cheap to compute at every offset
+ * strong: 64-bit hash (`delta_strong_hash`); only computed when the weak checksum matches
+ */
+typedef struct {
+    uint32_t weak;
+    uint64_t strong;
+} BlockSignature;
+
+/**
+ * @brief A growable buffer the file is reconstructed into by `delta_apply`.
+ *
+ * data: the reconstructed bytes
+ * size: number of bytes in `data`
+ * capacity: number of bytes allocated for `data`
+ * copied_bytes: number of bytes copied from the basis
+ * literal_bytes: number of bytes that were sent as literals
+ */
+typedef struct {
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+    size_t copied_bytes;
+    size_t literal_bytes;
+} DeltaOutput;
+
+#define DELTA_OUTPUT_INIT {NULL, 0, 0, 0, 0}
+
+/**
+ * @brief Receives the encoded instructions produced by `delta_generate`.
+ *
+ * `payload` holds at most MAX_PAYLOAD_SIZE bytes of complete instructions (so each payload can be
+ * applied on its own). `last` is non-zero for the final call, whose payload may be empty.
+ * Returns STATUS_OK to continue, or an error code to stop `delta_generate`.
+ */
+typedef int (*DeltaWriter)(const uint8_t* payload, size_t length, int last, void* context);
+
+/**
+ * @brief Returns the rolling checksum (Adler-32 style, as used by rsync) of `length` bytes.
+ */
+uint32_t delta_weak_checksum(const uint8_t* data, size_t length);
+
+/**
+ * @brief Slides the window of a weak checksum one byte forward: `removed` leaves the window and `added` enters it.
+ */
+uint32_t delta_roll_checksum(uint32_t checksum, uint8_t removed, uint8_t added, size_t block_size);
+
+/**
+ * @brief Returns the strong hash (64-bit FNV-1a) of `length` bytes.
+ */
+uint64_t delta_strong_hash(const uint8_t* data, size_t length);
+
+/**
+ * @brief Computes the SHA-256 hash of `length` bytes. Unlike the block hashes, it is strong enough to
+ * check that a file rebuilt from a delta is exactly the new version.
+ */
+void delta_file_hash(const uint8_t* data, size_t length, uint8_t hash[DELTA_FILE_HASH_SIZE]);
+
+/**
+ * @brief Returns the block size for a basis file of `file_size` bytes: about the square root of the
+ * size (fewer, larger blocks for large files), clamped to DELTA_MIN_BLOCK_SIZE..DELTA_MAX_BLOCK_SIZE.
+ */
+size_t delta_block_size(size_t file_size);
+
+/**
+ * @brief Computes the signatures of the full blocks of the basis; a partial block at the end is not
+ * included (if it is unchanged it is sent as a literal).
+ *
+ * @param signatures Set to the allocated signatures (NULL if there are none). The caller frees it.
+ * @param count Set to the number of signatures.
+ *
+ * @return STATUS_OK, or ERROR_MEMORY_ALLOCATION_FAILED.
+ */
+int delta_compute_signatures(const uint8_t* data, size_t size, size_t block_size, BlockSignature** signatures, size_t* count);
+
+/**
+ * @brief Serializes `count` signatures into `buffer` (DELTA_SIGNATURE_SIZE bytes each).
+ */
+void delta_pack_signatures(const BlockSignature* signatures, size_t count, uint8_t* buffer);
+
+/**
+ * @brief Deserializes `count` signatures from `buffer` (DELTA_SIGNATURE_SIZE bytes each).
+ */
+void delta_unpack_signatures(const uint8_t* buffer, size_t count, BlockSignature* signatures);
+
+/**
+ * @brief Encodes `data` (the new version of the file) as instructions against the basis signatures.
+ *
+ * @return STATUS_OK, or the error returned by `writer` / ERROR_MEMORY_ALLOCATION_FAILED.
+ */
+int delta_generate(const uint8_t* data, size_t size, const BlockSignature* signatures, size_t count, size_t block_size, DeltaWriter writer, void* context);
+
+/**
+ * @brief Applies one payload of instructions (as passed to a DeltaWriter), appending to `output`.
+ *
+ * @return STATUS_OK; ERROR_INVALID_DATA_SIZE if the instructions are malformed or reference blocks
+ * outside of the basis; or ERROR_MEMORY_ALLOCATION_FAILED.
+ */
+int delta_apply(const uint8_t* instructions, size_t length, const uint8_t* basis, size_t basis_size, size_t block_size, DeltaOutput* output);
+
+/**
+ * @brief Frees the memory of the output and resets the members to DELTA_OUTPUT_INIT values.
+ */
+void destroy_delta_output(DeltaOutput* output);
+
+#endif // DELTA_H
@@ -0,0 +1,151 @@
+/*
+ * Cache of open file descriptors for the files a server serves.
+ *
+ * The root directory is opened once, and files are looked up relative to it, so a request doesn't
+ * build a full path and walk it from `/`. Open descriptors of recently used files are kept (up to
+ * `capacity`, least recently used are closed first), so a hot file costs an O_PATH lookup and an
+ * `fstat` per request instead of opening the file, reading its stat and closing it again.
+ *
+ * Invalidation: every lookup stats the name. If the name now refers to another file (it was
+ * replaced, e.g. by a rename) the cached descriptor is dropped and the new file is opened; if the
+ * name no longer exists the lookup fails. A file that is written in place keeps its descriptor (reads
+ * see the new contents) and the returned stat is refreshed.
+ *
+ * Entries are reference counted: a descriptor stays open while it is in use, even if its entry is
+ * evicted or invalidated in the meantime. Descriptors are shared between threads, so they must be
+ * read with `pread` (not `read`/`lseek`, which would move the shared file offset).
+ *
+ * Names are relative to the root: absolute names and names with a `..` component are rejected, and
+ * names are resolved with `openat2` and RESOLVE_BENEATH (see `file_cache_open_beneath`), so neither
+ * a name nor a symlink below the root leads out of it.
+ */
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define FILE_CACHE_DEFAULT_CAPACITY 128
+// including the null terminator
+#define FILE_CACHE_MAX_NAME 256
+
+/**
+ * @brief An open file of the cache.
+ *
+ * name: the name of the file, relative to the root
+ * fd: the open file (read only)
+ * file_stat: the stat of the file as of the last lookup
+ * references: the number of users of the entry (`file_cache_acquire` without `file_cache_release`)
+ * cached: non-zero while the entry is in the cache; an entry that isn't is closed and freed when its
+ * last reference is released
+ * next: the next entry in the same hash bucket
+ * idle_previous, idle_next: the neighbours on the cache's idle list, while the entry is cached and unused
+ */
+typedef struct CachedFile {
+    char name[FILE_CACHE_MAX_NAME];
+    int fd;
+    struct stat file_stat;
+    size_t references;
+    int cached;
+    struct CachedFile* next;
+    struct CachedFile* idle_previous;
+    struct CachedFile* idle_next;
+} CachedFile;
+
+/**
+ * @brief A thread-safe cache of open files below a root directory.
+ *
+ * mutex: protects all other members except `root_fd`
+ * root_fd: the root directory (-1 if it could not be opened)
+ * buckets: hash table of the cached entries, by name
+ * bucket_count: the number of buckets
+ * count: the number of cached entries
+ * capacity: the maximum number of cached entries
+ * idle_head, idle_tail: the cached entries that aren't in use, most recently released first (for LRU eviction)
+ * hits: lookups answered from the cache
+ * misses: lookups that opened the file
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    int root_fd;
+    CachedFile** buckets;
+    size_t bucket_count;
+    size_t count;
+    size_t capacity;
+    CachedFile* idle_head;
+    CachedFile* idle_tail;
+    uint64_t hits;
+    uint64_t misses;
+} FileCache;
+
+/**
+ * @brief Opens the root directory and initializes an empty cache.
+ *
+ * @param root The directory the names are relative to.
+ * @param capacity The maximum number of cached open files (at least 1).
+ * @return 0 on success, or -1 if the root could not be opened or memory could not be allocated (the
+ * cache can still be used and destroyed, but every lookup fails with ERROR_FILE_NOT_FOUND).
+ */
+int file_cache_init(FileCache* cache, const char* root, size_t capacity);
+
+/**
+ * @brief Closes the root and all cached files. No entries may be in use.
+ */
+void file_cache_destroy(FileCache* cache);
+
+/**
+ * @brief Opens `name` relative to `root_fd` (with `flags` and O_CLOEXEC) without leaving the root:
+ * the whole name is resolved beneath it (`openat2` with RESOLVE_BENEATH), so a symlink that points
+ * out of the root (e.g. to `/etc`) fails with EXDEV. On kernels without `openat2` (before 5.6), only
+ * the last component is kept from being a symlink (O_NOFOLLOW).
+ *
+ * @return The new descriptor, or -1 (with errno set).
+ */
+int file_cache_open_beneath(int root_fd, const char* name, int flags);
+
+/**
+ * @brief Stats `name` relative to `root_fd`, resolved like `file_cache_open_beneath`.
+ *
+ * @return 0, or -1 (with errno set).
+ */
+int file_cache_stat(int root_fd, const char* name, struct stat* file_stat);
+
+/**
+ * @brief Returns non-zero if `name` is a valid file name: relative, not empty, without `..`
+ * components, and shorter than FILE_CACHE_MAX_NAME.
+ */
+int file_cache_valid_name(const char* name);
+
+/**
+ * @brief Looks up a regular file and takes a reference to it.
+ *
+ * @param file Set to the entry, whose `fd` and `file_stat` may be used until it is given back with
+ * `file_cache_release`.
+ * @return STATUS_OK; ERROR_INVALID_FILE_NAME if the name is absolute or has a `..` component;
+ * ERROR_FILE_OPEN_FAILED if the name is too long; ERROR_MEMORY_ALLOCATION_FAILED; or
+ * ERROR_FILE_NOT_FOUND if the file does not exist, is not a regular file, or can't be opened.
+ */
+int file_cache_acquire(FileCache* cache, const char* name, CachedFile** file);
+
+/**
+ * @brief Gives back a reference taken by `file_cache_acquire`.
+ */
+void file_cache_release(FileCache* cache, CachedFile* file);
+
+/**
+ * @brief Opens a file below the root without caching it, e.g. to hand its descriptor to another
+ * process, which must not share the cached descriptor's file offset and flags.
+ *
+ * @param fd Set to the new descriptor (opened with `flags` and O_CLOEXEC), which the caller closes.
+ * @return the same codes as `file_cache_acquire`.
+ */
+int file_cache_open(FileCache* cache, const char* name, int flags, int* fd);
+
+/**
+ * @brief Returns the number of cached entries.
+ */
+size_t file_cache_size(FileCache* cache);
+
+#endif // FILE_CACHE_H
@@ -2,12 +2,129 @@
 #define FILE_TRANSFER_H
 
 #include "protocol.h"
+#include "delta.h"
+#include "storage.h"
+#include "packfile.h"
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
+// the storage root of the server unless `server_storage_init` configures others
 #define SERVER_FILE_PATH "/code/c_examples/client_server/tests/fake_server_files"
 
+/**
+ * @brief Serves files from the storage roots at `paths` (see `storage.h`), with `io_threads` reader
+ * threads per root, instead of SERVER_FILE_PATH. Called once, before requests are handled.
+ *
+ * @return the status of `storage_init`.
+ */
+int server_storage_init(const char* const* paths, size_t root_count, size_t io_threads);
+
+/**
+ * @brief Returns the storage roots requests are answered from (created on first use).
+ */
+Storage* server_storage(void);
+
+/**
+ * @brief Returns the storage root `file_name` is placed on: its file cache, reader threads and catalog.
+ */
+StorageRoot* server_root(const char* file_name);
+
+/**
+ * @brief Serves files from a pack (see `packfile.h`) instead of the storage roots. Called once, before
+ * requests are handled.
+ *
+ * All commands that send a file or its metadata (including conditional, range, delta and multiplexed
+ * transfers) are then answered from the pack, with the ETag of `pack_format_etag`. Packed files have
+ * no file descriptor of their own, so COMMAND_REQUEST_FILE_DESCRIPTOR fails with
+ * ERROR_UNSUPPORTED_TRANSPORT.
+ *
+ * @return the status of `pack_open`.
+ */
+int server_pack_open(const char* path);
+
+/**
+ * @brief Returns the pack files are served from, or NULL if they are served from the storage roots.
+ */
+const Pack* server_pack(void);
+
+/**
+ * @brief Closes the pack opened by `server_pack_open`. No requests may be in progress.
+ */
+void server_pack_close(void);
+
+/**
+ * @brief Answers metadata requests from catalogs (see `catalog.h`) that scanner threads keep up to
+ * date with the storage roots (every `scan_interval_ms`); see `storage_open_catalogs` for where the
+ * catalogs are stored. Called once, before requests are handled.
+ *
+ * Files that aren't cataloged (yet) are looked up in their root as usual. The metadata can be up to
+ * one scan interval stale: a file removed since the last scan still gets its old metadata, and only
+ * a following request for its contents fails with ERROR_FILE_NOT_FOUND. The other commands don't use
+ * the catalogs: they need the file itself.
+ *
+ * @return the status of `storage_open_catalogs`.
+ */
+int server_catalog_open(const char* path, uint64_t scan_interval_ms);
+
+/**
+ * @brief Stops the scanner threads and closes the catalogs opened by `server_catalog_open`. No
+ * requests may be in progress.
+ */
+void server_catalog_close(void);
+
+/**
+ * @brief Receive exactly one message (header and payload) from a socket.
+ * 
+ * A single `recv` can return part of a message or more than one message, so the header is read
+ * first and then exactly `payload_size` bytes of payload.
+ * 
+ * @param socket the socket file descriptor to receive from
+ * @param buffer the buffer to store the message in (e.g. `uint8_t buffer[MAX_MESSAGE_SIZE]`)
+ * @param buffer_size the size of the buffer
+ * 
+ * @return the number of bytes in the message (header and payload), 0 if the peer closed the connection before sending a message, or -1 if the receive failed or the message does not fit in the buffer.
+ */
+ssize_t receive_message(int socket, uint8_t* buffer, size_t buffer_size);
+
+// buffer size for an ETag (including the quotes and the null terminator)
+#define ETAG_SIZE 64
+
+/**
+ * @brief Formats the ETag of a file: a validator that changes when the file is replaced, written, or
+ * truncated (derived from the inode, modification time, and size, so no contents are read).
+ */
+void format_etag(const struct stat* file_stat, char* etag, size_t etag_size);
+
+/**
+ * @brief Extracts the ETag from a metadata payload (see `request_file_metadata`).
+ * 
+ * @return 0 if the metadata contains an ETag that fits in `etag_size` bytes, otherwise -1.
+ */
+int parse_etag(const char* metadata, char* etag, size_t etag_size);
+
+/**
+ * @brief Returns the part of an ETag that identifies the version of the file's contents, so that the
+ * ETags of copies of a file on different hosts can be compared: for an ETag of `format_etag`, the
+ * mtime and size (the inode differs between hosts); a pack ETag (see `pack_format_etag`) is returned
+ * whole.
+ *
+ * @return a pointer into `etag`.
+ */
+const char* etag_version(const char* etag);
+
+/**
+ * @brief Extracts the file size from a metadata payload (see `request_file_metadata`).
+ * 
+ * @return 0 if the metadata contains the size, otherwise -1.
+ */
+int parse_file_size(const char* metadata, uint64_t* file_size);
+
 /**
  * @brief Send a COMMAND_REQUEST_METADATA request to the server.
  * 
+ * The metadata holds the size and the ETag of the file, one per line (e.g. `Size: 35\nETag: "..."`).
+ * 
  * This method allocates memory for the response payload. The caller is responsible for freeing the memory via `destroy_response`.
  * 
  * @param socket the socket file descriptor of the server
@@ -41,9 +158,112 @@ int send_file_metadata(int socket, const char* file_name);
  */
 int request_file_contents(int socket, const char* file_name, Response* response);
 
+// flags for `request_file_to_fd`
+#define SINK_PREALLOCATE 0x1
+#define SINK_DROP_BEHIND 0x2
+
+// with SINK_DROP_BEHIND, written data is flushed and dropped from the page cache in windows of this size
+#define SINK_DROP_BEHIND_WINDOW (8 * 1024 * 1024)
+
+/**
+ * @brief Send a COMMAND_REQUEST_CONTENTS request to the server and write the file contents to `fd`.
+ * 
+ * Unlike `request_file_contents`, the contents are not buffered in memory: the payload of each chunk
+ * is moved from the socket into `fd` with `splice` (through a pipe), skipping the message headers.
+ * If `fd` can't be spliced into (e.g. it was opened with O_APPEND) the payload is copied with `read`/`pwrite` instead.
+ * 
+ * SINK_PREALLOCATE: request the metadata first (on the same connection) and `fallocate` the file
+ * size up front, so the file system can allocate contiguous blocks.
+ * SINK_DROP_BEHIND: write back and drop the written data from the page cache as the transfer
+ * progresses (`sync_file_range` + POSIX_FADV_DONTNEED), so huge downloads don't evict other data.
+ * 
+ * @param socket the socket file descriptor of the server
+ * @param file_name the name of the file to request
+ * @param fd the file to write the contents to, starting at offset 0; it is truncated to the number of bytes received, or to 0 if the request fails
+ * @param flags a combination of SINK_PREALLOCATE and SINK_DROP_BEHIND, or 0
+ * @param response Filled with the header of the last chunk (`payload_size` is the total number of bytes written and `payload` is NULL), or the error response. The caller is responsible for freeing the memory via `destroy_response`.
+ * 
+ * @return 0 (STATUS_OK) if the request was successful, otherwise an error code starting with `ERROR_`.
+ */
+int request_file_to_fd(int socket, const char* file_name, int fd, int flags, Response* response);
+
+// files larger than READ_AHEAD_BUFFER_SIZE are read by the reader threads of their root up to READ_AHEAD_BUFFERS buffers ahead of the sender
+#define READ_AHEAD_BUFFERS 4
+#define READ_AHEAD_BUFFER_SIZE (64 * MAX_PAYLOAD_SIZE)
+
+/**
+ * @brief Send a COMMAND_REQUEST_FILE_IF_NONE_MATCH request: a conditional COMMAND_REQUEST_FILE for
+ * revalidating a cached copy of a file.
+ * 
+ * The request payload is the file name followed by the ETag of the cached copy (both null
+ * terminated). The server first responds with the metadata of the file. If the ETag still matches,
+ * the status is STATUS_NOT_MODIFIED and nothing else is sent; otherwise the status is STATUS_OK and
+ * the file contents follow as RESPONSE_CHUNK messages.
+ * 
+ * @param socket the socket file descriptor of the server
+ * @param file_name the name of the file to request
+ * @param etag the ETag of the cached copy, or NULL/"" to always receive the contents
+ * @param response Filled with the contents (like `request_file_contents`), or the metadata/error response. The caller is responsible for freeing the memory via `destroy_response`.
+ * @param current_etag Filled with the current ETag of the file (`ETAG_SIZE` bytes); empty if the request failed.
+ * 
+ * @return STATUS_OK if the contents were received, STATUS_NOT_MODIFIED if the cached copy is current, otherwise an error code starting with `ERROR_`.
+ */
+int request_file_contents_if_none_match(int socket, const char* file_name, const char* etag, Response* response, char* current_etag);
+
+/**
+ * @brief Handle a COMMAND_REQUEST_FILE_IF_NONE_MATCH request from the client.
+ * 
+ * @param socket the socket file descriptor of the client
+ * @param header the header of the request
+ * @param payload the payload of the request (the file name and the ETag)
+ * 
+ * @return 0 (STATUS_OK) if the request was successful, otherwise an error code starting with `ERROR_`.
+ */
+int send_file_contents_if_none_match(int socket, const Header* header, const uint8_t* payload);
+
+/**
+ * @brief Send a COMMAND_REQUEST_RANGE request: `length` bytes of a file, starting at `offset`.
+ * 
+ * The request payload is the file name (null terminated) followed by the offset and the length
+ * (64 bits each, in network byte order). The server responds with RESPONSE_CHUNK messages like for
+ * COMMAND_REQUEST_FILE; a range that extends past the end of the file is cut off there.
+ * 
+ * @param socket the socket file descriptor of the server
+ * @param file_name the name of the file to request
+ * @param offset the offset of the first byte; must be less than the file size
+ * @param length the number of bytes; must not be 0
+ * @param response Filled with the bytes of the range (like `request_file_contents`), or the error response (ERROR_INVALID_DATA_SIZE for an invalid range). The caller is responsible for freeing the memory via `destroy_response`.
+ * 
+ * @return 0 (STATUS_OK) if the request was successful, otherwise an error code starting with `ERROR_`.
+ */
+int request_file_range(int socket, const char* file_name, uint64_t offset, uint64_t length, Response* response);
+
+/**
+ * @brief Handle a COMMAND_REQUEST_RANGE request from the client.
+ * 
+ * @param socket the socket file descriptor of the client
+ * @param header the header of the request
+ * @param payload the payload of the request (the file name, the offset and the length)
+ * 
+ * @return 0 (STATUS_OK) if the request was successful, otherwise an error code starting with `ERROR_`.
+ */
+int send_file_range(int socket, const Header* header, const uint8_t* payload);
+
+/**
+ * @brief Reads the offset and the length from the payload of a COMMAND_REQUEST_RANGE request.
+ * 
+ * @return 0 if the payload is a file name followed by an offset and a length, otherwise -1.
+ */
+int parse_range_request(const Header* header, const uint8_t* payload, uint64_t* offset, uint64_t* length);
+
 /**
  * @brief Handle a COMMAND_REQUEST_CONTENTS request from the client.
  * 
+ * The file is read by the reader threads of its storage root (see `io_pool.h`). Reading and sending
+ * are pipelined: for larger files up to READ_AHEAD_BUFFERS reads are queued while the calling thread
+ * sends chunks from the buffers already filled, so disk and network latency overlap instead of
+ * adding up.
+ * 
  * @param socket the socket file descriptor of the client
  * @param file_name the name of the file to send metadata for 
  * 
@@ -52,7 +272,106 @@ int request_file_contents(int socket, const char* file_name, Response* response)
 int send_file_contents(int socket, const char* file_name);
 
 /**
- * @brief Handle a request from the client (e.g COMMAND_REQUEST_METADATA or COMMAND_REQUEST_CONTENTS).
+ * @brief A read-only memory mapping of a file received via `request_file_mapping`.
+ * 
+ * fd: the file descriptor received from the server (-1 if not set)
+ * data: pointer to the mapped file contents (NULL for empty files)
+ * size: number of bytes in the file
+ */
+typedef struct {
+    int fd;
+    uint8_t* data;
+    size_t size;
+} MappedFile;
+
+#define MAPPED_FILE_INIT {-1, NULL, 0}
+
+/**
+ * @brief Send a COMMAND_REQUEST_FILE_DESCRIPTOR request to the server over a unix domain socket.
+ * 
+ * Rather than copying the file contents through the socket, the server opens the file read-only and
+ * passes the file descriptor back (SCM_RIGHTS). The response payload contains the same metadata as
+ * COMMAND_REQUEST_METADATA. Only works when the client and server are on the same host.
+ * 
+ * @param socket the unix domain socket file descriptor of the server
+ * @param file_name the name of the file to request
+ * @param response A pointer to a Response struct that will be filled containing the header and payload (metadata or error message). The caller is responsible for freeing the memory via `destroy_response`.
+ * @param fd Set to the received read-only file descriptor, or -1 on failure. The caller is responsible for closing it.
+ * 
+ * @return 0 (STATUS_OK) if the request was successful, otherwise an error code starting with `ERROR_`.
+ */
+int request_file_descriptor(int socket, const char* file_name, Response* response, int* fd);
+
+/**
+ * @brief Handle a COMMAND_REQUEST_FILE_DESCRIPTOR request from the client.
+ * 
+ * Responds with ERROR_UNSUPPORTED_TRANSPORT if the client is not connected over a unix domain socket,
+ * or if the server serves a pack.
+ * 
+ * @param socket the socket file descriptor of the client
+ * @param file_name the name of the file to send the file descriptor for
+ * 
+ * @return 0 (STATUS_OK) if the request was successful, otherwise an error code starting with `ERROR_`.
+ */
+int send_file_descriptor(int socket, const char* file_name);
+
+/**
+ * @brief Request a file descriptor from the server (see `request_file_descriptor`) and memory map the file.
+ * 
+ * The file contents are read directly from the page cache; no bytes are copied through the socket.
+ * 
+ * @param socket the unix domain socket file descriptor of the server
+ * @param file_name the name of the file to request
+ * @param mapped_file Filled with the mapping. The caller is responsible for releasing it via `destroy_mapped_file`.
+ * 
+ * @return 0 (STATUS_OK) if the request was successful, otherwise an error code starting with `ERROR_`.
+ */
+int request_file_mapping(int socket, const char* file_name, MappedFile* mapped_file);
+
+/**
+ * @brief Unmaps the file, closes the file descriptor, and resets the members to MAPPED_FILE_INIT values.
+ */
+void destroy_mapped_file(MappedFile* mapped_file);
+
+// the server rejects COMMAND_REQUEST_DELTA requests with more block signatures than this
+#define DELTA_MAX_SIGNATURES (1024 * 1024)
+
+/**
+ * @brief Send a COMMAND_REQUEST_DELTA request to the server and reconstruct the current version of
+ * the file from the local copy (`basis`) and the differences sent by the server.
+ * 
+ * The request payload is the file name followed by the block size (uint32_t, network byte order).
+ * The block signatures of the basis follow in REQUEST_CHUNK messages (DELTA_SIGNATURE_SIZE bytes
+ * each), ending with a REQUEST_LAST_CHUNK message. The server responds with RESPONSE_CHUNK messages
+ * of delta instructions (see `delta.h`), so only the parts of the file that changed are transferred,
+ * and a RESPONSE_LAST_CHUNK message with the hash of the file (see `delta_file_hash`). The file is
+ * rebuilt in memory and checked against the hash, so a corrupted delta is never written anywhere.
+ * 
+ * @param socket the socket file descriptor of the server
+ * @param file_name the name of the file to request
+ * @param basis the local copy of the file (may be NULL if `basis_size` is 0)
+ * @param basis_size the number of bytes in `basis`
+ * @param response Filled with the header of the last chunk (`payload_size` is the size of the file and `payload` is NULL), or the error response. The caller is responsible for freeing the memory via `destroy_response`.
+ * @param output Filled with the current version of the file and the number of copied/literal bytes. The caller is responsible for freeing the memory via `destroy_delta_output`.
+ * 
+ * @return 0 (STATUS_OK) if the request was successful, ERROR_CHECKSUM_MISMATCH if the rebuilt file
+ * doesn't match the hash sent by the server, otherwise an error code starting with `ERROR_`.
+ */
+int request_file_delta(int socket, const char* file_name, const uint8_t* basis, size_t basis_size, Response* response, DeltaOutput* output);
+
+/**
+ * @brief Handle a COMMAND_REQUEST_DELTA request from the client (receives the block signatures that follow the request).
+ * 
+ * @param socket the socket file descriptor of the client
+ * @param header the header of the request
+ * @param payload the payload of the request (the file name and the block size)
+ * 
+ * @return 0 (STATUS_OK) if the request was successful, otherwise an error code starting with `ERROR_`.
+ */
+int send_file_delta(int socket, const Header* header, const uint8_t* payload);
+
+/**
+ * @brief Handle a request from the client (e.g COMMAND_REQUEST_METADATA, COMMAND_REQUEST_CONTENTS, COMMAND_REQUEST_FILE_DESCRIPTOR, or COMMAND_REQUEST_DELTA).
  * 
  * @param socket the socket file descriptor of the client
  * @param header the header of the request
@@ -62,6 +381,25 @@ int send_file_contents(int socket, const char* file_name);
  */
 int handle_request(int socket, const Header* header, const uint8_t* payload);
 
+/**
+ * @brief Sets a callback for the next `handle_request` on this thread: it is called once the file
+ * has been opened and only sending its contents remains, which takes as long as the client takes to
+ * receive it. It isn't called for requests that send no file contents, or fail before. Either way,
+ * it is cleared when `handle_request` returns.
+ *
+ * The server gives back the request's scheduler slot there (see `scheduler.h`).
+ */
+void handle_request_on_sending(void (*callback)(void*), void* context);
+
+/**
+ * @brief Answer a request with an error response instead of handling it (e.g. ERROR_OVERLOADED).
+ * 
+ * The response is sent on the stream of the request, so multiplexed clients can match it.
+ * 
+ * @return `error_code`, or ERROR_SEND_FAILED if the response could not be sent.
+ */
+int reject_request(int socket, const Header* header, uint8_t error_code, const char* error_message);
+
 
 /**
  * @brief Calculate the total number of chunks required to send a file of a given size.
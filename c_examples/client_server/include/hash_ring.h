@@ -0,0 +1,63 @@
+/*
+ * Consistent hashing: places keys (file names) on a set of nodes (e.g. storage roots or servers).
+ *
+ * Every node is hashed onto a ring at `virtual_nodes` points; a key belongs to the node of the first
+ * point at or after the key's hash (wrapping around). Adding or removing a node only moves the keys
+ * between it and its neighbors on the ring (about 1/n of them), unlike `hash % n`, which moves
+ * almost all of them. The virtual nodes even out the share of each node.
+ *
+ * Nodes are identified by name (e.g. the path of a root), not by their index, so the placement
+ * doesn't depend on the order in which the nodes are listed.
+ */
+#ifndef HASH_RING_H
+#define HASH_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASH_RING_DEFAULT_VIRTUAL_NODES 128
+
+/**
+ * @brief A point of the ring.
+ *
+ * hash: the position of the point on the ring
+ * node: the index of the node the point belongs to
+ */
+typedef struct {
+    uint64_t hash;
+    size_t node;
+} HashRingPoint;
+
+/**
+ * @brief A consistent hash ring.
+ *
+ * points: the points of all nodes, sorted by hash
+ * point_count: the number of points
+ * node_count: the number of nodes
+ */
+typedef struct {
+    HashRingPoint* points;
+    size_t point_count;
+    size_t node_count;
+} HashRing;
+
+/**
+ * @brief Builds a ring of `node_count` nodes with `virtual_nodes` points each.
+ *
+ * @param nodes the names of the nodes; node `i` of the ring is `nodes[i]`
+ * @return STATUS_OK, ERROR_INVALID_DATA_SIZE if there are no nodes or virtual nodes, or
+ * ERROR_MEMORY_ALLOCATION_FAILED.
+ */
+int hash_ring_init(HashRing* ring, const char* const* nodes, size_t node_count, size_t virtual_nodes);
+
+/**
+ * @brief Frees the points of the ring.
+ */
+void hash_ring_destroy(HashRing* ring);
+
+/**
+ * @brief Returns the index of the node `key` belongs to.
+ */
+size_t hash_ring_lookup(const HashRing* ring, const char* key);
+
+#endif // HASH_RING_H
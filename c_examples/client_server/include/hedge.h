@@ -0,0 +1,115 @@
+/*
+ * Hedged requests: cutting the tail latency caused by one slow server (a busy disk, a stalled
+ * process, ...) with a second copy of the request.
+ *
+ * A request goes to one replica (in turn). If it has not been answered after the hedge delay, the same
+ * request is sent to the next replica, and whichever answer comes first is used; the other request is
+ * cancelled by shutting down its connection. The hedge delay is a percentile (e.g. the 95th) of the
+ * latencies of recent first requests, so about 5% of the requests are hedged: the extra load is
+ * bounded, and only the requests that are already slow pay for it. A replica that fails, or rejects the
+ * request because it is overloaded, is hedged at once.
+ *
+ * The replicas must serve the same files.
+ */
+#ifndef HEDGE_H
+#define HEDGE_H
+
+#include "protocol.h"
+#include "connection_pool.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// the number of recent latencies the hedge delay is computed from
+#define HEDGE_LATENCY_WINDOW 256
+// the hedge delay is the initial delay until this many latencies were measured
+#define HEDGE_MIN_SAMPLES 16
+#define HEDGE_DEFAULT_PERCENTILE 95
+
+/**
+ * @brief How often hedging happened.
+ *
+ * requests: the number of requests
+ * hedged: the number of requests a hedge was sent for
+ * hedge_wins: the number of hedges that were answered first
+ * failed: the number of requests that no replica answered
+ */
+typedef struct {
+    uint64_t requests;
+    uint64_t hedged;
+    uint64_t hedge_wins;
+    uint64_t failed;
+} HedgeStats;
+
+/**
+ * @brief Sends hedged requests to a set of replicas. Thread safe.
+ *
+ * pool: the connections to the replicas
+ * replicas: the replicas (not copied; they must outlive the client)
+ * replica_count: the number of replicas
+ * percentile: the percentile of the latencies that is used as hedge delay (1 to 100)
+ * initial_delay_us: the hedge delay until HEDGE_MIN_SAMPLES latencies were measured
+ * mutex: protects everything below it
+ * finished: signaled when the last running attempt finishes
+ * running: the number of attempts whose thread is running (cancelled ones may outlive their request)
+ * latencies_us: the latencies of recent first requests (a ring buffer)
+ * latency_count: the number of latencies measured so far
+ * next_replica: the replica the next request is sent to first
+ * stats: how often hedging happened
+ */
+typedef struct {
+    ConnectionPool* pool;
+    const Endpoint* replicas;
+    size_t replica_count;
+    unsigned int percentile;
+    uint64_t initial_delay_us;
+    pthread_mutex_t mutex;
+    pthread_cond_t finished;
+    size_t running;
+    uint64_t latencies_us[HEDGE_LATENCY_WINDOW];
+    uint64_t latency_count;
+    size_t next_replica;
+    HedgeStats stats;
+} HedgedClient;
+
+/**
+ * @brief Initializes the client.
+ *
+ * @return STATUS_OK, or ERROR_INVALID_DATA_SIZE if there are no replicas or the percentile is not
+ * between 1 and 100.
+ */
+int hedged_client_init(HedgedClient* client, ConnectionPool* pool, const Endpoint* replicas, size_t replica_count, unsigned int percentile, uint64_t initial_delay_us);
+
+/**
+ * @brief Releases the client, after waiting for the cancelled requests that are still finishing in
+ * the background (with their connection shut down, that is quick unless one is still connecting).
+ */
+void hedged_client_destroy(HedgedClient* client);
+
+/**
+ * @brief Returns the current hedge delay: the percentile of the recent latencies.
+ */
+uint64_t hedged_client_delay_us(HedgedClient* client);
+
+/**
+ * @brief Copies how often hedging happened.
+ */
+void hedged_client_stats(HedgedClient* client, HedgeStats* stats);
+
+/**
+ * @brief Requests the metadata of a file, hedged (see `request_file_metadata`).
+ *
+ * A transport error (e.g. a replica that can't be reached) sends the hedge at once. Errors that the
+ * server reports, like ERROR_FILE_NOT_FOUND, count as an answer.
+ *
+ * @return the status of the first answer, or the last error if no replica answered.
+ */
+int hedged_request_file_metadata(HedgedClient* client, const char* file_name, Response* response);
+
+/**
+ * @brief Requests the contents of a file, hedged (see `request_file_contents` and
+ * `hedged_request_file_metadata`).
+ */
+int hedged_request_file_contents(HedgedClient* client, const char* file_name, Response* response);
+
+#endif // HEDGE_H
@@ -0,0 +1,138 @@
+/*
+ * A pool of threads that read files on behalf of other threads.
+ *
+ * A thread that reads a file itself is stuck for as long as the disk takes, and the number of reads
+ * in flight on a disk is however many threads happen to be reading it. With a pool per disk, reads
+ * are submitted as jobs: the pool's threads are the only ones waiting for the disk, the number of
+ * threads is the disk's queue depth, and a slow disk only backs up its own queue.
+ *
+ * A job is owned by its submitter, who must keep it (and its buffer) alive until it is done. The
+ * submitter either waits for the job (`io_pool_wait`), or has it delivered to a completion queue
+ * (`io_pool_submit_async`), whose descriptor can be polled along with sockets: a thread that serves
+ * several transfers keeps sending the chunks that have been read instead of waiting for the disk.
+ */
+#ifndef IO_POOL_H
+#define IO_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define IO_POOL_DEFAULT_THREADS 4
+
+struct IoCompletionQueue;
+
+/**
+ * @brief A read of `length` bytes at `offset` of `fd` into `buffer`.
+ *
+ * result: 0 if all `length` bytes were read, -1 if the read failed or the file is shorter
+ * done: set by the pool when the job is finished
+ * waiter: signaled when the job is finished, while a thread waits for it in `io_pool_wait` (NULL otherwise)
+ * completions: the queue the job is delivered to when it is finished (NULL if it is waited for)
+ * next: the next job in the pool's queue, or in the completion queue once it is finished
+ */
+typedef struct IoJob {
+    int fd;
+    uint8_t* buffer;
+    size_t length;
+    off_t offset;
+    int result;
+    int done;
+    pthread_cond_t* waiter;
+    struct IoCompletionQueue* completions;
+    struct IoJob* next;
+} IoJob;
+
+/**
+ * @brief The finished jobs of one consumer (e.g. a connection), in the order they finished.
+ *
+ * mutex: protects the list
+ * event_fd: readable (an eventfd) while the list is not empty
+ * head, tail: the finished jobs that have not been taken yet
+ */
+typedef struct IoCompletionQueue {
+    pthread_mutex_t mutex;
+    int event_fd;
+    IoJob* head;
+    IoJob* tail;
+} IoCompletionQueue;
+
+/**
+ * @brief A pool of reader threads with a queue of jobs.
+ *
+ * mutex: protects the queue, `stopping` and the `done` and `waiter` members of the jobs
+ * submitted: signaled when a job is queued (or the pool stops)
+ * head, tail: the queued jobs, oldest first
+ * threads: the reader threads
+ * thread_count: the number of reader threads
+ * stopping: set when the pool is destroyed
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t submitted;
+    IoJob* head;
+    IoJob* tail;
+    pthread_t* threads;
+    size_t thread_count;
+    int stopping;
+} IoPool;
+
+/**
+ * @brief Starts `thread_count` reader threads.
+ *
+ * @return 0 on success, or -1 if `thread_count` is 0 or the threads could not be started.
+ */
+int io_pool_init(IoPool* pool, size_t thread_count);
+
+/**
+ * @brief Finishes the queued jobs and stops the reader threads.
+ */
+void io_pool_destroy(IoPool* pool);
+
+/**
+ * @brief Queues a job; returns right away.
+ */
+void io_pool_submit(IoPool* pool, IoJob* job);
+
+/**
+ * @brief Queues a job that is added to `completions` when it is finished; returns right away.
+ */
+void io_pool_submit_async(IoPool* pool, IoJob* job, IoCompletionQueue* completions);
+
+/**
+ * @brief Waits until a submitted job is done. A job submitted with `io_pool_submit_async` may be
+ * waited for too (e.g. before its buffer is freed), but is still added to its completion queue.
+ *
+ * Only one thread may wait for a job. The waiter sleeps on a condition variable of its own, so a
+ * finished job wakes up its waiter only, not every thread that waits for a job of the pool.
+ */
+void io_pool_wait(IoPool* pool, IoJob* job);
+
+/**
+ * @brief Reads `length` bytes at `offset` on one of the pool's threads and waits for it.
+ *
+ * @return 0, or -1 if the read failed or the file is shorter.
+ */
+int io_pool_read(IoPool* pool, int fd, uint8_t* buffer, size_t length, off_t offset);
+
+/**
+ * @brief Creates an empty completion queue.
+ *
+ * @return 0 on success, or -1 if the eventfd could not be created.
+ */
+int io_completion_queue_init(IoCompletionQueue* completions);
+
+/**
+ * @brief Closes a completion queue. No jobs submitted to it may be pending anymore.
+ */
+void io_completion_queue_destroy(IoCompletionQueue* completions);
+
+/**
+ * @brief Takes the oldest finished job off the queue; doesn't wait.
+ *
+ * @return the job (its `result` and buffer can be used), or NULL if no job is finished.
+ */
+IoJob* io_completion_queue_pop(IoCompletionQueue* completions);
+
+#endif // IO_POOL_H
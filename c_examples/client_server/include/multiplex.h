@@ -0,0 +1,186 @@
+/*
+ * Multiple concurrent requests over a single connection.
+ *
+ * Each request is sent on its own stream (a non-zero `stream_id` in the header) and every message of
+ * its response carries the same stream id. The server sends the chunks of all active file transfers
+ * round-robin, one chunk per stream at a time, and answers other requests (e.g. metadata) as soon as
+ * they arrive, so a small response overtakes a large transfer instead of waiting behind it.
+ * Requests on stream 0 keep the one-at-a-time behavior of `handle_request`.
+ *
+ * The files are read by the reader threads of their storage roots (see `io_pool.h`), never by the
+ * connection's thread: a transfer whose next part is still being read is skipped, and the others
+ * keep sending, so a read from a cold disk only holds up its own stream.
+ */
+#ifndef MULTIPLEX_H
+#define MULTIPLEX_H
+
+#include "protocol.h"
+#include "file_cache.h"
+#include "io_pool.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// maximum number of file transfers the server interleaves on one connection
+#define MAX_CONCURRENT_STREAMS 64
+// size of the parts of a file read at a time for a transfer (a multiple of MAX_PAYLOAD_SIZE)
+#define STREAM_READ_SIZE (16 * MAX_PAYLOAD_SIZE)
+
+/**
+ * @brief A file transfer in progress on the server.
+ *
+ * stream_id: the stream of the request
+ * file: the file, from the file cache of its root (see `server_root`); NULL for a packed file
+ * fd: the open file (`file->fd`, or the pack's descriptor)
+ * offset: the offset of the file's contents in `fd` (non-zero for a packed file)
+ * file_size: the size of the file when it was opened
+ * chunk_index: the index of the next chunk to send
+ * total_chunks: the number of chunks of the file
+ * io_pool: the reader threads of the file's root
+ * read: the read of the next part of the file
+ * reading: non-zero while `read` is in progress
+ * failed: non-zero if a read failed
+ * buffer: the part of the file that was read last (STREAM_READ_SIZE bytes)
+ * buffered: the number of bytes in `buffer`
+ * buffer_position: the position of the next chunk in `buffer`
+ * next: the next stream in round-robin order
+ */
+typedef struct FileStream {
+    uint32_t stream_id;
+    CachedFile* file;
+    int fd;
+    off_t offset;
+    long file_size;
+    uint32_t chunk_index;
+    uint32_t total_chunks;
+    IoPool* io_pool;
+    IoJob read;
+    int reading;
+    int failed;
+    uint8_t* buffer;
+    size_t buffered;
+    size_t buffer_position;
+    struct FileStream* next;
+} FileStream;
+
+/**
+ * @brief The active file transfers of one server connection.
+ *
+ * streams: the active transfers, in round-robin order
+ * stream_count: the number of active transfers
+ * completions: the finished reads of the transfers (valid if `completions_open`)
+ * completions_open: non-zero once `completions` has been created (with the first transfer)
+ */
+typedef struct {
+    FileStream* streams;
+    size_t stream_count;
+    IoCompletionQueue completions;
+    int completions_open;
+} StreamMultiplexer;
+
+#define STREAM_MULTIPLEXER_INIT {NULL, 0, {.event_fd = -1}, 0}
+
+/**
+ * @brief Handles a request received on a non-zero stream.
+ *
+ * COMMAND_REQUEST_FILE requests are opened and added to the active transfers (their chunks are sent
+ * by `multiplexer_send_round`); all other commands are answered right away via `handle_request`.
+ *
+ * @return STATUS_OK if the request was accepted or answered, otherwise an error code starting with
+ * `ERROR_` (an error response has been sent to the client for errors it can act on, e.g.
+ * ERROR_FILE_NOT_FOUND, ERROR_INVALID_STREAM or ERROR_TOO_MANY_STREAMS).
+ */
+int multiplexer_handle_request(StreamMultiplexer* multiplexer, int socket, const Header* header, const uint8_t* payload);
+
+/**
+ * @brief Waits until a request arrives on `socket` or a chunk of an active transfer is ready to be
+ * sent (i.e. has been read); returns right away if one already is.
+ *
+ * @return non-zero if a request (or the end of the connection) is waiting on `socket`, 0 if only
+ * chunks are ready.
+ */
+int multiplexer_request_waiting(StreamMultiplexer* multiplexer, int socket);
+
+/**
+ * @brief Sends the next chunk of every active transfer whose chunk has been read, and queues the
+ * reads of the next parts; finished transfers are removed.
+ *
+ * @return STATUS_OK, or ERROR_SEND_FAILED if the connection failed (the transfers are left for
+ * `multiplexer_destroy`).
+ */
+int multiplexer_send_round(StreamMultiplexer* multiplexer, int socket);
+
+/**
+ * @brief Waits for the reads in progress, closes the files of all active transfers and resets the multiplexer to STREAM_MULTIPLEXER_INIT values.
+ */
+void multiplexer_destroy(StreamMultiplexer* multiplexer);
+
+/**
+ * @brief A response being received by the client.
+ *
+ * stream_id: the stream of the request
+ * response: the response received so far (the chunks are copied into the payload, which is
+ * allocated once the size of the file is known)
+ * capacity: the size of the file (the payload's allocation), from MESSAGE_RESPONSE_SIZE
+ * next: the next pending stream
+ */
+typedef struct PendingStream {
+    uint32_t stream_id;
+    Response response;
+    uint32_t capacity;
+    struct PendingStream* next;
+} PendingStream;
+
+/**
+ * @brief The client side of a multiplexed connection.
+ *
+ * socket: the socket file descriptor of the server
+ * next_stream_id: the stream id of the next request
+ * pending: the requests that have not been completely answered yet
+ */
+typedef struct {
+    int socket;
+    uint32_t next_stream_id;
+    PendingStream* pending;
+} MultiplexedConnection;
+
+/**
+ * @brief Initializes a multiplexed connection on a connected socket; the socket stays owned by the caller.
+ */
+void multiplexed_connection_init(MultiplexedConnection* connection, int socket);
+
+/**
+ * @brief Sends a COMMAND_REQUEST_FILE or COMMAND_REQUEST_METADATA request on a new stream without
+ * waiting for the response.
+ *
+ * @param stream_id Set to the stream of the request, which `multiplexed_receive` reports when the response is complete.
+ * @return STATUS_OK, ERROR_INVALID_COMMAND for other commands, or ERROR_SEND_FAILED / ERROR_MEMORY_ALLOCATION_FAILED.
+ */
+int multiplexed_request(MultiplexedConnection* connection, uint8_t command, const char* file_name, uint32_t* stream_id);
+
+/**
+ * @brief Receives messages until the response to one of the pending requests is complete.
+ *
+ * Responses complete in the order the server finishes them, not in the order they were requested.
+ * A file transfer starts with a MESSAGE_RESPONSE_SIZE message, so its payload is allocated once.
+ *
+ * @param stream_id Set to the stream of the completed request (0 for transport errors).
+ * @param response Filled with the complete response (as returned by `request_file_contents` or
+ * `request_file_metadata`). The caller is responsible for freeing the memory via `destroy_response`.
+ * @return The status of the completed request (STATUS_OK or the error code sent by the server), or
+ * ERROR_RECEIVE_FAILED / ERROR_INVALID_STREAM / ERROR_UNEXPECTED_MESSAGE_TYPE / ERROR_INVALID_DATA_SIZE
+ * if the connection can not be used anymore.
+ */
+int multiplexed_receive(MultiplexedConnection* connection, uint32_t* stream_id, Response* response);
+
+/**
+ * @brief Returns the number of requests that have not been completely answered yet.
+ */
+size_t multiplexed_pending_count(const MultiplexedConnection* connection);
+
+/**
+ * @brief Frees the responses of the pending requests; the socket is not closed.
+ */
+void multiplexed_connection_destroy(MultiplexedConnection* connection);
+
+#endif // MULTIPLEX_H
@@ -0,0 +1,109 @@
+/*
+ * Pack files: many (small) files stored in one large file.
+ *
+ * Serving millions of tiny files from a directory tree costs an open, a stat and a read per request,
+ * and the per-file overhead of the file system (inodes, directory entries) dominates. A pack holds
+ * the contents of all files back to back, followed by an index sorted by name, so the server maps
+ * the pack once and answers a request with a binary search and a copy out of the mapping.
+ *
+ * Layout (all integers big-endian, like the protocol):
+ *
+ *     header:  magic (PACK_MAGIC, 8 bytes) | entry count (u64) | index offset (u64) | names offset (u64)
+ *     data:    the contents of the files, back to back
+ *     index:   one PACK_ENTRY_SIZE entry per file, sorted by name (strcmp):
+ *              name offset (u64, in names) | offset (u64) | size (u64) | hash (u64) |
+ *              mtime seconds (u64) | mtime nanoseconds (u32) | name length (u32)
+ *     names:   the file names (relative to the packed directory), each null terminated
+ *
+ * The hash is the 64-bit FNV-1a hash of the contents; it is used as the ETag of packed files.
+ * Packs are created by the `pack` tool (see `src/pack.c`) and never modified afterwards; to update
+ * the served files, create a new pack and restart the server with it.
+ */
+#ifndef PACKFILE_H
+#define PACKFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define PACK_MAGIC "CSPACK01"
+#define PACK_HEADER_SIZE 32
+#define PACK_ENTRY_SIZE 48
+
+/**
+ * @brief A file stored in a pack.
+ *
+ * name: the name of the file (points into the pack's mapping)
+ * offset: the offset of the contents in the pack
+ * size: the size of the contents
+ * hash: the FNV-1a hash of the contents
+ * mtime: the modification time of the file when it was packed
+ */
+typedef struct {
+    const char* name;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t hash;
+    struct timespec mtime;
+} PackEntry;
+
+/**
+ * @brief An open (memory-mapped) pack.
+ *
+ * fd: the pack file, kept open so that contents can also be read with `pread`
+ * data: the mapping of the whole pack
+ * size: the size of the pack
+ * entry_count: the number of files in the pack
+ * index: the first index entry
+ * names: the names region
+ * names_size: the size of the names region
+ */
+typedef struct {
+    int fd;
+    uint8_t* data;
+    size_t size;
+    uint64_t entry_count;
+    const uint8_t* index;
+    const char* names;
+    size_t names_size;
+} Pack;
+
+#define PACK_INIT {-1, NULL, 0, 0, NULL, NULL, 0}
+
+/**
+ * @brief Packs the regular files below `root` (recursively; symbolic links are skipped) into a new
+ * pack at `path`. The pack is written to a temporary file and renamed, so a reader never sees a
+ * partly written pack; a server that has the old pack mapped keeps serving it until it is restarted.
+ *
+ * @param entry_count Set to the number of packed files (may be NULL).
+ * @return STATUS_OK, ERROR_FILE_OPEN_FAILED if a file could not be read or the pack written, or
+ * ERROR_MEMORY_ALLOCATION_FAILED.
+ */
+int pack_create(const char* root, const char* path, uint64_t* entry_count);
+
+/**
+ * @brief Maps a pack and checks that its header and index are consistent.
+ *
+ * @return STATUS_OK, ERROR_FILE_OPEN_FAILED if the pack could not be opened or mapped, or
+ * ERROR_INVALID_DATA_SIZE if it is not a valid pack. On error `pack` is left as PACK_INIT.
+ */
+int pack_open(Pack* pack, const char* path);
+
+/**
+ * @brief Unmaps and closes a pack and resets it to PACK_INIT.
+ */
+void pack_close(Pack* pack);
+
+/**
+ * @brief Looks up a file by name (binary search in the index).
+ *
+ * @return STATUS_OK, or ERROR_FILE_NOT_FOUND if the pack has no file with that name.
+ */
+int pack_find(const Pack* pack, const char* name, PackEntry* entry);
+
+/**
+ * @brief Formats the ETag of a packed file (derived from the hash and size of its contents).
+ */
+void pack_format_etag(const PackEntry* entry, char* etag, size_t etag_size);
+
+#endif // PACKFILE_H
@@ -0,0 +1,55 @@
+/*
+ * Downloading one file from several identical servers (replicas) at once.
+ *
+ * The file is split into one range per replica, and each replica's range is fetched with
+ * COMMAND_REQUEST_RANGE requests of PARALLEL_FETCH_REQUEST_SIZE bytes, over one connection per
+ * replica. A replica that is done steals the second half of the largest range left, so fast replicas
+ * end up fetching most of the file and a slow replica only holds up its last request. A replica that
+ * fails (can't be reached, doesn't have the file, ...) is dropped, and its range is taken over by the
+ * others.
+ *
+ * Before the download starts, every replica is asked for the file's metadata. The replicas must
+ * serve the same version of the file: only the replicas that agree with most of the others on its
+ * size and the version part of its ETag (see `etag_version`; the inode differs between hosts, so
+ * copies must keep the mtime, e.g. `rsync -t`) take part, and the others drop out with
+ * ERROR_VERSION_MISMATCH.
+ */
+#ifndef PARALLEL_FETCH_H
+#define PARALLEL_FETCH_H
+
+#include "sockets.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// the size of one range request; a range is stolen only if at least two requests are left of it
+#define PARALLEL_FETCH_REQUEST_SIZE (256 * 1024)
+
+/**
+ * @brief A replica, and what was fetched from it.
+ *
+ * endpoint: the server
+ * bytes: set to the number of bytes fetched from the replica
+ * status: set to STATUS_OK, or the error that made the replica drop out
+ */
+typedef struct {
+    Endpoint endpoint;
+    uint64_t bytes;
+    int status;
+} Replica;
+
+/**
+ * @brief Fetches a file from all `replicas` at once and writes it to `fd` (from offset 0; the file
+ * is truncated to the size of the fetched file).
+ *
+ * @param policy how the connections to the replicas are made (with `connect_with_deadline`)
+ * @param options the socket options of the connections; NULL uses the kernel defaults
+ * @param file_size set to the size of the file
+ *
+ * @return STATUS_OK, or the error of the last replica that dropped out if the file could not be
+ * fetched completely (e.g. ERROR_FILE_NOT_FOUND), or ERROR_FILE_OPEN_FAILED if `fd` could not be written.
+ * A replica that serves another version than the others is left out (its status is
+ * ERROR_VERSION_MISMATCH) and doesn't fail the fetch.
+ */
+int parallel_fetch(Replica* replicas, size_t replica_count, const RetryPolicy* policy, const SocketOptions* options, const char* file_name, int fd, uint64_t* file_size);
+
+#endif // PARALLEL_FETCH_H
@@ -5,6 +5,7 @@
 #define PROTOCOL_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 #define NOT_SET 255
 
@@ -12,9 +13,23 @@
 #define MESSAGE_RESPONSE 2
 #define MESSAGE_RESPONSE_CHUNK 3
 #define MESSAGE_RESPONSE_LAST_CHUNK  4
+// requests that don't fit in one message (e.g. the block signatures of COMMAND_REQUEST_DELTA)
+// continue with REQUEST_CHUNK messages and end with a REQUEST_LAST_CHUNK message
+#define MESSAGE_REQUEST_CHUNK 5
+#define MESSAGE_REQUEST_LAST_CHUNK 6
+// pushed by the server on a subscribed connection when a file changes (see `subscription.h`)
+#define MESSAGE_NOTIFICATION 7
+// sent on a multiplexed stream ahead of the chunks of a file: the size of the file (uint64_t, network
+// byte order), so that the client can allocate it in one go
+#define MESSAGE_RESPONSE_SIZE 8
 
 #define COMMAND_REQUEST_FILE 1
 #define COMMAND_REQUEST_METADATA 2
+#define COMMAND_REQUEST_FILE_DESCRIPTOR 3
+#define COMMAND_REQUEST_DELTA 4
+#define COMMAND_REQUEST_FILE_IF_NONE_MATCH 5
+#define COMMAND_REQUEST_RANGE 6
+#define COMMAND_SUBSCRIBE 7
 
 #define STATUS_OK 0
 #define ERROR_UNKNOWN_COMMAND 1
@@ -28,12 +43,26 @@
 #define ERROR_INVALID_COMMAND 9
 #define ERROR_INVALID_MESSAGE_TYPE 10
 #define ERROR_UNEXPECTED_MESSAGE_TYPE 11
+#define ERROR_UNSUPPORTED_TRANSPORT 12
+// not an error: the file still has the ETag the client sent with COMMAND_REQUEST_FILE_IF_NONE_MATCH
+#define STATUS_NOT_MODIFIED 13
+#define ERROR_INVALID_STREAM 14
+#define ERROR_TOO_MANY_STREAMS 15
+// the server is overloaded and rejected the request without handling it; retry later or elsewhere
+#define ERROR_OVERLOADED 16
+// the file name is absolute or has a `..` component (see `file_cache.h`)
+#define ERROR_INVALID_FILE_NAME 17
+// the file rebuilt from a delta doesn't match the hash the server sent with it (see `delta_file_hash`)
+#define ERROR_CHECKSUM_MISMATCH 18
+// the replica serves another version of the file than the other replicas (see `parallel_fetch.h`)
+#define ERROR_VERSION_MISMATCH 19
 
 #define HEADER_OFFSET_MESSAGE_TYPE 0
 #define HEADER_OFFSET_COMMAND 1
 #define HEADER_OFFSET_PAYLOAD_SIZE 2
 #define HEADER_OFFSET_CHUNK_INDEX 6
 #define HEADER_OFFSET_STATUS 10
+#define HEADER_OFFSET_STREAM_ID 11
 
 #define MAX_PAYLOAD_SIZE 1024
 
@@ -45,6 +74,8 @@
  * payload_size: size of the payload data in bytes
  * chunk_index: index of the chunk (for chunked messages)
  * status: status of the response (not used for requests)
+ * stream_id: the stream a message belongs to; requests on stream 0 are answered one at a time, in
+ * order; responses to requests on other streams can be interleaved (see `multiplex.h`)
  */
 #pragma pack(push, 1) // this ensures that the struct is packed with 1 byte alignment (i.e. without padding); this is needed so offset calculations are correct when converting creating the byte array message
 typedef struct {
@@ -57,12 +88,13 @@ typedef struct {
     uint32_t payload_size;
     uint32_t chunk_index;
     uint8_t status;
+    uint32_t stream_id;
 } Header;
 #pragma pack(pop)
 
 #define HEADER_SIZE sizeof(Header)
 #define MAX_MESSAGE_SIZE (HEADER_SIZE + MAX_PAYLOAD_SIZE)
-#define HEADER_INIT {NOT_SET, NOT_SET, 0, 0, NOT_SET}
+#define HEADER_INIT {NOT_SET, NOT_SET, 0, 0, NOT_SET, 0}
 
 /**
  * @brief holds the header and payload (data) that will be sent over the network.
@@ -80,29 +112,62 @@ typedef struct {
  * 
  * header: the parsed header metadata
  * payload: pointer to the parsed payload data
+ * pooled: non-zero if `payload` is a message buffer (see `message_buffer_acquire`) rather than
+ * memory from malloc; payloads assembled from several chunks are never pooled
  */
 typedef struct {
     Header header;
     uint8_t* payload;
+    uint8_t pooled;
 } Response;
 
-#define RESPONSE_INIT {HEADER_INIT, NULL}
+#define RESPONSE_INIT {HEADER_INIT, NULL, 0}
+
+// the most buffers a thread keeps for reuse; buffers released beyond this are freed
+#define MESSAGE_BUFFER_CACHE_SIZE 64
+
+/**
+ * @brief Returns a buffer of MAX_MESSAGE_SIZE bytes, or NULL if memory could not be allocated.
+ *
+ * Every message and single-message payload fits in MAX_MESSAGE_SIZE bytes, so the protocol layer
+ * uses these buffers instead of allocating memory for each message: each thread keeps the buffers it
+ * releases on a free list and hands them out again, without locks. In steady state (e.g. a server
+ * sending chunks) no memory is allocated or freed at all.
+ * The buffer must be given back with `message_buffer_release`, on any thread.
+ */
+uint8_t* message_buffer_acquire(void);
+
+/**
+ * @brief Gives back a buffer from `message_buffer_acquire`. It is kept for reuse by the calling
+ * thread (up to MESSAGE_BUFFER_CACHE_SIZE buffers) and freed when the thread exits.
+ */
+void message_buffer_release(uint8_t* buffer);
+
+/**
+ * @brief Frees the buffers kept for reuse by the calling thread.
+ */
+void message_buffer_trim(void);
+
+/**
+ * @brief Returns the number of buffers kept for reuse by the calling thread.
+ */
+size_t message_buffer_cached(void);
 
 /**
- * @brief Frees the memory allocated for the Message struct and resets the members to their default values.
+ * @brief Releases the byte array of the Message struct and resets the members to their default values.
  */
 void destroy_message(Message* message);
 
 /**
- * @brief Frees the memory allocated for the Response struct and resets the members to RESPONSE_INIT values.
+ * @brief Releases (or frees, if not pooled) the payload of the Response struct and resets the members to RESPONSE_INIT values.
  */
 void destroy_response(Response* response);
 
 /**
  * @brief Fills a Message struct with the byte array representation of a Header and payload that can be sent over the network.
  * 
- * Memory is allocated for the byte array in the Message struct.
- * The caller is responsible for freeing the memory, which can be done with the `destroy_message` function.
+ * The byte array in the Message struct is a message buffer (see `message_buffer_acquire`).
+ * The caller is responsible for releasing it, which can be done with the `destroy_message` function.
  * 
  * @param header Pointer to the Header struct.
  * @param payload Pointer to the byte array payload data.
@@ -112,6 +177,11 @@ void destroy_response(Response* response);
  */
 int create_message(const Header* header, const uint8_t* payload, Message* message);
 
+/**
+ * @brief Writes the byte array representation of a Header (HEADER_SIZE bytes) to `data`.
+ */
+void encode_header(const Header* header, uint8_t* data);
+
 /**
  * @brief Extracts the Header struct from a raw byte array.
  */
@@ -120,8 +190,8 @@ int extract_header(const uint8_t* data, uint32_t data_size, Header* header);
 /**
  * @brief Parses a raw byte array into a Response struct containing the Header and payload.
  * 
- * Memory is allocated for the payload in the Response struct.
- * The caller is responsible for freeing the memory, which can be done with the `destroy_response` function.
+ * The payload in the Response struct is a message buffer (see `message_buffer_acquire`).
+ * The caller is responsible for releasing it, which can be done with the `destroy_response` function.
  * 
  * @param data Pointer to the byte array received over the network, containing the header and payload.
  * @param data_size The size of the byte array data.
@@ -0,0 +1,155 @@
+/*
+ * Request scheduler: limits how many requests are handled at once and decides which waiting request
+ * runs next.
+ *
+ * A request holds its slot while the server works on it, e.g. opening the file. The server gives the
+ * slot back once only sending the contents remains (see
+ * `handle_request_on_sending`), so a slow client doesn't keep other requests waiting.
+ *
+ * Requests are split into priority classes. Interactive requests (metadata, small files) are cheap,
+ * so running them ahead of bulk transfers cuts their latency a lot while delaying the bulk transfers
+ * only a little (shortest job first). Two rules keep bulk transfers from being hurt too much or
+ * hurting everyone else:
+ * - aging: a bulk request that has waited longer than `aging_ms` runs before interactive requests
+ * - bulk cap: at most `max_bulk` bulk requests run at once, so some slots are always left for
+ *   interactive requests
+ *
+ * Admission control (in the spirit of CoDel): the scheduler watches how long the requests of each
+ * class wait for a slot. A short burst is absorbed by the queue, but when the waiting time of a class
+ * stays above `target_ms` for a whole `interval_ms` its queue is standing, i.e. requests arrive faster
+ * than they can be handled. Until the waiting time of the class drops below the target again, its
+ * requests that can't run right away are rejected with ERROR_OVERLOADED instead of being queued, so
+ * clients fail fast (and can retry elsewhere) rather than time out after waiting. The classes are
+ * tracked separately so that the waits of one don't mask (or fake) a standing queue in the other.
+ */
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define SCHEDULER_CLASS_INTERACTIVE 0
+#define SCHEDULER_CLASS_BULK 1
+#define SCHEDULER_CLASSES 2
+
+// files up to this size are interactive; larger files are bulk
+#define SCHEDULER_SMALL_FILE_SIZE (64 * 1024)
+
+#define SCHEDULER_DEFAULT_MAX_RUNNING 16
+#define SCHEDULER_DEFAULT_MAX_BULK 4
+#define SCHEDULER_DEFAULT_AGING_MS 500
+// CoDel uses 5ms/100ms for packets; requests take longer than packets, so the defaults are larger
+#define SCHEDULER_DEFAULT_TARGET_MS 50
+#define SCHEDULER_DEFAULT_INTERVAL_MS 500
+
+/**
+ * @brief A request waiting for, or holding, a slot. Lives on the stack of the thread handling the request.
+ *
+ * priority_class: SCHEDULER_CLASS_INTERACTIVE or SCHEDULER_CLASS_BULK
+ * enqueued_ms: `monotonic_time_ms` when the request started waiting
+ * granted: non-zero once the request may run
+ * wake: signaled when the request is granted
+ * next: the next request waiting in the same class
+ */
+typedef struct SchedulerTicket {
+    int priority_class;
+    uint64_t enqueued_ms;
+    int granted;
+    pthread_cond_t wake;
+    struct SchedulerTicket* next;
+} SchedulerTicket;
+
+/**
+ * @brief A thread-safe scheduler shared by all connections of a server.
+ *
+ * mutex: protects all other members
+ * head, tail: the waiting requests of each class, in arrival order
+ * queued: the number of waiting requests of each class
+ * running: the number of requests holding a slot
+ * running_bulk: the number of bulk requests holding a slot
+ * max_running: the maximum number of requests that run at once
+ * max_bulk: the maximum number of bulk requests that run at once
+ * aging_ms: bulk requests that waited this long run before interactive requests
+ * target_ms: the acceptable waiting time (0 disables admission control)
+ * interval_ms: how long the waiting time must stay above the target before requests are rejected
+ * above_target_until_ms: for each class, when its waiting time first went above the target, plus `interval_ms` (0 while below the target)
+ * overloaded: for each class, non-zero while its requests that can't run right away are rejected
+ * rejected: the number of requests rejected so far
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    SchedulerTicket* head[SCHEDULER_CLASSES];
+    SchedulerTicket* tail[SCHEDULER_CLASSES];
+    size_t queued[SCHEDULER_CLASSES];
+    size_t running;
+    size_t running_bulk;
+    size_t max_running;
+    size_t max_bulk;
+    uint64_t aging_ms;
+    uint64_t target_ms;
+    uint64_t interval_ms;
+    uint64_t above_target_until_ms[SCHEDULER_CLASSES];
+    int overloaded[SCHEDULER_CLASSES];
+    uint64_t rejected;
+} Scheduler;
+
+/**
+ * @brief Initializes a scheduler with no running or waiting requests and admission control disabled
+ * (see `scheduler_set_admission`).
+ *
+ * @param max_running The maximum number of requests that run at once (at least 1).
+ * @param max_bulk The maximum number of bulk requests that run at once (at least 1, at most `max_running`).
+ * @param aging_ms Bulk requests that waited this long run before interactive requests.
+ * @return 0 on success, or -1 if the limits are invalid or the mutex could not be initialized.
+ */
+int scheduler_init(Scheduler* scheduler, size_t max_running, size_t max_bulk, uint64_t aging_ms);
+
+/**
+ * @brief Enables admission control: the requests of a class are rejected while the waiting time of
+ * the class has been above `target_ms` for at least `interval_ms`. A `target_ms` of 0 disables it.
+ */
+void scheduler_set_admission(Scheduler* scheduler, uint64_t target_ms, uint64_t interval_ms);
+
+/**
+ * @brief Releases the scheduler's resources. No requests may be running or waiting.
+ */
+void scheduler_destroy(Scheduler* scheduler);
+
+/**
+ * @brief Returns the priority class of a request for `command` on a file of `file_size` bytes.
+ * A `file_size` of -1 (unknown, e.g. the file does not exist and an error response will be sent) is
+ * interactive: the response is small.
+ */
+int scheduler_classify(uint8_t command, long file_size);
+
+/**
+ * @brief Waits until the request may run.
+ *
+ * @return STATUS_OK, after which the request must be followed by `scheduler_release` with the same
+ * ticket; or ERROR_OVERLOADED if the request was rejected by admission control (it must not be
+ * handled, and not released).
+ */
+int scheduler_acquire(Scheduler* scheduler, SchedulerTicket* ticket, int priority_class);
+
+/**
+ * @brief Gives up the slot of a request and starts the next waiting request, if any.
+ */
+void scheduler_release(Scheduler* scheduler, SchedulerTicket* ticket);
+
+/**
+ * @brief Returns the number of requests of a class that are waiting for a slot.
+ */
+size_t scheduler_queued(Scheduler* scheduler, int priority_class);
+
+/**
+ * @brief Returns non-zero while the requests of a class that can't run right away are rejected.
+ */
+int scheduler_overloaded(Scheduler* scheduler, int priority_class);
+
+/**
+ * @brief Returns the number of requests rejected by admission control so far.
+ */
+uint64_t scheduler_rejected(Scheduler* scheduler);
+
+#endif // SCHEDULER_H
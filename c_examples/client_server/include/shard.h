@@ -0,0 +1,68 @@
+/*
+ * Client-side sharding: files partitioned across several servers, without a router in between.
+ *
+ * Each file name is placed on one server by consistent hashing (`hash_ring.h`), with the servers
+ * named `address:port` on the ring, so every client that knows the same list of servers sends a file's
+ * requests to the same server, whatever the order of the list. To add or remove servers, build a new
+ * map from the new list: only the files placed on the added servers (or that were on the removed
+ * ones) move, about 1/n of them, and those are the only files that must be copied between servers.
+ */
+#ifndef SHARD_H
+#define SHARD_H
+
+#include "protocol.h"
+#include "hash_ring.h"
+#include "connection_pool.h"
+#include <stddef.h>
+
+// the longest `address:port` name of a server on the ring
+#define SHARD_NAME_SIZE (POOL_ADDRESS_SIZE + 16)
+
+/**
+ * @brief Which server each file name is placed on.
+ *
+ * servers: the servers (not copied; they must outlive the map)
+ * server_count: the number of servers
+ * ring: the placement of the names on the servers
+ */
+typedef struct {
+    const Endpoint* servers;
+    size_t server_count;
+    HashRing ring;
+} ShardMap;
+
+/**
+ * @brief Builds the map of `server_count` servers with `virtual_nodes` points each on the ring.
+ *
+ * @return STATUS_OK, ERROR_INVALID_DATA_SIZE if there are no servers or an address is too long, or
+ * ERROR_MEMORY_ALLOCATION_FAILED.
+ */
+int shard_map_init(ShardMap* map, const Endpoint* servers, size_t server_count, size_t virtual_nodes);
+
+/**
+ * @brief Frees the ring of the map.
+ */
+void shard_map_destroy(ShardMap* map);
+
+/**
+ * @brief Returns the server `file_name` is placed on.
+ */
+const Endpoint* shard_map_lookup(const ShardMap* map, const char* file_name);
+
+/**
+ * @brief Requests the metadata of a file from the server it is placed on, over a connection from
+ * `pool` (see `request_file_metadata`).
+ *
+ * @return the status of the request, or ERROR_SEND_FAILED if the server could not be reached.
+ */
+int shard_request_file_metadata(const ShardMap* map, ConnectionPool* pool, const char* file_name, Response* response);
+
+/**
+ * @brief Requests the contents of a file from the server it is placed on, over a connection from
+ * `pool` (see `request_file_contents`).
+ *
+ * @return the status of the request, or ERROR_SEND_FAILED if the server could not be reached.
+ */
+int shard_request_file_contents(const ShardMap* map, ConnectionPool* pool, const char* file_name, Response* response);
+
+#endif // SHARD_H
@@ -3,21 +3,141 @@
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <getopt.h>
 
+/**
+ * @brief Tuning options applied to sockets created by `connect_socket`, `bind_or_die` and `accept_or_die`.
+ *
+ * A value of 0 leaves the kernel default in place.
+ *
+ * tcp_nodelay: TCP_NODELAY; disables Nagle's algorithm so small writes are sent immediately
+ * tcp_cork: TCP_CORK; holds back partial frames until the socket is uncorked (see `socket_flush`)
+ * send_buffer_size: SO_SNDBUF in bytes
+ * receive_buffer_size: SO_RCVBUF in bytes
+ * tcp_quickack: TCP_QUICKACK; disables delayed ACKs (not sticky; the kernel may re-enable them)
+ * tcp_fastopen: TCP_FASTOPEN queue length on the server; any non-zero value enables TCP_FASTOPEN_CONNECT on the client (best effort; ignored if the kernel doesn't allow it)
+ * busy_poll: SO_BUSY_POLL in microseconds to busy poll the device queue on blocking receives
+ * notsent_lowat: TCP_NOTSENT_LOWAT in bytes; limits the amount of unsent data queued in the kernel
+ * backlog: the backlog passed to `listen` (see `listen_or_die`)
+ */
+typedef struct {
+    int tcp_nodelay;
+    int tcp_cork;
+    int send_buffer_size;
+    int receive_buffer_size;
+    int tcp_quickack;
+    int tcp_fastopen;
+    int busy_poll;
+    int notsent_lowat;
+    int backlog;
+} SocketOptions;
+
+#define SOCKET_OPTIONS_INIT {0, 0, 0, 0, 0, 0, 0, 0, 1}
+
+/**
+ * @brief Addresses starting with this prefix (e.g. "unix:/tmp/server.sock") refer to a unix domain
+ * socket path rather than an IP address; the port is ignored for these addresses.
+ */
+#define UNIX_ADDRESS_PREFIX "unix:"
+
+/**
+ * @brief A server to connect to, e.g. one of the replicas or shards a client spreads its requests over.
+ *
+ * address: the address of the server (IP address or `unix:<path>`)
+ * port: the port of the server
+ */
+typedef struct {
+    const char* address;
+    in_addr_t port;
+} Endpoint;
+
+/**
+ * @brief Controls how `connect_with_deadline` retries a connection.
+ * 
+ * attempt_timeout_ms: how long a single connection attempt may take before it is abandoned; 0 for no timeout
+ * initial_backoff_ms: the delay before the first retry; doubled after every failed attempt
+ * max_backoff_ms: the upper bound on the delay between attempts
+ * deadline_ms: the overall time budget for all attempts, including delays; 0 for no deadline
+ * max_attempts: the maximum number of attempts; 0 for no limit (the deadline applies)
+ * 
+ * A random jitter of up to half of each delay is applied so that many clients reconnecting at
+ * the same time (e.g. after a server restart) don't retry in lockstep.
+ */
+typedef struct {
+    int attempt_timeout_ms;
+    int initial_backoff_ms;
+    int max_backoff_ms;
+    int deadline_ms;
+    int max_attempts;
+} RetryPolicy;
+
+#define RETRY_POLICY_INIT {1000, 10, 1000, 5000, 0}
+
+#define CONNECT_OK 0
+#define CONNECT_ERROR_INVALID_ADDRESS 1
+#define CONNECT_ERROR_SOCKET 2
+#define CONNECT_ERROR_TIMEOUT 3
+#define CONNECT_ERROR_REFUSED 4
+#define CONNECT_ERROR_FAILED 5
+
+/**
+ * @brief `struct option` entries (see getopt_long) for each field of SocketOptions.
+ *
+ * Used by the server and client command line parsers; when getopt_long returns 0 for one of these
+ * entries, pass the option name and `optarg` to `set_socket_option`.
+ */
+#define SOCKET_LONG_OPTIONS \
+    {"nodelay", no_argument, NULL, 0}, \
+    {"cork", no_argument, NULL, 0}, \
+    {"sndbuf", required_argument, NULL, 0}, \
+    {"rcvbuf", required_argument, NULL, 0}, \
+    {"quickack", no_argument, NULL, 0}, \
+    {"fastopen", required_argument, NULL, 0}, \
+    {"busy-poll", required_argument, NULL, 0}, \
+    {"notsent-lowat", required_argument, NULL, 0}, \
+    {"backlog", required_argument, NULL, 0}
+
+/**
+ * @brief Sets the field of `options` that corresponds to a name in SOCKET_LONG_OPTIONS.
+ *
+ * @param options The options to update.
+ * @param name The long option name (e.g. "sndbuf").
+ * @param value The option argument, or NULL for flags (e.g. "nodelay").
+ * @return 0 on success, or -1 if the name is unknown or the value is not a non-negative integer.
+ */
+int set_socket_option(SocketOptions* options, const char* name, const char* value);
+
+/**
+ * @brief Applies the options to a socket. Options that do not apply to the socket type are ignored.
+ *
+ * @param socket_fd The socket file descriptor.
+ * @param options The options to apply; NULL applies nothing.
+ * @param listening Non-zero if the socket will be used to listen (TCP_FASTOPEN is set differently on the server).
+ * @return 0 on success, or -1 if setting an option failed (errno is set).
+ */
+int apply_socket_options(int socket_fd, const SocketOptions* options, int listening);
+
+/**
+ * @brief Pushes out any partial frames held back by TCP_CORK. Does nothing if the socket is not corked.
+ *
+ * Should be called after the last message of a response has been sent.
+ */
+void socket_flush(int socket_fd);
 
 /**
  * @brief Creates a socket and connects it to a given IP address and port.
  * 
- * @param ip_address The IP address of the server.
+ * @param ip_address The IP address of the server, or UNIX_ADDRESS_PREFIX followed by a unix domain socket path.
  * @param port The port of the server.
+ * @param options The socket options to apply before connecting; NULL uses the kernel defaults.
  * @return The socket file descriptor of the server connection, or -1 if the connection fails.
  */
-int connect_socket(const char* ip_address, in_addr_t port);
+int connect_socket(const char* ip_address, in_addr_t port, const SocketOptions* options);
 
 /**
  * @brief Creates a socket and connects it to a given IP address and port. Exits the program if the connection fails.
  * 
- * @param ip_address The IP address of the server.
+ * @param ip_address The IP address of the server, or UNIX_ADDRESS_PREFIX followed by a unix domain socket path.
  * @param port The port of the server.
  * @return The socket file descriptor of the server connection.
  */
@@ -26,21 +146,56 @@ int connect_or_die(const char* ip_address, in_addr_t port);
 /**
  * @brief Creates a socket and connects it to a given IP address and port. Retries the connection if it fails. Exits the program if the connection fails after the maximum number of retries.
  * 
- * @param ip_address The IP address of the server.
+ * @param ip_address The IP address of the server, or UNIX_ADDRESS_PREFIX followed by a unix domain socket path.
  * @param port The port of the server.
  * @param max_retries The maximum number of retries.
  * @param retry_delay The delay between retries in seconds.
+ * @param options The socket options to apply before connecting; NULL uses the kernel defaults.
  * @return The socket file descriptor of the server connection.
  */
-int connect_with_retry_or_die(const char* ip_address, in_addr_t port, int max_retries, int retry_delay);
+int connect_with_retry_or_die(const char* ip_address, in_addr_t port, int max_retries, int retry_delay, const SocketOptions* options);
+
+/**
+ * @brief Connects to a given address and port using non-blocking connects, retrying with exponential
+ * backoff (and jitter) until the connection succeeds, the deadline passes, or the attempts run out.
+ * 
+ * Unlike `connect_with_retry_or_die`, errors are returned to the caller instead of exiting the program.
+ * Refused connections, attempt timeouts, and (for unix domain sockets) missing socket files are retried;
+ * other errors are returned immediately.
+ * 
+ * @param ip_address The IP address of the server, or UNIX_ADDRESS_PREFIX followed by a unix domain socket path.
+ * @param port The port of the server.
+ * @param policy The retry policy; NULL uses RETRY_POLICY_INIT.
+ * @param options The socket options to apply before connecting; NULL uses the kernel defaults.
+ * @param socket_fd Set to the (blocking) socket file descriptor of the server connection, or -1 on failure.
+ * @return CONNECT_OK on success, otherwise an error code starting with `CONNECT_ERROR_` (errno is set to the last error).
+ */
+int connect_with_deadline(const char* ip_address, in_addr_t port, const RetryPolicy* policy, const SocketOptions* options, int* socket_fd);
+
+/**
+ * @brief Returns a human readable description of a `CONNECT_` status code.
+ */
+const char* connect_error_string(int status);
 
 /**
  * @brief Creates a socket and binds to a port. Exits the program if the binding fails.
  * 
  * @param port The port to bind to.
+ * @param options The socket options to apply before binding; NULL uses the kernel defaults.
  * @return The socket file descriptor of the bound server socket/port.
  */
-int bind_or_die(in_addr_t port);
+int bind_or_die(in_addr_t port, const SocketOptions* options);
+
+/**
+ * @brief Creates a unix domain stream socket and binds it to a path. Exits the program if the binding fails.
+ * 
+ * Any existing file at `path` (e.g. left behind by a previous server) is removed first.
+ * 
+ * @param path The file system path of the socket.
+ * @param options The socket options to apply before binding; TCP specific options are ignored. NULL uses the kernel defaults.
+ * @return The socket file descriptor of the bound server socket.
+ */
+int bind_unix_or_die(const char* path, const SocketOptions* options);
 
 /**
  * @brief Listens on a socket. Exits the program if listening fails.
@@ -54,9 +209,10 @@ void listen_or_die(int server_socket, int backlog);
  * @brief Accepts a connection on a server socket. Exits the program if the connection fails.
  * 
  * @param server_socket The server socket file descriptor.
+ * @param options The socket options to apply to the accepted connection; NULL uses the kernel defaults.
  * @return The client socket file descriptor of the accepted connection.
  */
-int accept_or_die(int server_socket);
+int accept_or_die(int server_socket, const SocketOptions* options);
 
 /**
  * @brief Receives data from a socket. Exits the program if the receive fails.
@@ -67,6 +223,71 @@ int accept_or_die(int server_socket);
  */
 ssize_t receive_or_die(int socket_fd, void* buffer, size_t length);
 
+/**
+ * @brief Sends all `length` bytes, retrying on partial sends.
+ *
+ * @return `length` on success, or -1 if the send fails.
+ */
+ssize_t send_all(int socket_fd, const void* buffer, size_t length);
+
+/**
+ * @brief Receives exactly `length` bytes, retrying on partial receives.
+ *
+ * @return `length` on success, 0 if the peer closed the connection before any byte was received, or -1
+ * if the receive fails or the connection is closed part way through.
+ */
+ssize_t receive_all(int socket_fd, void* buffer, size_t length);
+
+
+/**
+ * @brief The maximum number of file descriptors that can be passed in one message.
+ */
+#define MAX_PASSED_FDS 8
+
+/**
+ * @brief Sends all `length` bytes and a file descriptor over a unix domain socket (SCM_RIGHTS).
+ * 
+ * The receiving process gets its own descriptor that refers to the same open file description.
+ * 
+ * @param socket_fd The unix domain socket file descriptor.
+ * @param buffer The data to send; must be at least one byte because the descriptor is attached to the data.
+ * @param length The number of bytes to send.
+ * @param fd The file descriptor to pass.
+ * @return `length` on success, or -1 if the send fails.
+ */
+ssize_t send_all_with_fd(int socket_fd, const void* buffer, size_t length, int fd);
+
+/**
+ * @brief Receives exactly `length` bytes and, if one was sent alongside the data, a file descriptor (SCM_RIGHTS).
+ * 
+ * @param socket_fd The unix domain socket file descriptor.
+ * @param buffer The buffer to store the received data.
+ * @param length The number of bytes to receive.
+ * @param fd Set to the received file descriptor, or -1 if none was received. The caller is responsible for closing it.
+ * @return `length` on success, 0 if the peer closed the connection before any byte was received, or -1 on failure.
+ */
+ssize_t receive_all_with_fd(int socket_fd, void* buffer, size_t length, int* fd);
+
+/**
+ * @brief Same as `send_all_with_fd` but passes up to MAX_PASSED_FDS file descriptors at once.
+ */
+ssize_t send_all_with_fds(int socket_fd, const void* buffer, size_t length, const int* fds, int fd_count);
+
+/**
+ * @brief Same as `receive_all_with_fd` but receives up to `max_fds` file descriptors.
+ * 
+ * @param fds Filled with the received file descriptors. The caller is responsible for closing them.
+ * @param max_fds The capacity of `fds`.
+ * @param fd_count Set to the number of descriptors stored in `fds`.
+ * @return As `receive_all_with_fd`; -1 (with no descriptors left open) if more descriptors were sent than
+ * `max_fds` or than fit in one message (MAX_PASSED_FDS), rather than losing some of them.
+ */
+ssize_t receive_all_with_fds(int socket_fd, void* buffer, size_t length, int* fds, int max_fds, int* fd_count);
+
+/**
+ * @brief Returns non-zero if the socket is a unix domain socket (i.e. can pass file descriptors).
+ */
+int is_unix_socket(int socket_fd);
 
 /**
  * @brief cleans up the socket file descriptor (shutdown and close).
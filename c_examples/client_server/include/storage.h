@@ -0,0 +1,86 @@
+/*
+ * The directories (storage roots) a server serves files from, e.g. one per disk.
+ *
+ * Each file name is placed on one root by consistent hashing (see `hash_ring.h`), so the files are
+ * spread over the disks and adding a root only moves about 1/n of them. A file must be stored in the
+ * root its name is placed on; it is looked up there only.
+ *
+ * Each root has its own file cache, reader thread pool and (optionally) catalog, so reads from
+ * different disks run in parallel and a slow disk only holds up requests for its own files.
+ */
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include "file_cache.h"
+#include "io_pool.h"
+#include "catalog.h"
+#include "hash_ring.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief A storage root.
+ *
+ * path: the directory
+ * cache: the open files of the root
+ * io_pool: the threads that read the root's files
+ * catalog: the catalog of the root (valid if `cataloged`)
+ * cataloged: non-zero if the root has a catalog (see `storage_open_catalogs`)
+ */
+typedef struct {
+    char* path;
+    FileCache cache;
+    IoPool io_pool;
+    Catalog catalog;
+    int cataloged;
+} StorageRoot;
+
+/**
+ * @brief The storage roots and the placement of file names on them.
+ *
+ * roots: the roots
+ * root_count: the number of roots
+ * ring: the consistent hash ring of the roots (by path)
+ */
+typedef struct {
+    StorageRoot* roots;
+    size_t root_count;
+    HashRing ring;
+} Storage;
+
+/**
+ * @brief Sets up the roots at `paths`, with `io_threads` reader threads each.
+ *
+ * @return STATUS_OK; ERROR_FILE_OPEN_FAILED if a root could not be opened (the storage can still be
+ * used and destroyed, but files placed on that root are not found); or ERROR_INVALID_DATA_SIZE if
+ * there are no roots, and ERROR_MEMORY_ALLOCATION_FAILED if memory or threads could not be allocated
+ * (then the storage must not be used).
+ */
+int storage_init(Storage* storage, const char* const* paths, size_t root_count, size_t io_threads);
+
+/**
+ * @brief Closes the catalogs, stops the reader threads and closes the roots. No files may be in use.
+ */
+void storage_destroy(Storage* storage);
+
+/**
+ * @brief Returns the root `name` is placed on.
+ */
+StorageRoot* storage_root(const Storage* storage, const char* name);
+
+/**
+ * @brief Opens a catalog (see `catalog.h`) for every root and starts its scanner thread. The catalog of
+ * the only root is at `path`; with several roots, each uses `path.HASH`, where HASH is the FNV-1a hash
+ * of the root's path (16 hex digits), so a root keeps its catalog when roots are reordered or added.
+ *
+ * @return STATUS_OK, or ERROR_FILE_OPEN_FAILED if a catalog could not be opened or its scanner not
+ * started (no catalogs are left open).
+ */
+int storage_open_catalogs(Storage* storage, const char* path, uint64_t scan_interval_ms);
+
+/**
+ * @brief Stops the scanner threads and closes the catalogs opened by `storage_open_catalogs`.
+ */
+void storage_close_catalogs(Storage* storage);
+
+#endif // STORAGE_H
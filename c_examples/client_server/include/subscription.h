@@ -0,0 +1,152 @@
+/*
+ * File change subscriptions: the server tells clients when a file changes, instead of the clients
+ * polling its metadata.
+ *
+ * A client sends COMMAND_SUBSCRIBE with one or more null terminated patterns: a file name, or a prefix
+ * followed by `*` (e.g. `logs/` and `*`; `*` alone matches every file). From then on, the connection carries
+ * notifications: whenever a matching file is written (closed after writing), renamed into place,
+ * touched or removed, the server sends a MESSAGE_NOTIFICATION with its name, size and mtime. More
+ * COMMAND_SUBSCRIBE requests can be sent on the connection to add patterns; each is acknowledged with a
+ * response (STATUS_OK, or the error). Any other request is rejected and the connection closed.
+ *
+ * On the server, the subscribed connections are handed to one thread (the notifier), which watches the
+ * directories of the storage roots with inotify. There is nothing to poll: a change costs one stat and
+ * one message per subscriber. The subscribed connections are non-blocking: the notifications a
+ * subscriber doesn't take right away are queued for it, and one whose queue fills up (it stopped reading)
+ * is disconnected rather than holding up the others. When a directory is removed or moved away, each file
+ * that was in it is notified as removed.
+ *
+ * Notifications are not stored: a client that reconnects (or is told that notifications were lost, when
+ * the kernel's event queue overflowed) should check the files it cares about again.
+ */
+#ifndef SUBSCRIPTION_H
+#define SUBSCRIPTION_H
+
+#include "protocol.h"
+#include "storage.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+// the payload of a notification: the null terminated name, then the size (8 bytes), mtime seconds (8
+// bytes) and mtime nanoseconds (4 bytes), in network byte order
+#define SUBSCRIPTION_NOTIFICATION_SIZE 20
+// the most bytes of notifications queued for a subscriber that doesn't read them; one that falls further
+// behind is disconnected
+#define SUBSCRIPTION_QUEUE_SIZE (64 * 1024)
+
+// the kinds of notifications
+#define NOTIFICATION_SUBSCRIBED 1 // a COMMAND_SUBSCRIBE was answered; `status` is its result
+#define NOTIFICATION_CHANGED 2    // the file was created or changed
+#define NOTIFICATION_REMOVED 3    // the file was removed or renamed away (or its directory was)
+#define NOTIFICATION_LOST 4       // notifications were lost; the subscribed files should be checked again
+
+/**
+ * @brief A message received on a subscribed connection.
+ *
+ * kind: NOTIFICATION_SUBSCRIBED, NOTIFICATION_CHANGED, NOTIFICATION_REMOVED or NOTIFICATION_LOST
+ * status: for NOTIFICATION_SUBSCRIBED, STATUS_OK or the error the subscription failed with
+ * name: the name of the file (empty unless the kind is NOTIFICATION_CHANGED or NOTIFICATION_REMOVED)
+ * size: the new size of the file (NOTIFICATION_CHANGED only)
+ * mtime: the new modification time of the file (NOTIFICATION_CHANGED only)
+ */
+typedef struct {
+    int kind;
+    int status;
+    char name[FILE_CACHE_MAX_NAME];
+    uint64_t size;
+    struct timespec mtime;
+} Notification;
+
+struct _Subscriber;
+struct _PendingSubscriber;
+struct _WatchedDirectory;
+
+/**
+ * @brief The server side: watches the storage roots and notifies the subscribers.
+ *
+ * storage: the roots that are watched
+ * inotify_fd: the inotify instance
+ * wakeup_fd: an eventfd that wakes the thread up for new subscribers and for stopping
+ * thread: the thread that watches and notifies
+ * mutex: protects `pending`, `subscriber_count` and `stop`
+ * pending: the connections handed over that the thread hasn't taken yet
+ * subscriber_count: the number of subscribed connections (including pending ones)
+ * stop: non-zero once `notifier_stop` was called
+ * subscribers: the subscribed connections (only used by the thread)
+ * subscriber_capacity: the allocated size of `subscribers`
+ * directories: the watched directories, indexed by watch descriptor (only used by the thread)
+ * directory_capacity: the allocated size of `directories`
+ */
+typedef struct {
+    const Storage* storage;
+    int inotify_fd;
+    int wakeup_fd;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    struct _PendingSubscriber* pending;
+    size_t subscriber_count;
+    int stop;
+    struct _Subscriber* subscribers;
+    size_t subscriber_capacity;
+    struct _WatchedDirectory* directories;
+    size_t directory_capacity;
+} Notifier;
+
+/**
+ * @brief Starts watching the directories of the roots of `storage` (recursively, including directories
+ * created later) and the thread that notifies the subscribers.
+ *
+ * @return STATUS_OK; ERROR_FILE_OPEN_FAILED if inotify is not available or a root could not be watched;
+ * or ERROR_MEMORY_ALLOCATION_FAILED.
+ */
+int notifier_start(Notifier* notifier, const Storage* storage);
+
+/**
+ * @brief Stops the thread, closes the subscribed connections and releases the notifier.
+ */
+void notifier_stop(Notifier* notifier);
+
+/**
+ * @brief Hands a connection over to the notifier, with the COMMAND_SUBSCRIBE request received on it.
+ *
+ * On success, the notifier owns the socket (which it makes non-blocking): it answers the request, sends
+ * the notifications and closes the connection when the client is gone. On failure, the caller still owns
+ * it.
+ *
+ * @return STATUS_OK, or ERROR_MEMORY_ALLOCATION_FAILED.
+ */
+int notifier_add_subscriber(Notifier* notifier, int socket, const Header* header, const uint8_t* payload);
+
+/**
+ * @brief Returns the number of subscribed connections.
+ */
+size_t notifier_subscriber_count(Notifier* notifier);
+
+/**
+ * @brief Sends a COMMAND_SUBSCRIBE request for `patterns` without waiting for the answer (which is
+ * received by `receive_notification`, in order with the notifications).
+ *
+ * @return STATUS_OK, ERROR_INVALID_DATA_SIZE if there are no patterns, ERROR_MAX_PAYLOAD_SIZE_EXCEEDED if
+ * they don't fit in one message, or ERROR_SEND_FAILED.
+ */
+int send_subscribe(int socket, const char* const* patterns, size_t pattern_count);
+
+/**
+ * @brief Subscribes a new connection to `patterns`: sends the request and waits for the answer.
+ *
+ * @return STATUS_OK, the error the server answered with (e.g. ERROR_INVALID_FILE_NAME), or a transport
+ * error (ERROR_SEND_FAILED, ERROR_RECEIVE_FAILED).
+ */
+int request_subscribe(int socket, const char* const* patterns, size_t pattern_count);
+
+/**
+ * @brief Receives the next notification (or answer to COMMAND_SUBSCRIBE), blocking until one arrives.
+ *
+ * @return STATUS_OK, ERROR_RECEIVE_FAILED if the connection is closed or broken, or
+ * ERROR_UNEXPECTED_MESSAGE_TYPE / ERROR_INVALID_DATA_SIZE for a malformed message.
+ */
+int receive_notification(int socket, Notification* notification);
+
+#endif // SUBSCRIPTION_H
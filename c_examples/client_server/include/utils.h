@@ -1,7 +1,38 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stdint.h>
+#include <stddef.h>
+
+#define FNV1A_OFFSET_BASIS 14695981039346656037ULL
+
 int utils_function();
 int strlen_null_term(const char *string);
 
+/**
+ * @brief Returns the current time of a monotonic clock (CLOCK_MONOTONIC) in milliseconds.
+ * 
+ * Useful for measuring elapsed time and timeouts; it is not affected by changes to the wall clock.
+ */
+uint64_t monotonic_time_ms();
+
+/**
+ * @brief Like `monotonic_time_ms`, in microseconds.
+ */
+uint64_t monotonic_time_us();
+
+/**
+ * @brief Continues a 64-bit FNV-1a hash with `length` more bytes; start with FNV1A_OFFSET_BASIS.
+ * 
+ * Fast and well distributed, but not cryptographic: fine for hash tables and change detection.
+ */
+uint64_t fnv1a_hash(uint64_t hash, const void* data, size_t length);
+
+/**
+ * @brief Parses the decimal value of a command line option into `number`.
+ *
+ * @return 0, or -1 if the value is empty, not a number, or not within [min, max].
+ */
+int parse_number(const char* value, long min, long max, long* number);
+
 #endif // UTILS_H
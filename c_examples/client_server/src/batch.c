@@ -0,0 +1,167 @@
+#include "utils.h"
+#include "protocol.h"
+#include "file_cache.h"
+#include "file_transfer.h"
+#include "batch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/**
+ * The state shared by the fetching threads.
+ *
+ * mutex: protects `manifest` and `stats`
+ */
+typedef struct {
+    const BatchOptions* options;
+    FILE* manifest;
+    BatchStats* stats;
+    pthread_mutex_t mutex;
+} _Batch;
+
+/**
+ * Creates the directories leading up to `path` (like `mkdir -p $(dirname path)`).
+ */
+static int _make_parent_directories(char* path) {
+    for (char* slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        int rvalue = mkdir(path, 0755);
+        *slash = '/';
+        if (rvalue == -1 && errno != EEXIST) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Fetches one file into the output directory. The contents are written to a temporary file next to
+ * the destination, which replaces the destination once the transfer is complete.
+ */
+static int _fetch_file(const BatchOptions* options, const char* file_name, uint64_t* bytes) {
+    // the name becomes a path below the output directory, so it must not lead out of it
+    if (!file_cache_valid_name(file_name)) {
+        fprintf(stderr, "Error fetching `%s`: invalid file name\n", file_name);
+        return ERROR_INVALID_FILE_NAME;
+    }
+    char path[4096];
+    char temporary_path[4200];
+    snprintf(path, sizeof(path), "%s/%s", options->output_directory, file_name);
+    snprintf(temporary_path, sizeof(temporary_path), "%s.part.XXXXXX", path);
+    if (_make_parent_directories(temporary_path) == -1) {
+        fprintf(stderr, "Error fetching `%s`: creating directories: %s\n", file_name, strerror(errno));
+        return ERROR_FILE_OPEN_FAILED;
+    }
+    int fd = mkstemp(temporary_path);
+    if (fd == -1) {
+        fprintf(stderr, "Error fetching `%s`: creating file: %s\n", file_name, strerror(errno));
+        return ERROR_FILE_OPEN_FAILED;
+    }
+    fchmod(fd, 0644);
+
+    int rvalue;
+    Response response = RESPONSE_INIT;
+    const char* address = options->address;
+    in_addr_t port = options->port;
+    if (options->shards != NULL) {
+        const Endpoint* server = shard_map_lookup(options->shards, file_name);
+        address = server->address;
+        port = server->port;
+    }
+    int socket = connection_pool_checkout(options->pool, address, port);
+    if (socket == -1) {
+        fprintf(stderr, "Error fetching `%s`: could not connect to %s:%u\n", file_name, address, port);
+        rvalue = ERROR_SEND_FAILED;
+        goto error;
+    }
+    rvalue = request_file_to_fd(socket, file_name, fd, options->sink_flags, &response);
+    connection_pool_checkin(options->pool, address, port, socket, connection_pool_is_reusable(rvalue));
+    if (rvalue != STATUS_OK) {
+        fprintf(stderr, "Error fetching `%s`: `%d` - %s\n", file_name, rvalue, response.payload != NULL ? (char*)response.payload : "");
+        goto error;
+    }
+    *bytes = response.header.payload_size;
+    destroy_response(&response);
+    if (close(fd) != 0 || rename(temporary_path, path) != 0) {
+        fprintf(stderr, "Error fetching `%s`: writing file: %s\n", file_name, strerror(errno));
+        unlink(temporary_path);
+        return ERROR_FILE_OPEN_FAILED;
+    }
+    if (options->verbose) {
+        printf("Fetched `%s` (%" PRIu64 " bytes)\n", file_name, *bytes);
+    }
+    return STATUS_OK;
+
+error:
+    destroy_response(&response);
+    close(fd);
+    unlink(temporary_path);
+    return rvalue;
+}
+
+static void* _batch_worker(void* arg) {
+    _Batch* batch = (_Batch*)arg;
+    char* line = NULL;
+    size_t line_size = 0;
+    while (1) {
+        pthread_mutex_lock(&batch->mutex);
+        ssize_t length = getline(&line, &line_size, batch->manifest);
+        if (length > 0) {
+            // strip the line ending (including a DOS one)
+            while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+                line[--length] = '\0';
+            }
+            batch->stats->files += length > 0;
+        }
+        pthread_mutex_unlock(&batch->mutex);
+        if (length == -1) {
+            break;
+        }
+        if (length == 0) {
+            continue;
+        }
+        uint64_t bytes = 0;
+        int rvalue = _fetch_file(batch->options, line, &bytes);
+
+        pthread_mutex_lock(&batch->mutex);
+        if (rvalue == STATUS_OK) {
+            batch->stats->fetched++;
+            batch->stats->bytes += bytes;
+        } else {
+            batch->stats->failed++;
+        }
+        pthread_mutex_unlock(&batch->mutex);
+    }
+    free(line);
+    return NULL;
+}
+
+int batch_fetch(const BatchOptions* options, FILE* manifest, BatchStats* stats) {
+    *stats = (BatchStats){0};
+    uint64_t start_ms = monotonic_time_ms();
+    _Batch batch = {options, manifest, stats, PTHREAD_MUTEX_INITIALIZER};
+    size_t concurrency = options->concurrency > 0 ? options->concurrency : 1;
+    pthread_t* threads = malloc(concurrency * sizeof(pthread_t));
+    if (threads == NULL) {
+        return ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    size_t thread_count = 0;
+    for (; thread_count < concurrency; thread_count++) {
+        if (pthread_create(&threads[thread_count], NULL, _batch_worker, &batch) != 0) {
+            break;
+        }
+    }
+    // the threads that did start work through the whole manifest
+    for (size_t i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&batch.mutex);
+    stats->elapsed_ms = monotonic_time_ms() - start_ms;
+    return thread_count > 0 ? STATUS_OK : ERROR_MEMORY_ALLOCATION_FAILED;
+}
@@ -0,0 +1,522 @@
+#include "utils.h"
+#include "protocol.h"
+#include "catalog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SLOT_EMPTY 0
+#define SLOT_USED 1
+#define SLOT_REMOVED 2
+
+// the words of a slot after its sequence word
+#define WORD_STATE 0
+#define WORD_SIZE 1
+#define WORD_MTIME_SEC 2
+#define WORD_MTIME_NSEC 3
+#define WORD_INODE 4
+#define WORD_HASH 5
+#define WORD_RESERVED 6
+#define WORD_NAME 7
+#define SLOT_WORDS (CATALOG_SLOT_SIZE / sizeof(uint64_t) - 1)
+
+// a reader reports a miss rather than wait forever for a slot whose writer died in the middle of an update
+#define MAX_READ_ATTEMPTS 1000
+
+typedef struct {
+    char magic[8];
+    uint64_t slot_size;
+    uint64_t capacity;
+    uint64_t unused;
+    uint64_t used;
+    _Atomic uint64_t files;
+    uint64_t dirty;
+    uint64_t reserved;
+} _Header;
+
+typedef struct {
+    _Atomic uint64_t sequence;
+    _Atomic uint64_t words[SLOT_WORDS];
+} _Slot;
+
+_Static_assert(sizeof(_Header) == CATALOG_HEADER_SIZE, "catalog header size");
+_Static_assert(sizeof(_Slot) == CATALOG_SLOT_SIZE, "catalog slot size");
+_Static_assert((SLOT_WORDS - WORD_NAME) * sizeof(uint64_t) == CATALOG_MAX_NAME, "catalog name size");
+
+static _Header* _header(const Catalog* catalog) {
+    return (_Header*)catalog->data;
+}
+
+static _Slot* _slot(const Catalog* catalog, uint64_t index) {
+    return (_Slot*)(catalog->data + CATALOG_HEADER_SIZE) + index;
+}
+
+static uint64_t _home(const Catalog* catalog, const char* name, size_t length) {
+    return fnv1a_hash(FNV1A_OFFSET_BASIS, name, length) & (catalog->capacity - 1);
+}
+
+/**
+ * Copies the words of a slot; retries until the copy isn't torn by a concurrent update (seqlock).
+ *
+ * @return 0, or -1 if the slot stayed locked by a writer.
+ */
+static int _read_slot(const _Slot* slot, uint64_t* words) {
+    for (int attempt = 0; attempt < MAX_READ_ATTEMPTS; attempt++) {
+        uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        if (sequence & 1) {
+            sched_yield();
+            continue;
+        }
+        for (size_t i = 0; i < SLOT_WORDS; i++) {
+            words[i] = atomic_load_explicit(&slot->words[i], memory_order_relaxed);
+        }
+        // the loads of the words must not be reordered after the second load of the sequence
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->sequence, memory_order_relaxed) == sequence) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Replaces the words of a slot (seqlock). Only called by the writer.
+ */
+static void _write_slot(_Slot* slot, const uint64_t* words) {
+    uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+    atomic_store_explicit(&slot->sequence, sequence + 1, memory_order_relaxed);
+    // the stores of the words must not be reordered before the sequence is odd
+    atomic_thread_fence(memory_order_release);
+    for (size_t i = 0; i < SLOT_WORDS; i++) {
+        atomic_store_explicit(&slot->words[i], words[i], memory_order_relaxed);
+    }
+    atomic_store_explicit(&slot->sequence, sequence + 2, memory_order_release);
+}
+
+static int _name_equals(const uint64_t* words, const char* name, size_t length) {
+    return memcmp((const char*)(words + WORD_NAME), name, length + 1) == 0;
+}
+
+int catalog_lookup(const Catalog* catalog, const char* name, CatalogEntry* entry) {
+    size_t length = strnlen(name, CATALOG_MAX_NAME);
+    if (catalog->data == NULL || length == CATALOG_MAX_NAME) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+    uint64_t index = _home(catalog, name, length);
+    for (uint64_t probe = 0; probe < catalog->capacity; probe++) {
+        uint64_t words[SLOT_WORDS];
+        if (_read_slot(_slot(catalog, index), words) == -1 || words[WORD_STATE] == SLOT_EMPTY) {
+            break;
+        }
+        if (words[WORD_STATE] == SLOT_USED && _name_equals(words, name, length)) {
+            entry->size = words[WORD_SIZE];
+            entry->mtime.tv_sec = words[WORD_MTIME_SEC];
+            entry->mtime.tv_nsec = words[WORD_MTIME_NSEC];
+            entry->inode = words[WORD_INODE];
+            entry->hash = words[WORD_HASH];
+            return STATUS_OK;
+        }
+        index = (index + 1) & (catalog->capacity - 1);
+    }
+    return ERROR_FILE_NOT_FOUND;
+}
+
+size_t catalog_size(const Catalog* catalog) {
+    return atomic_load_explicit(&_header(catalog)->files, memory_order_relaxed);
+}
+
+/**
+ * Returns non-zero if `fd` holds a catalog with `capacity` slots.
+ */
+static int _valid(int fd, uint64_t capacity, size_t size) {
+    struct stat file_stat;
+    _Header header;
+    return fstat(fd, &file_stat) == 0 && (size_t)file_stat.st_size == size
+        && pread(fd, &header, sizeof(header), 0) == sizeof(header)
+        && memcmp(header.magic, CATALOG_MAGIC, sizeof(header.magic)) == 0
+        && header.slot_size == CATALOG_SLOT_SIZE && header.capacity == capacity;
+}
+
+/**
+ * Creates an empty catalog in `fd`. The file is sparse, so the slots take no disk space until used.
+ */
+static int _create(int fd, uint64_t capacity, size_t size) {
+    _Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CATALOG_MAGIC, sizeof(header.magic));
+    header.slot_size = CATALOG_SLOT_SIZE;
+    header.capacity = capacity;
+    if (ftruncate(fd, 0) == -1 || ftruncate(fd, size) == -1 || pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        return -1;
+    }
+    return 0;
+}
+
+int catalog_open(Catalog* catalog, const char* path, uint64_t capacity) {
+    catalog->data = NULL;
+    catalog->writer = 0;
+    catalog->seen = NULL;
+    catalog->root = NULL;
+    catalog->stop = 0;
+    catalog->capacity = 1;
+    while (catalog->capacity < capacity) {
+        catalog->capacity <<= 1;
+    }
+    catalog->size = CATALOG_HEADER_SIZE + catalog->capacity * CATALOG_SLOT_SIZE;
+    catalog->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (catalog->fd == -1) {
+        return ERROR_FILE_OPEN_FAILED;
+    }
+    if (!_valid(catalog->fd, catalog->capacity, catalog->size)) {
+        // only recreate the catalog while no other process is scanning it
+        int created = flock(catalog->fd, LOCK_EX | LOCK_NB) == 0
+            && (_valid(catalog->fd, catalog->capacity, catalog->size) || _create(catalog->fd, catalog->capacity, catalog->size) == 0);
+        flock(catalog->fd, LOCK_UN);
+        if (!created) {
+            goto error;
+        }
+    }
+    catalog->data = mmap(NULL, catalog->size, PROT_READ | PROT_WRITE, MAP_SHARED, catalog->fd, 0);
+    if (catalog->data == MAP_FAILED) {
+        catalog->data = NULL;
+        goto error;
+    }
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&catalog->wakeup, &attributes);
+    pthread_condattr_destroy(&attributes);
+    pthread_mutex_init(&catalog->mutex, NULL);
+    return STATUS_OK;
+
+error:
+    close(catalog->fd);
+    catalog->fd = -1;
+    return ERROR_FILE_OPEN_FAILED;
+}
+
+void catalog_close(Catalog* catalog) {
+    catalog_stop_scanner(catalog);
+    if (catalog->writer) {
+        // the catalog was left consistent: the next writer doesn't need to check every slot
+        _header(catalog)->dirty = 0;
+        msync(catalog->data, catalog->size, MS_SYNC);
+        flock(catalog->fd, LOCK_UN);
+        catalog->writer = 0;
+    }
+    munmap(catalog->data, catalog->size);
+    catalog->data = NULL;
+    close(catalog->fd);
+    catalog->fd = -1;
+    pthread_mutex_destroy(&catalog->mutex);
+    pthread_cond_destroy(&catalog->wakeup);
+}
+
+/**
+ * Repairs a catalog whose last writer died: slots it left in the middle of an update become
+ * tombstones, and the counts are recomputed. Called with the write lock held.
+ */
+static void _recover(Catalog* catalog) {
+    _Header* header = _header(catalog);
+    uint64_t used = 0;
+    uint64_t files = 0;
+    for (uint64_t i = 0; i < catalog->capacity; i++) {
+        _Slot* slot = _slot(catalog, i);
+        uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+        if (sequence & 1) {
+            for (size_t word = 0; word < SLOT_WORDS; word++) {
+                atomic_store_explicit(&slot->words[word], 0, memory_order_relaxed);
+            }
+            atomic_store_explicit(&slot->words[WORD_STATE], SLOT_REMOVED, memory_order_relaxed);
+            atomic_store_explicit(&slot->sequence, sequence + 1, memory_order_release);
+        }
+        uint64_t state = atomic_load_explicit(&slot->words[WORD_STATE], memory_order_relaxed);
+        used += state != SLOT_EMPTY;
+        files += state == SLOT_USED;
+    }
+    header->used = used;
+    atomic_store_explicit(&header->files, files, memory_order_relaxed);
+}
+
+/**
+ * Takes the write lock (once; it is kept until the catalog is closed).
+ */
+static int _become_writer(Catalog* catalog) {
+    if (catalog->writer) {
+        return 0;
+    }
+    if (flock(catalog->fd, LOCK_EX | LOCK_NB) == -1) {
+        return -1;
+    }
+    catalog->writer = 1;
+    _Header* header = _header(catalog);
+    if (header->dirty) {
+        _recover(catalog);
+    }
+    header->dirty = 1;
+    return 0;
+}
+
+/**
+ * Finds the slot of `name`. Only called by the writer (so the slots can be read without the seqlock).
+ *
+ * @param state Set to the state of the returned slot: SLOT_USED if it holds `name`, otherwise the
+ * (empty or removed) slot a new entry for `name` goes to.
+ * @return the index of the slot, or -1 if `name` isn't cataloged and there is no room for it.
+ */
+static int64_t _find_slot(Catalog* catalog, const char* name, size_t length, uint64_t* state) {
+    uint64_t index = _home(catalog, name, length);
+    int64_t free_slot = -1;
+    uint64_t free_state = SLOT_EMPTY;
+    for (uint64_t probe = 0; probe < catalog->capacity; probe++) {
+        _Slot* slot = _slot(catalog, index);
+        uint64_t slot_state = atomic_load_explicit(&slot->words[WORD_STATE], memory_order_relaxed);
+        if (slot_state == SLOT_EMPTY) {
+            if (free_slot == -1) {
+                free_slot = index;
+            }
+            break;
+        }
+        if (slot_state == SLOT_REMOVED && free_slot == -1) {
+            free_slot = index;
+            free_state = SLOT_REMOVED;
+        } else if (slot_state == SLOT_USED) {
+            uint64_t words[SLOT_WORDS];
+            for (size_t i = WORD_NAME; i < SLOT_WORDS; i++) {
+                words[i] = atomic_load_explicit(&slot->words[i], memory_order_relaxed);
+            }
+            if (_name_equals(words, name, length)) {
+                *state = SLOT_USED;
+                return index;
+            }
+        }
+        index = (index + 1) & (catalog->capacity - 1);
+    }
+    // new entries may reuse tombstones, but only fill empty slots up to three quarters: longer probe
+    // sequences would make lookups (especially misses) slow
+    if (free_slot == -1 || (free_state == SLOT_EMPTY && (_header(catalog)->used + 1) * 4 > catalog->capacity * 3)) {
+        return -1;
+    }
+    *state = free_state;
+    return free_slot;
+}
+
+/**
+ * Hashes the contents of a file.
+ */
+static int _hash_contents(int fd, uint64_t* hash) {
+    *hash = FNV1A_OFFSET_BASIS;
+    uint8_t buffer[64 * 1024];
+    ssize_t bytes_read;
+    while ((bytes_read = read(fd, buffer, sizeof(buffer))) > 0) {
+        *hash = fnv1a_hash(*hash, buffer, bytes_read);
+    }
+    return bytes_read == -1 ? -1 : 0;
+}
+
+/**
+ * Turns the entry in `slot` into a tombstone.
+ */
+static void _remove_slot(Catalog* catalog, _Slot* slot) {
+    uint64_t words[SLOT_WORDS] = {0};
+    words[WORD_STATE] = SLOT_REMOVED;
+    _write_slot(slot, words);
+    atomic_fetch_sub_explicit(&_header(catalog)->files, 1, memory_order_relaxed);
+}
+
+/**
+ * Marks a slot as holding a file the current scan found.
+ */
+static void _see(Catalog* catalog, uint64_t index) {
+    catalog->seen[index / 8] |= (uint8_t)(1 << (index % 8));
+}
+
+static int _seen(const Catalog* catalog, uint64_t index) {
+    return (catalog->seen[index / 8] >> (index % 8)) & 1;
+}
+
+/**
+ * Brings the entry of the file `name` (`file_name` in `directory_fd`) up to date.
+ */
+static void _update_file(Catalog* catalog, int directory_fd, const char* file_name, const char* name, const struct stat* file_stat) {
+    _Header* header = _header(catalog);
+    size_t length = strlen(name);
+    uint64_t state;
+    int64_t index = _find_slot(catalog, name, length, &state);
+    if (index == -1) {
+        return;
+    }
+    _Slot* slot = _slot(catalog, index);
+    if (state == SLOT_USED
+        && atomic_load_explicit(&slot->words[WORD_INODE], memory_order_relaxed) == file_stat->st_ino
+        && atomic_load_explicit(&slot->words[WORD_SIZE], memory_order_relaxed) == (uint64_t)file_stat->st_size
+        && atomic_load_explicit(&slot->words[WORD_MTIME_SEC], memory_order_relaxed) == (uint64_t)file_stat->st_mtim.tv_sec
+        && atomic_load_explicit(&slot->words[WORD_MTIME_NSEC], memory_order_relaxed) == (uint64_t)file_stat->st_mtim.tv_nsec) {
+        // unchanged: only marked as seen, in memory, so that an unchanged catalog isn't written at all
+        _see(catalog, index);
+        return;
+    }
+    // the stat of the open file is stored, taken before the contents are read: if the file is written
+    // while it is hashed, its mtime changes and the next scan hashes it again
+    struct stat open_stat;
+    uint64_t hash;
+    int fd = openat(directory_fd, file_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    int readable = fd != -1 && fstat(fd, &open_stat) == 0 && S_ISREG(open_stat.st_mode) && _hash_contents(fd, &hash) == 0;
+    if (fd != -1) {
+        close(fd);
+    }
+    if (!readable) {
+        // a file that can't be read isn't cataloged; requests for it fall back to the file system
+        if (state == SLOT_USED) {
+            _remove_slot(catalog, slot);
+        }
+        return;
+    }
+    uint64_t words[SLOT_WORDS] = {0};
+    words[WORD_STATE] = SLOT_USED;
+    words[WORD_SIZE] = open_stat.st_size;
+    words[WORD_MTIME_SEC] = open_stat.st_mtim.tv_sec;
+    words[WORD_MTIME_NSEC] = open_stat.st_mtim.tv_nsec;
+    words[WORD_INODE] = open_stat.st_ino;
+    words[WORD_HASH] = hash;
+    memcpy(words + WORD_NAME, name, length + 1);
+    _write_slot(slot, words);
+    _see(catalog, index);
+    if (state == SLOT_EMPTY) {
+        header->used++;
+    }
+    if (state != SLOT_USED) {
+        atomic_fetch_add_explicit(&header->files, 1, memory_order_relaxed);
+    }
+}
+
+/**
+ * Catalogs the regular files in `directory_fd` (`relative` below the root), recursively.
+ *
+ * @return 0 if the whole directory was read, otherwise -1.
+ */
+static int _scan_directory(Catalog* catalog, int directory_fd, const char* relative) {
+    DIR* directory = fdopendir(directory_fd);
+    if (directory == NULL) {
+        close(directory_fd);
+        return -1;
+    }
+    int rvalue = 0;
+    struct dirent* dirent;
+    while ((dirent = readdir(directory)) != NULL) {
+        if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+            continue;
+        }
+        char name[CATALOG_MAX_NAME];
+        int length = snprintf(name, sizeof(name), "%s%s%s", relative, relative[0] != '\0' ? "/" : "", dirent->d_name);
+        struct stat file_stat;
+        // files with longer names aren't cataloged; a file that was removed in the meantime is skipped
+        if (length >= (int)sizeof(name) || fstatat(dirfd(directory), dirent->d_name, &file_stat, AT_SYMLINK_NOFOLLOW) == -1) {
+            continue;
+        }
+        if (S_ISDIR(file_stat.st_mode)) {
+            int subdirectory_fd = openat(dirfd(directory), dirent->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (subdirectory_fd == -1 ? errno != ENOENT : _scan_directory(catalog, subdirectory_fd, name) == -1) {
+                rvalue = -1;
+            }
+        } else if (S_ISREG(file_stat.st_mode)) {
+            _update_file(catalog, dirfd(directory), dirent->d_name, name, &file_stat);
+        }
+    }
+    closedir(directory);
+    return rvalue;
+}
+
+int catalog_scan(Catalog* catalog, const char* root) {
+    if (_become_writer(catalog) == -1) {
+        return ERROR_FILE_OPEN_FAILED;
+    }
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd == -1) {
+        return ERROR_FILE_OPEN_FAILED;
+    }
+    // one bit per slot: whether the scan found the file of the slot
+    catalog->seen = calloc((catalog->capacity + 7) / 8, 1);
+    if (catalog->seen == NULL) {
+        close(root_fd);
+        return ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    int rvalue = STATUS_OK;
+    if (_scan_directory(catalog, root_fd, "") == -1) {
+        // a directory that couldn't be read may still hold its files: keep their entries
+        rvalue = ERROR_FILE_OPEN_FAILED;
+    } else {
+        // entries the scan didn't see are files that were removed (or can no longer be cataloged)
+        for (uint64_t i = 0; i < catalog->capacity; i++) {
+            _Slot* slot = _slot(catalog, i);
+            if (!_seen(catalog, i) && atomic_load_explicit(&slot->words[WORD_STATE], memory_order_relaxed) == SLOT_USED) {
+                _remove_slot(catalog, slot);
+            }
+        }
+    }
+    free(catalog->seen);
+    catalog->seen = NULL;
+    return rvalue;
+}
+
+static void* _scanner(void* arg) {
+    Catalog* catalog = (Catalog*)arg;
+    pthread_mutex_lock(&catalog->mutex);
+    while (!catalog->stop) {
+        pthread_mutex_unlock(&catalog->mutex);
+        catalog_scan(catalog, catalog->root);
+        pthread_mutex_lock(&catalog->mutex);
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += catalog->interval_ms / 1000;
+        deadline.tv_nsec += (catalog->interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (!catalog->stop && pthread_cond_timedwait(&catalog->wakeup, &catalog->mutex, &deadline) != ETIMEDOUT) {
+        }
+    }
+    pthread_mutex_unlock(&catalog->mutex);
+    return NULL;
+}
+
+int catalog_start_scanner(Catalog* catalog, const char* root, uint64_t interval_ms) {
+    if (catalog->root != NULL) {
+        return -1;
+    }
+    catalog->root = strdup(root);
+    if (catalog->root == NULL) {
+        return -1;
+    }
+    catalog->interval_ms = interval_ms > CATALOG_MIN_SCAN_INTERVAL_MS ? interval_ms : CATALOG_MIN_SCAN_INTERVAL_MS;
+    catalog->stop = 0;
+    if (pthread_create(&catalog->scanner, NULL, _scanner, catalog) != 0) {
+        free(catalog->root);
+        catalog->root = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void catalog_stop_scanner(Catalog* catalog) {
+    if (catalog->root == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&catalog->mutex);
+    catalog->stop = 1;
+    pthread_cond_signal(&catalog->wakeup);
+    pthread_mutex_unlock(&catalog->mutex);
+    pthread_join(catalog->scanner, NULL);
+    free(catalog->root);
+    catalog->root = NULL;
+}
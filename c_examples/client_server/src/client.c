@@ -1,28 +1,585 @@
 #include "sockets.h"
 #include "protocol.h"
 #include "file_transfer.h"
+#include "multiplex.h"
+#include "connection_pool.h"
+#include "batch.h"
+#include "parallel_fetch.h"
+#include "shard.h"
+#include "hedge.h"
+#include "subscription.h"
 #include "utils.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define PORT 9002
 #define ADDRESS "0.0.0.0"
+// the most replicas --replicas (or servers --shards) accepts
+#define MAX_REPLICAS 16
+// idle connections of the batch mode's pool are reused for this long
+#define BATCH_IDLE_TIMEOUT_MS 10000
+// the hedge delay of --hedge until enough latencies were measured
+#define HEDGE_INITIAL_DELAY_US 10000
+
+void print_usage(const char* program) {
+    printf("Usage: %s [--nodelay] [--cork] [--sndbuf BYTES] [--rcvbuf BYTES] [--quickack] [--fastopen 1]"
+        " [--busy-poll USEC] [--notsent-lowat BYTES] [--unix PATH] [--connect-timeout MS] [--deadline MS]"
+        " [--output PATH [--preallocate] [--drop-behind]] [--if-none-match ETAG] <command> <file_name>\n"
+        "       %s [options] --multiplex <0|1> <file_name>...\n"
+        "       %s [options] --batch <manifest|-> --output-dir DIR [--concurrency N] [--verbose]\n"
+        "       %s [options] --replicas ADDRESS[:PORT],... --output PATH 1 <file_name>\n"
+        "       %s [options] --shards ADDRESS[:PORT],... <command> <file_name> (or with --batch)\n"
+        "       %s [options] --hedge ADDRESS[:PORT],... [--hedge-percentile P] [--repeat N] <0|1> <file_name>\n"
+        "       %s [options] --subscribe <file_name|prefix*>...\n", program, program, program, program, program, program, program);
+}
+
+/**
+ * @brief Brings the local copy at `path` up to date with COMMAND_REQUEST_DELTA. The new version is
+ * written to a temporary file that replaces the local copy, so it is never left half-written.
+ */
+int sync_file_delta(int server_socket, const char* file_name, const char* path) {
+    // a missing local copy is not an error; the whole file is sent as literals
+    uint8_t* basis = NULL;
+    size_t basis_size = 0;
+    int basis_fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat basis_stat;
+    if (basis_fd != -1 && fstat(basis_fd, &basis_stat) == 0 && basis_stat.st_size > 0) {
+        basis = mmap(NULL, basis_stat.st_size, PROT_READ, MAP_PRIVATE, basis_fd, 0);
+        basis_size = basis != MAP_FAILED ? basis_stat.st_size : 0;
+        basis = basis != MAP_FAILED ? basis : NULL;
+    }
+    Response response;
+    DeltaOutput output;
+    int rvalue = request_file_delta(server_socket, file_name, basis, basis_size, &response, &output);
+    if (basis != NULL) {
+        munmap(basis, basis_size);
+    }
+    if (basis_fd != -1) {
+        close(basis_fd);
+    }
+    if (rvalue != STATUS_OK) {
+        printf("Error requesting file delta: `%d`\n", rvalue);
+        printf("Error message: %s\n", response.payload != NULL ? (char*) response.payload : "");
+        destroy_response(&response);
+        return rvalue;
+    }
+    destroy_response(&response);
+
+    // the file (already checked against the server's hash) is written to a unique temporary file and
+    // synced before it replaces the local copy, so neither a concurrent sync nor a crash can leave a
+    // partial file behind
+    char temporary_path[PATH_MAX];
+    snprintf(temporary_path, sizeof(temporary_path), "%s.XXXXXX", path);
+    int output_fd = mkostemp(temporary_path, O_CLOEXEC);
+    if (output_fd == -1) {
+        perror("mkostemp");
+        destroy_delta_output(&output);
+        return ERROR_FILE_OPEN_FAILED;
+    }
+    fchmod(output_fd, 0644);
+    int failed = 0;
+    for (size_t written = 0; written < output.size && !failed;) {
+        ssize_t bytes_written = write(output_fd, output.data + written, output.size - written);
+        failed = bytes_written == -1 && errno != EINTR;
+        written += bytes_written > 0 ? bytes_written : 0;
+    }
+    failed = failed || fsync(output_fd) != 0;
+    failed = close(output_fd) != 0 || failed;
+    if (failed || rename(temporary_path, path) != 0) {
+        perror("writing file");
+        unlink(temporary_path);
+        destroy_delta_output(&output);
+        return ERROR_FILE_OPEN_FAILED;
+    }
+    printf("Updated `%s`: %zu bytes, %zu copied from the local copy, %zu received\n\n", path, output.size, output.copied_bytes, output.literal_bytes);
+    destroy_delta_output(&output);
+    return STATUS_OK;
+}
+
+/**
+ * @brief Requests the metadata (command 0) or contents (command 1) of several files at once over one
+ * connection, and prints each response as soon as it is complete.
+ */
+int request_multiplexed(int server_socket, int command, char* const* file_names, int file_count) {
+    MultiplexedConnection connection;
+    multiplexed_connection_init(&connection, server_socket);
+    uint8_t request_command = command == 0 ? COMMAND_REQUEST_METADATA : COMMAND_REQUEST_FILE;
+    uint32_t first_stream_id = 0;
+    int rvalue = STATUS_OK;
+    for (int i = 0; i < file_count && rvalue == STATUS_OK; i++) {
+        uint32_t stream_id;
+        rvalue = multiplexed_request(&connection, request_command, file_names[i], &stream_id);
+        first_stream_id = i == 0 ? stream_id : first_stream_id;
+    }
+    int failed = rvalue != STATUS_OK;
+    while (multiplexed_pending_count(&connection) > 0) {
+        uint32_t stream_id;
+        Response response;
+        rvalue = multiplexed_receive(&connection, &stream_id, &response);
+        if (stream_id == 0) {
+            printf("Error receiving responses: `%d`\n", rvalue);
+            failed = 1;
+            break;
+        }
+        // stream ids are handed out in order, so they map back to the file names
+        const char* file_name = file_names[stream_id - first_stream_id];
+        if (rvalue != STATUS_OK) {
+            printf("Error requesting `%s`: `%d` - %s\n", file_name, rvalue, response.payload != NULL ? (char*)response.payload : "");
+            failed = 1;
+        } else if (command == 0) {
+            printf("Received metadata for file `%s` - `%s`\n", file_name, (char*)response.payload);
+        } else {
+            printf("Received %u bytes for file `%s`\n", response.header.payload_size, file_name);
+        }
+        destroy_response(&response);
+    }
+    multiplexed_connection_destroy(&connection);
+    return failed ? 1 : 0;
+}
+
+/**
+ * @brief Fetches the files named in a manifest (or stdin for "-") into `output_directory` and prints
+ * the throughput and the number of failures.
+ */
+int fetch_batch(const char* address, const RetryPolicy* policy, const SocketOptions* socket_options, const char* manifest_path, BatchOptions* options) {
+    FILE* manifest = strcmp(manifest_path, "-") == 0 ? stdin : fopen(manifest_path, "r");
+    if (manifest == NULL) {
+        perror("opening manifest");
+        return 1;
+    }
+    ConnectionPool pool;
+    if (connection_pool_init(&pool, options->concurrency, BATCH_IDLE_TIMEOUT_MS, socket_options) != 0) {
+        fprintf(stderr, "Error creating connection pool\n");
+        return 1;
+    }
+    pool.retry_policy = *policy;
+    options->pool = &pool;
+    options->address = address;
+    options->port = PORT;
+    BatchStats stats;
+    int rvalue = batch_fetch(options, manifest, &stats);
+    connection_pool_destroy(&pool);
+    if (manifest != stdin) {
+        fclose(manifest);
+    }
+    if (rvalue != STATUS_OK) {
+        fprintf(stderr, "Error starting batch: `%d`\n", rvalue);
+        return 1;
+    }
+    double seconds = stats.elapsed_ms > 0 ? stats.elapsed_ms / 1000.0 : 0.001;
+    printf("Fetched %zu of %zu files (%" PRIu64 " bytes) in %.3f s: %.1f files/s, %.2f MiB/s; %zu failed\n",
+        stats.fetched, stats.files, stats.bytes, seconds, stats.fetched / seconds, stats.bytes / seconds / (1024 * 1024), stats.failed);
+    return stats.failed > 0 ? 1 : 0;
+}
+
+/**
+ * @brief Parses a comma separated list of servers (`ADDRESS[:PORT]` or `unix:<path>`) into
+ * `endpoints`, whose addresses point into `list`. Returns the number of servers, or -1 if the list is
+ * empty or too long, or a port is not a number from 1 to 65535.
+ */
+int parse_endpoints(char* list, Endpoint* endpoints, size_t max_endpoints) {
+    size_t count = 0;
+    char* saveptr;
+    for (char* endpoint = strtok_r(list, ",", &saveptr); endpoint != NULL; endpoint = strtok_r(NULL, ",", &saveptr)) {
+        if (count == max_endpoints) {
+            return -1;
+        }
+        endpoints[count].address = endpoint;
+        endpoints[count].port = PORT;
+        char* colon = strrchr(endpoint, ':');
+        if (strncmp(endpoint, UNIX_ADDRESS_PREFIX, strlen(UNIX_ADDRESS_PREFIX)) != 0 && colon != NULL) {
+            long port;
+            if (parse_number(colon + 1, 1, 65535, &port) != 0) {
+                return -1;
+            }
+            *colon = '\0';
+            endpoints[count].port = port;
+        }
+        count++;
+    }
+    return count > 0 ? (int)count : -1;
+}
+
+/**
+ * @brief Downloads a file from several replicas at once into `output_path` and prints how much came
+ * from each replica.
+ */
+int fetch_from_replicas(const Endpoint* endpoints, size_t replica_count, const RetryPolicy* policy, const SocketOptions* socket_options, const char* file_name, const char* output_path) {
+    Replica replicas[MAX_REPLICAS];
+    for (size_t i = 0; i < replica_count; i++) {
+        replicas[i] = (Replica){endpoints[i], 0, STATUS_OK};
+    }
+    // the file is sized before any data arrives, so a failed fetch would look complete: it is written
+    // next to the output and renamed over it only once all ranges arrived
+    char temporary_path[PATH_MAX];
+    snprintf(temporary_path, sizeof(temporary_path), "%s.XXXXXX", output_path);
+    int output_fd = mkostemp(temporary_path, O_CLOEXEC);
+    if (output_fd == -1) {
+        perror("mkostemp");
+        return 1;
+    }
+    fchmod(output_fd, 0644);
+    uint64_t start_ms = monotonic_time_ms();
+    uint64_t file_size;
+    int rvalue = parallel_fetch(replicas, replica_count, policy, socket_options, file_name, output_fd, &file_size);
+    uint64_t elapsed_ms = monotonic_time_ms() - start_ms;
+    if (close(output_fd) != 0 && rvalue == STATUS_OK) {
+        perror("close");
+        rvalue = ERROR_FILE_OPEN_FAILED;
+    }
+    if (rvalue == STATUS_OK && rename(temporary_path, output_path) != 0) {
+        perror("rename");
+        rvalue = ERROR_FILE_OPEN_FAILED;
+    }
+    if (rvalue != STATUS_OK) {
+        unlink(temporary_path);
+    }
+    for (size_t i = 0; i < replica_count; i++) {
+        const char* note = replicas[i].status == ERROR_VERSION_MISMATCH ? " (serves another version)" : replicas[i].status != STATUS_OK ? " (dropped out)" : "";
+        printf("%s:%u: %" PRIu64 " bytes%s\n", replicas[i].endpoint.address, replicas[i].endpoint.port, replicas[i].bytes, note);
+    }
+    if (rvalue != STATUS_OK) {
+        printf("Error fetching `%s`: `%d`\n", file_name, rvalue);
+        return 1;
+    }
+    double seconds = elapsed_ms > 0 ? elapsed_ms / 1000.0 : 0.001;
+    printf("Wrote %" PRIu64 " bytes to `%s` in %.3f s (%.2f MiB/s)\n\n", file_size, output_path, seconds, file_size / seconds / (1024 * 1024));
+    return 0;
+}
+
+static int compare_latencies(const void* a, const void* b) {
+    uint64_t latency_a = *(const uint64_t*)a;
+    uint64_t latency_b = *(const uint64_t*)b;
+    return (latency_a > latency_b) - (latency_a < latency_b);
+}
+
+/**
+ * @brief Requests the metadata (command 0) or contents (command 1) of a file `repeat` times with
+ * hedged requests, and prints the latencies and how often hedges were sent and won.
+ */
+int request_hedged(const Endpoint* replicas, size_t replica_count, unsigned int percentile, int repeat, const RetryPolicy* policy, const SocketOptions* socket_options, int command, const char* file_name) {
+    ConnectionPool pool;
+    if (connection_pool_init(&pool, 2, BATCH_IDLE_TIMEOUT_MS, socket_options) != 0) {
+        fprintf(stderr, "Error creating connection pool\n");
+        return 1;
+    }
+    pool.retry_policy = *policy;
+    HedgedClient client;
+    uint64_t* latencies_us = malloc(repeat * sizeof(uint64_t));
+    if (latencies_us == NULL || hedged_client_init(&client, &pool, replicas, replica_count, percentile, HEDGE_INITIAL_DELAY_US) != STATUS_OK) {
+        print_usage("client");
+        free(latencies_us);
+        connection_pool_destroy(&pool);
+        return 1;
+    }
+    int failed = 0;
+    for (int i = 0; i < repeat; i++) {
+        uint64_t start_us = monotonic_time_us();
+        Response response;
+        int rvalue = command == 0 ? hedged_request_file_metadata(&client, file_name, &response) : hedged_request_file_contents(&client, file_name, &response);
+        latencies_us[i] = monotonic_time_us() - start_us;
+        if (rvalue != STATUS_OK) {
+            printf("Error requesting `%s`: `%d` - %s\n", file_name, rvalue, response.payload != NULL ? (char*)response.payload : "");
+            failed = 1;
+        } else if (repeat == 1 && command == 0) {
+            printf("Received metadata for file `%s` - `%s`\n", file_name, (char*)response.payload);
+        } else if (repeat == 1) {
+            printf("Received %u bytes for file `%s`\n", response.header.payload_size, file_name);
+        }
+        destroy_response(&response);
+    }
+    HedgeStats stats;
+    hedged_client_stats(&client, &stats);
+    qsort(latencies_us, repeat, sizeof(uint64_t), compare_latencies);
+    printf("%" PRIu64 " requests: p50 %.3f ms, p99 %.3f ms, max %.3f ms; hedge delay %.3f ms\n", stats.requests,
+        latencies_us[repeat / 2] / 1000.0, latencies_us[repeat * 99 / 100] / 1000.0, latencies_us[repeat - 1] / 1000.0, hedged_client_delay_us(&client) / 1000.0);
+    printf("Hedged %" PRIu64 " (%.1f%%), hedge won %" PRIu64 " (%.1f%% of hedges); %" PRIu64 " failed\n\n", stats.hedged, 100.0 * stats.hedged / stats.requests,
+        stats.hedge_wins, stats.hedged > 0 ? 100.0 * stats.hedge_wins / stats.hedged : 0.0, stats.failed);
+    hedged_client_destroy(&client);
+    connection_pool_destroy(&pool);
+    free(latencies_us);
+    return failed;
+}
+
+/**
+ * @brief Subscribes to the files matching `patterns` and prints a line for each change, until the
+ * server closes the connection.
+ */
+int watch_files(int server_socket, const char* const* patterns, size_t pattern_count) {
+    int rvalue = request_subscribe(server_socket, patterns, pattern_count);
+    if (rvalue != STATUS_OK) {
+        printf("Error subscribing: `%d`\n", rvalue);
+        return 1;
+    }
+    printf("Subscribed; waiting for changes\n");
+    Notification notification;
+    while (receive_notification(server_socket, &notification) == STATUS_OK) {
+        if (notification.kind == NOTIFICATION_CHANGED) {
+            printf("Changed: `%s` - %" PRIu64 " bytes, modified %lld.%09ld\n", notification.name, notification.size,
+                (long long)notification.mtime.tv_sec, notification.mtime.tv_nsec);
+        } else if (notification.kind == NOTIFICATION_REMOVED) {
+            printf("Removed: `%s`\n", notification.name);
+        } else if (notification.kind == NOTIFICATION_LOST) {
+            printf("Changes were lost; the files should be checked again\n");
+        }
+        fflush(stdout);
+    }
+    printf("Connection closed\n");
+    return 1;
+}
+
+/**
+ * @brief Connects to the server, retrying according to the policy. Returns the socket, or -1 (after
+ * printing the reason) if the server could not be reached before the deadline.
+ */
+int connect_to_server(const char* address, in_addr_t port, const RetryPolicy* policy, const SocketOptions* socket_options) {
+    int server_socket;
+    int status = connect_with_deadline(address, port, policy, socket_options, &server_socket);
+    if (status != CONNECT_OK) {
+        fprintf(stderr, "Error connecting to `%s`: %s\n", address, connect_error_string(status));
+        return -1;
+    }
+    return server_socket;
+}
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        printf("Usage: %s <command> <file_name>\n", argv[0]);
+    SocketOptions socket_options = SOCKET_OPTIONS_INIT;
+    RetryPolicy retry_policy = RETRY_POLICY_INIT;
+    struct option long_options[] = {
+        SOCKET_LONG_OPTIONS,
+        {"unix", required_argument, NULL, 'u'},
+        {"connect-timeout", required_argument, NULL, 't'},
+        {"deadline", required_argument, NULL, 'd'},
+        {"output", required_argument, NULL, 'o'},
+        {"preallocate", no_argument, NULL, 'p'},
+        {"drop-behind", no_argument, NULL, 'b'},
+        {"if-none-match", required_argument, NULL, 'e'},
+        {"multiplex", no_argument, NULL, 'm'},
+        {"batch", required_argument, NULL, 'B'},
+        {"output-dir", required_argument, NULL, 'O'},
+        {"concurrency", required_argument, NULL, 'c'},
+        {"verbose", no_argument, NULL, 'v'},
+        {"replicas", required_argument, NULL, 'R'},
+        {"shards", required_argument, NULL, 'S'},
+        {"hedge", required_argument, NULL, 'H'},
+        {"hedge-percentile", required_argument, NULL, 'P'},
+        {"repeat", required_argument, NULL, 'r'},
+        {"subscribe", no_argument, NULL, 'W'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    // either ADDRESS or "unix:<path>" when connecting to a server on the same host over a unix domain socket
+    char address[256] = ADDRESS;
+    in_addr_t port = PORT;
+    // with --output, file contents (command 1) are streamed into this file instead of being printed
+    const char* output_path = NULL;
+    int sink_flags = 0;
+    // with --if-none-match, file contents (command 1) are only sent if the file's ETag is different
+    const char* if_none_match = NULL;
+    // with --multiplex, several files (commands 0 and 1) are requested concurrently over one connection
+    int multiplex = 0;
+    // with --batch, the files named in a manifest are fetched concurrently into --output-dir
+    const char* manifest_path = NULL;
+    BatchOptions batch_options = {.concurrency = BATCH_DEFAULT_CONCURRENCY};
+    // with --replicas, file contents (command 1) are fetched from all replicas at once into --output
+    Endpoint replicas[MAX_REPLICAS];
+    int replica_count = 0;
+    // with --shards, each file is requested from the server it is placed on (see shard.h)
+    Endpoint shard_servers[MAX_REPLICAS];
+    int shard_count = 0;
+    // with --hedge, requests (commands 0 and 1) that are slow to be answered are sent to a second replica
+    Endpoint hedge_replicas[MAX_REPLICAS];
+    int hedge_count = 0;
+    unsigned int hedge_percentile = HEDGE_DEFAULT_PERCENTILE;
+    int repeat = 1;
+    // with --subscribe, the connection stays open and the changes of the matching files are printed
+    int subscribe = 0;
+    int option;
+    int option_index;
+    long number;
+    int rvalue;
+    while ((option = getopt_long(argc, argv, "u:t:d:o:pbe:mB:O:c:vR:S:H:P:r:Wh", long_options, &option_index)) != -1) {
+        if (option == 0 && set_socket_option(&socket_options, long_options[option_index].name, optarg) == 0) {
+            continue;
+        }
+        if (option == 'u') {
+            snprintf(address, sizeof(address), "%s%s", UNIX_ADDRESS_PREFIX, optarg);
+            continue;
+        }
+        if (option == 't' && parse_number(optarg, 0, INT_MAX, &number) == 0) {
+            retry_policy.attempt_timeout_ms = (int)number;
+            continue;
+        }
+        if (option == 'd' && parse_number(optarg, 0, INT_MAX, &number) == 0) {
+            retry_policy.deadline_ms = (int)number;
+            continue;
+        }
+        if (option == 'o') {
+            output_path = optarg;
+            continue;
+        }
+        if (option == 'p') {
+            sink_flags |= SINK_PREALLOCATE;
+            continue;
+        }
+        if (option == 'b') {
+            sink_flags |= SINK_DROP_BEHIND;
+            continue;
+        }
+        if (option == 'e') {
+            if_none_match = optarg;
+            continue;
+        }
+        if (option == 'm') {
+            multiplex = 1;
+            continue;
+        }
+        if (option == 'B') {
+            manifest_path = optarg;
+            continue;
+        }
+        if (option == 'O') {
+            batch_options.output_directory = optarg;
+            continue;
+        }
+        if (option == 'c' && parse_number(optarg, 0, INT_MAX, &number) == 0) {
+            batch_options.concurrency = number;
+            continue;
+        }
+        if (option == 'v') {
+            batch_options.verbose = 1;
+            continue;
+        }
+        if (option == 'R') {
+            replica_count = parse_endpoints(optarg, replicas, MAX_REPLICAS);
+            if (replica_count > 0) {
+                continue;
+            }
+        }
+        if (option == 'S') {
+            shard_count = parse_endpoints(optarg, shard_servers, MAX_REPLICAS);
+            if (shard_count > 0) {
+                continue;
+            }
+        }
+        if (option == 'H') {
+            hedge_count = parse_endpoints(optarg, hedge_replicas, MAX_REPLICAS);
+            if (hedge_count > 0) {
+                continue;
+            }
+        }
+        if (option == 'P' && parse_number(optarg, 1, 100, &number) == 0) {
+            hedge_percentile = (int)number;
+            continue;
+        }
+        if (option == 'r' && parse_number(optarg, 1, INT_MAX, &number) == 0) {
+            repeat = (int)number;
+            continue;
+        }
+        if (option == 'W') {
+            subscribe = 1;
+            continue;
+        }
+        print_usage(argv[0]);
+        return option == 'h' ? 0 : 1;
+    }
+    ShardMap shards;
+    if (shard_count > 0) {
+        // the files of one multiplexed connection or parallel fetch would have to be on one server
+        if (multiplex || replica_count > 0) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        if (shard_map_init(&shards, shard_servers, shard_count, HASH_RING_DEFAULT_VIRTUAL_NODES) != STATUS_OK) {
+            fprintf(stderr, "Error creating the shard map\n");
+            return 1;
+        }
+    }
+    if (manifest_path != NULL) {
+        if (batch_options.output_directory == NULL || batch_options.concurrency == 0 || optind != argc) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        batch_options.sink_flags = sink_flags;
+        batch_options.shards = shard_count > 0 ? &shards : NULL;
+        rvalue = fetch_batch(address, &retry_policy, &socket_options, manifest_path, &batch_options);
+        if (shard_count > 0) {
+            shard_map_destroy(&shards);
+        }
+        return rvalue;
+    }
+    if (subscribe) {
+        // a subscription is for one server; with --shards, the files of a prefix are spread over all of them
+        if (argc - optind < 1 || shard_count > 0 || multiplex || replica_count > 0 || hedge_count > 0) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        int server_socket = connect_to_server(address, port, &retry_policy, &socket_options);
+        if (server_socket == -1) {
+            return 1;
+        }
+        rvalue = watch_files(server_socket, (const char* const*)argv + optind, argc - optind);
+        socket_cleanup(server_socket);
+        return rvalue;
+    }
+    if (multiplex ? argc - optind < 2 : argc - optind != 2) {
+        print_usage(argv[0]);
         return 1;
     }
-    int command = atoi(argv[1]);
-    const char* file_name = argv[2];
+    int command = atoi(argv[optind]);
+    const char* file_name = argv[optind + 1];
+    if (shard_count > 0) {
+        const Endpoint* server = shard_map_lookup(&shards, file_name);
+        snprintf(address, sizeof(address), "%s", server->address);
+        port = server->port;
+        printf("`%s` is on %s:%u\n", file_name, address, port);
+        shard_map_destroy(&shards);
+    }
     
     int server_socket;
-    int rvalue;
+    if (replica_count > 0) {
+        if (command != 1 || output_path == NULL) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        return fetch_from_replicas(replicas, replica_count, &retry_policy, &socket_options, file_name, output_path);
+    }
+    if (hedge_count > 0) {
+        if ((command != 0 && command != 1) || multiplex || shard_count > 0) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        return request_hedged(hedge_replicas, hedge_count, hedge_percentile, repeat, &retry_policy, &socket_options, command, file_name);
+    }
+    if (multiplex) {
+        if (command != 0 && command != 1) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        server_socket = connect_to_server(address, port, &retry_policy, &socket_options);
+        if (server_socket == -1) {
+            return 1;
+        }
+        rvalue = request_multiplexed(server_socket, command, argv + optind + 1, argc - optind - 1);
+        socket_cleanup(server_socket);
+        return rvalue;
+    }
     Response response;
     switch (command) {
         case 0:
             printf("\n\nRequesting File Metadata: `%s`\n", file_name);
-            server_socket = connect_with_retry_or_die(ADDRESS, PORT, 3, 1);
+            server_socket = connect_to_server(address, port, &retry_policy, &socket_options);
+            if (server_socket == -1) {
+                return 1;
+            }
             rvalue = request_file_metadata(server_socket, file_name, &response);
             socket_cleanup(server_socket);
             if (rvalue != STATUS_OK) {
@@ -35,7 +592,62 @@ int main(int argc, char *argv[]) {
             break;
         case 1:
             printf("\n\nRequesting File Contents: `%s`\n", file_name);
-            server_socket = connect_with_retry_or_die(ADDRESS, PORT, 3, 1);
+            server_socket = connect_to_server(address, port, &retry_policy, &socket_options);
+            if (server_socket == -1) {
+                return 1;
+            }
+            if (if_none_match != NULL) {
+                char etag[ETAG_SIZE];
+                rvalue = request_file_contents_if_none_match(server_socket, file_name, if_none_match, &response, etag);
+                socket_cleanup(server_socket);
+                if (rvalue == STATUS_NOT_MODIFIED) {
+                    printf("Not modified (ETag: %s)\n\n", etag);
+                    destroy_response(&response);
+                    break;
+                }
+                if (rvalue != STATUS_OK) {
+                    printf("Error requesting file contents: `%d`\n", rvalue);
+                    destroy_response(&response);
+                    return 1;
+                }
+                printf("ETag: %s\n", etag);
+                printf("Contents:\n------\n%.*s\n------\n\n", (int)response.header.payload_size, (char*) response.payload);
+                destroy_response(&response);
+                break;
+            }
+            if (output_path != NULL) {
+                // the file is written next to the output and renamed over it once complete, so a failed
+                // transfer leaves neither a partial file nor a truncated previous version
+                char temporary_path[PATH_MAX];
+                snprintf(temporary_path, sizeof(temporary_path), "%s.XXXXXX", output_path);
+                int output_fd = mkostemp(temporary_path, O_CLOEXEC);
+                if (output_fd == -1) {
+                    perror("mkostemp");
+                    socket_cleanup(server_socket);
+                    return 1;
+                }
+                fchmod(output_fd, 0644);
+                rvalue = request_file_to_fd(server_socket, file_name, output_fd, sink_flags, &response);
+                socket_cleanup(server_socket);
+                if (close(output_fd) != 0 && rvalue == STATUS_OK) {
+                    perror("close");
+                    rvalue = ERROR_FILE_OPEN_FAILED;
+                }
+                if (rvalue == STATUS_OK && rename(temporary_path, output_path) != 0) {
+                    perror("rename");
+                    rvalue = ERROR_FILE_OPEN_FAILED;
+                }
+                if (rvalue != STATUS_OK) {
+                    unlink(temporary_path);
+                    printf("Error requesting file contents: `%d`==`%d`?\n", rvalue, response.header.status);
+                    printf("Error message: %s\n", response.payload != NULL ? (char*) response.payload : "");
+                    destroy_response(&response);
+                    return 1;
+                }
+                printf("Wrote %u bytes (%d chunks) to `%s`\n\n", response.header.payload_size, response.header.chunk_index + 1, output_path);
+                destroy_response(&response);
+                break;
+            }
             rvalue = request_file_contents(server_socket, file_name, &response);
             socket_cleanup(server_socket);
             if (rvalue != STATUS_OK) {
@@ -49,6 +661,40 @@ int main(int argc, char *argv[]) {
             printf("Contents:\n------\n%s\n------\n\n", (char*) response.payload);
             destroy_response(&response);
             break;
+        case 2:
+            // zero-copy: the server passes a file descriptor over the unix domain socket (requires --unix)
+            printf("\n\nRequesting File Descriptor: `%s`\n", file_name);
+            server_socket = connect_to_server(address, port, &retry_policy, &socket_options);
+            if (server_socket == -1) {
+                return 1;
+            }
+            MappedFile mapped_file;
+            rvalue = request_file_mapping(server_socket, file_name, &mapped_file);
+            socket_cleanup(server_socket);
+            if (rvalue != STATUS_OK) {
+                printf("Error requesting file descriptor: `%d`\n", rvalue);
+                return 1;
+            }
+            printf("Mapped size: %zu\n", mapped_file.size);
+            printf("Contents:\n------\n%.*s\n------\n\n", (int)mapped_file.size, (char*)mapped_file.data);
+            destroy_mapped_file(&mapped_file);
+            break;
+        case 3:
+            // delta sync: only the parts of the file that differ from the local copy (--output) are transferred
+            if (output_path == NULL) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            printf("\n\nRequesting File Delta: `%s`\n", file_name);
+            server_socket = connect_to_server(address, port, &retry_policy, &socket_options);
+            if (server_socket == -1) {
+                return 1;
+            }
+            rvalue = sync_file_delta(server_socket, file_name, output_path);
+            socket_cleanup(server_socket);
+            if (rvalue != STATUS_OK) {
+                return 1;
+            }
             break;
         default:
             printf("Unknown command\n");
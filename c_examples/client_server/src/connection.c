@@ -0,0 +1,277 @@
+#include "connection.h"
+#include "file_transfer.h"
+#include "multiplex.h"
+#include "sockets.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/time.h>
+
+int connections_init(Connections* connections, Scheduler* scheduler, Notifier* notifier) {
+    connections->wakeup_fd = eventfd(0, EFD_CLOEXEC);
+    if (connections->wakeup_fd == -1) {
+        return ERROR_FILE_OPEN_FAILED;
+    }
+    connections->scheduler = scheduler;
+    connections->notifier = notifier;
+    pthread_mutex_init(&connections->mutex, NULL);
+    pthread_cond_init(&connections->drained, NULL);
+    connections->connections = NULL;
+    connections->connection_count = 0;
+    return STATUS_OK;
+}
+
+void connections_destroy(Connections* connections) {
+    close(connections->wakeup_fd);
+    pthread_mutex_destroy(&connections->mutex);
+    pthread_cond_destroy(&connections->drained);
+}
+
+ClientConnection* connection_register(Connections* connections, int client_socket) {
+    ClientConnection* connection = malloc(sizeof(ClientConnection));
+    if (connection == NULL) {
+        return NULL;
+    }
+    connection->connections = connections;
+    connection->socket = client_socket;
+    pthread_mutex_lock(&connections->mutex);
+    connection->next = connections->connections;
+    connections->connections = connection;
+    connections->connection_count++;
+    pthread_mutex_unlock(&connections->mutex);
+    return connection;
+}
+
+void connection_unregister(ClientConnection* connection) {
+    Connections* connections = connection->connections;
+    pthread_mutex_lock(&connections->mutex);
+    for (ClientConnection** link = &connections->connections; *link != NULL; link = &(*link)->next) {
+        if (*link == connection) {
+            *link = connection->next;
+            break;
+        }
+    }
+    connections->connection_count--;
+    pthread_cond_broadcast(&connections->drained);
+    pthread_mutex_unlock(&connections->mutex);
+    free(connection);
+}
+
+/**
+ * @brief Returns the scheduler class of a request; requests for large files are bulk transfers.
+ */
+static int _classify_request(const Header* header, const uint8_t* payload) {
+    long file_size = -1;
+    // the payload of every command starts with the null terminated file name
+    if (payload != NULL && strnlen((const char*)payload, header->payload_size) < header->payload_size) {
+        const Pack* pack = server_pack();
+        PackEntry entry;
+        CachedFile* file;
+        CatalogEntry cataloged;
+        StorageRoot* root = server_root((const char*)payload);
+        if (pack != NULL && (header->command == COMMAND_REQUEST_FILE || header->command == COMMAND_REQUEST_METADATA || header->command == COMMAND_REQUEST_RANGE)) {
+            if (pack_find(pack, (const char*)payload, &entry) == STATUS_OK) {
+                file_size = entry.size;
+            }
+        } else if (root->cataloged && catalog_lookup(&root->catalog, (const char*)payload, &cataloged) == STATUS_OK) {
+            // close enough for classifying: the file may have changed since the last scan
+            file_size = cataloged.size;
+        } else if (file_cache_acquire(&root->cache, (const char*)payload, &file) == STATUS_OK) {
+            // the file stays in the cache, so handling the request doesn't open it again
+            file_size = file->file_stat.st_size;
+            file_cache_release(&root->cache, file);
+        }
+    }
+    // a range request sends only (up to) its length
+    uint64_t offset;
+    uint64_t length;
+    if (header->command == COMMAND_REQUEST_RANGE && file_size >= 0 && parse_range_request(header, payload, &offset, &length) == 0) {
+        uint64_t remaining = offset < (uint64_t)file_size ? (uint64_t)file_size - offset : 0;
+        file_size = length < remaining ? (long)length : (long)remaining;
+    }
+    return scheduler_classify(header->command, file_size);
+}
+
+/**
+ * @brief The scheduler slot of the request being handled.
+ *
+ * scheduler: the scheduler the slot was acquired from
+ * ticket: the request's ticket
+ * released: non-zero once the slot has been given back
+ */
+typedef struct {
+    Scheduler* scheduler;
+    SchedulerTicket ticket;
+    int released;
+} _Admission;
+
+/**
+ * @brief Gives back the slot of a request, unless it was already given back.
+ */
+static void _release_admission(void* context) {
+    _Admission* admission = (_Admission*)context;
+    if (!admission->released) {
+        scheduler_release(admission->scheduler, &admission->ticket);
+        admission->released = 1;
+    }
+}
+
+/**
+ * @brief Waits for the next request on an idle connection.
+ *
+ * @return Non-zero if there is something to receive (a request, or the client closing the connection);
+ * zero if the connection should be closed: it was idle for the keep-alive timeout, or the server is
+ * draining and no request arrived within the grace period.
+ */
+static int _wait_for_request(Connections* connections, int client_socket) {
+    struct pollfd fds[2] = {{client_socket, POLLIN, 0}, {connections->wakeup_fd, POLLIN, 0}};
+    int ready;
+    do {
+        ready = poll(fds, 2, CONNECTION_KEEP_ALIVE_TIMEOUT_SECONDS * 1000);
+    } while (ready == -1 && errno == EINTR);
+    if (ready <= 0) {
+        return 0;
+    }
+    if (fds[0].revents != 0) {
+        return 1;
+    }
+    // draining: the client may have sent a request just before it could see the connection close
+    do {
+        ready = poll(fds, 1, CONNECTION_DRAIN_GRACE_MS);
+    } while (ready == -1 && errno == EINTR);
+    return ready > 0;
+}
+
+void* connection_serve(void* arg) {
+    ClientConnection* connection = (ClientConnection*)arg;
+    Connections* connections = connection->connections;
+    int client_socket = connection->socket;
+
+    // connections are kept alive so that clients (e.g. a connection pool) can send several requests
+    // without a new handshake each time. Waiting for a request is bounded by `_wait_for_request`; the
+    // receive timeout bounds a request that stops part way through.
+    struct timeval timeout = {CONNECTION_KEEP_ALIVE_TIMEOUT_SECONDS, 0};
+    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    uint8_t buffer[MAX_MESSAGE_SIZE];
+    // file transfers requested on non-zero streams; their chunks are interleaved with each other and
+    // with the responses to requests that arrive while they are running
+    StreamMultiplexer multiplexer = STREAM_MULTIPLEXER_INIT;
+    int subscribed = 0;
+    while (1) {
+        // requests that are already waiting are handled before the next round of chunks; while
+        // the transfers' files are being read, either may come first
+        if (multiplexer.stream_count > 0 && !multiplexer_request_waiting(&multiplexer, client_socket)) {
+            if (multiplexer_send_round(&multiplexer, client_socket) != STATUS_OK) {
+                fprintf(stderr, "***ERROR*** sending chunks (socket=%d)\n", client_socket);
+                break;
+            }
+            continue;
+        }
+        if (multiplexer.stream_count == 0 && !_wait_for_request(connections, client_socket)) {
+            printf("Closing idle connection (socket=%d)\n", client_socket);
+            break;
+        }
+        ssize_t bytes_received = receive_message(client_socket, buffer, MAX_MESSAGE_SIZE);
+        if (bytes_received == 0) {
+            printf("Connection closed (socket=%d)\n", client_socket);
+            break;
+        }
+        if (bytes_received < 0) {
+            fprintf(stderr, "***ERROR*** receiving message (socket=%d)\n", client_socket);
+            break;
+        }
+
+        Response response;
+        int rvalue = parse_message(buffer, bytes_received, &response);
+        if (rvalue != STATUS_OK) {
+            fprintf(stderr, "Error parsing message\n");
+            break;
+        }
+        printf("Received request (socket=%d): command=%d, payload=%s\n", client_socket, response.header.command, (char*)response.payload);
+        if (response.header.command == COMMAND_SUBSCRIBE) {
+            // the notifier takes the connection over: from now on, it is the only one sending on it.
+            // Subscribing isn't scheduled, it only waits for changes.
+            if (connections->notifier != NULL && multiplexer.stream_count == 0 && response.header.stream_id == 0
+                && notifier_add_subscriber(connections->notifier, client_socket, &response.header, response.payload) == STATUS_OK) {
+                destroy_response(&response);
+                printf("Connection subscribed (socket=%d)\n", client_socket);
+                subscribed = 1;
+                break;
+            }
+            rvalue = reject_request(client_socket, &response.header, ERROR_INVALID_COMMAND,
+                connections->notifier != NULL ? "Subscribe on a connection without transfers in progress" : "Subscriptions are not available");
+            destroy_response(&response);
+            if (rvalue == ERROR_SEND_FAILED) {
+                break;
+            }
+            continue;
+        }
+        // wait for a slot; small requests are let through ahead of bulk transfers
+        _Admission admission = {connections->scheduler, .released = 0};
+        if (scheduler_acquire(connections->scheduler, &admission.ticket, _classify_request(&response.header, response.payload)) != STATUS_OK) {
+            // shed load: a fast rejection lets the client retry elsewhere instead of timing out here.
+            // Rejections come in floods, so they are counted by the scheduler rather than logged.
+            rvalue = reject_request(client_socket, &response.header, ERROR_OVERLOADED, "Server overloaded");
+            destroy_response(&response);
+            if (rvalue == ERROR_SEND_FAILED) {
+                break;
+            }
+            continue;
+        }
+        // the slot covers opening the file. It is given back once only sending the contents remains,
+        // which goes at the client's pace, so a slow client doesn't hold up the queue; the reads of the
+        // contents are bounded by the reader threads of the storage root instead. A multiplexed
+        // transfer gives it back once the transfer is queued.
+        if (response.header.stream_id != 0) {
+            rvalue = multiplexer_handle_request(&multiplexer, client_socket, &response.header, response.payload);
+        } else {
+            handle_request_on_sending(_release_admission, &admission);
+            rvalue = handle_request(client_socket, &response.header, response.payload);
+        }
+        _release_admission(&admission);
+        destroy_response(&response);
+        if (rvalue == ERROR_SEND_FAILED) {
+            // the client is gone or the response was cut off part way through; the connection can't be reused
+            fprintf(stderr, "Error handling request: status=%d\n", rvalue);
+            break;
+        }
+        if (rvalue != STATUS_OK) {
+            fprintf(stderr, "Error handling request: status=%d\n", rvalue);
+        } else {
+            printf("Request handled\n");
+        }
+    }
+    multiplexer_destroy(&multiplexer);
+    if (!subscribed) {
+        socket_cleanup(client_socket);
+    }
+    connection_unregister(connection);
+    return NULL;
+}
+
+int connections_drain(Connections* connections, int timeout_seconds) {
+    // the eventfd stays signaled, so every connection sees it the next time it waits for a request
+    uint64_t one = 1;
+    if (write(connections->wakeup_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("write");
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_seconds;
+    pthread_mutex_lock(&connections->mutex);
+    while (connections->connection_count > 0) {
+        printf("Draining %d connection(s)\n", connections->connection_count);
+        if (pthread_cond_timedwait(&connections->drained, &connections->mutex, &deadline) != 0) {
+            break;
+        }
+    }
+    int remaining = connections->connection_count;
+    pthread_mutex_unlock(&connections->mutex);
+    return remaining;
+}
@@ -0,0 +1,163 @@
+#include "connection_pool.h"
+#include "protocol.h"
+#include "sockets.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+
+int connection_pool_init(ConnectionPool* pool, size_t max_idle_per_address, uint64_t idle_timeout_ms, const SocketOptions* options) {
+    if (pthread_mutex_init(&pool->mutex, NULL) != 0) {
+        return -1;
+    }
+    pool->idle = NULL;
+    pool->idle_count = 0;
+    pool->max_idle_per_address = max_idle_per_address;
+    pool->idle_timeout_ms = idle_timeout_ms;
+    pool->options = options != NULL ? *options : (SocketOptions)SOCKET_OPTIONS_INIT;
+    pool->retry_policy = (RetryPolicy)RETRY_POLICY_INIT;
+    return 0;
+}
+
+void connection_pool_destroy(ConnectionPool* pool) {
+    pthread_mutex_lock(&pool->mutex);
+    IdleConnection* connection = pool->idle;
+    while (connection != NULL) {
+        IdleConnection* next = connection->next;
+        socket_cleanup(connection->socket);
+        free(connection);
+        connection = next;
+    }
+    pool->idle = NULL;
+    pool->idle_count = 0;
+    pthread_mutex_unlock(&pool->mutex);
+    pthread_mutex_destroy(&pool->mutex);
+}
+
+/**
+ * Closes idle connections that have exceeded the idle timeout. The caller must hold the mutex.
+ */
+static void _evict_expired(ConnectionPool* pool, uint64_t now_ms) {
+    IdleConnection** link = &pool->idle;
+    while (*link != NULL) {
+        IdleConnection* connection = *link;
+        if (now_ms - connection->last_used_ms > pool->idle_timeout_ms) {
+            *link = connection->next;
+            socket_cleanup(connection->socket);
+            free(connection);
+            pool->idle_count--;
+        } else {
+            link = &connection->next;
+        }
+    }
+}
+
+/**
+ * Removes and returns the most recently used idle connection to address/port, or NULL if there is
+ * none. The caller must hold the mutex.
+ */
+static IdleConnection* _take_idle(ConnectionPool* pool, const char* address, in_addr_t port) {
+    for (IdleConnection** link = &pool->idle; *link != NULL; link = &(*link)->next) {
+        IdleConnection* connection = *link;
+        if (connection->port == port && strcmp(connection->address, address) == 0) {
+            *link = connection->next;
+            pool->idle_count--;
+            return connection;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * An idle connection should have nothing to read. If poll reports it as readable, the server has
+ * closed it (recv would return 0), reset it, or sent unexpected data; either way it can't be reused.
+ */
+static int _is_healthy(int socket) {
+    struct pollfd poll_fd = {socket, POLLIN | POLLRDHUP, 0};
+    int ready = poll(&poll_fd, 1, 0);
+    return ready == 0;
+}
+
+int connection_pool_checkout(ConnectionPool* pool, const char* address, in_addr_t port) {
+    if (strlen(address) >= POOL_ADDRESS_SIZE) {
+        return -1;
+    }
+    while (1) {
+        pthread_mutex_lock(&pool->mutex);
+        _evict_expired(pool, monotonic_time_ms());
+        IdleConnection* connection = _take_idle(pool, address, port);
+        pthread_mutex_unlock(&pool->mutex);
+        if (connection == NULL) {
+            break;
+        }
+        // the health check is done outside of the lock since it is a system call
+        int socket = connection->socket;
+        free(connection);
+        if (_is_healthy(socket)) {
+            return socket;
+        }
+        socket_cleanup(socket);
+    }
+    int socket;
+    connect_with_deadline(address, port, &pool->retry_policy, &pool->options, &socket);
+    return socket;
+}
+
+void connection_pool_checkin(ConnectionPool* pool, const char* address, in_addr_t port, int socket, int reusable) {
+    if (socket == -1) {
+        return;
+    }
+    if (!reusable || strlen(address) >= POOL_ADDRESS_SIZE) {
+        socket_cleanup(socket);
+        return;
+    }
+    IdleConnection* connection = malloc(sizeof(IdleConnection));
+    if (connection == NULL) {
+        socket_cleanup(socket);
+        return;
+    }
+    connection->socket = socket;
+    strcpy(connection->address, address);
+    connection->port = port;
+    connection->last_used_ms = monotonic_time_ms();
+
+    pthread_mutex_lock(&pool->mutex);
+    size_t idle_for_address = 0;
+    for (IdleConnection* idle = pool->idle; idle != NULL; idle = idle->next) {
+        if (idle->port == port && strcmp(idle->address, address) == 0) {
+            idle_for_address++;
+        }
+    }
+    if (idle_for_address >= pool->max_idle_per_address) {
+        pthread_mutex_unlock(&pool->mutex);
+        socket_cleanup(socket);
+        free(connection);
+        return;
+    }
+    // most recently used first; these connections are the least likely to have been closed by the server
+    connection->next = pool->idle;
+    pool->idle = connection;
+    pool->idle_count++;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+int connection_pool_is_reusable(int status) {
+    switch (status) {
+        case ERROR_SEND_FAILED:
+        case ERROR_RECEIVE_FAILED:
+        case ERROR_MEMORY_ALLOCATION_FAILED:
+        case ERROR_INVALID_DATA_SIZE:
+        case ERROR_MAX_PAYLOAD_SIZE_EXCEEDED:
+        case ERROR_UNEXPECTED_MESSAGE_TYPE:
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+size_t connection_pool_idle_count(ConnectionPool* pool) {
+    pthread_mutex_lock(&pool->mutex);
+    size_t idle_count = pool->idle_count;
+    pthread_mutex_unlock(&pool->mutex);
+    return idle_count;
+}
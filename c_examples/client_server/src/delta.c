@@ -0,0 +1,396 @@
+#include "utils.h"
+#include "delta.h"
+#include "protocol.h"
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+static void _put_uint32(uint8_t* buffer, uint32_t value) {
+    value = htonl(value);
+    memcpy(buffer, &value, sizeof(value));
+}
+
+static uint32_t _get_uint32(const uint8_t* buffer) {
+    uint32_t value;
+    memcpy(&value, buffer, sizeof(value));
+    return ntohl(value);
+}
+
+uint32_t delta_weak_checksum(const uint8_t* data, size_t length) {
+    // a is the sum of the bytes, b the sum of a after each byte (so each byte is weighted by its
+    // distance from the end of the window); both are kept to 16 bits
+    uint32_t a = 0;
+    uint32_t b = 0;
+    for (size_t i = 0; i < length; i++) {
+        a += data[i];
+        b += a;
+    }
+    return (a & 0xffff) | ((b & 0xffff) << 16);
+}
+
+uint32_t delta_roll_checksum(uint32_t checksum, uint8_t removed, uint8_t added, size_t block_size) {
+    uint32_t a = checksum & 0xffff;
+    uint32_t b = checksum >> 16;
+    a = (a - removed + added) & 0xffff;
+    b = (b - (uint32_t)block_size * removed + a) & 0xffff;
+    return a | (b << 16);
+}
+
+uint64_t delta_strong_hash(const uint8_t* data, size_t length) {
+    return fnv1a_hash(FNV1A_OFFSET_BASIS, data, length);
+}
+
+static const uint32_t _SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint32_t _rotate_right(uint32_t value, int bits) {
+    return (value >> bits) | (value << (32 - bits));
+}
+
+/**
+ * Processes one 64 byte block of SHA-256 input.
+ */
+static void _sha256_block(uint32_t state[8], const uint8_t* block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = _get_uint32(block + 4 * i);
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = _rotate_right(w[i - 15], 7) ^ _rotate_right(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = _rotate_right(w[i - 2], 17) ^ _rotate_right(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t v[8];
+    memcpy(v, state, sizeof(v));
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 = _rotate_right(v[4], 6) ^ _rotate_right(v[4], 11) ^ _rotate_right(v[4], 25);
+        uint32_t choice = (v[4] & v[5]) ^ (~v[4] & v[6]);
+        uint32_t t1 = v[7] + s1 + choice + _SHA256_K[i] + w[i];
+        uint32_t s0 = _rotate_right(v[0], 2) ^ _rotate_right(v[0], 13) ^ _rotate_right(v[0], 22);
+        uint32_t majority = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+        memmove(v + 1, v, 7 * sizeof(uint32_t));
+        v[4] += t1;
+        v[0] = t1 + s0 + majority;
+    }
+    for (int i = 0; i < 8; i++) {
+        state[i] += v[i];
+    }
+}
+
+void delta_file_hash(const uint8_t* data, size_t length, uint8_t hash[DELTA_FILE_HASH_SIZE]) {
+    uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    size_t offset = 0;
+    for (; length - offset >= 64; offset += 64) {
+        _sha256_block(state, data + offset);
+    }
+    // the rest of the data, the 0x80 terminator and the length in bits fill one or two more blocks
+    uint8_t tail[128] = {0};
+    size_t remaining = length - offset;
+    if (remaining > 0) {
+        memcpy(tail, data + offset, remaining);
+    }
+    tail[remaining] = 0x80;
+    size_t tail_size = remaining < 56 ? 64 : 128;
+    uint64_t bits = (uint64_t)length * 8;
+    _put_uint32(tail + tail_size - 8, (uint32_t)(bits >> 32));
+    _put_uint32(tail + tail_size - 4, (uint32_t)bits);
+    for (size_t i = 0; i < tail_size; i += 64) {
+        _sha256_block(state, tail + i);
+    }
+    for (int i = 0; i < 8; i++) {
+        _put_uint32(hash + 4 * i, state[i]);
+    }
+}
+
+size_t delta_block_size(size_t file_size) {
+    size_t block_size = 1;
+    while (block_size * block_size < file_size && block_size < DELTA_MAX_BLOCK_SIZE) {
+        block_size *= 2;
+    }
+    if (block_size < DELTA_MIN_BLOCK_SIZE) {
+        return DELTA_MIN_BLOCK_SIZE;
+    }
+    return block_size;
+}
+
+int delta_compute_signatures(const uint8_t* data, size_t size, size_t block_size, BlockSignature** signatures, size_t* count) {
+    *count = size / block_size;
+    *signatures = NULL;
+    if (*count == 0) {
+        return STATUS_OK;
+    }
+    *signatures = malloc(*count * sizeof(BlockSignature));
+    if (*signatures == NULL) {
+        *count = 0;
+        return ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    for (size_t i = 0; i < *count; i++) {
+        (*signatures)[i].weak = delta_weak_checksum(data + i * block_size, block_size);
+        (*signatures)[i].strong = delta_strong_hash(data + i * block_size, block_size);
+    }
+    return STATUS_OK;
+}
+
+void delta_pack_signatures(const BlockSignature* signatures, size_t count, uint8_t* buffer) {
+    for (size_t i = 0; i < count; i++) {
+        uint8_t* signature = buffer + i * DELTA_SIGNATURE_SIZE;
+        _put_uint32(signature, signatures[i].weak);
+        _put_uint32(signature + 4, (uint32_t)(signatures[i].strong >> 32));
+        _put_uint32(signature + 8, (uint32_t)signatures[i].strong);
+    }
+}
+
+void delta_unpack_signatures(const uint8_t* buffer, size_t count, BlockSignature* signatures) {
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t* signature = buffer + i * DELTA_SIGNATURE_SIZE;
+        signatures[i].weak = _get_uint32(signature);
+        signatures[i].strong = ((uint64_t)_get_uint32(signature + 4) << 32) | _get_uint32(signature + 8);
+    }
+}
+
+/**
+ * Open addressing hash table from weak checksum to signature index, so that the (very frequent)
+ * lookups of non-matching offsets are a single probe. Slots hold the index + 1; 0 is empty.
+ */
+typedef struct {
+    size_t* slots;
+    size_t mask;
+} _SignatureTable;
+
+static size_t _slot(uint32_t weak, size_t mask) {
+    return (weak * 2654435761u) & mask;
+}
+
+static int _build_table(_SignatureTable* table, const BlockSignature* signatures, size_t count) {
+    size_t capacity = 16;
+    while (capacity < count * 2) {
+        capacity *= 2;
+    }
+    table->slots = calloc(capacity, sizeof(size_t));
+    if (table->slots == NULL) {
+        return ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    table->mask = capacity - 1;
+    for (size_t i = 0; i < count; i++) {
+        size_t slot = _slot(signatures[i].weak, table->mask);
+        while (table->slots[slot] != 0) {
+            slot = (slot + 1) & table->mask;
+        }
+        table->slots[slot] = i + 1;
+    }
+    return STATUS_OK;
+}
+
+/**
+ * Returns the index of the block matching the window at `data`, or -1. The strong hash is only
+ * computed if a block with the same weak checksum exists.
+ */
+static long _find_block(const _SignatureTable* table, const BlockSignature* signatures, uint32_t weak, const uint8_t* data, size_t block_size) {
+    int strong_computed = 0;
+    uint64_t strong = 0;
+    for (size_t slot = _slot(weak, table->mask); table->slots[slot] != 0; slot = (slot + 1) & table->mask) {
+        size_t index = table->slots[slot] - 1;
+        if (signatures[index].weak != weak) {
+            continue;
+        }
+        if (!strong_computed) {
+            strong = delta_strong_hash(data, block_size);
+            strong_computed = 1;
+        }
+        if (signatures[index].strong == strong) {
+            return index;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Packs instructions into MAX_PAYLOAD_SIZE payloads. Consecutive block copies are merged into one
+ * COPY instruction, and literals are split so that every payload holds complete instructions.
+ */
+typedef struct {
+    uint8_t payload[MAX_PAYLOAD_SIZE];
+    size_t length;
+    uint32_t copy_first;
+    uint32_t copy_count;
+    DeltaWriter writer;
+    void* context;
+} _DeltaEncoder;
+
+static int _flush_payload(_DeltaEncoder* encoder, int last) {
+    int rvalue = encoder->writer(encoder->payload, encoder->length, last, encoder->context);
+    encoder->length = 0;
+    return rvalue;
+}
+
+static int _flush_copy(_DeltaEncoder* encoder) {
+    if (encoder->copy_count == 0) {
+        return STATUS_OK;
+    }
+    if (encoder->length + DELTA_COPY_INSTRUCTION_SIZE > MAX_PAYLOAD_SIZE) {
+        int rvalue = _flush_payload(encoder, 0);
+        if (rvalue != STATUS_OK) {
+            return rvalue;
+        }
+    }
+    uint8_t* instruction = encoder->payload + encoder->length;
+    instruction[0] = DELTA_INSTRUCTION_COPY;
+    _put_uint32(instruction + 1, encoder->copy_first);
+    _put_uint32(instruction + 5, encoder->copy_count);
+    encoder->length += DELTA_COPY_INSTRUCTION_SIZE;
+    encoder->copy_count = 0;
+    return STATUS_OK;
+}
+
+static int _emit_copy(_DeltaEncoder* encoder, uint32_t block) {
+    if (encoder->copy_count > 0 && block == encoder->copy_first + encoder->copy_count) {
+        encoder->copy_count++;
+        return STATUS_OK;
+    }
+    int rvalue = _flush_copy(encoder);
+    encoder->copy_first = block;
+    encoder->copy_count = 1;
+    return rvalue;
+}
+
+static int _emit_literal(_DeltaEncoder* encoder, const uint8_t* data, size_t length) {
+    if (length == 0) {
+        return STATUS_OK;
+    }
+    int rvalue = _flush_copy(encoder);
+    while (rvalue == STATUS_OK && length > 0) {
+        size_t space = MAX_PAYLOAD_SIZE - encoder->length;
+        if (space <= DELTA_LITERAL_HEADER_SIZE) {
+            rvalue = _flush_payload(encoder, 0);
+            continue;
+        }
+        size_t literal_length = length < space - DELTA_LITERAL_HEADER_SIZE ? length : space - DELTA_LITERAL_HEADER_SIZE;
+        uint8_t* instruction = encoder->payload + encoder->length;
+        instruction[0] = DELTA_INSTRUCTION_LITERAL;
+        _put_uint32(instruction + 1, literal_length);
+        memcpy(instruction + DELTA_LITERAL_HEADER_SIZE, data, literal_length);
+        encoder->length += DELTA_LITERAL_HEADER_SIZE + literal_length;
+        data += literal_length;
+        length -= literal_length;
+    }
+    return rvalue;
+}
+
+int delta_generate(const uint8_t* data, size_t size, const BlockSignature* signatures, size_t count, size_t block_size, DeltaWriter writer, void* context) {
+    _DeltaEncoder encoder = {.length = 0, .copy_count = 0, .writer = writer, .context = context};
+    _SignatureTable table = {NULL, 0};
+    int rvalue = STATUS_OK;
+    size_t literal_start = 0;
+    if (count > 0 && size >= block_size) {
+        rvalue = _build_table(&table, signatures, count);
+        if (rvalue != STATUS_OK) {
+            return rvalue;
+        }
+        size_t offset = 0;
+        uint32_t weak = delta_weak_checksum(data, block_size);
+        while (rvalue == STATUS_OK && offset + block_size <= size) {
+            long block = _find_block(&table, signatures, weak, data + offset, block_size);
+            if (block != -1) {
+                rvalue = _emit_literal(&encoder, data + literal_start, offset - literal_start);
+                if (rvalue == STATUS_OK) {
+                    rvalue = _emit_copy(&encoder, block);
+                }
+                offset += block_size;
+                literal_start = offset;
+                if (offset + block_size <= size) {
+                    weak = delta_weak_checksum(data + offset, block_size);
+                }
+            } else {
+                if (offset + block_size < size) {
+                    weak = delta_roll_checksum(weak, data[offset], data[offset + block_size], block_size);
+                }
+                offset++;
+            }
+        }
+        free(table.slots);
+    }
+    if (rvalue == STATUS_OK) {
+        rvalue = _emit_literal(&encoder, data + literal_start, size - literal_start);
+    }
+    if (rvalue == STATUS_OK) {
+        rvalue = _flush_copy(&encoder);
+    }
+    if (rvalue == STATUS_OK) {
+        rvalue = _flush_payload(&encoder, 1);
+    }
+    return rvalue;
+}
+
+static int _append(DeltaOutput* output, const uint8_t* data, size_t length) {
+    if (output->size + length > output->capacity) {
+        size_t capacity = output->capacity > 0 ? output->capacity : MAX_PAYLOAD_SIZE;
+        while (capacity < output->size + length) {
+            capacity *= 2;
+        }
+        uint8_t* new_data = realloc(output->data, capacity);
+        if (new_data == NULL) {
+            return ERROR_MEMORY_ALLOCATION_FAILED;
+        }
+        output->data = new_data;
+        output->capacity = capacity;
+    }
+    memcpy(output->data + output->size, data, length);
+    output->size += length;
+    return STATUS_OK;
+}
+
+int delta_apply(const uint8_t* instructions, size_t length, const uint8_t* basis, size_t basis_size, size_t block_size, DeltaOutput* output) {
+    size_t offset = 0;
+    while (offset < length) {
+        uint8_t type = instructions[offset];
+        if (type == DELTA_INSTRUCTION_COPY) {
+            if (length - offset < DELTA_COPY_INSTRUCTION_SIZE) {
+                return ERROR_INVALID_DATA_SIZE;
+            }
+            uint64_t first = _get_uint32(instructions + offset + 1);
+            uint64_t count = _get_uint32(instructions + offset + 5);
+            if ((first + count) * block_size > basis_size) {
+                return ERROR_INVALID_DATA_SIZE;
+            }
+            int rvalue = _append(output, basis + first * block_size, count * block_size);
+            if (rvalue != STATUS_OK) {
+                return rvalue;
+            }
+            output->copied_bytes += count * block_size;
+            offset += DELTA_COPY_INSTRUCTION_SIZE;
+        } else if (type == DELTA_INSTRUCTION_LITERAL) {
+            if (length - offset < DELTA_LITERAL_HEADER_SIZE) {
+                return ERROR_INVALID_DATA_SIZE;
+            }
+            size_t literal_length = _get_uint32(instructions + offset + 1);
+            offset += DELTA_LITERAL_HEADER_SIZE;
+            if (literal_length > length - offset) {
+                return ERROR_INVALID_DATA_SIZE;
+            }
+            int rvalue = _append(output, instructions + offset, literal_length);
+            if (rvalue != STATUS_OK) {
+                return rvalue;
+            }
+            output->literal_bytes += literal_length;
+            offset += literal_length;
+        } else {
+            return ERROR_INVALID_DATA_SIZE;
+        }
+    }
+    return STATUS_OK;
+}
+
+void destroy_delta_output(DeltaOutput* output) {
+    if (output != NULL) {
+        free(output->data);
+        *output = (DeltaOutput)DELTA_OUTPUT_INIT;
+    }
+}
@@ -0,0 +1,331 @@
+#include "utils.h"
+#include "protocol.h"
+#include "file_cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+int file_cache_init(FileCache* cache, const char* root, size_t capacity) {
+    pthread_mutex_init(&cache->mutex, NULL);
+    cache->buckets = NULL;
+    cache->capacity = capacity > 0 ? capacity : 1;
+    // twice as many buckets as entries keeps the chains short
+    cache->bucket_count = cache->capacity * 2;
+    cache->count = 0;
+    cache->idle_head = NULL;
+    cache->idle_tail = NULL;
+    cache->hits = 0;
+    cache->misses = 0;
+    // O_DIRECTORY: fail unless the root is a directory; O_PATH: the descriptor is only used as the
+    // starting point of lookups, so no read permission on the directory is needed
+    cache->root_fd = open(root, O_DIRECTORY | O_PATH | O_CLOEXEC);
+    if (cache->root_fd == -1) {
+        return -1;
+    }
+    cache->buckets = calloc(cache->bucket_count, sizeof(CachedFile*));
+    if (cache->buckets == NULL) {
+        close(cache->root_fd);
+        cache->root_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void file_cache_destroy(FileCache* cache) {
+    if (cache->buckets != NULL) {
+        for (size_t i = 0; i < cache->bucket_count; i++) {
+            CachedFile* entry = cache->buckets[i];
+            while (entry != NULL) {
+                CachedFile* next = entry->next;
+                close(entry->fd);
+                free(entry);
+                entry = next;
+            }
+        }
+        free(cache->buckets);
+        cache->buckets = NULL;
+    }
+    if (cache->root_fd != -1) {
+        close(cache->root_fd);
+        cache->root_fd = -1;
+    }
+    cache->count = 0;
+    cache->idle_head = NULL;
+    cache->idle_tail = NULL;
+    pthread_mutex_destroy(&cache->mutex);
+}
+
+int file_cache_open_beneath(int root_fd, const char* name, int flags) {
+#ifdef SYS_openat2
+    struct open_how how = {.flags = flags | O_CLOEXEC, .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS};
+    int fd = syscall(SYS_openat2, root_fd, name, &how, sizeof(how));
+    if (fd != -1 || errno != ENOSYS) {
+        return fd;
+    }
+#endif
+    // kernels before 5.6: at least the file itself can't be a symlink
+    return openat(root_fd, name, flags | O_CLOEXEC | O_NOFOLLOW);
+}
+
+int file_cache_stat(int root_fd, const char* name, struct stat* file_stat) {
+    int fd = file_cache_open_beneath(root_fd, name, O_PATH);
+    if (fd == -1) {
+        return -1;
+    }
+    int rvalue = fstat(fd, file_stat);
+    close(fd);
+    return rvalue;
+}
+
+int file_cache_valid_name(const char* name) {
+    size_t length = strnlen(name, FILE_CACHE_MAX_NAME);
+    if (length == 0 || length == FILE_CACHE_MAX_NAME || name[0] == '/') {
+        return 0;
+    }
+    const char* component = name;
+    while (1) {
+        const char* end = strchr(component, '/');
+        size_t component_length = end != NULL ? (size_t)(end - component) : strlen(component);
+        if (component_length == 2 && component[0] == '.' && component[1] == '.') {
+            return 0;
+        }
+        if (end == NULL) {
+            return 1;
+        }
+        component = end + 1;
+    }
+}
+
+/**
+ * Returns STATUS_OK if `name` can be looked up, otherwise the error code for it.
+ */
+static int _check_name(FileCache* cache, const char* name) {
+    if (cache->root_fd == -1) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+    if (strnlen(name, FILE_CACHE_MAX_NAME) == FILE_CACHE_MAX_NAME) {
+        return ERROR_FILE_OPEN_FAILED;
+    }
+    return file_cache_valid_name(name) ? STATUS_OK : ERROR_INVALID_FILE_NAME;
+}
+
+static size_t _bucket(FileCache* cache, const char* name) {
+    return fnv1a_hash(FNV1A_OFFSET_BASIS, name, strlen(name)) % cache->bucket_count;
+}
+
+static int _same_file(const struct stat* a, const struct stat* b) {
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino;
+}
+
+/**
+ * Whether the file has not been modified in between two stats of it.
+ */
+static int _same_contents(const struct stat* a, const struct stat* b) {
+    return a->st_size == b->st_size && a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/**
+ * Returns the cached entry of `name`, or NULL. Called with the mutex held.
+ */
+static CachedFile* _find(FileCache* cache, const char* name) {
+    for (CachedFile* entry = cache->buckets[_bucket(cache, name)]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Takes an entry off the idle list (it must be on it). Called with the mutex held.
+ */
+static void _idle_remove(FileCache* cache, CachedFile* entry) {
+    if (entry->idle_previous != NULL) {
+        entry->idle_previous->idle_next = entry->idle_next;
+    } else {
+        cache->idle_head = entry->idle_next;
+    }
+    if (entry->idle_next != NULL) {
+        entry->idle_next->idle_previous = entry->idle_previous;
+    } else {
+        cache->idle_tail = entry->idle_previous;
+    }
+    entry->idle_previous = NULL;
+    entry->idle_next = NULL;
+}
+
+/**
+ * Takes a reference to a cached entry, which takes it off the idle list if it was unused. Called with
+ * the mutex held.
+ */
+static void _reference(FileCache* cache, CachedFile* entry) {
+    if (entry->references == 0) {
+        _idle_remove(cache, entry);
+    }
+    entry->references++;
+}
+
+/**
+ * Removes an entry from the cache; it is closed now if it isn't in use, otherwise by the last
+ * `file_cache_release`. Called with the mutex held.
+ */
+static void _remove(FileCache* cache, CachedFile* entry) {
+    CachedFile** link = &cache->buckets[_bucket(cache, entry->name)];
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    entry->next = NULL;
+    entry->cached = 0;
+    cache->count--;
+    if (entry->references == 0) {
+        _idle_remove(cache, entry);
+        close(entry->fd);
+        free(entry);
+    }
+}
+
+/**
+ * Removes the least recently used entry that isn't in use: the tail of the idle list. Called with the
+ * mutex held.
+ *
+ * @return 0 if an entry was removed, or -1 if all entries are in use.
+ */
+static int _evict(FileCache* cache) {
+    if (cache->idle_tail == NULL) {
+        return -1;
+    }
+    _remove(cache, cache->idle_tail);
+    return 0;
+}
+
+int file_cache_acquire(FileCache* cache, const char* name, CachedFile** file) {
+    int rvalue = _check_name(cache, name);
+    if (rvalue != STATUS_OK) {
+        return rvalue;
+    }
+    // the lookup that validates the cached descriptor is done without holding the mutex
+    struct stat file_stat;
+    int found = file_cache_stat(cache->root_fd, name, &file_stat) == 0 && S_ISREG(file_stat.st_mode);
+
+    pthread_mutex_lock(&cache->mutex);
+    CachedFile* entry = _find(cache, name);
+    // the users of an entry read its stat without the mutex, so it is only refreshed while unused; a file
+    // modified in place while in use gets a new entry instead
+    if (entry != NULL && found && _same_file(&entry->file_stat, &file_stat)
+        && (entry->references == 0 || _same_contents(&entry->file_stat, &file_stat))) {
+        if (entry->references == 0) {
+            entry->file_stat = file_stat;
+        }
+        _reference(cache, entry);
+        cache->hits++;
+        pthread_mutex_unlock(&cache->mutex);
+        *file = entry;
+        return STATUS_OK;
+    }
+    if (entry != NULL) {
+        // the file was removed or replaced since it was opened
+        _remove(cache, entry);
+    }
+    cache->misses++;
+    pthread_mutex_unlock(&cache->mutex);
+    if (!found) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    entry = malloc(sizeof(CachedFile));
+    if (entry == NULL) {
+        return ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    entry->fd = file_cache_open_beneath(cache->root_fd, name, O_RDONLY);
+    // stat the open file rather than reuse `file_stat`: the name may have been replaced in between
+    if (entry->fd == -1 || fstat(entry->fd, &entry->file_stat) == -1 || !S_ISREG(entry->file_stat.st_mode)) {
+        if (entry->fd != -1) {
+            close(entry->fd);
+        }
+        free(entry);
+        return ERROR_FILE_NOT_FOUND;
+    }
+    strcpy(entry->name, name);
+    entry->references = 1;
+    entry->cached = 0;
+    entry->next = NULL;
+    entry->idle_previous = NULL;
+    entry->idle_next = NULL;
+
+    pthread_mutex_lock(&cache->mutex);
+    CachedFile* other = _find(cache, name);
+    if (other != NULL && _same_file(&other->file_stat, &entry->file_stat)) {
+        // another thread opened the same file in the meantime; use its descriptor
+        _reference(cache, other);
+        pthread_mutex_unlock(&cache->mutex);
+        close(entry->fd);
+        free(entry);
+        *file = other;
+        return STATUS_OK;
+    }
+    if (other != NULL) {
+        _remove(cache, other);
+    }
+    // when every cached file is in use, the new one is used once and not cached
+    if (cache->count < cache->capacity || _evict(cache) == 0) {
+        size_t bucket = _bucket(cache, name);
+        entry->next = cache->buckets[bucket];
+        cache->buckets[bucket] = entry;
+        entry->cached = 1;
+        cache->count++;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    *file = entry;
+    return STATUS_OK;
+}
+
+void file_cache_release(FileCache* cache, CachedFile* file) {
+    pthread_mutex_lock(&cache->mutex);
+    file->references--;
+    int unused = !file->cached && file->references == 0;
+    if (file->cached && file->references == 0) {
+        // the most recently used idle entry goes to the front, the next one to evict is at the back
+        file->idle_next = cache->idle_head;
+        if (cache->idle_head != NULL) {
+            cache->idle_head->idle_previous = file;
+        } else {
+            cache->idle_tail = file;
+        }
+        cache->idle_head = file;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    if (unused) {
+        close(file->fd);
+        free(file);
+    }
+}
+
+int file_cache_open(FileCache* cache, const char* name, int flags, int* fd) {
+    *fd = -1;
+    int rvalue = _check_name(cache, name);
+    if (rvalue != STATUS_OK) {
+        return rvalue;
+    }
+    int new_fd = file_cache_open_beneath(cache->root_fd, name, flags);
+    struct stat file_stat;
+    if (new_fd == -1 || fstat(new_fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode)) {
+        if (new_fd != -1) {
+            close(new_fd);
+        }
+        return ERROR_FILE_NOT_FOUND;
+    }
+    *fd = new_fd;
+    return STATUS_OK;
+}
+
+size_t file_cache_size(FileCache* cache) {
+    pthread_mutex_lock(&cache->mutex);
+    size_t count = cache->count;
+    pthread_mutex_unlock(&cache->mutex);
+    return count;
+}
@@ -1,14 +1,41 @@
 #include "utils.h"
 #include "protocol.h"
+#include "sockets.h"
 #include "file_transfer.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <endian.h>
+
+// the stream of the request `handle_request` is handling on this thread; responses are sent on the
+// same stream so that the client can match them with the request (see `multiplex.h`)
+static _Thread_local uint32_t _response_stream_id = 0;
+// called (once) when the request `handle_request` is handling on this thread has opened its file and
+// only sending the contents remains (see `handle_request_on_sending`)
+static _Thread_local void (*_on_sending)(void*) = NULL;
+static _Thread_local void* _on_sending_context = NULL;
+
+/**
+ * Runs the `handle_request_on_sending` callback of the current request, if it hasn't run yet.
+ */
+static void _sending() {
+    void (*on_sending)(void*) = _on_sending;
+    _on_sending = NULL;
+    if (on_sending != NULL) {
+        on_sending(_on_sending_context);
+    }
+}
 
 int _send_error_response(int socket, uint8_t command, uint8_t error_code, const char* error_message) {
     Header header;
@@ -17,6 +44,7 @@ int _send_error_response(int socket, uint8_t command, uint8_t error_code, const
     header.payload_size = strlen_null_term(error_message);
     header.chunk_index = 0;
     header.status = error_code;
+    header.stream_id = _response_stream_id;
 
     Message message;
     int rvalue = create_message(&header, (const uint8_t*)error_message, &message);
@@ -24,11 +52,88 @@ int _send_error_response(int socket, uint8_t command, uint8_t error_code, const
         destroy_message(&message); // free memory in case of error (we aren't sure if any was allocated)
         return rvalue;
     }
-    send(socket, message.data, message.size, 0);
+    send_all(socket, message.data, message.size);
     destroy_message(&message);
+    socket_flush(socket);
     return error_code;
 }
 
+static Storage _server_storage;
+static int _server_storage_configured = 0;
+static pthread_once_t _server_storage_once = PTHREAD_ONCE_INIT;
+
+static void _init_server_storage(void) {
+    if (!_server_storage_configured) {
+        const char* paths[] = {SERVER_FILE_PATH};
+        storage_init(&_server_storage, paths, 1, IO_POOL_DEFAULT_THREADS);
+    }
+}
+
+int server_storage_init(const char* const* paths, size_t root_count, size_t io_threads) {
+    _server_storage_configured = 1;
+    int rvalue = storage_init(&_server_storage, paths, root_count, io_threads);
+    pthread_once(&_server_storage_once, _init_server_storage);
+    return rvalue;
+}
+
+Storage* server_storage(void) {
+    pthread_once(&_server_storage_once, _init_server_storage);
+    return &_server_storage;
+}
+
+StorageRoot* server_root(const char* file_name) {
+    return storage_root(server_storage(), file_name);
+}
+
+static Pack _server_pack = PACK_INIT;
+
+int server_pack_open(const char* path) {
+    return pack_open(&_server_pack, path);
+}
+
+const Pack* server_pack(void) {
+    return _server_pack.data != NULL ? &_server_pack : NULL;
+}
+
+void server_pack_close(void) {
+    pack_close(&_server_pack);
+}
+
+int server_catalog_open(const char* path, uint64_t scan_interval_ms) {
+    return storage_open_catalogs(server_storage(), path, scan_interval_ms);
+}
+
+void server_catalog_close(void) {
+    storage_close_catalogs(server_storage());
+}
+
+/**
+ * Looks up a requested file in the file cache of its root. If that fails, the error response for
+ * `command` is sent and its error code returned.
+ */
+static int _acquire_file(int socket, uint8_t command, const char* file_name, CachedFile** file) {
+    int rvalue = file_cache_acquire(&server_root(file_name)->cache, file_name, file);
+    if (rvalue != STATUS_OK) {
+        char error_message[500];
+        snprintf(error_message, sizeof(error_message), "Error opening file: %s", file_name);
+        return _send_error_response(socket, command, rvalue, error_message);
+    }
+    return STATUS_OK;
+}
+
+int _send_payload(int socket, uint8_t message_type, uint8_t command, uint32_t chunk_index, const uint8_t* payload, uint32_t payload_size) {
+    int is_response_chunk = message_type == MESSAGE_RESPONSE_CHUNK || message_type == MESSAGE_RESPONSE_LAST_CHUNK;
+    Header header = {message_type, command, payload_size, chunk_index, is_response_chunk ? STATUS_OK : NOT_SET, is_response_chunk ? _response_stream_id : 0};
+    Message message;
+    int rvalue = create_message(&header, payload, &message);
+    if (rvalue != STATUS_OK) {
+        return rvalue;
+    }
+    ssize_t bytes_sent = send_all(socket, message.data, message.size);
+    destroy_message(&message);
+    return bytes_sent == -1 ? ERROR_SEND_FAILED : STATUS_OK;
+}
+
 int _send_request(int socket, uint8_t command, const char* file_name) {
     uint32_t payload_size = strlen_null_term(file_name);
     Header header;
@@ -37,6 +142,7 @@ int _send_request(int socket, uint8_t command, const char* file_name) {
     header.payload_size = payload_size;
     header.chunk_index = 0;
     header.status = NOT_SET;
+    header.stream_id = 0;
 
     // convert string (filename) to raw bytes
     Message message;
@@ -47,14 +153,147 @@ int _send_request(int socket, uint8_t command, const char* file_name) {
     // send the message (byte array) to the server
     // Man page: "Upon successful completion, the number of bytes which were sent is returned. 
     // Otherwise, -1 is returned..."
-    ssize_t bytes_sent = send(socket, message.data, message.size, 0);
+    ssize_t bytes_sent = send_all(socket, message.data, message.size);
     destroy_message(&message); // free memory allocated in `create_message` before continuing/returning
     if (bytes_sent <= 0) {
         return ERROR_SEND_FAILED;
     }
+    socket_flush(socket);
     return STATUS_OK;
 }
 
+ssize_t receive_message(int socket, uint8_t* buffer, size_t buffer_size) {
+    if (buffer_size < HEADER_SIZE) {
+        return -1;
+    }
+    // read the fixed size header first so that we know how many payload bytes belong to this message
+    ssize_t bytes_received = receive_all(socket, buffer, HEADER_SIZE);
+    if (bytes_received <= 0) {
+        return bytes_received;
+    }
+    Header header;
+    if (extract_header(buffer, HEADER_SIZE, &header) != STATUS_OK || header.payload_size > buffer_size - HEADER_SIZE) {
+        return -1;
+    }
+    if (header.payload_size > 0 && receive_all(socket, buffer + HEADER_SIZE, header.payload_size) != header.payload_size) {
+        return -1;
+    }
+    return HEADER_SIZE + header.payload_size;
+}
+
+void format_etag(const struct stat* file_stat, char* etag, size_t etag_size) {
+    // changes whenever the file is replaced (inode), written (mtime with nanoseconds), or truncated (size)
+    snprintf(etag, etag_size, "\"%jx-%jx.%lx-%jx\"", (uintmax_t)file_stat->st_ino, (uintmax_t)file_stat->st_mtim.tv_sec,
+        file_stat->st_mtim.tv_nsec, (uintmax_t)file_stat->st_size);
+}
+
+/**
+ * Formats the metadata payload: the size of the file and its ETag, one per line.
+ */
+static void _format_metadata(const struct stat* file_stat, char* metadata, size_t metadata_size) {
+    char etag[ETAG_SIZE];
+    format_etag(file_stat, etag, sizeof(etag));
+    snprintf(metadata, metadata_size, "Size: %ld\nETag: %s", file_stat->st_size, etag);
+}
+
+/**
+ * A requested file, served from the server's pack or from the file cache of its storage root. All
+ * commands go through it, so they serve the same contents under the same ETag.
+ *
+ * packed: the contents in the mapping of the pack (NULL if the file is served from its root)
+ * file: the cache entry of the file (NULL if it is packed)
+ * root: the storage root of the file (NULL if it is packed)
+ * size: the size of the contents
+ * etag: the ETag of the contents
+ */
+typedef struct {
+    const uint8_t* packed;
+    CachedFile* file;
+    StorageRoot* root;
+    uint64_t size;
+    char etag[ETAG_SIZE];
+} _ServedFile;
+
+/**
+ * Looks up a requested file in the pack, if the server serves one, otherwise in the file cache of its
+ * root. If that fails, the error response for `command` is sent and its error code returned;
+ * otherwise the file is given back with `_close_served_file`.
+ */
+static int _open_served_file(int socket, uint8_t command, const char* file_name, _ServedFile* served) {
+    served->packed = NULL;
+    served->file = NULL;
+    served->root = NULL;
+    const Pack* pack = server_pack();
+    if (pack != NULL) {
+        PackEntry entry;
+        if (pack_find(pack, file_name, &entry) != STATUS_OK) {
+            return _send_error_response(socket, command, ERROR_FILE_NOT_FOUND, "File not found");
+        }
+        served->packed = pack->data + entry.offset;
+        served->size = entry.size;
+        pack_format_etag(&entry, served->etag, sizeof(served->etag));
+        return STATUS_OK;
+    }
+    int rvalue = _acquire_file(socket, command, file_name, &served->file);
+    if (rvalue != STATUS_OK) {
+        return rvalue;
+    }
+    // the ETag is taken from the open file, so it always describes the contents that are sent
+    served->root = server_root(file_name);
+    served->size = served->file->file_stat.st_size;
+    format_etag(&served->file->file_stat, served->etag, sizeof(served->etag));
+    return STATUS_OK;
+}
+
+static void _close_served_file(_ServedFile* served) {
+    if (served->file != NULL) {
+        file_cache_release(&served->root->cache, served->file);
+        served->file = NULL;
+    }
+}
+
+/**
+ * Formats the metadata payload of a served file (see `_format_metadata`).
+ */
+static void _format_served_metadata(const _ServedFile* served, char* metadata, size_t metadata_size) {
+    snprintf(metadata, metadata_size, "Size: %" PRIu64 "\nETag: %s", served->size, served->etag);
+}
+
+int parse_etag(const char* metadata, char* etag, size_t etag_size) {
+    const char* value = metadata != NULL ? strstr(metadata, "ETag: ") : NULL;
+    if (value == NULL) {
+        return -1;
+    }
+    value += strlen("ETag: ");
+    size_t length = strcspn(value, "\n");
+    if (length >= etag_size) {
+        return -1;
+    }
+    memcpy(etag, value, length);
+    etag[length] = '\0';
+    return 0;
+}
+
+const char* etag_version(const char* etag) {
+    // "inode-mtime-size" has two dashes, a pack ETag "hash-size" only one
+    const char* dash = strchr(etag, '-');
+    if (dash != NULL && strchr(dash + 1, '-') != NULL) {
+        return dash + 1;
+    }
+    return etag;
+}
+
+int parse_file_size(const char* metadata, uint64_t* file_size) {
+    const char* value = metadata != NULL ? strstr(metadata, "Size: ") : NULL;
+    // strtoull would accept (and negate) a sign
+    if (value == NULL || !isdigit((unsigned char)value[strlen("Size: ")])) {
+        return -1;
+    }
+    errno = 0;
+    *file_size = strtoull(value + strlen("Size: "), NULL, 10);
+    return errno == 0 ? 0 : -1;
+}
+
 int request_file_metadata(int socket, const char* file_name, Response* response) {
     int rvalue = _send_request(socket, COMMAND_REQUEST_METADATA, file_name);
     if (rvalue != STATUS_OK) {
@@ -62,7 +301,7 @@ int request_file_metadata(int socket, const char* file_name, Response* response)
     }
     // receive the data from the server
     uint8_t buffer[MAX_MESSAGE_SIZE];
-    ssize_t bytes_received = recv(socket, buffer, MAX_MESSAGE_SIZE, 0);
+    ssize_t bytes_received = receive_message(socket, buffer, MAX_MESSAGE_SIZE);
     if (bytes_received <= 0) {
         return ERROR_RECEIVE_FAILED;
     }
@@ -76,33 +315,31 @@ int request_file_metadata(int socket, const char* file_name, Response* response)
 }
 
 int send_file_metadata(int socket, const char* file_name) {
-    // the file name does not includfe the path, so we need to prepend the path
-    char full_path[256];
-    // Concatenate the full path with the file name
-    // From man page:
-    // The snprintf() function will write at most size-1 of the characters printed into
-    // the output string (the size'th character then gets the terminating ‘\0’)
-    // if the return value is greater than or equal to the size argument, the string was too short
-    // and some of the printed characters were discarded. 
-    int rvalue = snprintf(full_path, sizeof(full_path), "%s/%s", SERVER_FILE_PATH, file_name);
-    if (rvalue < 0 || rvalue >= sizeof(full_path)) {
-        char error_message[256];
-        snprintf(error_message, sizeof(error_message), "Error creating full path; status: %d", rvalue);
-        _send_error_response(socket, COMMAND_REQUEST_METADATA, ERROR_FILE_OPEN_FAILED, error_message);
-        return ERROR_FILE_OPEN_FAILED;
-    }
-    // man page: The stat utility displays information about the file pointed to by file.
-    struct stat file_stat;
-    if (stat(full_path, &file_stat) == -1) {
-        const char* error_message = "Error getting file stats";
-        _send_error_response(socket, COMMAND_REQUEST_METADATA, ERROR_FILE_NOT_FOUND, error_message);
-        return ERROR_FILE_NOT_FOUND;
-    }
-
     char metadata[256];
-    // let's just return the size of the file for now
-    snprintf(metadata, sizeof(metadata), "Size: %ld", file_stat.st_size);
-    Header header = {MESSAGE_RESPONSE, COMMAND_REQUEST_METADATA, strlen_null_term(metadata), 0, STATUS_OK};
+    int rvalue;
+    CatalogEntry cataloged;
+    if (server_pack() == NULL && server_root(file_name)->cataloged
+        && catalog_lookup(&server_root(file_name)->catalog, file_name, &cataloged) == STATUS_OK) {
+        // answered from the catalog without touching the file system; the ETag is the one a stat of
+        // the file gives, so it matches the ETags of the other commands
+        struct stat file_stat;
+        memset(&file_stat, 0, sizeof(file_stat));
+        file_stat.st_ino = cataloged.inode;
+        file_stat.st_mtim = cataloged.mtime;
+        file_stat.st_size = cataloged.size;
+        _format_metadata(&file_stat, metadata, sizeof(metadata));
+    } else {
+        // a file of a root is kept open by its cache, so that a following request for its contents
+        // doesn't open it again
+        _ServedFile served;
+        rvalue = _open_served_file(socket, COMMAND_REQUEST_METADATA, file_name, &served);
+        if (rvalue != STATUS_OK) {
+            return rvalue;
+        }
+        _format_served_metadata(&served, metadata, sizeof(metadata));
+        _close_served_file(&served);
+    }
+    Header header = {MESSAGE_RESPONSE, COMMAND_REQUEST_METADATA, strlen_null_term(metadata), 0, STATUS_OK, _response_stream_id};
     Message message;
     rvalue = create_message(&header, (const uint8_t*)metadata, &message);
     if (rvalue != STATUS_OK) {
@@ -112,16 +349,19 @@ int send_file_metadata(int socket, const char* file_name) {
         _send_error_response(socket, COMMAND_REQUEST_METADATA, rvalue, error_message);
         return rvalue;
     }
-    ssize_t bytes_sent = send(socket, message.data, message.size, 0);
+    ssize_t bytes_sent = send_all(socket, message.data, message.size);
     destroy_message(&message);
     if (bytes_sent <= 0) {
         const char* error_message = "Error sending message";
         _send_error_response(socket, COMMAND_REQUEST_METADATA, ERROR_SEND_FAILED, error_message);
         return ERROR_SEND_FAILED;
     }
+    socket_flush(socket);
     return STATUS_OK;
 }
 
+static int _receive_chunks(int socket, Response* response);
+
 int request_file_contents(int socket, const char* file_name, Response* response) {
     uint32_t payload_size = strlen_null_term(file_name);
     Header header;
@@ -130,6 +370,7 @@ int request_file_contents(int socket, const char* file_name, Response* response)
     header.payload_size = payload_size;
     header.chunk_index = 0;
     header.status = NOT_SET;
+    header.stream_id = 0;
 
     Message message;
     int rvalue = create_message(&header, (const uint8_t*)file_name, &message);
@@ -137,18 +378,29 @@ int request_file_contents(int socket, const char* file_name, Response* response)
         return rvalue;
     }
 
-    ssize_t bytes_sent = send(socket, message.data, message.size, 0);
+    ssize_t bytes_sent = send_all(socket, message.data, message.size);
     destroy_message(&message);
     if (bytes_sent <= 0) {
         return ERROR_SEND_FAILED;
     }
+    socket_flush(socket);
+    return _receive_chunks(socket, response);
+}
 
+/**
+ * Receives the RESPONSE_CHUNK messages of a file into `response` (or the error response that
+ * replaces them).
+ */
+static int _receive_chunks(int socket, Response* response) {
     uint8_t buffer[MAX_MESSAGE_SIZE];
     size_t total_bytes_received = 0;
-    
+    size_t capacity = 0;
+    int rvalue;
+
     response->payload = NULL;
+    response->pooled = 0;
     while (1) {
-        ssize_t bytes_received = recv(socket, buffer, MAX_MESSAGE_SIZE, 0);
+        ssize_t bytes_received = receive_message(socket, buffer, MAX_MESSAGE_SIZE);
         if (bytes_received <= 0) {
             rvalue = ERROR_RECEIVE_FAILED;
             goto error;
@@ -175,12 +427,21 @@ int request_file_contents(int socket, const char* file_name, Response* response)
             // original pointer passed in (in which case it doesn't matter), or it will be a new pointer,
             // in which case the old pointer is freed and invalid.
             // TLDR; we are using realloc to continually grow the payload buffer as we receive more data
-            uint8_t* new_payload = realloc(response->payload, total_bytes_received + temp_header.payload_size);
-            if (new_payload == NULL) {
-                rvalue = ERROR_MEMORY_ALLOCATION_FAILED;
-                goto error;
+            // The buffer grows by doubling its capacity rather than by one chunk at a time, so a file
+            // of n chunks takes O(log n) reallocations instead of n.
+            if (total_bytes_received + temp_header.payload_size > capacity) {
+                size_t new_capacity = capacity > 0 ? capacity * 2 : MAX_PAYLOAD_SIZE;
+                while (new_capacity < total_bytes_received + temp_header.payload_size) {
+                    new_capacity *= 2;
+                }
+                uint8_t* new_payload = realloc(response->payload, new_capacity);
+                if (new_payload == NULL) {
+                    rvalue = ERROR_MEMORY_ALLOCATION_FAILED;
+                    goto error;
+                }
+                response->payload = new_payload;
+                capacity = new_capacity;
             }
-            response->payload = new_payload;
             // from man page:
             //  void *memcpy(void *restrict dst, const void *restrict src, size_t n);
             // The memcpy() function copies n bytes from memory area src to memory area dst.
@@ -216,74 +477,939 @@ error:
     return rvalue;
 }
 
-int send_file_contents(int socket, const char* file_name) {
-    char full_path[256];
-    int rvalue = snprintf(full_path, sizeof(full_path), "%s/%s", SERVER_FILE_PATH, file_name);
-    if (rvalue < 0 || rvalue >= sizeof(full_path)) {
-        char error_message[256];
-        snprintf(error_message, sizeof(error_message), "Error creating full path; status: %d", rvalue);
-        _send_error_response(socket, COMMAND_REQUEST_FILE, ERROR_FILE_OPEN_FAILED, error_message);
-        return ERROR_FILE_OPEN_FAILED;
+/**
+ * State of the output file while `request_file_to_fd` writes chunks into it.
+ */
+typedef struct {
+    int fd;
+    int flags;
+    int pipe_fds[2];
+    off_t offset;
+    // start of the window that has been written but not yet dropped from the page cache
+    off_t drop_offset;
+    int use_splice;
+} _FileSink;
+
+/**
+ * Copies `size` bytes into the sink with `pwrite`; the bytes are read from `source` (the socket or the pipe).
+ */
+static int _copy_to_sink(_FileSink* sink, int source, size_t size) {
+    uint8_t buffer[MAX_PAYLOAD_SIZE];
+    while (size > 0) {
+        size_t length = size < sizeof(buffer) ? size : sizeof(buffer);
+        ssize_t bytes_read = read(source, buffer, length);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            return -1;
+        }
+        for (ssize_t written = 0; written < bytes_read;) {
+            ssize_t bytes_written = pwrite(sink->fd, buffer + written, bytes_read - written, sink->offset);
+            if (bytes_written == -1 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_written <= 0) {
+                return -1;
+            }
+            written += bytes_written;
+            sink->offset += bytes_written;
+        }
+        size -= bytes_read;
     }
-    // rb is for reading in binary mode which is appropriate for transferring raw bytes
-    FILE* file = fopen(full_path, "rb");
-    if (file == NULL) {
-        char error_message[500];
-        snprintf(error_message, sizeof(error_message), "Error opening file: %s", full_path);
-        return _send_error_response(socket, COMMAND_REQUEST_FILE, ERROR_FILE_NOT_FOUND, error_message);
+    return 0;
+}
+
+/**
+ * Moves `size` payload bytes from the socket into the sink: socket -> pipe -> file. The data is never
+ * copied into user space. Falls back to `_copy_to_sink` if either side doesn't support splice.
+ */
+static int _splice_to_sink(_FileSink* sink, int socket, size_t size) {
+    while (size > 0) {
+        if (!sink->use_splice) {
+            return _copy_to_sink(sink, socket, size);
+        }
+        ssize_t in_pipe = splice(socket, NULL, sink->pipe_fds[1], NULL, size, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in_pipe == -1 && errno == EINTR) {
+            continue;
+        }
+        if (in_pipe == -1 && errno == EINVAL) {
+            sink->use_splice = 0;
+            continue;
+        }
+        if (in_pipe <= 0) {
+            return -1;
+        }
+        size -= in_pipe;
+        while (in_pipe > 0) {
+            ssize_t bytes_written = splice(sink->pipe_fds[0], NULL, sink->fd, &sink->offset, in_pipe, SPLICE_F_MOVE);
+            if (bytes_written == -1 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_written == -1 && errno == EINVAL) {
+                // the output can't be spliced into; the bytes already in the pipe are copied out instead
+                sink->use_splice = 0;
+                if (_copy_to_sink(sink, sink->pipe_fds[0], in_pipe) == -1) {
+                    return -1;
+                }
+                break;
+            }
+            if (bytes_written <= 0) {
+                return -1;
+            }
+            in_pipe -= bytes_written;
+        }
     }
-     // Get the total file size so that we can calculate the number of chunks (and set LAST_CHUNK)
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    return 0;
+}
 
-    uint8_t buffer[MAX_PAYLOAD_SIZE];
-    // we need to do this instead of checking if bytes_read < MAX_PAYLOAD_SIZE because the last chunk might be exactly MAX_PAYLOAD_SIZE
-    uint32_t total_chunks = calculate_total_chunks(file_size);
-    for (uint32_t chunk_index = 0; chunk_index < total_chunks; chunk_index++) {
-        size_t bytes_read = fread(buffer, 1, MAX_PAYLOAD_SIZE, file);
+/**
+ * With SINK_DROP_BEHIND: once a full window has been written, start writing it back; the window
+ * before it has had time to be written, so wait for it and drop it from the page cache.
+ */
+static void _drop_behind(_FileSink* sink, int finished) {
+    if (!(sink->flags & SINK_DROP_BEHIND)) {
+        return;
+    }
+    if (finished) {
+        sync_file_range(sink->fd, sink->drop_offset, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(sink->fd, sink->drop_offset, 0, POSIX_FADV_DONTNEED);
+        return;
+    }
+    while (sink->offset - sink->drop_offset >= 2 * SINK_DROP_BEHIND_WINDOW) {
+        sync_file_range(sink->fd, sink->drop_offset + SINK_DROP_BEHIND_WINDOW, SINK_DROP_BEHIND_WINDOW, SYNC_FILE_RANGE_WRITE);
+        sync_file_range(sink->fd, sink->drop_offset, SINK_DROP_BEHIND_WINDOW, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(sink->fd, sink->drop_offset, SINK_DROP_BEHIND_WINDOW, POSIX_FADV_DONTNEED);
+        sink->drop_offset += SINK_DROP_BEHIND_WINDOW;
+    }
+}
+
+static void _close_sink(_FileSink* sink) {
+    if (sink->pipe_fds[0] != -1) {
+        close(sink->pipe_fds[0]);
+        close(sink->pipe_fds[1]);
+    }
+}
+
+/**
+ * With SINK_PREALLOCATE: requests the file size and allocates it. Preallocation is only a hint, so
+ * failures other than the request itself (e.g. a file system without fallocate) are ignored.
+ */
+static int _preallocate(_FileSink* sink, int socket, const char* file_name, Response* response) {
+    int rvalue = request_file_metadata(socket, file_name, response);
+    if (rvalue != STATUS_OK) {
+        return rvalue;
+    }
+    intmax_t file_size;
+    if (sscanf((const char*)response->payload, "Size: %jd", &file_size) == 1 && file_size > 0) {
+        fallocate(sink->fd, 0, 0, file_size);
+    }
+    destroy_response(response);
+    return STATUS_OK;
+}
+
+int request_file_to_fd(int socket, const char* file_name, int fd, int flags, Response* response) {
+    *response = (Response)RESPONSE_INIT;
+    _FileSink sink = {fd, flags, {-1, -1}, 0, 0, 1};
+    int rvalue;
+    if (flags & SINK_PREALLOCATE) {
+        rvalue = _preallocate(&sink, socket, file_name, response);
+        if (rvalue != STATUS_OK) {
+            return rvalue;
+        }
+    }
+    if (pipe2(sink.pipe_fds, O_CLOEXEC) == -1) {
+        sink.use_splice = 0;
+    }
+    rvalue = _send_request(socket, COMMAND_REQUEST_FILE, file_name);
+    if (rvalue != STATUS_OK) {
+        goto error;
+    }
+    uint8_t buffer[MAX_MESSAGE_SIZE];
+    while (1) {
+        // only the header is read into user space; the payload goes straight to the file
+        if (receive_all(socket, buffer, HEADER_SIZE) != HEADER_SIZE) {
+            rvalue = ERROR_RECEIVE_FAILED;
+            goto error;
+        }
         Header header;
-        header.message_type = (chunk_index == total_chunks - 1) ? MESSAGE_RESPONSE_LAST_CHUNK : MESSAGE_RESPONSE_CHUNK;
-        header.command = COMMAND_REQUEST_FILE;
-        header.payload_size = bytes_read;
-        header.chunk_index = chunk_index;
+        rvalue = extract_header(buffer, HEADER_SIZE, &header);
+        if (rvalue != STATUS_OK) {
+            goto error;
+        }
+        if (header.payload_size > MAX_PAYLOAD_SIZE) {
+            rvalue = ERROR_MAX_PAYLOAD_SIZE_EXCEEDED;
+            goto error;
+        }
+        if (header.message_type == MESSAGE_RESPONSE_CHUNK || header.message_type == MESSAGE_RESPONSE_LAST_CHUNK) {
+            if (_splice_to_sink(&sink, socket, header.payload_size) == -1) {
+                rvalue = ERROR_RECEIVE_FAILED;
+                goto error;
+            }
+            _drop_behind(&sink, 0);
+            if (header.message_type == MESSAGE_RESPONSE_LAST_CHUNK) {
+                response->header = header;
+                response->header.message_type = MESSAGE_RESPONSE;
+                response->header.payload_size = sink.offset;
+                break;
+            }
+        }
+        else if (header.message_type == MESSAGE_RESPONSE && header.status != STATUS_OK) {
+            // error responses are small; read the error message like any other message
+            if (header.payload_size > 0 && receive_all(socket, buffer + HEADER_SIZE, header.payload_size) != header.payload_size) {
+                rvalue = ERROR_RECEIVE_FAILED;
+                goto error;
+            }
+            rvalue = parse_message(buffer, HEADER_SIZE + header.payload_size, response);
+            if (rvalue == STATUS_OK) {
+                rvalue = response->header.status;
+            }
+            goto error;
+        }
+        else {
+            rvalue = ERROR_UNEXPECTED_MESSAGE_TYPE;
+            goto error;
+        }
+    }
+    // drop any preallocated space beyond the received contents (e.g. the file shrank after the metadata request)
+    if (ftruncate(fd, sink.offset) == -1) {
+        rvalue = ERROR_FILE_OPEN_FAILED;
+        goto error;
+    }
+    _drop_behind(&sink, 1);
+    _close_sink(&sink);
+    return STATUS_OK;
+
+error:
+    // don't leave part of the file (or the preallocated space) behind as if it were the file
+    if (ftruncate(fd, 0) == -1) {
+        perror("ftruncate");
+    }
+    _close_sink(&sink);
+    return rvalue;
+}
+
+/**
+ * Sends `length` bytes of file contents as MAX_PAYLOAD_SIZE chunks, starting at `*chunk_index`.
+ */
+static int _send_chunks(int socket, uint8_t command, const uint8_t* data, size_t length, uint32_t* chunk_index, uint32_t total_chunks) {
+    for (size_t offset = 0; offset < length; offset += MAX_PAYLOAD_SIZE) {
+        Header header;
+        header.message_type = (*chunk_index == total_chunks - 1) ? MESSAGE_RESPONSE_LAST_CHUNK : MESSAGE_RESPONSE_CHUNK;
+        header.command = command;
+        header.payload_size = length - offset < MAX_PAYLOAD_SIZE ? length - offset : MAX_PAYLOAD_SIZE;
+        header.chunk_index = *chunk_index;
         header.status = STATUS_OK;
+        header.stream_id = _response_stream_id;
 
         Message message;
-        rvalue = create_message(&header, buffer, &message);
+        int rvalue = create_message(&header, data + offset, &message);
         if (rvalue != STATUS_OK) {
             destroy_message(&message);
-            fclose(file);
             char error_message[256];
-            snprintf(error_message, sizeof(error_message), "Error creating message (chunk %d), status: %d", chunk_index, rvalue);
-            return _send_error_response(socket, COMMAND_REQUEST_FILE, rvalue, error_message);
+            snprintf(error_message, sizeof(error_message), "Error creating message (chunk %d), status: %d", *chunk_index, rvalue);
+            return _send_error_response(socket, command, rvalue, error_message);
         }
-        ssize_t bytes_sent = send(socket, message.data, message.size, 0);
+        ssize_t bytes_sent = send_all(socket, message.data, message.size);
         if (bytes_sent != message.size) {
-            fclose(file);
             destroy_message(&message);
             char error_message[256];
-            snprintf(error_message, sizeof(error_message), "Error sending chunk %d, bytes_sent: %ld", chunk_index, bytes_sent);
-            return _send_error_response(socket, COMMAND_REQUEST_FILE, ERROR_SEND_FAILED, error_message);
+            snprintf(error_message, sizeof(error_message), "Error sending chunk %d, bytes_sent: %ld", *chunk_index, bytes_sent);
+            return _send_error_response(socket, command, ERROR_SEND_FAILED, error_message);
         }
         destroy_message(&message);
+        (*chunk_index)++;
     }
-    fclose(file);
+    return STATUS_OK;
+}
+
+/**
+ * Queues the read of the part of the contents at `offset` (up to one read-ahead buffer) into
+ * `buffer`. The contents are the `size` bytes of the file at `start`.
+ */
+static void _submit_read(IoPool* pool, IoJob* job, int fd, uint8_t* buffer, off_t start, off_t offset, long size) {
+    job->fd = fd;
+    job->buffer = buffer;
+    job->offset = start + offset;
+    job->length = size - offset < READ_AHEAD_BUFFER_SIZE ? size - offset : READ_AHEAD_BUFFER_SIZE;
+    io_pool_submit(pool, job);
+}
+
+/**
+ * Sends `file_size` bytes of a file from `start` on, when they are more than one read-ahead buffer.
+ * The reads of up to READ_AHEAD_BUFFERS parts are queued on the root's reader threads ahead of the
+ * chunks being sent.
+ */
+static int _send_chunks_pipelined(int socket, uint8_t command, IoPool* pool, int fd, off_t start, long file_size, uint32_t total_chunks) {
+    IoJob jobs[READ_AHEAD_BUFFERS];
+    uint8_t* buffers[READ_AHEAD_BUFFERS] = {NULL};
+    int rvalue = STATUS_OK;
+    for (int i = 0; i < READ_AHEAD_BUFFERS; i++) {
+        buffers[i] = malloc(READ_AHEAD_BUFFER_SIZE);
+        if (buffers[i] == NULL) {
+            rvalue = ERROR_MEMORY_ALLOCATION_FAILED;
+        }
+    }
+    if (rvalue != STATUS_OK) {
+        // nothing has been sent yet: the client gets an error response instead of waiting for chunks
+        rvalue = _send_error_response(socket, command, ERROR_MEMORY_ALLOCATION_FAILED, "Error allocating buffer");
+        goto error;
+    }
+    // `submitted` and `consumed` count parts; part `i` is read by `jobs[i % READ_AHEAD_BUFFERS]`
+    size_t submitted = 0;
+    size_t consumed = 0;
+    off_t offset = 0;
+    for (; submitted < READ_AHEAD_BUFFERS && offset < file_size; submitted++) {
+        _submit_read(pool, &jobs[submitted], fd, buffers[submitted], start, offset, file_size);
+        offset += jobs[submitted].length;
+    }
+    uint32_t chunk_index = 0;
+    while (consumed < submitted && rvalue == STATUS_OK) {
+        IoJob* job = &jobs[consumed % READ_AHEAD_BUFFERS];
+        io_pool_wait(pool, job);
+        consumed++;
+        if (job->result == -1) {
+            const char* error_message = "Error reading file";
+            rvalue = _send_error_response(socket, command, ERROR_FILE_OPEN_FAILED, error_message);
+            break;
+        }
+        rvalue = _send_chunks(socket, command, job->buffer, job->length, &chunk_index, total_chunks);
+        if (rvalue == STATUS_OK && offset < file_size) {
+            // the buffer has been sent: reuse it for the next part
+            _submit_read(pool, job, fd, job->buffer, start, offset, file_size);
+            offset += job->length;
+            submitted++;
+        }
+    }
+    // the buffers can only be freed once the reads still queued (if sending failed) are done
+    for (; consumed < submitted; consumed++) {
+        io_pool_wait(pool, &jobs[consumed % READ_AHEAD_BUFFERS]);
+    }
+
+error:
+    for (int i = 0; i < READ_AHEAD_BUFFERS; i++) {
+        free(buffers[i]);
+    }
+    return rvalue;
+}
+
+static int _send_file_chunks(int socket, uint8_t command, IoPool* pool, int fd, off_t start, long file_size);
+
+/**
+ * Sends `length` bytes of a served file, from `offset` on, as RESPONSE_CHUNK messages. A packed file
+ * is copied straight out of the mapping.
+ */
+static int _send_served_file(int socket, uint8_t command, const _ServedFile* served, uint64_t offset, uint64_t length) {
+    if (served->packed == NULL) {
+        return _send_file_chunks(socket, command, &served->root->io_pool, served->file->fd, offset, length);
+    }
+    _sending();
+    uint32_t chunk_index = 0;
+    int rvalue = _send_chunks(socket, command, served->packed + offset, length, &chunk_index, calculate_total_chunks(length));
+    socket_flush(socket);
+    return rvalue;
+}
+
+int send_file_contents(int socket, const char* file_name) {
+    _ServedFile served;
+    int rvalue = _open_served_file(socket, COMMAND_REQUEST_FILE, file_name, &served);
+    if (rvalue != STATUS_OK) {
+        return rvalue;
+    }
+    // the size is needed to calculate the number of chunks (and set LAST_CHUNK)
+    rvalue = _send_served_file(socket, COMMAND_REQUEST_FILE, &served, 0, served.size);
+    _close_served_file(&served);
+    return rvalue;
+}
+
+/**
+ * Sends `file_size` bytes of an open file, from `start` on, as RESPONSE_CHUNK messages (see
+ * `send_file_contents`).
+ */
+static int _send_file_chunks(int socket, uint8_t command, IoPool* pool, int fd, off_t start, long file_size) {
+    _sending();
+    int rvalue;
+    // we need to do this instead of checking if bytes_read < MAX_PAYLOAD_SIZE because the last chunk might be exactly MAX_PAYLOAD_SIZE
+    uint32_t total_chunks = calculate_total_chunks(file_size);
+
+    if (file_size <= READ_AHEAD_BUFFER_SIZE) {
+        // small files are read in one go
+        // files that fit in one message are read into a message buffer, which costs no allocation
+        int pooled = file_size <= MAX_MESSAGE_SIZE;
+        uint8_t* buffer = pooled ? message_buffer_acquire() : malloc(file_size);
+        if (buffer == NULL) {
+            const char* error_message = "Error allocating buffer";
+            return _send_error_response(socket, command, ERROR_MEMORY_ALLOCATION_FAILED, error_message);
+        }
+        if (file_size > 0 && io_pool_read(pool, fd, buffer, file_size, start) == -1) {
+            rvalue = _send_error_response(socket, command, ERROR_FILE_OPEN_FAILED, "Error reading file");
+        } else {
+            uint32_t chunk_index = 0;
+            rvalue = _send_chunks(socket, command, buffer, file_size, &chunk_index, total_chunks);
+        }
+        if (pooled) {
+            message_buffer_release(buffer);
+        } else {
+            free(buffer);
+        }
+    } else {
+        // tell the kernel we read the whole file front to back: it doubles the read-ahead window and
+        // starts reading now, so the disk works on the next buffers while we send the current one
+        posix_fadvise(fd, start, file_size, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(fd, start, READ_AHEAD_BUFFERS * READ_AHEAD_BUFFER_SIZE, POSIX_FADV_WILLNEED);
+        rvalue = _send_chunks_pipelined(socket, command, pool, fd, start, file_size, total_chunks);
+    }
+    socket_flush(socket);
+    return rvalue;
+}
+
+int request_file_contents_if_none_match(int socket, const char* file_name, const char* etag, Response* response, char* current_etag) {
+    *response = (Response)RESPONSE_INIT;
+    current_etag[0] = '\0';
+    // payload: file name and ETag, both null terminated
+    uint8_t payload[MAX_PAYLOAD_SIZE];
+    size_t name_size = strlen_null_term(file_name);
+    size_t etag_size = strlen_null_term(etag != NULL ? etag : "");
+    if (name_size + etag_size > MAX_PAYLOAD_SIZE) {
+        return ERROR_MAX_PAYLOAD_SIZE_EXCEEDED;
+    }
+    memcpy(payload, file_name, name_size);
+    memcpy(payload + name_size, etag != NULL ? etag : "", etag_size);
+    int rvalue = _send_payload(socket, MESSAGE_REQUEST, COMMAND_REQUEST_FILE_IF_NONE_MATCH, 0, payload, name_size + etag_size);
+    if (rvalue != STATUS_OK) {
+        return rvalue;
+    }
+    socket_flush(socket);
+
+    // the first response is the metadata (STATUS_OK, followed by the chunks), STATUS_NOT_MODIFIED, or an error
+    uint8_t buffer[MAX_MESSAGE_SIZE];
+    ssize_t bytes_received = receive_message(socket, buffer, MAX_MESSAGE_SIZE);
+    if (bytes_received <= 0) {
+        return ERROR_RECEIVE_FAILED;
+    }
+    rvalue = parse_message(buffer, bytes_received, response);
+    if (rvalue != STATUS_OK) {
+        return rvalue;
+    }
+    if (response->header.message_type != MESSAGE_RESPONSE) {
+        destroy_response(response);
+        return ERROR_UNEXPECTED_MESSAGE_TYPE;
+    }
+    if (response->header.status != STATUS_OK) {
+        if (response->header.status == STATUS_NOT_MODIFIED) {
+            parse_etag((const char*)response->payload, current_etag, ETAG_SIZE);
+        }
+        return response->header.status;
+    }
+    parse_etag((const char*)response->payload, current_etag, ETAG_SIZE);
+    destroy_response(response);
+    return _receive_chunks(socket, response);
+}
+
+int send_file_contents_if_none_match(int socket, const Header* header, const uint8_t* payload) {
+    // payload: file name and ETag, both null terminated (an empty ETag matches nothing)
+    const char* file_name = (const char*)payload;
+    size_t name_size = payload != NULL ? strnlen(file_name, header->payload_size) + 1 : 0;
+    const char* etag = "";
+    if (name_size > 0 && name_size < header->payload_size && payload[header->payload_size - 1] == '\0') {
+        etag = (const char*)payload + name_size;
+    }
+    if (name_size == 0 || name_size > header->payload_size) {
+        return _send_error_response(socket, COMMAND_REQUEST_FILE_IF_NONE_MATCH, ERROR_INVALID_DATA_SIZE, "Invalid request");
+    }
+    _ServedFile served;
+    int rvalue = _open_served_file(socket, COMMAND_REQUEST_FILE_IF_NONE_MATCH, file_name, &served);
+    if (rvalue != STATUS_OK) {
+        return rvalue;
+    }
+    char metadata[256];
+    _format_served_metadata(&served, metadata, sizeof(metadata));
+    int not_modified = strcmp(etag, served.etag) == 0;
+    Header response_header = {MESSAGE_RESPONSE, COMMAND_REQUEST_FILE_IF_NONE_MATCH, strlen_null_term(metadata), 0, not_modified ? STATUS_NOT_MODIFIED : STATUS_OK, _response_stream_id};
+    Message message;
+    rvalue = create_message(&response_header, (const uint8_t*)metadata, &message);
+    if (rvalue == STATUS_OK) {
+        rvalue = send_all(socket, message.data, message.size) == -1 ? ERROR_SEND_FAILED : STATUS_OK;
+    }
+    destroy_message(&message);
+    if (rvalue == STATUS_OK && !not_modified) {
+        rvalue = _send_served_file(socket, COMMAND_REQUEST_FILE_IF_NONE_MATCH, &served, 0, served.size);
+    }
+    _close_served_file(&served);
+    socket_flush(socket);
+    return rvalue;
+}
+
+int request_file_range(int socket, const char* file_name, uint64_t offset, uint64_t length, Response* response) {
+    *response = (Response)RESPONSE_INIT;
+    // payload: file name (null terminated), offset and length
+    uint8_t payload[MAX_PAYLOAD_SIZE];
+    size_t name_size = strlen_null_term(file_name);
+    if (name_size + 2 * sizeof(uint64_t) > MAX_PAYLOAD_SIZE) {
+        return ERROR_MAX_PAYLOAD_SIZE_EXCEEDED;
+    }
+    memcpy(payload, file_name, name_size);
+    uint64_t network_offset = htobe64(offset);
+    uint64_t network_length = htobe64(length);
+    memcpy(payload + name_size, &network_offset, sizeof(network_offset));
+    memcpy(payload + name_size + sizeof(uint64_t), &network_length, sizeof(network_length));
+    int rvalue = _send_payload(socket, MESSAGE_REQUEST, COMMAND_REQUEST_RANGE, 0, payload, name_size + 2 * sizeof(uint64_t));
+    if (rvalue != STATUS_OK) {
+        return rvalue;
+    }
+    socket_flush(socket);
+    return _receive_chunks(socket, response);
+}
+
+int parse_range_request(const Header* header, const uint8_t* payload, uint64_t* offset, uint64_t* length) {
+    size_t name_size = payload != NULL ? strnlen((const char*)payload, header->payload_size) + 1 : 0;
+    if (name_size == 0 || name_size + 2 * sizeof(uint64_t) != header->payload_size) {
+        return -1;
+    }
+    memcpy(offset, payload + name_size, sizeof(uint64_t));
+    memcpy(length, payload + name_size + sizeof(uint64_t), sizeof(uint64_t));
+    *offset = be64toh(*offset);
+    *length = be64toh(*length);
+    return 0;
+}
+
+int send_file_range(int socket, const Header* header, const uint8_t* payload) {
+    const char* file_name = (const char*)payload;
+    uint64_t offset;
+    uint64_t length;
+    if (parse_range_request(header, payload, &offset, &length) != 0) {
+        return _send_error_response(socket, COMMAND_REQUEST_RANGE, ERROR_INVALID_DATA_SIZE, "Invalid range request");
+    }
+    _ServedFile served;
+    int rvalue = _open_served_file(socket, COMMAND_REQUEST_RANGE, file_name, &served);
+    if (rvalue != STATUS_OK) {
+        return rvalue;
+    }
+    if (length == 0 || offset >= served.size) {
+        rvalue = _send_error_response(socket, COMMAND_REQUEST_RANGE, ERROR_INVALID_DATA_SIZE, "Invalid range");
+    } else {
+        length = length < served.size - offset ? length : served.size - offset;
+        rvalue = _send_served_file(socket, COMMAND_REQUEST_RANGE, &served, offset, length);
+    }
+    _close_served_file(&served);
+    return rvalue;
+}
+
+int send_file_descriptor(int socket, const char* file_name) {
+    if (!is_unix_socket(socket)) {
+        const char* error_message = "File descriptors can only be passed over a unix domain socket";
+        return _send_error_response(socket, COMMAND_REQUEST_FILE_DESCRIPTOR, ERROR_UNSUPPORTED_TRANSPORT, error_message);
+    }
+    if (server_pack() != NULL) {
+        // a packed file has no descriptor of its own; the client fetches its contents instead
+        const char* error_message = "File descriptors can't be passed for files served from a pack";
+        return _send_error_response(socket, COMMAND_REQUEST_FILE_DESCRIPTOR, ERROR_UNSUPPORTED_TRANSPORT, error_message);
+    }
+    // O_RDONLY: the client gets a descriptor to the same open file description, so it must not be
+    // able to modify the file; the description (and its file offset) is the client's own, so the
+    // cached descriptors are not handed out
+    int fd;
+    int rvalue = file_cache_open(&server_root(file_name)->cache, file_name, O_RDONLY, &fd);
+    if (rvalue != STATUS_OK) {
+        char error_message[500];
+        snprintf(error_message, sizeof(error_message), "Error opening file: %s", file_name);
+        return _send_error_response(socket, COMMAND_REQUEST_FILE_DESCRIPTOR, rvalue, error_message);
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1) {
+        close(fd);
+        const char* error_message = "Error getting file stats";
+        return _send_error_response(socket, COMMAND_REQUEST_FILE_DESCRIPTOR, ERROR_FILE_NOT_FOUND, error_message);
+    }
+    char metadata[256];
+    _format_metadata(&file_stat, metadata, sizeof(metadata));
+    Header header = {MESSAGE_RESPONSE, COMMAND_REQUEST_FILE_DESCRIPTOR, strlen_null_term(metadata), 0, STATUS_OK, _response_stream_id};
+    Message message;
+    rvalue = create_message(&header, (const uint8_t*)metadata, &message);
+    if (rvalue != STATUS_OK) {
+        close(fd);
+        destroy_message(&message);
+        char error_message[256];
+        snprintf(error_message, sizeof(error_message), "Error creating message; status: %d", rvalue);
+        return _send_error_response(socket, COMMAND_REQUEST_FILE_DESCRIPTOR, rvalue, error_message);
+    }
+    ssize_t bytes_sent = send_all_with_fd(socket, message.data, message.size, fd);
+    destroy_message(&message);
+    // the kernel has duplicated the descriptor into the message, so our copy can be closed right away
+    close(fd);
+    if (bytes_sent <= 0) {
+        const char* error_message = "Error sending message";
+        return _send_error_response(socket, COMMAND_REQUEST_FILE_DESCRIPTOR, ERROR_SEND_FAILED, error_message);
+    }
+    return STATUS_OK;
+}
+
+int request_file_descriptor(int socket, const char* file_name, Response* response, int* fd) {
+    *fd = -1;
+    int rvalue = _send_request(socket, COMMAND_REQUEST_FILE_DESCRIPTOR, file_name);
+    if (rvalue != STATUS_OK) {
+        return rvalue;
+    }
+    // same as `receive_message` except that the header is read with recvmsg so that we pick up the
+    // descriptor that is attached to the first byte of the response
+    uint8_t buffer[MAX_MESSAGE_SIZE];
+    if (receive_all_with_fd(socket, buffer, HEADER_SIZE, fd) <= 0) {
+        return ERROR_RECEIVE_FAILED;
+    }
+    Header header;
+    rvalue = extract_header(buffer, HEADER_SIZE, &header);
+    if (rvalue != STATUS_OK || header.payload_size > MAX_PAYLOAD_SIZE) {
+        rvalue = rvalue != STATUS_OK ? rvalue : ERROR_MAX_PAYLOAD_SIZE_EXCEEDED;
+        goto error;
+    }
+    if (header.payload_size > 0 && receive_all(socket, buffer + HEADER_SIZE, header.payload_size) != header.payload_size) {
+        rvalue = ERROR_RECEIVE_FAILED;
+        goto error;
+    }
+    rvalue = parse_message(buffer, HEADER_SIZE + header.payload_size, response);
+    if (rvalue == STATUS_OK && response->header.status != STATUS_OK) {
+        rvalue = response->header.status;
+    }
+    if (rvalue == STATUS_OK && *fd == -1) {
+        rvalue = ERROR_RECEIVE_FAILED;
+    }
+    if (rvalue != STATUS_OK) {
+        goto error;
+    }
+    return STATUS_OK;
+
+error:
+    if (*fd != -1) {
+        close(*fd);
+        *fd = -1;
+    }
+    return rvalue;
+}
+
+int request_file_mapping(int socket, const char* file_name, MappedFile* mapped_file) {
+    *mapped_file = (MappedFile)MAPPED_FILE_INIT;
+    Response response = RESPONSE_INIT;
+    int rvalue = request_file_descriptor(socket, file_name, &response, &mapped_file->fd);
+    destroy_response(&response);
+    if (rvalue != STATUS_OK) {
+        return rvalue;
+    }
+    // use the size of the descriptor rather than the metadata in case the file changed in between
+    struct stat file_stat;
+    if (fstat(mapped_file->fd, &file_stat) == -1) {
+        destroy_mapped_file(mapped_file);
+        return ERROR_FILE_OPEN_FAILED;
+    }
+    mapped_file->size = file_stat.st_size;
+    // mmap fails with EINVAL for a length of 0, so empty files are left unmapped
+    if (mapped_file->size > 0) {
+        void* data = mmap(NULL, mapped_file->size, PROT_READ, MAP_SHARED, mapped_file->fd, 0);
+        if (data == MAP_FAILED) {
+            destroy_mapped_file(mapped_file);
+            return ERROR_FILE_OPEN_FAILED;
+        }
+        mapped_file->data = data;
+    }
+    return STATUS_OK;
+}
+
+void destroy_mapped_file(MappedFile* mapped_file) {
+    if (mapped_file != NULL) {
+        if (mapped_file->data != NULL) {
+            munmap(mapped_file->data, mapped_file->size);
+        }
+        if (mapped_file->fd != -1) {
+            close(mapped_file->fd);
+        }
+        *mapped_file = (MappedFile)MAPPED_FILE_INIT;
+    }
+}
+
+int request_file_delta(int socket, const char* file_name, const uint8_t* basis, size_t basis_size, Response* response, DeltaOutput* output) {
+    *response = (Response)RESPONSE_INIT;
+    *output = (DeltaOutput)DELTA_OUTPUT_INIT;
+    size_t block_size = delta_block_size(basis_size);
+    BlockSignature* signatures;
+    size_t signature_count;
+    int rvalue = delta_compute_signatures(basis, basis_size, block_size, &signatures, &signature_count);
+    if (rvalue != STATUS_OK) {
+        return rvalue;
+    }
+    // request: file name (null terminated) followed by the block size
+    uint8_t payload[MAX_PAYLOAD_SIZE];
+    size_t name_size = strlen_null_term(file_name);
+    if (name_size + sizeof(uint32_t) > MAX_PAYLOAD_SIZE) {
+        free(signatures);
+        return ERROR_MAX_PAYLOAD_SIZE_EXCEEDED;
+    }
+    memcpy(payload, file_name, name_size);
+    uint32_t network_block_size = htonl(block_size);
+    memcpy(payload + name_size, &network_block_size, sizeof(network_block_size));
+    rvalue = _send_payload(socket, MESSAGE_REQUEST, COMMAND_REQUEST_DELTA, 0, payload, name_size + sizeof(uint32_t));
+    // signatures: as many as fit in each message; the last message may be empty
+    size_t signatures_per_message = MAX_PAYLOAD_SIZE / DELTA_SIGNATURE_SIZE;
+    uint32_t chunk_index = 0;
+    for (size_t sent = 0; rvalue == STATUS_OK; chunk_index++) {
+        size_t count = signature_count - sent < signatures_per_message ? signature_count - sent : signatures_per_message;
+        int last = sent + count == signature_count;
+        delta_pack_signatures(signatures + sent, count, payload);
+        rvalue = _send_payload(socket, last ? MESSAGE_REQUEST_LAST_CHUNK : MESSAGE_REQUEST_CHUNK, COMMAND_REQUEST_DELTA, chunk_index, payload, count * DELTA_SIGNATURE_SIZE);
+        sent += count;
+        if (last) {
+            break;
+        }
+    }
+    free(signatures);
+    if (rvalue != STATUS_OK) {
+        return rvalue;
+    }
+    socket_flush(socket);
+
+    uint8_t buffer[MAX_MESSAGE_SIZE];
+    while (1) {
+        ssize_t bytes_received = receive_message(socket, buffer, MAX_MESSAGE_SIZE);
+        if (bytes_received <= 0) {
+            rvalue = ERROR_RECEIVE_FAILED;
+            goto error;
+        }
+        Header header;
+        rvalue = extract_header(buffer, bytes_received, &header);
+        if (rvalue != STATUS_OK) {
+            goto error;
+        }
+        if (header.message_type == MESSAGE_RESPONSE_CHUNK) {
+            rvalue = delta_apply(buffer + HEADER_SIZE, header.payload_size, basis, basis_size, block_size, output);
+            if (rvalue != STATUS_OK) {
+                goto error;
+            }
+        }
+        else if (header.message_type == MESSAGE_RESPONSE_LAST_CHUNK) {
+            // the last chunk carries the hash of the new version instead of instructions
+            if (header.payload_size != DELTA_FILE_HASH_SIZE) {
+                rvalue = ERROR_INVALID_DATA_SIZE;
+                goto error;
+            }
+            uint8_t hash[DELTA_FILE_HASH_SIZE];
+            delta_file_hash(output->data, output->size, hash);
+            if (memcmp(hash, buffer + HEADER_SIZE, DELTA_FILE_HASH_SIZE) != 0) {
+                rvalue = ERROR_CHECKSUM_MISMATCH;
+                goto error;
+            }
+            response->header = header;
+            response->header.message_type = MESSAGE_RESPONSE;
+            response->header.payload_size = output->size;
+            break;
+        }
+        else if (header.message_type == MESSAGE_RESPONSE && header.status != STATUS_OK) {
+            rvalue = parse_message(buffer, bytes_received, response);
+            if (rvalue == STATUS_OK) {
+                rvalue = response->header.status;
+            }
+            goto error;
+        }
+        else {
+            rvalue = ERROR_UNEXPECTED_MESSAGE_TYPE;
+            goto error;
+        }
+    }
+    return STATUS_OK;
+
+error:
+    destroy_delta_output(output);
+    return rvalue;
+}
+
+/**
+ * Receives the REQUEST_CHUNK messages with block signatures that follow a COMMAND_REQUEST_DELTA
+ * request. All of them are read (even if there are too many) so that the connection stays at a
+ * message boundary; returns ERROR_RECEIVE_FAILED only if that isn't possible.
+ */
+static int _receive_signatures(int socket, BlockSignature** signatures, size_t* count) {
+    *signatures = NULL;
+    *count = 0;
+    int rvalue = STATUS_OK;
+    uint8_t buffer[MAX_MESSAGE_SIZE];
+    while (1) {
+        ssize_t bytes_received = receive_message(socket, buffer, MAX_MESSAGE_SIZE);
+        if (bytes_received <= 0) {
+            free(*signatures);
+            *signatures = NULL;
+            return ERROR_RECEIVE_FAILED;
+        }
+        Header header;
+        if (extract_header(buffer, bytes_received, &header) != STATUS_OK
+            || (header.message_type != MESSAGE_REQUEST_CHUNK && header.message_type != MESSAGE_REQUEST_LAST_CHUNK)) {
+            free(*signatures);
+            *signatures = NULL;
+            return ERROR_UNEXPECTED_MESSAGE_TYPE;
+        }
+        size_t received = header.payload_size / DELTA_SIGNATURE_SIZE;
+        if (header.payload_size % DELTA_SIGNATURE_SIZE != 0 || *count + received > DELTA_MAX_SIGNATURES) {
+            rvalue = ERROR_INVALID_DATA_SIZE;
+        }
+        if (rvalue == STATUS_OK && received > 0) {
+            BlockSignature* new_signatures = realloc(*signatures, (*count + received) * sizeof(BlockSignature));
+            if (new_signatures == NULL) {
+                rvalue = ERROR_MEMORY_ALLOCATION_FAILED;
+            } else {
+                *signatures = new_signatures;
+                delta_unpack_signatures(buffer + HEADER_SIZE, received, *signatures + *count);
+                *count += received;
+            }
+        }
+        if (header.message_type == MESSAGE_REQUEST_LAST_CHUNK) {
+            break;
+        }
+    }
+    if (rvalue != STATUS_OK) {
+        free(*signatures);
+        *signatures = NULL;
+        *count = 0;
+    }
+    return rvalue;
+}
+
+typedef struct {
+    int socket;
+    uint32_t chunk_index;
+} _DeltaResponse;
+
+/**
+ * Sends a payload of delta instructions as a RESPONSE_CHUNK; the LAST_CHUNK is the hash of the file.
+ */
+static int _send_delta_payload(const uint8_t* payload, size_t length, int last, void* context) {
+    _DeltaResponse* delta_response = (_DeltaResponse*)context;
+    if (last && length == 0) {
+        return STATUS_OK;
+    }
+    return _send_payload(delta_response->socket, MESSAGE_RESPONSE_CHUNK, COMMAND_REQUEST_DELTA, delta_response->chunk_index++, payload, length);
+}
+
+int send_file_delta(int socket, const Header* header, const uint8_t* payload) {
+    BlockSignature* signatures;
+    size_t signature_count;
+    int rvalue = _receive_signatures(socket, &signatures, &signature_count);
+    if (rvalue == ERROR_RECEIVE_FAILED || rvalue == ERROR_UNEXPECTED_MESSAGE_TYPE) {
+        // the connection is not at a message boundary anymore; there's no point in responding
+        return rvalue;
+    }
+    if (rvalue != STATUS_OK) {
+        return _send_error_response(socket, COMMAND_REQUEST_DELTA, rvalue, "Error receiving block signatures");
+    }
+    // payload: file name (null terminated) followed by the block size
+    const char* file_name = (const char*)payload;
+    size_t name_size = payload != NULL ? strnlen(file_name, header->payload_size) + 1 : 0;
+    uint32_t block_size = 0;
+    if (name_size > 0 && name_size + sizeof(uint32_t) <= header->payload_size) {
+        memcpy(&block_size, payload + name_size, sizeof(block_size));
+        block_size = ntohl(block_size);
+    }
+    if (block_size < DELTA_MIN_BLOCK_SIZE || block_size > DELTA_MAX_BLOCK_SIZE) {
+        free(signatures);
+        return _send_error_response(socket, COMMAND_REQUEST_DELTA, ERROR_INVALID_DATA_SIZE, "Invalid delta request");
+    }
+
+    _ServedFile served;
+    rvalue = _open_served_file(socket, COMMAND_REQUEST_DELTA, file_name, &served);
+    if (rvalue != STATUS_OK) {
+        free(signatures);
+        return rvalue;
+    }
+    // the rolling checksum looks at every offset, so the whole file is needed. A packed file is used
+    // in place; a file of a root is read rather than mapped: a mapping of a file that is truncated
+    // meanwhile raises SIGBUS when accessed.
+    size_t size = served.size;
+    const uint8_t* data = served.packed;
+    uint8_t* buffer = NULL;
+    if (data == NULL) {
+        buffer = malloc(size > 0 ? size : 1);
+        if (buffer == NULL) {
+            _close_served_file(&served);
+            free(signatures);
+            return _send_error_response(socket, COMMAND_REQUEST_DELTA, ERROR_MEMORY_ALLOCATION_FAILED, "Error allocating buffer");
+        }
+        if (size > 0 && io_pool_read(&served.root->io_pool, served.file->fd, buffer, size, 0) != 0) {
+            _close_served_file(&served);
+            free(buffer);
+            free(signatures);
+            // e.g. the file was truncated since it was opened
+            return _send_error_response(socket, COMMAND_REQUEST_DELTA, ERROR_FILE_OPEN_FAILED, "Error reading file");
+        }
+        data = buffer;
+    }
+    _DeltaResponse delta_response = {socket, 0};
+    rvalue = delta_generate(data, size, signatures, signature_count, block_size, _send_delta_payload, &delta_response);
+    free(signatures);
+    if (rvalue == STATUS_OK) {
+        // the client checks the file it rebuilt against this hash before replacing its copy
+        uint8_t hash[DELTA_FILE_HASH_SIZE];
+        delta_file_hash(data, size, hash);
+        rvalue = _send_payload(socket, MESSAGE_RESPONSE_LAST_CHUNK, COMMAND_REQUEST_DELTA, delta_response.chunk_index, hash, sizeof(hash));
+    }
+    free(buffer);
+    _close_served_file(&served);
+    if (rvalue != STATUS_OK) {
+        char error_message[256];
+        snprintf(error_message, sizeof(error_message), "Error sending delta (chunk %u), status: %d", delta_response.chunk_index, rvalue);
+        return _send_error_response(socket, COMMAND_REQUEST_DELTA, rvalue, error_message);
+    }
+    socket_flush(socket);
     return STATUS_OK;
 }
 
 int handle_request(int socket, const Header* header, const uint8_t* payload) {
+    _response_stream_id = header->stream_id;
+    int rvalue;
     switch (header->command) {
         case COMMAND_REQUEST_METADATA:
-            return send_file_metadata(socket, (const char*)payload);
+            rvalue = send_file_metadata(socket, (const char*)payload);
+            break;
         case COMMAND_REQUEST_FILE:
-            return send_file_contents(socket, (const char*)payload);
+            rvalue = send_file_contents(socket, (const char*)payload);
+            break;
+        case COMMAND_REQUEST_FILE_DESCRIPTOR:
+            rvalue = send_file_descriptor(socket, (const char*)payload);
+            break;
+        case COMMAND_REQUEST_DELTA:
+            rvalue = send_file_delta(socket, header, payload);
+            break;
+        case COMMAND_REQUEST_FILE_IF_NONE_MATCH:
+            rvalue = send_file_contents_if_none_match(socket, header, payload);
+            break;
+        case COMMAND_REQUEST_RANGE:
+            rvalue = send_file_range(socket, header, payload);
+            break;
         default:
             char error_message[256];
             snprintf(error_message, sizeof(error_message), "Invalid command: %d", header->command);
-            return _send_error_response(socket, header->command, ERROR_INVALID_COMMAND, error_message);
+            rvalue = _send_error_response(socket, header->command, ERROR_INVALID_COMMAND, error_message);
+            break;
+    }
+    _response_stream_id = 0;
+    _on_sending = NULL;
+    return rvalue;
+}
+
+void handle_request_on_sending(void (*callback)(void*), void* context) {
+    _on_sending = callback;
+    _on_sending_context = context;
+}
+
+int reject_request(int socket, const Header* header, uint8_t error_code, const char* error_message) {
+    if (header->command == COMMAND_REQUEST_DELTA) {
+        // the block signatures follow the request; skip them so the connection stays at a message boundary
+        BlockSignature* signatures;
+        size_t signature_count;
+        int rvalue = _receive_signatures(socket, &signatures, &signature_count);
+        free(signatures);
+        if (rvalue == ERROR_RECEIVE_FAILED || rvalue == ERROR_UNEXPECTED_MESSAGE_TYPE) {
+            return rvalue;
+        }
     }
-    return ERROR_INVALID_COMMAND;
+    _response_stream_id = header->stream_id;
+    int rvalue = _send_error_response(socket, header->command, error_code, error_message);
+    _response_stream_id = 0;
+    return rvalue;
 }
 
 int calculate_total_chunks(long file_size) {
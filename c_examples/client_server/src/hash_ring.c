@@ -0,0 +1,79 @@
+#include "utils.h"
+#include "protocol.h"
+#include "hash_ring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * FNV-1a of a string, followed by a finalizer (from MurmurHash3): the names of virtual nodes differ
+ * only in their last characters, and FNV-1a alone would leave their points close together.
+ */
+static uint64_t _hash(const char* string) {
+    uint64_t hash = fnv1a_hash(FNV1A_OFFSET_BASIS, string, strlen(string));
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static int _compare_points(const void* a, const void* b) {
+    const HashRingPoint* point_a = (const HashRingPoint*)a;
+    const HashRingPoint* point_b = (const HashRingPoint*)b;
+    if (point_a->hash != point_b->hash) {
+        return point_a->hash < point_b->hash ? -1 : 1;
+    }
+    // equal hashes are (very) unlikely; order them by node so that the ring doesn't depend on qsort
+    return (point_a->node > point_b->node) - (point_a->node < point_b->node);
+}
+
+int hash_ring_init(HashRing* ring, const char* const* nodes, size_t node_count, size_t virtual_nodes) {
+    ring->points = NULL;
+    ring->point_count = 0;
+    ring->node_count = 0;
+    if (node_count == 0 || virtual_nodes == 0) {
+        return ERROR_INVALID_DATA_SIZE;
+    }
+    ring->points = malloc(node_count * virtual_nodes * sizeof(HashRingPoint));
+    if (ring->points == NULL) {
+        return ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    for (size_t node = 0; node < node_count; node++) {
+        for (size_t i = 0; i < virtual_nodes; i++) {
+            char name[512];
+            snprintf(name, sizeof(name), "%s#%zu", nodes[node], i);
+            ring->points[ring->point_count++] = (HashRingPoint){_hash(name), node};
+        }
+    }
+    qsort(ring->points, ring->point_count, sizeof(HashRingPoint), _compare_points);
+    ring->node_count = node_count;
+    return STATUS_OK;
+}
+
+void hash_ring_destroy(HashRing* ring) {
+    free(ring->points);
+    ring->points = NULL;
+    ring->point_count = 0;
+    ring->node_count = 0;
+}
+
+size_t hash_ring_lookup(const HashRing* ring, const char* key) {
+    if (ring->node_count == 1) {
+        return 0;
+    }
+    uint64_t hash = _hash(key);
+    // binary search for the first point at or after the hash
+    size_t low = 0;
+    size_t high = ring->point_count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (ring->points[middle].hash < hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return ring->points[low < ring->point_count ? low : 0].node;
+}
@@ -0,0 +1,315 @@
+#include "utils.h"
+#include "protocol.h"
+#include "file_transfer.h"
+#include "hedge.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+
+typedef int (*_RequestFunction)(int socket, const char* file_name, Response* response);
+
+struct _HedgedRequest;
+
+/**
+ * One copy of a request, sent to one replica by its own thread.
+ *
+ * socket: the connection while the request is in progress, otherwise -1
+ * latency_us: the time from the start of the hedged request until the answer (or failure)
+ */
+typedef struct {
+    struct _HedgedRequest* request;
+    const Endpoint* replica;
+    int started;
+    int socket;
+    int done;
+    int cancelled;
+    int rvalue;
+    Response response;
+    uint64_t latency_us;
+} _Attempt;
+
+/**
+ * A hedged request. It is shared by the caller and the threads of its attempts, and freed by the last
+ * of them: a cancelled attempt may finish after the caller has returned.
+ *
+ * mutex: protects the attempts, `winner` and `references`
+ * changed: signaled when an attempt is done
+ * winner: the index of the attempt whose answer is used, or -1
+ */
+typedef struct _HedgedRequest {
+    HedgedClient* client;
+    ConnectionPool* pool;
+    _RequestFunction function;
+    char* file_name;
+    uint64_t start_us;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    int references;
+    int winner;
+    _Attempt attempts[2];
+} _HedgedRequest;
+
+/**
+ * Whether the server answered the request (successfully or with an error like ERROR_FILE_NOT_FOUND),
+ * rather than the request failing on the way. A server that sheds load (ERROR_OVERLOADED) rejects the
+ * request quickly so that it is retried elsewhere: that is a failure, like a transport error.
+ */
+static int _answered(int rvalue) {
+    return rvalue != ERROR_OVERLOADED && connection_pool_is_reusable(rvalue);
+}
+
+static void _release(_HedgedRequest* request) {
+    pthread_mutex_lock(&request->mutex);
+    int references = --request->references;
+    pthread_mutex_unlock(&request->mutex);
+    if (references == 0) {
+        pthread_cond_destroy(&request->changed);
+        pthread_mutex_destroy(&request->mutex);
+        free(request->file_name);
+        free(request);
+    }
+}
+
+static void* _attempt_worker(void* arg) {
+    _Attempt* attempt = (_Attempt*)arg;
+    _HedgedRequest* request = attempt->request;
+    int socket = connection_pool_checkout(request->pool, attempt->replica->address, attempt->replica->port);
+    pthread_mutex_lock(&request->mutex);
+    int cancelled = attempt->cancelled;
+    attempt->socket = cancelled ? -1 : socket;
+    pthread_mutex_unlock(&request->mutex);
+
+    int rvalue = ERROR_SEND_FAILED;
+    Response response = RESPONSE_INIT;
+    if (socket != -1 && !cancelled) {
+        rvalue = request->function(socket, request->file_name, &response);
+    }
+
+    pthread_mutex_lock(&request->mutex);
+    attempt->socket = -1;
+    attempt->done = 1;
+    attempt->rvalue = rvalue;
+    attempt->latency_us = monotonic_time_us() - request->start_us;
+    // a connection shut down by the cancellation can't be reused, even if the answer made it through
+    int reusable = cancelled || (connection_pool_is_reusable(rvalue) && !attempt->cancelled);
+    int won = request->winner == -1 && _answered(rvalue);
+    if (won) {
+        request->winner = attempt - request->attempts;
+        attempt->response = response;
+    }
+    pthread_cond_broadcast(&request->changed);
+    pthread_mutex_unlock(&request->mutex);
+
+    if (!won) {
+        destroy_response(&response);
+    }
+    if (socket != -1) {
+        connection_pool_checkin(request->pool, attempt->replica->address, attempt->replica->port, socket, reusable);
+    }
+    HedgedClient* client = request->client;
+    _release(request);
+    pthread_mutex_lock(&client->mutex);
+    if (--client->running == 0) {
+        pthread_cond_broadcast(&client->finished);
+    }
+    pthread_mutex_unlock(&client->mutex);
+    return NULL;
+}
+
+/**
+ * Starts an attempt of the request on `replica`. Called with the request's mutex held (the client's
+ * mutex is taken after it, never the other way around).
+ */
+static void _start_attempt(_HedgedRequest* request, int index, const Endpoint* replica) {
+    _Attempt* attempt = &request->attempts[index];
+    attempt->request = request;
+    attempt->replica = replica;
+    attempt->started = 1;
+    attempt->socket = -1;
+    attempt->response = (Response)RESPONSE_INIT;
+    request->references++;
+    pthread_mutex_lock(&request->client->mutex);
+    request->client->running++;
+    pthread_mutex_unlock(&request->client->mutex);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, _attempt_worker, attempt) != 0) {
+        request->references--;
+        pthread_mutex_lock(&request->client->mutex);
+        request->client->running--;
+        pthread_mutex_unlock(&request->client->mutex);
+        attempt->done = 1;
+        attempt->rvalue = ERROR_MEMORY_ALLOCATION_FAILED;
+        return;
+    }
+    pthread_detach(thread);
+}
+
+static int _compare_latencies(const void* a, const void* b) {
+    uint64_t latency_a = *(const uint64_t*)a;
+    uint64_t latency_b = *(const uint64_t*)b;
+    return (latency_a > latency_b) - (latency_a < latency_b);
+}
+
+/**
+ * Returns the hedge delay. Called with the client's mutex held.
+ */
+static uint64_t _delay_us(HedgedClient* client) {
+    if (client->latency_count < HEDGE_MIN_SAMPLES) {
+        return client->initial_delay_us;
+    }
+    size_t count = client->latency_count < HEDGE_LATENCY_WINDOW ? client->latency_count : HEDGE_LATENCY_WINDOW;
+    uint64_t latencies[HEDGE_LATENCY_WINDOW];
+    memcpy(latencies, client->latencies_us, count * sizeof(uint64_t));
+    qsort(latencies, count, sizeof(uint64_t), _compare_latencies);
+    // the smallest latency that at least `percentile`% of the latencies don't exceed
+    size_t index = (count * client->percentile + 99) / 100;
+    return latencies[index > 0 ? index - 1 : 0];
+}
+
+/**
+ * Returns the time `delay_us` from `start_us`, as a deadline for `pthread_cond_timedwait` (on CLOCK_MONOTONIC).
+ */
+static struct timespec _deadline(uint64_t start_us, uint64_t delay_us) {
+    uint64_t deadline_us = start_us + delay_us;
+    return (struct timespec){(time_t)(deadline_us / 1000000), (long)(deadline_us % 1000000) * 1000};
+}
+
+static int _hedged_request(HedgedClient* client, _RequestFunction function, const char* file_name, Response* response) {
+    *response = (Response)RESPONSE_INIT;
+    _HedgedRequest* request = calloc(1, sizeof(_HedgedRequest));
+    char* name = strdup(file_name);
+    if (request == NULL || name == NULL) {
+        free(request);
+        free(name);
+        return ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    request->client = client;
+    request->pool = client->pool;
+    request->function = function;
+    request->file_name = name;
+    request->references = 1;
+    request->winner = -1;
+    pthread_mutex_init(&request->mutex, NULL);
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&request->changed, &attributes);
+    pthread_condattr_destroy(&attributes);
+
+    pthread_mutex_lock(&client->mutex);
+    size_t primary = client->next_replica;
+    client->next_replica = (client->next_replica + 1) % client->replica_count;
+    uint64_t delay_us = _delay_us(client);
+    pthread_mutex_unlock(&client->mutex);
+
+    pthread_mutex_lock(&request->mutex);
+    request->start_us = monotonic_time_us();
+    _start_attempt(request, 0, &client->replicas[primary]);
+    struct timespec deadline = _deadline(request->start_us, delay_us);
+    // a primary that fails or is overloaded (rather than answers) is hedged at once
+    while (request->winner == -1 && !request->attempts[0].done) {
+        if (pthread_cond_timedwait(&request->changed, &request->mutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    int hedged = request->winner == -1 && client->replica_count > 1;
+    if (hedged) {
+        _start_attempt(request, 1, &client->replicas[(primary + 1) % client->replica_count]);
+    }
+    while (request->winner == -1 && !(request->attempts[0].done && (!hedged || request->attempts[1].done))) {
+        pthread_cond_wait(&request->changed, &request->mutex);
+    }
+    int rvalue;
+    if (request->winner != -1) {
+        _Attempt* winner = &request->attempts[request->winner];
+        *response = winner->response;
+        winner->response = (Response)RESPONSE_INIT;
+        rvalue = winner->rvalue;
+    } else {
+        rvalue = request->attempts[hedged ? 1 : 0].rvalue;
+    }
+    // cancel the slower request: shutting down its connection ends its blocking receive
+    for (int i = 0; i < 2; i++) {
+        _Attempt* attempt = &request->attempts[i];
+        if (attempt->started && !attempt->done) {
+            attempt->cancelled = 1;
+            if (attempt->socket != -1) {
+                shutdown(attempt->socket, SHUT_RDWR);
+            }
+        }
+    }
+    // the latency of the primary; if it was cancelled, it would have taken at least this long. A failure
+    // or a rejection says nothing about how long an answer takes (a fast rejection would pull the delay
+    // down), so it isn't measured.
+    _Attempt* first = &request->attempts[0];
+    int measured = !first->done || _answered(first->rvalue);
+    uint64_t latency_us = first->done ? first->latency_us : monotonic_time_us() - request->start_us;
+    int hedge_won = request->winner == 1;
+    int failed = request->winner == -1;
+    pthread_mutex_unlock(&request->mutex);
+    _release(request);
+
+    pthread_mutex_lock(&client->mutex);
+    if (measured) {
+        client->latencies_us[client->latency_count % HEDGE_LATENCY_WINDOW] = latency_us;
+        client->latency_count++;
+    }
+    client->stats.requests++;
+    client->stats.hedged += hedged;
+    client->stats.hedge_wins += hedge_won;
+    client->stats.failed += failed;
+    pthread_mutex_unlock(&client->mutex);
+    return rvalue;
+}
+
+int hedged_client_init(HedgedClient* client, ConnectionPool* pool, const Endpoint* replicas, size_t replica_count, unsigned int percentile, uint64_t initial_delay_us) {
+    if (replica_count == 0 || percentile < 1 || percentile > 100) {
+        return ERROR_INVALID_DATA_SIZE;
+    }
+    client->pool = pool;
+    client->replicas = replicas;
+    client->replica_count = replica_count;
+    client->percentile = percentile;
+    client->initial_delay_us = initial_delay_us;
+    pthread_mutex_init(&client->mutex, NULL);
+    pthread_cond_init(&client->finished, NULL);
+    client->running = 0;
+    client->latency_count = 0;
+    client->next_replica = 0;
+    client->stats = (HedgeStats){0};
+    return STATUS_OK;
+}
+
+void hedged_client_destroy(HedgedClient* client) {
+    pthread_mutex_lock(&client->mutex);
+    while (client->running > 0) {
+        pthread_cond_wait(&client->finished, &client->mutex);
+    }
+    pthread_mutex_unlock(&client->mutex);
+    pthread_cond_destroy(&client->finished);
+    pthread_mutex_destroy(&client->mutex);
+}
+
+uint64_t hedged_client_delay_us(HedgedClient* client) {
+    pthread_mutex_lock(&client->mutex);
+    uint64_t delay_us = _delay_us(client);
+    pthread_mutex_unlock(&client->mutex);
+    return delay_us;
+}
+
+void hedged_client_stats(HedgedClient* client, HedgeStats* stats) {
+    pthread_mutex_lock(&client->mutex);
+    *stats = client->stats;
+    pthread_mutex_unlock(&client->mutex);
+}
+
+int hedged_request_file_metadata(HedgedClient* client, const char* file_name, Response* response) {
+    return _hedged_request(client, request_file_metadata, file_name, response);
+}
+
+int hedged_request_file_contents(HedgedClient* client, const char* file_name, Response* response) {
+    return _hedged_request(client, request_file_contents, file_name, response);
+}
@@ -0,0 +1,183 @@
+#include "io_pool.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+
+/**
+ * Reads `length` bytes at `offset`; returns -1 if the read fails or the file is shorter than expected.
+ */
+static int _read_exactly(int fd, uint8_t* buffer, size_t length, off_t offset) {
+    size_t total = 0;
+    while (total < length) {
+        ssize_t bytes_read = pread(fd, buffer + total, length - total, offset + total);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            return -1;
+        }
+        total += bytes_read;
+    }
+    return 0;
+}
+
+static void* _io_worker(void* arg) {
+    IoPool* pool = (IoPool*)arg;
+    pthread_mutex_lock(&pool->mutex);
+    while (1) {
+        while (pool->head == NULL && !pool->stopping) {
+            pthread_cond_wait(&pool->submitted, &pool->mutex);
+        }
+        IoJob* job = pool->head;
+        if (job == NULL) {
+            break;
+        }
+        pool->head = job->next;
+        if (pool->head == NULL) {
+            pool->tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+        int result = _read_exactly(job->fd, job->buffer, job->length, job->offset);
+
+        pthread_mutex_lock(&pool->mutex);
+        job->result = result;
+        job->done = 1;
+        // delivered before the pool's mutex is released: once `io_pool_wait` returns, the pool no
+        // longer touches the job or its queue
+        IoCompletionQueue* completions = job->completions;
+        if (completions != NULL) {
+            pthread_mutex_lock(&completions->mutex);
+            job->next = NULL;
+            if (completions->tail != NULL) {
+                completions->tail->next = job;
+            } else {
+                completions->head = job;
+            }
+            completions->tail = job;
+            eventfd_write(completions->event_fd, 1);
+            pthread_mutex_unlock(&completions->mutex);
+        }
+        if (job->waiter != NULL) {
+            pthread_cond_signal(job->waiter);
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+int io_pool_init(IoPool* pool, size_t thread_count) {
+    if (thread_count == 0) {
+        return -1;
+    }
+    pool->threads = malloc(thread_count * sizeof(pthread_t));
+    if (pool->threads == NULL) {
+        return -1;
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->submitted, NULL);
+    pool->head = NULL;
+    pool->tail = NULL;
+    pool->stopping = 0;
+    pool->thread_count = 0;
+    for (size_t i = 0; i < thread_count; i++) {
+        if (pthread_create(&pool->threads[i], NULL, _io_worker, pool) != 0) {
+            io_pool_destroy(pool);
+            return -1;
+        }
+        pool->thread_count++;
+    }
+    return 0;
+}
+
+void io_pool_destroy(IoPool* pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->submitted);
+    pthread_mutex_unlock(&pool->mutex);
+    for (size_t i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    free(pool->threads);
+    pool->threads = NULL;
+    pool->thread_count = 0;
+    pthread_cond_destroy(&pool->submitted);
+    pthread_mutex_destroy(&pool->mutex);
+}
+
+void io_pool_submit(IoPool* pool, IoJob* job) {
+    io_pool_submit_async(pool, job, NULL);
+}
+
+void io_pool_submit_async(IoPool* pool, IoJob* job, IoCompletionQueue* completions) {
+    job->result = -1;
+    job->done = 0;
+    job->waiter = NULL;
+    job->completions = completions;
+    job->next = NULL;
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->tail != NULL) {
+        pool->tail->next = job;
+    } else {
+        pool->head = job;
+    }
+    pool->tail = job;
+    pthread_cond_signal(&pool->submitted);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void io_pool_wait(IoPool* pool, IoJob* job) {
+    pthread_mutex_lock(&pool->mutex);
+    if (!job->done) {
+        // the worker signals it with the pool's mutex held, so it can be destroyed once the job is done
+        pthread_cond_t done;
+        pthread_cond_init(&done, NULL);
+        job->waiter = &done;
+        while (!job->done) {
+            pthread_cond_wait(&done, &pool->mutex);
+        }
+        job->waiter = NULL;
+        pthread_cond_destroy(&done);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+int io_pool_read(IoPool* pool, int fd, uint8_t* buffer, size_t length, off_t offset) {
+    IoJob job = {.fd = fd, .buffer = buffer, .length = length, .offset = offset};
+    io_pool_submit(pool, &job);
+    io_pool_wait(pool, &job);
+    return job.result;
+}
+
+int io_completion_queue_init(IoCompletionQueue* completions) {
+    completions->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (completions->event_fd == -1) {
+        return -1;
+    }
+    pthread_mutex_init(&completions->mutex, NULL);
+    completions->head = NULL;
+    completions->tail = NULL;
+    return 0;
+}
+
+void io_completion_queue_destroy(IoCompletionQueue* completions) {
+    close(completions->event_fd);
+    completions->event_fd = -1;
+    pthread_mutex_destroy(&completions->mutex);
+}
+
+IoJob* io_completion_queue_pop(IoCompletionQueue* completions) {
+    pthread_mutex_lock(&completions->mutex);
+    IoJob* job = completions->head;
+    if (job != NULL) {
+        completions->head = job->next;
+        if (completions->head == NULL) {
+            completions->tail = NULL;
+            // the queue is empty: reset the eventfd so that it is no longer readable
+            eventfd_t count;
+            eventfd_read(completions->event_fd, &count);
+        }
+    }
+    pthread_mutex_unlock(&completions->mutex);
+    return job;
+}
@@ -0,0 +1,382 @@
+#include "utils.h"
+#include "protocol.h"
+#include "sockets.h"
+#include "file_transfer.h"
+#include "multiplex.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <endian.h>
+#include <poll.h>
+#include <sys/stat.h>
+
+/**
+ * Sends one message on a stream.
+ */
+static int _send_on_stream(int socket, uint32_t stream_id, uint8_t message_type, uint8_t command, uint8_t status, uint32_t chunk_index, const uint8_t* payload, uint32_t payload_size) {
+    Header header = {message_type, command, payload_size, chunk_index, status, stream_id};
+    Message message;
+    int rvalue = create_message(&header, payload, &message);
+    if (rvalue != STATUS_OK) {
+        return rvalue;
+    }
+    ssize_t bytes_sent = send_all(socket, message.data, message.size);
+    destroy_message(&message);
+    return bytes_sent == -1 ? ERROR_SEND_FAILED : STATUS_OK;
+}
+
+/**
+ * Sends an error response on a stream and returns `error_code`.
+ */
+static int _send_stream_error(int socket, uint32_t stream_id, uint8_t command, uint8_t error_code, const char* error_message) {
+    int rvalue = _send_on_stream(socket, stream_id, MESSAGE_RESPONSE, command, error_code, 0, (const uint8_t*)error_message, strlen_null_term(error_message));
+    socket_flush(socket);
+    return rvalue == STATUS_OK ? error_code : rvalue;
+}
+
+/**
+ * Queues the read of the part of the file that starts at the stream's next chunk.
+ */
+static void _submit_read(StreamMultiplexer* multiplexer, FileStream* stream) {
+    long position = (long)stream->chunk_index * MAX_PAYLOAD_SIZE;
+    stream->read.fd = stream->fd;
+    stream->read.buffer = stream->buffer;
+    stream->read.offset = stream->offset + position;
+    stream->read.length = stream->file_size - position < STREAM_READ_SIZE ? stream->file_size - position : STREAM_READ_SIZE;
+    stream->reading = 1;
+    io_pool_submit_async(stream->io_pool, &stream->read, &multiplexer->completions);
+}
+
+/**
+ * Whether the stream's next chunk (or its error response) can be sent.
+ */
+static int _chunk_ready(const FileStream* stream) {
+    return !stream->reading && (stream->failed || stream->buffer_position < stream->buffered || stream->file_size == 0);
+}
+
+int multiplexer_handle_request(StreamMultiplexer* multiplexer, int socket, const Header* header, const uint8_t* payload) {
+    if (header->command != COMMAND_REQUEST_FILE) {
+        // everything else is answered in one go, ahead of the chunks of the active transfers
+        return handle_request(socket, header, payload);
+    }
+    if (payload == NULL || strnlen((const char*)payload, header->payload_size) == header->payload_size) {
+        return _send_stream_error(socket, header->stream_id, header->command, ERROR_INVALID_DATA_SIZE, "Invalid file name");
+    }
+    if (multiplexer->stream_count >= MAX_CONCURRENT_STREAMS) {
+        return _send_stream_error(socket, header->stream_id, header->command, ERROR_TOO_MANY_STREAMS, "Too many concurrent streams");
+    }
+    FileStream** tail = &multiplexer->streams;
+    for (; *tail != NULL; tail = &(*tail)->next) {
+        if ((*tail)->stream_id == header->stream_id) {
+            return _send_stream_error(socket, header->stream_id, header->command, ERROR_INVALID_STREAM, "Stream already in use");
+        }
+    }
+
+    // a packed file is read from the pack's descriptor, at its offset in the pack
+    CachedFile* file = NULL;
+    int fd;
+    off_t offset = 0;
+    long file_size;
+    const Pack* pack = server_pack();
+    PackEntry entry;
+    if (pack != NULL) {
+        if (pack_find(pack, (const char*)payload, &entry) != STATUS_OK) {
+            return _send_stream_error(socket, header->stream_id, header->command, ERROR_FILE_NOT_FOUND, "File not found");
+        }
+        fd = pack->fd;
+        offset = entry.offset;
+        file_size = entry.size;
+    } else {
+        int rvalue = file_cache_acquire(&server_root((const char*)payload)->cache, (const char*)payload, &file);
+        if (rvalue != STATUS_OK) {
+            char error_message[500];
+            snprintf(error_message, sizeof(error_message), "Error opening file: %s", (const char*)payload);
+            return _send_stream_error(socket, header->stream_id, header->command, rvalue, error_message);
+        }
+        fd = file->fd;
+        file_size = file->file_stat.st_size;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    if (!multiplexer->completions_open) {
+        multiplexer->completions_open = io_completion_queue_init(&multiplexer->completions) == 0;
+    }
+    FileStream* stream = multiplexer->completions_open ? calloc(1, sizeof(FileStream)) : NULL;
+    uint8_t* buffer = stream != NULL && file_size > 0 ? malloc(STREAM_READ_SIZE) : NULL;
+    if (stream == NULL || (file_size > 0 && buffer == NULL)) {
+        free(stream);
+        if (file != NULL) {
+            file_cache_release(&server_root(file->name)->cache, file);
+        }
+        return _send_stream_error(socket, header->stream_id, header->command, ERROR_MEMORY_ALLOCATION_FAILED, "Error allocating stream");
+    }
+    uint64_t network_file_size = htobe64((uint64_t)file_size);
+    if (_send_on_stream(socket, header->stream_id, MESSAGE_RESPONSE_SIZE, header->command, STATUS_OK, 0, (const uint8_t*)&network_file_size, sizeof(network_file_size)) != STATUS_OK) {
+        free(buffer);
+        free(stream);
+        if (file != NULL) {
+            file_cache_release(&server_root(file->name)->cache, file);
+        }
+        return ERROR_SEND_FAILED;
+    }
+    stream->stream_id = header->stream_id;
+    stream->file = file;
+    stream->fd = fd;
+    stream->offset = offset;
+    stream->file_size = file_size;
+    stream->chunk_index = 0;
+    // an empty file is sent as a single empty last chunk so that the client sees the stream finish
+    uint32_t total_chunks = calculate_total_chunks(file_size);
+    stream->total_chunks = total_chunks > 0 ? total_chunks : 1;
+    stream->io_pool = &server_root((const char*)payload)->io_pool;
+    stream->buffer = buffer;
+    if (file_size > 0) {
+        _submit_read(multiplexer, stream);
+    }
+    stream->next = NULL;
+    // new transfers go to the end of the round
+    *tail = stream;
+    multiplexer->stream_count++;
+    return STATUS_OK;
+}
+
+/**
+ * Sends the next chunk of a transfer (its chunk must be ready) and queues the read of the next part
+ * once the buffer has been sent. Sets `*finished` when the transfer is done (or failed and an error
+ * response was sent instead).
+ */
+static int _send_next_chunk(StreamMultiplexer* multiplexer, FileStream* stream, int socket, int* finished) {
+    if (stream->failed) {
+        // the file was truncated or can't be read anymore
+        *finished = 1;
+        int rvalue = _send_stream_error(socket, stream->stream_id, COMMAND_REQUEST_FILE, ERROR_FILE_OPEN_FAILED, "Error reading file");
+        return rvalue == ERROR_SEND_FAILED ? rvalue : STATUS_OK;
+    }
+    size_t length = stream->buffered - stream->buffer_position < MAX_PAYLOAD_SIZE ? stream->buffered - stream->buffer_position : MAX_PAYLOAD_SIZE;
+    *finished = stream->chunk_index == stream->total_chunks - 1;
+    uint8_t message_type = *finished ? MESSAGE_RESPONSE_LAST_CHUNK : MESSAGE_RESPONSE_CHUNK;
+    int rvalue = _send_on_stream(socket, stream->stream_id, message_type, COMMAND_REQUEST_FILE, STATUS_OK, stream->chunk_index, stream->buffer + stream->buffer_position, length);
+    stream->chunk_index++;
+    stream->buffer_position += length;
+    if (rvalue == STATUS_OK && !*finished && stream->buffer_position == stream->buffered) {
+        _submit_read(multiplexer, stream);
+    }
+    return rvalue;
+}
+
+/**
+ * Hands the finished reads to their streams.
+ */
+static void _collect_reads(StreamMultiplexer* multiplexer) {
+    if (!multiplexer->completions_open) {
+        return;
+    }
+    IoJob* job;
+    while ((job = io_completion_queue_pop(&multiplexer->completions)) != NULL) {
+        for (FileStream* stream = multiplexer->streams; stream != NULL; stream = stream->next) {
+            if (&stream->read == job) {
+                stream->reading = 0;
+                stream->failed = job->result == -1;
+                stream->buffered = job->length;
+                stream->buffer_position = 0;
+                break;
+            }
+        }
+    }
+}
+
+static void _close_stream(FileStream* stream) {
+    if (stream->reading) {
+        io_pool_wait(stream->io_pool, &stream->read);
+    }
+    free(stream->buffer);
+    if (stream->file != NULL) {
+        file_cache_release(&server_root(stream->file->name)->cache, stream->file);
+    }
+    free(stream);
+}
+
+int multiplexer_request_waiting(StreamMultiplexer* multiplexer, int socket) {
+    _collect_reads(multiplexer);
+    int timeout = -1;
+    for (FileStream* stream = multiplexer->streams; stream != NULL; stream = stream->next) {
+        if (_chunk_ready(stream)) {
+            timeout = 0;
+            break;
+        }
+    }
+    struct pollfd poll_fds[2] = {{socket, POLLIN, 0}, {multiplexer->completions.event_fd, POLLIN, 0}};
+    int poll_count = multiplexer->completions_open ? 2 : 1;
+    while (poll(poll_fds, poll_count, timeout) == -1) {
+        if (errno != EINTR) {
+            // let the caller find out what is wrong with the socket
+            return 1;
+        }
+    }
+    return poll_fds[0].revents != 0;
+}
+
+int multiplexer_send_round(StreamMultiplexer* multiplexer, int socket) {
+    _collect_reads(multiplexer);
+    int rvalue = STATUS_OK;
+    FileStream** link = &multiplexer->streams;
+    while (*link != NULL && rvalue == STATUS_OK) {
+        FileStream* stream = *link;
+        if (!_chunk_ready(stream)) {
+            // still being read: the other transfers go ahead
+            link = &stream->next;
+            continue;
+        }
+        int finished = 0;
+        rvalue = _send_next_chunk(multiplexer, stream, socket, &finished);
+        if (rvalue == STATUS_OK && finished) {
+            *link = stream->next;
+            _close_stream(stream);
+            multiplexer->stream_count--;
+        } else {
+            link = &stream->next;
+        }
+    }
+    socket_flush(socket);
+    return rvalue;
+}
+
+void multiplexer_destroy(StreamMultiplexer* multiplexer) {
+    while (multiplexer->streams != NULL) {
+        FileStream* stream = multiplexer->streams;
+        multiplexer->streams = stream->next;
+        _close_stream(stream);
+    }
+    multiplexer->stream_count = 0;
+    if (multiplexer->completions_open) {
+        io_completion_queue_destroy(&multiplexer->completions);
+        multiplexer->completions_open = 0;
+    }
+}
+
+void multiplexed_connection_init(MultiplexedConnection* connection, int socket) {
+    connection->socket = socket;
+    connection->next_stream_id = 1;
+    connection->pending = NULL;
+}
+
+int multiplexed_request(MultiplexedConnection* connection, uint8_t command, const char* file_name, uint32_t* stream_id) {
+    if (command != COMMAND_REQUEST_FILE && command != COMMAND_REQUEST_METADATA) {
+        return ERROR_INVALID_COMMAND;
+    }
+    PendingStream* pending = malloc(sizeof(PendingStream));
+    if (pending == NULL) {
+        return ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    *stream_id = connection->next_stream_id++;
+    if (connection->next_stream_id == 0) {
+        // stream 0 means "not multiplexed"
+        connection->next_stream_id = 1;
+    }
+    int rvalue = _send_on_stream(connection->socket, *stream_id, MESSAGE_REQUEST, command, NOT_SET, 0, (const uint8_t*)file_name, strlen_null_term(file_name));
+    if (rvalue != STATUS_OK) {
+        free(pending);
+        return rvalue;
+    }
+    socket_flush(connection->socket);
+    pending->stream_id = *stream_id;
+    pending->response = (Response)RESPONSE_INIT;
+    pending->capacity = 0;
+    pending->next = connection->pending;
+    connection->pending = pending;
+    return STATUS_OK;
+}
+
+int multiplexed_receive(MultiplexedConnection* connection, uint32_t* stream_id, Response* response) {
+    uint8_t buffer[MAX_MESSAGE_SIZE];
+    *stream_id = 0;
+    while (1) {
+        ssize_t bytes_received = receive_message(connection->socket, buffer, sizeof(buffer));
+        if (bytes_received <= 0) {
+            return ERROR_RECEIVE_FAILED;
+        }
+        Header header;
+        int rvalue = extract_header(buffer, bytes_received, &header);
+        if (rvalue != STATUS_OK) {
+            return rvalue;
+        }
+        PendingStream** link = &connection->pending;
+        while (*link != NULL && (*link)->stream_id != header.stream_id) {
+            link = &(*link)->next;
+        }
+        PendingStream* pending = *link;
+        if (pending == NULL) {
+            return ERROR_INVALID_STREAM;
+        }
+
+        if (header.message_type == MESSAGE_RESPONSE) {
+            // a complete response (metadata), or an error that replaces the rest of a transfer
+            destroy_response(&pending->response);
+            rvalue = parse_message(buffer, bytes_received, response);
+            if (rvalue == STATUS_OK) {
+                rvalue = header.status;
+            }
+        } else if (header.message_type == MESSAGE_RESPONSE_SIZE) {
+            // the whole file is allocated up front, so the chunks are copied into place
+            uint64_t file_size;
+            if (pending->response.payload != NULL || header.payload_size != sizeof(file_size)) {
+                return ERROR_UNEXPECTED_MESSAGE_TYPE;
+            }
+            memcpy(&file_size, buffer + HEADER_SIZE, sizeof(file_size));
+            file_size = be64toh(file_size);
+            if (file_size > UINT32_MAX) {
+                return ERROR_INVALID_DATA_SIZE;
+            }
+            pending->response.payload = malloc(file_size > 0 ? file_size : 1);
+            if (pending->response.payload == NULL) {
+                return ERROR_MEMORY_ALLOCATION_FAILED;
+            }
+            pending->capacity = file_size;
+            continue;
+        } else if (header.message_type == MESSAGE_RESPONSE_CHUNK || header.message_type == MESSAGE_RESPONSE_LAST_CHUNK) {
+            uint32_t size = pending->response.header.payload_size;
+            if (pending->response.payload == NULL) {
+                return ERROR_UNEXPECTED_MESSAGE_TYPE;
+            }
+            if (header.payload_size > pending->capacity - size) {
+                return ERROR_INVALID_DATA_SIZE;
+            }
+            memcpy(pending->response.payload + size, buffer + HEADER_SIZE, header.payload_size);
+            pending->response.header.payload_size = size + header.payload_size;
+            if (header.message_type == MESSAGE_RESPONSE_CHUNK) {
+                continue;
+            }
+            *response = pending->response;
+            response->header.message_type = MESSAGE_RESPONSE;
+            response->header.command = header.command;
+            response->header.status = STATUS_OK;
+            response->header.stream_id = header.stream_id;
+            rvalue = STATUS_OK;
+        } else {
+            return ERROR_UNEXPECTED_MESSAGE_TYPE;
+        }
+        *link = pending->next;
+        free(pending);
+        *stream_id = header.stream_id;
+        return rvalue;
+    }
+}
+
+size_t multiplexed_pending_count(const MultiplexedConnection* connection) {
+    size_t count = 0;
+    for (const PendingStream* pending = connection->pending; pending != NULL; pending = pending->next) {
+        count++;
+    }
+    return count;
+}
+
+void multiplexed_connection_destroy(MultiplexedConnection* connection) {
+    while (connection->pending != NULL) {
+        PendingStream* pending = connection->pending;
+        connection->pending = pending->next;
+        destroy_response(&pending->response);
+        free(pending);
+    }
+}
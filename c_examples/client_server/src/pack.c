@@ -0,0 +1,47 @@
+/*
+ * Packs the files the server serves into one pack file (see `packfile.h`), which the server can then
+ * serve with `--pack PATH`.
+ */
+#include "protocol.h"
+#include "packfile.h"
+#include "file_transfer.h"
+#include <stdio.h>
+#include <getopt.h>
+#include <inttypes.h>
+
+void print_usage(const char* program) {
+    printf("Usage: %s [--root DIR] <output>\n"
+        "Packs the files below DIR (default: %s) into <output>; <output> should not be below DIR.\n",
+        program, SERVER_FILE_PATH);
+}
+
+int main(int argc, char* argv[]) {
+    struct option long_options[] = {
+        {"root", required_argument, NULL, 'r'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    const char* root = SERVER_FILE_PATH;
+    int option;
+    while ((option = getopt_long(argc, argv, "r:h", long_options, NULL)) != -1) {
+        if (option == 'r') {
+            root = optarg;
+            continue;
+        }
+        print_usage(argv[0]);
+        return option == 'h' ? 0 : 1;
+    }
+    if (argc - optind != 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    const char* output = argv[optind];
+    uint64_t entry_count;
+    int rvalue = pack_create(root, output, &entry_count);
+    if (rvalue != STATUS_OK) {
+        fprintf(stderr, "***ERROR*** packing %s into %s: status=%d\n", root, output, rvalue);
+        return 1;
+    }
+    printf("Packed %" PRIu64 " file(s) from %s into %s\n", entry_count, root, output);
+    return 0;
+}
@@ -0,0 +1,344 @@
+#include "utils.h"
+#include "protocol.h"
+#include "packfile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <endian.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+// offsets of the index entry fields
+#define ENTRY_OFFSET_NAME 0
+#define ENTRY_OFFSET_DATA 8
+#define ENTRY_OFFSET_SIZE 16
+#define ENTRY_OFFSET_HASH 24
+#define ENTRY_OFFSET_MTIME_SEC 32
+#define ENTRY_OFFSET_MTIME_NSEC 40
+#define ENTRY_OFFSET_NAME_LENGTH 44
+
+/**
+ * The names of the files to pack, relative to the root.
+ */
+typedef struct {
+    char** names;
+    size_t count;
+    size_t capacity;
+} _NameList;
+
+static uint64_t _load_u64(const uint8_t* data) {
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return be64toh(value);
+}
+
+static uint32_t _load_u32(const uint8_t* data) {
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return be32toh(value);
+}
+
+static void _store_u64(uint8_t* data, uint64_t value) {
+    value = htobe64(value);
+    memcpy(data, &value, sizeof(value));
+}
+
+static void _store_u32(uint8_t* data, uint32_t value) {
+    value = htobe32(value);
+    memcpy(data, &value, sizeof(value));
+}
+
+static int _append_name(_NameList* list, const char* name) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity > 0 ? list->capacity * 2 : 64;
+        char** names = realloc(list->names, capacity * sizeof(char*));
+        if (names == NULL) {
+            return ERROR_MEMORY_ALLOCATION_FAILED;
+        }
+        list->names = names;
+        list->capacity = capacity;
+    }
+    list->names[list->count] = strdup(name);
+    if (list->names[list->count] == NULL) {
+        return ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    list->count++;
+    return STATUS_OK;
+}
+
+/**
+ * Adds the regular files below `root`/`relative` to `list` (recursively).
+ */
+static int _collect_names(const char* root, const char* relative, _NameList* list) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s%s%s", root, relative[0] != '\0' ? "/" : "", relative);
+    DIR* directory = opendir(path);
+    if (directory == NULL) {
+        return ERROR_FILE_OPEN_FAILED;
+    }
+    int rvalue = STATUS_OK;
+    struct dirent* dirent;
+    while (rvalue == STATUS_OK && (dirent = readdir(directory)) != NULL) {
+        if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+            continue;
+        }
+        char name[4096];
+        int length = snprintf(name, sizeof(name), "%s%s%s", relative, relative[0] != '\0' ? "/" : "", dirent->d_name);
+        struct stat file_stat;
+        // lstat: symbolic links are skipped rather than followed (out of the root, or in a loop)
+        if (length >= (int)sizeof(name) || fstatat(dirfd(directory), dirent->d_name, &file_stat, AT_SYMLINK_NOFOLLOW) == -1) {
+            rvalue = ERROR_FILE_OPEN_FAILED;
+        } else if (S_ISDIR(file_stat.st_mode)) {
+            rvalue = _collect_names(root, name, list);
+        } else if (S_ISREG(file_stat.st_mode)) {
+            rvalue = _append_name(list, name);
+        }
+    }
+    closedir(directory);
+    return rvalue;
+}
+
+static int _compare_names(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/**
+ * Appends the contents of `root`/`name` to the pack and fills in its index entry (except the name).
+ */
+static int _pack_file(const char* root, const char* name, FILE* pack, uint8_t* entry) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat file_stat;
+    if (fd == -1 || fstat(fd, &file_stat) == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return ERROR_FILE_OPEN_FAILED;
+    }
+    off_t offset = ftello(pack);
+    uint64_t size = 0;
+    uint64_t hash = FNV1A_OFFSET_BASIS;
+    uint8_t buffer[64 * 1024];
+    ssize_t bytes_read;
+    while ((bytes_read = read(fd, buffer, sizeof(buffer))) > 0) {
+        hash = fnv1a_hash(hash, buffer, bytes_read);
+        if (fwrite(buffer, 1, bytes_read, pack) != (size_t)bytes_read) {
+            bytes_read = -1;
+            break;
+        }
+        size += bytes_read;
+    }
+    close(fd);
+    if (bytes_read == -1 || offset == -1) {
+        return ERROR_FILE_OPEN_FAILED;
+    }
+    _store_u64(entry + ENTRY_OFFSET_DATA, offset);
+    _store_u64(entry + ENTRY_OFFSET_SIZE, size);
+    _store_u64(entry + ENTRY_OFFSET_HASH, hash);
+    _store_u64(entry + ENTRY_OFFSET_MTIME_SEC, file_stat.st_mtim.tv_sec);
+    _store_u32(entry + ENTRY_OFFSET_MTIME_NSEC, file_stat.st_mtim.tv_nsec);
+    return STATUS_OK;
+}
+
+int pack_create(const char* root, const char* path, uint64_t* entry_count) {
+    _NameList list = {NULL, 0, 0};
+    uint8_t* index = NULL;
+    FILE* pack = NULL;
+    char temporary_path[4096];
+    snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", path);
+
+    int rvalue = _collect_names(root, "", &list);
+    if (rvalue != STATUS_OK) {
+        goto error;
+    }
+    qsort(list.names, list.count, sizeof(char*), _compare_names);
+    index = calloc(list.count > 0 ? list.count : 1, PACK_ENTRY_SIZE);
+    pack = fopen(temporary_path, "wb");
+    if (index == NULL || pack == NULL) {
+        rvalue = index == NULL ? ERROR_MEMORY_ALLOCATION_FAILED : ERROR_FILE_OPEN_FAILED;
+        goto error;
+    }
+    // the header is written last, once the offsets are known
+    uint8_t header[PACK_HEADER_SIZE] = {0};
+    if (fwrite(header, 1, sizeof(header), pack) != sizeof(header)) {
+        rvalue = ERROR_FILE_OPEN_FAILED;
+        goto error;
+    }
+    uint64_t name_offset = 0;
+    for (size_t i = 0; i < list.count; i++) {
+        uint8_t* entry = index + i * PACK_ENTRY_SIZE;
+        rvalue = _pack_file(root, list.names[i], pack, entry);
+        if (rvalue != STATUS_OK) {
+            goto error;
+        }
+        size_t name_length = strlen(list.names[i]);
+        _store_u64(entry + ENTRY_OFFSET_NAME, name_offset);
+        _store_u32(entry + ENTRY_OFFSET_NAME_LENGTH, name_length);
+        name_offset += name_length + 1;
+    }
+    off_t index_offset = ftello(pack);
+    if (index_offset == -1 || fwrite(index, PACK_ENTRY_SIZE, list.count, pack) != list.count) {
+        rvalue = ERROR_FILE_OPEN_FAILED;
+        goto error;
+    }
+    for (size_t i = 0; i < list.count; i++) {
+        if (fwrite(list.names[i], 1, strlen(list.names[i]) + 1, pack) != strlen(list.names[i]) + 1) {
+            rvalue = ERROR_FILE_OPEN_FAILED;
+            goto error;
+        }
+    }
+    memcpy(header, PACK_MAGIC, strlen(PACK_MAGIC));
+    _store_u64(header + 8, list.count);
+    _store_u64(header + 16, index_offset);
+    _store_u64(header + 24, index_offset + (uint64_t)list.count * PACK_ENTRY_SIZE);
+    if (fseeko(pack, 0, SEEK_SET) == -1 || fwrite(header, 1, sizeof(header), pack) != sizeof(header)
+        || fflush(pack) != 0 || fsync(fileno(pack)) == -1) {
+        rvalue = ERROR_FILE_OPEN_FAILED;
+        goto error;
+    }
+    fclose(pack);
+    pack = NULL;
+    if (rename(temporary_path, path) == -1) {
+        rvalue = ERROR_FILE_OPEN_FAILED;
+        goto error;
+    }
+    if (entry_count != NULL) {
+        *entry_count = list.count;
+    }
+    rvalue = STATUS_OK;
+
+error:
+    if (pack != NULL) {
+        fclose(pack);
+    }
+    if (rvalue != STATUS_OK) {
+        unlink(temporary_path);
+    }
+    for (size_t i = 0; i < list.count; i++) {
+        free(list.names[i]);
+    }
+    free(list.names);
+    free(index);
+    return rvalue;
+}
+
+/**
+ * Decodes index entry `i`.
+ */
+static void _read_entry(const Pack* pack, uint64_t i, PackEntry* entry) {
+    const uint8_t* data = pack->index + i * PACK_ENTRY_SIZE;
+    entry->name = pack->names + _load_u64(data + ENTRY_OFFSET_NAME);
+    entry->offset = _load_u64(data + ENTRY_OFFSET_DATA);
+    entry->size = _load_u64(data + ENTRY_OFFSET_SIZE);
+    entry->hash = _load_u64(data + ENTRY_OFFSET_HASH);
+    entry->mtime.tv_sec = (time_t)_load_u64(data + ENTRY_OFFSET_MTIME_SEC);
+    entry->mtime.tv_nsec = _load_u32(data + ENTRY_OFFSET_MTIME_NSEC);
+}
+
+/**
+ * Checks that the index only points into the pack, so that lookups can trust it.
+ */
+static int _validate(const Pack* pack, uint64_t index_offset, uint64_t names_offset) {
+    for (uint64_t i = 0; i < pack->entry_count; i++) {
+        const uint8_t* data = pack->index + i * PACK_ENTRY_SIZE;
+        uint64_t name_offset = _load_u64(data + ENTRY_OFFSET_NAME);
+        uint32_t name_length = _load_u32(data + ENTRY_OFFSET_NAME_LENGTH);
+        uint64_t offset = _load_u64(data + ENTRY_OFFSET_DATA);
+        uint64_t size = _load_u64(data + ENTRY_OFFSET_SIZE);
+        if (name_offset >= pack->names_size || name_length >= pack->names_size - name_offset
+            || pack->names[name_offset + name_length] != '\0' || strlen(pack->names + name_offset) != name_length) {
+            return ERROR_INVALID_DATA_SIZE;
+        }
+        if (offset < PACK_HEADER_SIZE || offset > index_offset || size > index_offset - offset) {
+            return ERROR_INVALID_DATA_SIZE;
+        }
+        if (i > 0) {
+            PackEntry previous;
+            _read_entry(pack, i - 1, &previous);
+            if (strcmp(previous.name, pack->names + name_offset) >= 0) {
+                return ERROR_INVALID_DATA_SIZE;
+            }
+        }
+    }
+    return STATUS_OK;
+}
+
+int pack_open(Pack* pack, const char* path) {
+    *pack = (Pack)PACK_INIT;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat file_stat;
+    if (fd == -1 || fstat(fd, &file_stat) == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return ERROR_FILE_OPEN_FAILED;
+    }
+    if (file_stat.st_size < PACK_HEADER_SIZE) {
+        close(fd);
+        return ERROR_INVALID_DATA_SIZE;
+    }
+    uint8_t* data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return ERROR_FILE_OPEN_FAILED;
+    }
+    Pack opened = {fd, data, file_stat.st_size, 0, NULL, NULL, 0};
+    uint64_t entry_count = _load_u64(data + 8);
+    uint64_t index_offset = _load_u64(data + 16);
+    uint64_t names_offset = _load_u64(data + 24);
+    if (memcmp(data, PACK_MAGIC, strlen(PACK_MAGIC)) != 0 || index_offset < PACK_HEADER_SIZE
+        || index_offset > opened.size || entry_count > (opened.size - index_offset) / PACK_ENTRY_SIZE
+        || names_offset != index_offset + entry_count * PACK_ENTRY_SIZE) {
+        pack_close(&opened);
+        return ERROR_INVALID_DATA_SIZE;
+    }
+    opened.entry_count = entry_count;
+    opened.index = data + index_offset;
+    opened.names = (const char*)data + names_offset;
+    opened.names_size = opened.size - names_offset;
+    if (_validate(&opened, index_offset, names_offset) != STATUS_OK) {
+        pack_close(&opened);
+        return ERROR_INVALID_DATA_SIZE;
+    }
+    *pack = opened;
+    return STATUS_OK;
+}
+
+void pack_close(Pack* pack) {
+    if (pack->data != NULL) {
+        munmap(pack->data, pack->size);
+    }
+    if (pack->fd != -1) {
+        close(pack->fd);
+    }
+    *pack = (Pack)PACK_INIT;
+}
+
+int pack_find(const Pack* pack, const char* name, PackEntry* entry) {
+    uint64_t low = 0;
+    uint64_t high = pack->entry_count;
+    while (low < high) {
+        uint64_t middle = low + (high - low) / 2;
+        _read_entry(pack, middle, entry);
+        int comparison = strcmp(name, entry->name);
+        if (comparison == 0) {
+            return STATUS_OK;
+        }
+        if (comparison < 0) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    return ERROR_FILE_NOT_FOUND;
+}
+
+void pack_format_etag(const PackEntry* entry, char* etag, size_t etag_size) {
+    // the contents can't change without changing the hash (or, very unlikely, keeping it but not the size)
+    snprintf(etag, etag_size, "\"%016" PRIx64 "-%" PRIx64 "\"", entry->hash, entry->size);
+}
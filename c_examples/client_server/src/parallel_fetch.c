@@ -0,0 +1,326 @@
+#include "protocol.h"
+#include "sockets.h"
+#include "file_transfer.h"
+#include "parallel_fetch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+struct _Worker;
+
+/**
+ * The state shared by the workers (one per replica).
+ *
+ * mutex: protects the ranges of the workers and everything below it
+ * changed: signaled when a request finishes or a worker drops out (there may be work to steal)
+ * in_flight: the number of requests in progress
+ * last_error: the error of the last worker that dropped out
+ * write_failed: set if the output file could not be written (everyone stops)
+ */
+typedef struct {
+    const RetryPolicy* policy;
+    const SocketOptions* options;
+    const char* file_name;
+    int fd;
+    struct _Worker* workers;
+    size_t worker_count;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    size_t in_flight;
+    int last_error;
+    int write_failed;
+} _ParallelFetch;
+
+/**
+ * A worker fetches the range [position, end) from its replica, front to back. The bytes before
+ * `position` have been requested already; thieves only take from the back.
+ */
+typedef struct _Worker {
+    _ParallelFetch* fetch;
+    Replica* replica;
+    uint64_t position;
+    uint64_t end;
+    int failed;
+    int started;
+    pthread_t thread;
+} _Worker;
+
+/**
+ * Gives the thief the back half of the largest range left (or all of it, if its worker dropped out).
+ * Called with the mutex held.
+ *
+ * @return 1 if the thief got a range, 0 if there is nothing worth stealing.
+ */
+static int _steal(_ParallelFetch* fetch, _Worker* thief) {
+    _Worker* victim = NULL;
+    uint64_t most = 0;
+    for (size_t i = 0; i < fetch->worker_count; i++) {
+        _Worker* worker = &fetch->workers[i];
+        uint64_t remaining = worker->end - worker->position;
+        // splitting the last request of a range gains nothing: its worker is about to ask for it anyway
+        if (worker != thief && remaining > most && (worker->failed || remaining >= 2 * PARALLEL_FETCH_REQUEST_SIZE)) {
+            victim = worker;
+            most = remaining;
+        }
+    }
+    if (victim == NULL) {
+        return 0;
+    }
+    uint64_t split = victim->failed ? victim->position : victim->position + most / 2;
+    thief->position = split;
+    thief->end = victim->end;
+    victim->end = split;
+    return 1;
+}
+
+/**
+ * Whether a worker that is still fetching might yet drop out and leave work behind: it has a request
+ * in progress, or has not fetched all of its range. Called with the mutex held.
+ */
+static int _may_leave_work(const _ParallelFetch* fetch) {
+    if (fetch->in_flight > 0) {
+        return 1;
+    }
+    for (size_t i = 0; i < fetch->worker_count; i++) {
+        const _Worker* worker = &fetch->workers[i];
+        if (!worker->failed && worker->position < worker->end) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Writes `length` bytes at `offset`.
+ */
+static int _write_at(int fd, const uint8_t* data, size_t length, off_t offset) {
+    size_t total = 0;
+    while (total < length) {
+        ssize_t bytes_written = pwrite(fd, data + total, length - total, offset + total);
+        if (bytes_written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_written <= 0) {
+            return -1;
+        }
+        total += bytes_written;
+    }
+    return 0;
+}
+
+/**
+ * Marks the worker as dropped out; its range is left for the others. Called with the mutex held.
+ */
+static void _drop_out(_Worker* worker, int error) {
+    worker->failed = 1;
+    worker->replica->status = error;
+    worker->fetch->last_error = error;
+    pthread_cond_broadcast(&worker->fetch->changed);
+}
+
+static void* _fetch_worker(void* arg) {
+    _Worker* worker = (_Worker*)arg;
+    _ParallelFetch* fetch = worker->fetch;
+    int socket;
+    if (connect_with_deadline(worker->replica->endpoint.address, worker->replica->endpoint.port, fetch->policy, fetch->options, &socket) != CONNECT_OK) {
+        pthread_mutex_lock(&fetch->mutex);
+        _drop_out(worker, ERROR_SEND_FAILED);
+        pthread_mutex_unlock(&fetch->mutex);
+        return NULL;
+    }
+    pthread_mutex_lock(&fetch->mutex);
+    while (!fetch->write_failed) {
+        if (worker->position == worker->end && !_steal(fetch, worker)) {
+            // nothing to steal right now; wait for the others, who may still drop out and leave work behind
+            if (!_may_leave_work(fetch)) {
+                break;
+            }
+            pthread_cond_wait(&fetch->changed, &fetch->mutex);
+            continue;
+        }
+        uint64_t offset = worker->position;
+        uint64_t length = worker->end - offset < PARALLEL_FETCH_REQUEST_SIZE ? worker->end - offset : PARALLEL_FETCH_REQUEST_SIZE;
+        worker->position += length;
+        fetch->in_flight++;
+        pthread_mutex_unlock(&fetch->mutex);
+
+        Response response;
+        int rvalue = request_file_range(socket, fetch->file_name, offset, length, &response);
+        if (rvalue == STATUS_OK && response.header.payload_size != length) {
+            // the replica's copy is shorter than the file being fetched
+            rvalue = ERROR_INVALID_DATA_SIZE;
+        }
+        int write_failed = rvalue == STATUS_OK && _write_at(fetch->fd, response.payload, length, offset) != 0;
+        destroy_response(&response);
+
+        pthread_mutex_lock(&fetch->mutex);
+        fetch->in_flight--;
+        pthread_cond_broadcast(&fetch->changed);
+        if (write_failed) {
+            fetch->write_failed = 1;
+            break;
+        }
+        if (rvalue != STATUS_OK) {
+            // the request is given back: thieves never take from the front of a range, so it is still contiguous
+            worker->position = offset;
+            _drop_out(worker, rvalue);
+            break;
+        }
+        worker->replica->bytes += length;
+    }
+    pthread_mutex_unlock(&fetch->mutex);
+    socket_cleanup(socket);
+    return NULL;
+}
+
+/**
+ * The version of the file a replica serves.
+ *
+ * status: STATUS_OK, or the error of the metadata request
+ * size: the size of the file
+ * etag: the ETag of the file
+ */
+typedef struct {
+    int status;
+    uint64_t size;
+    char etag[ETAG_SIZE];
+} _Version;
+
+/**
+ * Asks a replica for the size and ETag of the file.
+ */
+static void _fetch_version(const Replica* replica, const RetryPolicy* policy, const SocketOptions* options, const char* file_name, _Version* version) {
+    int socket;
+    if (connect_with_deadline(replica->endpoint.address, replica->endpoint.port, policy, options, &socket) != CONNECT_OK) {
+        version->status = ERROR_SEND_FAILED;
+        return;
+    }
+    Response response;
+    version->status = request_file_metadata(socket, file_name, &response);
+    socket_cleanup(socket);
+    if (version->status == STATUS_OK && (parse_file_size((const char*)response.payload, &version->size) != 0
+        || parse_etag((const char*)response.payload, version->etag, sizeof(version->etag)) != 0)) {
+        version->status = ERROR_INVALID_DATA_SIZE;
+    }
+    destroy_response(&response);
+}
+
+static int _same_version(const _Version* a, const _Version* b) {
+    return a->size == b->size && strcmp(etag_version(a->etag), etag_version(b->etag)) == 0;
+}
+
+/**
+ * Asks every replica for the version of the file it serves, and keeps the replicas that serve the
+ * version most of them do (on a tie, the version of the first one that answered). The others drop out:
+ * with ERROR_VERSION_MISMATCH, or with the error of their metadata request.
+ *
+ * @return STATUS_OK, or the error of the last replica if none of them answered.
+ */
+static int _agree_on_version(Replica* replicas, size_t replica_count, const RetryPolicy* policy, const SocketOptions* options, const char* file_name, uint64_t* file_size) {
+    _Version* versions = calloc(replica_count, sizeof(_Version));
+    if (versions == NULL) {
+        return ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    for (size_t i = 0; i < replica_count; i++) {
+        _fetch_version(&replicas[i], policy, options, file_name, &versions[i]);
+    }
+    const _Version* agreed = NULL;
+    size_t most = 0;
+    for (size_t i = 0; i < replica_count; i++) {
+        size_t count = 0;
+        for (size_t j = 0; j < replica_count && versions[i].status == STATUS_OK; j++) {
+            count += versions[j].status == STATUS_OK && _same_version(&versions[i], &versions[j]);
+        }
+        if (count > most) {
+            agreed = &versions[i];
+            most = count;
+        }
+    }
+    int rvalue = agreed != NULL ? STATUS_OK : versions[replica_count - 1].status;
+    for (size_t i = 0; i < replica_count; i++) {
+        if (versions[i].status != STATUS_OK) {
+            replicas[i].status = versions[i].status;
+        } else if (!_same_version(&versions[i], agreed)) {
+            replicas[i].status = ERROR_VERSION_MISMATCH;
+        }
+    }
+    if (agreed != NULL) {
+        *file_size = agreed->size;
+    }
+    free(versions);
+    return rvalue;
+}
+
+int parallel_fetch(Replica* replicas, size_t replica_count, const RetryPolicy* policy, const SocketOptions* options, const char* file_name, int fd, uint64_t* file_size) {
+    *file_size = 0;
+    for (size_t i = 0; i < replica_count; i++) {
+        replicas[i].bytes = 0;
+        replicas[i].status = STATUS_OK;
+    }
+    if (replica_count == 0) {
+        return ERROR_INVALID_DATA_SIZE;
+    }
+    int rvalue = _agree_on_version(replicas, replica_count, policy, options, file_name, file_size);
+    if (rvalue != STATUS_OK) {
+        return rvalue;
+    }
+    if (ftruncate(fd, *file_size) != 0) {
+        return ERROR_FILE_OPEN_FAILED;
+    }
+    _ParallelFetch fetch = {policy, options, file_name, fd, NULL, replica_count, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, STATUS_OK, 0};
+    fetch.workers = calloc(replica_count, sizeof(_Worker));
+    if (fetch.workers == NULL) {
+        return ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    // every replica that serves the agreed version starts with an equal share of the file; the others
+    // have dropped out already
+    size_t agreeing = 0;
+    for (size_t i = 0; i < replica_count; i++) {
+        agreeing += replicas[i].status == STATUS_OK;
+    }
+    for (size_t i = 0, share = 0; i < replica_count; i++) {
+        _Worker* worker = &fetch.workers[i];
+        worker->fetch = &fetch;
+        worker->replica = &replicas[i];
+        worker->failed = replicas[i].status != STATUS_OK;
+        if (!worker->failed) {
+            worker->position = *file_size * share / agreeing;
+            worker->end = *file_size * (share + 1) / agreeing;
+            share++;
+        }
+    }
+    for (size_t i = 0; i < replica_count; i++) {
+        _Worker* worker = &fetch.workers[i];
+        if (worker->failed) {
+            continue;
+        }
+        worker->started = pthread_create(&worker->thread, NULL, _fetch_worker, worker) == 0;
+        if (!worker->started) {
+            pthread_mutex_lock(&fetch.mutex);
+            _drop_out(worker, ERROR_MEMORY_ALLOCATION_FAILED);
+            pthread_mutex_unlock(&fetch.mutex);
+        }
+    }
+    for (size_t i = 0; i < replica_count; i++) {
+        if (fetch.workers[i].started) {
+            pthread_join(fetch.workers[i].thread, NULL);
+        }
+    }
+    rvalue = STATUS_OK;
+    for (size_t i = 0; i < replica_count; i++) {
+        if (fetch.workers[i].position < fetch.workers[i].end) {
+            // every replica dropped out before the whole file was fetched
+            rvalue = fetch.last_error;
+        }
+    }
+    if (fetch.write_failed) {
+        rvalue = ERROR_FILE_OPEN_FAILED;
+    }
+    free(fetch.workers);
+    pthread_cond_destroy(&fetch.changed);
+    pthread_mutex_destroy(&fetch.mutex);
+    return rvalue;
+}
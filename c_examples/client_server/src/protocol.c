@@ -3,31 +3,111 @@
 #include <stdio.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <pthread.h>
 
+/**
+ * A released message buffer; the link to the next one is stored in the buffer itself.
+ */
+typedef struct _FreeBuffer {
+    struct _FreeBuffer* next;
+} _FreeBuffer;
 
-int create_message(const Header* header, const uint8_t* payload, Message* message) {
-    if (header->payload_size > MAX_PAYLOAD_SIZE) {
-        return ERROR_MAX_PAYLOAD_SIZE_EXCEEDED;
+/**
+ * The buffers kept for reuse by one thread.
+ */
+typedef struct {
+    _FreeBuffer* head;
+    size_t count;
+    int registered;
+} _BufferCache;
+
+static _Thread_local _BufferCache _buffer_cache = {NULL, 0, 0};
+// its destructor frees the cache of a thread when the thread exits
+static pthread_key_t _buffer_cache_key;
+static pthread_once_t _buffer_cache_key_once = PTHREAD_ONCE_INIT;
+
+static void _free_buffer_cache(void* arg) {
+    _BufferCache* cache = (_BufferCache*)arg;
+    while (cache->head != NULL) {
+        _FreeBuffer* buffer = cache->head;
+        cache->head = buffer->next;
+        free(buffer);
     }
-    message->size = HEADER_SIZE + header->payload_size;
-    // define a byte array of the size of the message
-    message->data = (uint8_t*)malloc(message->size);
-    if (message->data == NULL) {
-        return ERROR_MEMORY_ALLOCATION_FAILED;
+    cache->count = 0;
+}
+
+static void _create_buffer_cache_key(void) {
+    pthread_key_create(&_buffer_cache_key, _free_buffer_cache);
+}
+
+uint8_t* message_buffer_acquire(void) {
+    _BufferCache* cache = &_buffer_cache;
+    if (cache->head == NULL) {
+        return (uint8_t*)malloc(MAX_MESSAGE_SIZE);
+    }
+    _FreeBuffer* buffer = cache->head;
+    cache->head = buffer->next;
+    cache->count--;
+    return (uint8_t*)buffer;
+}
+
+void message_buffer_release(uint8_t* buffer) {
+    if (buffer == NULL) {
+        return;
+    }
+    _BufferCache* cache = &_buffer_cache;
+    if (cache->count >= MESSAGE_BUFFER_CACHE_SIZE) {
+        free(buffer);
+        return;
+    }
+    if (!cache->registered) {
+        // the destructor only runs for threads with a non-NULL value
+        pthread_once(&_buffer_cache_key_once, _create_buffer_cache_key);
+        pthread_setspecific(_buffer_cache_key, cache);
+        cache->registered = 1;
     }
+    _FreeBuffer* free_buffer = (_FreeBuffer*)buffer;
+    free_buffer->next = cache->head;
+    cache->head = free_buffer;
+    cache->count++;
+}
+
+void message_buffer_trim(void) {
+    _free_buffer_cache(&_buffer_cache);
+}
+
+size_t message_buffer_cached(void) {
+    return _buffer_cache.count;
+}
+
+void encode_header(const Header* header, uint8_t* data) {
     // first byte is the message type
-    message->data[HEADER_OFFSET_MESSAGE_TYPE] = header->message_type;
+    data[HEADER_OFFSET_MESSAGE_TYPE] = header->message_type;
     // second byte is the command
-    message->data[HEADER_OFFSET_COMMAND] = header->command;
+    data[HEADER_OFFSET_COMMAND] = header->command;
     // next four bytes are the payload size
     // transform the integer to network byte order (big-endian)
     // we need to transform it because, unlike the other fields, the these are multi-byte integer fields
     // (uint32_t*) provides us with a way to access 4 bytes of memory as a single 32-bit integer
     // then we have to dereference in order to assign the value to the memory location
-    *(uint32_t*)(message->data + HEADER_OFFSET_PAYLOAD_SIZE) = htonl(header->payload_size);
+    *(uint32_t*)(data + HEADER_OFFSET_PAYLOAD_SIZE) = htonl(header->payload_size);
     // next four bytes is the chunk index
-    *(uint32_t*)(message->data + HEADER_OFFSET_CHUNK_INDEX) = htonl(header->chunk_index);
-    message->data[HEADER_OFFSET_STATUS] = header->status;
+    *(uint32_t*)(data + HEADER_OFFSET_CHUNK_INDEX) = htonl(header->chunk_index);
+    data[HEADER_OFFSET_STATUS] = header->status;
+    *(uint32_t*)(data + HEADER_OFFSET_STREAM_ID) = htonl(header->stream_id);
+}
+
+int create_message(const Header* header, const uint8_t* payload, Message* message) {
+    if (header->payload_size > MAX_PAYLOAD_SIZE) {
+        return ERROR_MAX_PAYLOAD_SIZE_EXCEEDED;
+    }
+    message->size = HEADER_SIZE + header->payload_size;
+    // define a byte array of the size of the message
+    message->data = message_buffer_acquire();
+    if (message->data == NULL) {
+        return ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    encode_header(header, message->data);
     if (header->payload_size > 0 && payload != NULL) {
         // copy the payload into the message starting after the header
         memcpy(message->data + HEADER_SIZE, payload, header->payload_size);
@@ -44,6 +124,7 @@ int extract_header(const uint8_t* data, uint32_t data_size, Header* header) {
     header->payload_size = ntohl(*(uint32_t*)(data + HEADER_OFFSET_PAYLOAD_SIZE));
     header->chunk_index = ntohl(*(uint32_t*)(data + HEADER_OFFSET_CHUNK_INDEX));
     header->status = data[HEADER_OFFSET_STATUS];
+    header->stream_id = ntohl(*(uint32_t*)(data + HEADER_OFFSET_STREAM_ID));
     return STATUS_OK;
 }
 
@@ -54,18 +135,26 @@ int parse_message(const uint8_t* data, uint32_t data_size, Response* response) {
         return status;
     }
     response->header = header;
+    response->payload = NULL;
+    response->pooled = 0;
     if (response->header.payload_size > 0) {
         if (data_size < (HEADER_SIZE + response->header.payload_size)) {
             return ERROR_INVALID_DATA_SIZE;
         }
-        // create a byte array of the size of the payload and then copy the payload into it (starting at the 11th byte)
-        response->payload = (uint8_t*)malloc(response->header.payload_size);
+        // a single message's payload always fits in a message buffer; larger sizes only come from
+        // callers parsing their own (non-protocol) data
+        if (response->header.payload_size <= MAX_MESSAGE_SIZE) {
+            response->payload = message_buffer_acquire();
+            response->pooled = 1;
+        } else {
+            response->payload = (uint8_t*)malloc(response->header.payload_size);
+            response->pooled = 0;
+        }
         if (response->payload == NULL) {
             return ERROR_MEMORY_ALLOCATION_FAILED;
         }
+        // copy the payload into it (starting after the header)
         memcpy(response->payload, data + HEADER_SIZE, response->header.payload_size);
-    } else {
-        response->payload = NULL;
     }
     return STATUS_OK;
 }
@@ -73,7 +162,7 @@ int parse_message(const uint8_t* data, uint32_t data_size, Response* response) {
 void destroy_message(Message* message) {
     if (message != NULL) {
         if (message->data != NULL) {
-            free(message->data);
+            message_buffer_release(message->data);
             message->data = NULL;
         }
         message->size = 0;
@@ -83,9 +172,14 @@ void destroy_message(Message* message) {
 void destroy_response(Response *response) {
     if (response != NULL) {
         if(response->payload != NULL) {
-            free(response->payload);
+            if (response->pooled) {
+                message_buffer_release(response->payload);
+            } else {
+                free(response->payload);
+            }
             response->payload = NULL;
         }
+        response->pooled = 0;
         response->header = (Header)HEADER_INIT;
     }
 }
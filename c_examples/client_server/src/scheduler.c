@@ -0,0 +1,205 @@
+#include "utils.h"
+#include "protocol.h"
+#include "scheduler.h"
+
+int scheduler_init(Scheduler* scheduler, size_t max_running, size_t max_bulk, uint64_t aging_ms) {
+    if (max_running == 0 || max_bulk == 0 || max_bulk > max_running) {
+        return -1;
+    }
+    if (pthread_mutex_init(&scheduler->mutex, NULL) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < SCHEDULER_CLASSES; i++) {
+        scheduler->head[i] = NULL;
+        scheduler->tail[i] = NULL;
+        scheduler->queued[i] = 0;
+    }
+    scheduler->running = 0;
+    scheduler->running_bulk = 0;
+    scheduler->max_running = max_running;
+    scheduler->max_bulk = max_bulk;
+    scheduler->aging_ms = aging_ms;
+    scheduler->target_ms = 0;
+    scheduler->interval_ms = 0;
+    for (int i = 0; i < SCHEDULER_CLASSES; i++) {
+        scheduler->above_target_until_ms[i] = 0;
+        scheduler->overloaded[i] = 0;
+    }
+    scheduler->rejected = 0;
+    return 0;
+}
+
+void scheduler_set_admission(Scheduler* scheduler, uint64_t target_ms, uint64_t interval_ms) {
+    pthread_mutex_lock(&scheduler->mutex);
+    scheduler->target_ms = target_ms;
+    scheduler->interval_ms = interval_ms;
+    for (int i = 0; i < SCHEDULER_CLASSES; i++) {
+        scheduler->above_target_until_ms[i] = 0;
+        scheduler->overloaded[i] = 0;
+    }
+    pthread_mutex_unlock(&scheduler->mutex);
+}
+
+void scheduler_destroy(Scheduler* scheduler) {
+    pthread_mutex_destroy(&scheduler->mutex);
+}
+
+int scheduler_classify(uint8_t command, long file_size) {
+    switch (command) {
+        case COMMAND_REQUEST_METADATA:
+        case COMMAND_REQUEST_FILE_DESCRIPTOR:
+            // no file contents are sent
+            return SCHEDULER_CLASS_INTERACTIVE;
+        default:
+            return file_size <= SCHEDULER_SMALL_FILE_SIZE ? SCHEDULER_CLASS_INTERACTIVE : SCHEDULER_CLASS_BULK;
+    }
+}
+
+/**
+ * Returns the class of the waiting request that should run next, or -1 if none can run.
+ * Called with the mutex held.
+ */
+static int _next_class(Scheduler* scheduler) {
+    if (scheduler->running >= scheduler->max_running) {
+        return -1;
+    }
+    SchedulerTicket* bulk = scheduler->head[SCHEDULER_CLASS_BULK];
+    int bulk_allowed = bulk != NULL && scheduler->running_bulk < scheduler->max_bulk;
+    if (bulk_allowed && monotonic_time_ms() - bulk->enqueued_ms >= scheduler->aging_ms) {
+        return SCHEDULER_CLASS_BULK;
+    }
+    if (scheduler->head[SCHEDULER_CLASS_INTERACTIVE] != NULL) {
+        return SCHEDULER_CLASS_INTERACTIVE;
+    }
+    return bulk_allowed ? SCHEDULER_CLASS_BULK : -1;
+}
+
+/**
+ * Updates the overload state of a class with a sample of its waiting time. Like CoDel, only a
+ * waiting time that stays above the target for a whole interval (i.e. whose minimum over the interval
+ * is above the target) counts as overload; any sample below the target ends it. Each class is tracked
+ * on its own: bulk requests wait behind interactive ones by design, and an interactive request that
+ * runs right away says nothing about the bulk queue. Called with the mutex held.
+ */
+static void _record_wait(Scheduler* scheduler, int priority_class, uint64_t wait_ms, uint64_t now_ms) {
+    if (scheduler->target_ms == 0) {
+        return;
+    }
+    if (wait_ms < scheduler->target_ms) {
+        scheduler->above_target_until_ms[priority_class] = 0;
+        scheduler->overloaded[priority_class] = 0;
+    } else if (scheduler->above_target_until_ms[priority_class] == 0) {
+        scheduler->above_target_until_ms[priority_class] = now_ms + scheduler->interval_ms;
+    } else if (now_ms >= scheduler->above_target_until_ms[priority_class]) {
+        scheduler->overloaded[priority_class] = 1;
+    }
+}
+
+/**
+ * Grants slots to waiting requests while there are free slots. Called with the mutex held.
+ */
+static void _dispatch(Scheduler* scheduler) {
+    int priority_class;
+    while ((priority_class = _next_class(scheduler)) != -1) {
+        SchedulerTicket* ticket = scheduler->head[priority_class];
+        scheduler->head[priority_class] = ticket->next;
+        if (scheduler->head[priority_class] == NULL) {
+            scheduler->tail[priority_class] = NULL;
+        }
+        scheduler->queued[priority_class]--;
+        scheduler->running++;
+        scheduler->running_bulk += priority_class == SCHEDULER_CLASS_BULK;
+        ticket->granted = 1;
+        pthread_cond_signal(&ticket->wake);
+        uint64_t now_ms = monotonic_time_ms();
+        _record_wait(scheduler, priority_class, now_ms - ticket->enqueued_ms, now_ms);
+    }
+}
+
+/**
+ * Removes a waiting ticket from its queue. Called with the mutex held.
+ */
+static void _remove_waiting(Scheduler* scheduler, SchedulerTicket* ticket) {
+    int priority_class = ticket->priority_class;
+    SchedulerTicket* previous = NULL;
+    for (SchedulerTicket* current = scheduler->head[priority_class]; current != ticket; current = current->next) {
+        previous = current;
+    }
+    if (previous == NULL) {
+        scheduler->head[priority_class] = ticket->next;
+    } else {
+        previous->next = ticket->next;
+    }
+    if (scheduler->tail[priority_class] == ticket) {
+        scheduler->tail[priority_class] = previous;
+    }
+    scheduler->queued[priority_class]--;
+}
+
+int scheduler_acquire(Scheduler* scheduler, SchedulerTicket* ticket, int priority_class) {
+    ticket->priority_class = priority_class;
+    ticket->enqueued_ms = monotonic_time_ms();
+    ticket->granted = 0;
+    ticket->next = NULL;
+    pthread_cond_init(&ticket->wake, NULL);
+
+    pthread_mutex_lock(&scheduler->mutex);
+    // queue behind the requests of the same class that are already waiting, then let the dispatcher
+    // decide; if a slot is free and nobody is ahead of us, we are granted right away
+    if (scheduler->tail[priority_class] != NULL) {
+        scheduler->tail[priority_class]->next = ticket;
+    } else {
+        scheduler->head[priority_class] = ticket;
+    }
+    scheduler->tail[priority_class] = ticket;
+    scheduler->queued[priority_class]++;
+    _dispatch(scheduler);
+    if (!ticket->granted) {
+        // the request at the front of the class's queue has been waiting all along; when no slot
+        // frees up, its waiting time is the only sign of overload
+        uint64_t oldest_ms = scheduler->head[priority_class]->enqueued_ms;
+        _record_wait(scheduler, priority_class, ticket->enqueued_ms - oldest_ms, ticket->enqueued_ms);
+        if (scheduler->overloaded[priority_class]) {
+            _remove_waiting(scheduler, ticket);
+            scheduler->rejected++;
+            pthread_mutex_unlock(&scheduler->mutex);
+            pthread_cond_destroy(&ticket->wake);
+            return ERROR_OVERLOADED;
+        }
+    }
+    while (!ticket->granted) {
+        pthread_cond_wait(&ticket->wake, &scheduler->mutex);
+    }
+    pthread_mutex_unlock(&scheduler->mutex);
+    pthread_cond_destroy(&ticket->wake);
+    return STATUS_OK;
+}
+
+void scheduler_release(Scheduler* scheduler, SchedulerTicket* ticket) {
+    pthread_mutex_lock(&scheduler->mutex);
+    scheduler->running--;
+    scheduler->running_bulk -= ticket->priority_class == SCHEDULER_CLASS_BULK;
+    _dispatch(scheduler);
+    pthread_mutex_unlock(&scheduler->mutex);
+}
+
+int scheduler_overloaded(Scheduler* scheduler, int priority_class) {
+    pthread_mutex_lock(&scheduler->mutex);
+    int overloaded = scheduler->overloaded[priority_class];
+    pthread_mutex_unlock(&scheduler->mutex);
+    return overloaded;
+}
+
+uint64_t scheduler_rejected(Scheduler* scheduler) {
+    pthread_mutex_lock(&scheduler->mutex);
+    uint64_t rejected = scheduler->rejected;
+    pthread_mutex_unlock(&scheduler->mutex);
+    return rejected;
+}
+
+size_t scheduler_queued(Scheduler* scheduler, int priority_class) {
+    pthread_mutex_lock(&scheduler->mutex);
+    size_t queued = scheduler->queued[priority_class];
+    pthread_mutex_unlock(&scheduler->mutex);
+    return queued;
+}
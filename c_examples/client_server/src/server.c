@@ -1,6 +1,10 @@
 #include "utils.h"
 #include "protocol.h"
 #include "file_transfer.h"
+#include "multiplex.h"
+#include "scheduler.h"
+#include "subscription.h"
+#include "connection.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -8,72 +12,340 @@
 #include <sockets.h>
 #include <netinet/in.h>
 #include <unistd.h>
+#include <poll.h>
+#include <inttypes.h>
+#include <limits.h>
 
 #define PORT 9002
+#define DRAIN_TIMEOUT_SECONDS 30
+#define MAX_LISTENERS 2
+#define MAX_ROOTS 16
+
+SocketOptions socket_options = SOCKET_OPTIONS_INIT;
+// decides which requests run when there are more than `--max-active` at once (see scheduler.h)
+Scheduler scheduler;
+// sends change notifications to the connections that subscribed (see subscription.h); not started
+// when serving a pack, which doesn't change
+Notifier notifier;
+// the connections being served; drained during a graceful upgrade (see connection.h)
+Connections connections;
 
 /**
  * @brief accept a connection and return the client socket, or -1 if the connection fails.
  */
 int accept_connection(int server_socket) {
-    struct sockaddr_in client_addr;
+    struct sockaddr_storage client_addr;
     socklen_t client_len = sizeof(client_addr);
-    return accept(server_socket, (struct sockaddr *)&client_addr, &client_len);
+    int client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_len);
+    if (client_socket != -1 && apply_socket_options(client_socket, &socket_options, 0) == -1) {
+        socket_cleanup(client_socket);
+        return -1;
+    }
+    return client_socket;
 }
 
-void* server_worker(void* arg) {
-    // the client socket is stored on the heap to pass into the thread; don't forget to free it
-    // convert it to an int pointer and then dereference it to get the value
-    int client_socket = *(int*)arg;
-    free(arg);
+void print_usage(const char* program) {
+    printf("Usage: %s [--nodelay] [--cork] [--sndbuf BYTES] [--rcvbuf BYTES] [--quickack] [--fastopen QUEUE]"
+        " [--busy-poll USEC] [--notsent-lowat BYTES] [--backlog N] [--unix PATH] [--upgrade-socket PATH [--takeover]]"
+        " [--max-active N] [--max-bulk N] [--aging-ms MS] [--target-delay-ms MS] [--delay-interval-ms MS]"
+        " [--root DIR]... [--io-threads N] [--pack PATH] [--catalog PATH [--catalog-scan-ms MS]]\n", program);
+}
 
-    uint8_t buffer[MAX_MESSAGE_SIZE];
-    ssize_t bytes_received = recv(client_socket, buffer, MAX_MESSAGE_SIZE, 0);
-    if (bytes_received <= 0) {
-        fprintf(stderr, "***ERROR*** receiving message\n");
-        socket_cleanup(client_socket);
-        return NULL;
+/**
+ * @brief Receives the listening sockets from the running server over the upgrade socket at `path`.
+ * 
+ * Returns the number of sockets stored in `listeners`, or -1 if the handoff failed.
+ */
+int take_over_listeners(const char* path, int* listeners, int max_listeners) {
+    char address[256];
+    snprintf(address, sizeof(address), "%s%s", UNIX_ADDRESS_PREFIX, path);
+    int control_socket;
+    int status = connect_with_deadline(address, 0, NULL, NULL, &control_socket);
+    if (status != CONNECT_OK) {
+        fprintf(stderr, "***ERROR*** connecting to upgrade socket %s: %s\n", path, connect_error_string(status));
+        return -1;
+    }
+    uint8_t count;
+    int listener_count;
+    ssize_t bytes_received = receive_all_with_fds(control_socket, &count, sizeof(count), listeners, max_listeners, &listener_count);
+    close(control_socket);
+    if (bytes_received != sizeof(count) || listener_count != count) {
+        fprintf(stderr, "***ERROR*** receiving listening sockets\n");
+        return -1;
     }
+    return listener_count;
+}
 
-    Response response;
-    int rvalue = parse_message(buffer, bytes_received, &response);
-    if (rvalue != STATUS_OK) {
-        fprintf(stderr, "Error parsing message\n");
-        socket_cleanup(client_socket);
-        return NULL;
-    }
-    printf("Received request (socket=%d): command=%d, payload=%s\n", client_socket, response.header.command, (char*)response.payload);
-    rvalue = handle_request(client_socket, &response.header, response.payload);
-    if (rvalue != STATUS_OK) {
-        fprintf(stderr, "Error handling request: status=%d\n", rvalue);
-    } else {
-        printf("Request handled\n");
-    }
-    socket_cleanup(client_socket);
-    destroy_response(&response);
-    return NULL;
+/**
+ * @brief Hands the listening sockets over to a new server process that connected to the upgrade socket.
+ * 
+ * Returns 0 on success; the caller must then stop accepting connections and drain.
+ */
+int hand_off_listeners(int upgrade_socket, const char* upgrade_path, const struct pollfd* listeners, int listener_count) {
+    int control_socket = accept(upgrade_socket, NULL, NULL);
+    if (control_socket == -1) {
+        perror("accept");
+        return -1;
+    }
+    // remove our upgrade socket first so that the new server can bind the same path once it has the listeners
+    close(upgrade_socket);
+    unlink(upgrade_path);
+    int fds[MAX_LISTENERS];
+    for (int i = 0; i < listener_count; i++) {
+        fds[i] = listeners[i].fd;
+    }
+    uint8_t count = listener_count;
+    ssize_t bytes_sent = send_all_with_fds(control_socket, &count, sizeof(count), fds, listener_count);
+    close(control_socket);
+    return bytes_sent == sizeof(count) ? 0 : -1;
 }
 
-int main() {
+int main(int argc, char *argv[]) {
+    struct option long_options[] = {
+        SOCKET_LONG_OPTIONS,
+        {"unix", required_argument, NULL, 'u'},
+        {"upgrade-socket", required_argument, NULL, 'g'},
+        {"takeover", no_argument, NULL, 't'},
+        {"max-active", required_argument, NULL, 'a'},
+        {"max-bulk", required_argument, NULL, 'k'},
+        {"aging-ms", required_argument, NULL, 'A'},
+        {"target-delay-ms", required_argument, NULL, 'T'},
+        {"delay-interval-ms", required_argument, NULL, 'I'},
+        {"root", required_argument, NULL, 'r'},
+        {"io-threads", required_argument, NULL, 'i'},
+        {"pack", required_argument, NULL, 'p'},
+        {"catalog", required_argument, NULL, 'c'},
+        {"catalog-scan-ms", required_argument, NULL, 'S'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    const char* unix_path = NULL;
+    const char* upgrade_path = NULL;
+    int takeover = 0;
+    size_t max_active = SCHEDULER_DEFAULT_MAX_RUNNING;
+    size_t max_bulk = SCHEDULER_DEFAULT_MAX_BULK;
+    uint64_t aging_ms = SCHEDULER_DEFAULT_AGING_MS;
+    uint64_t target_delay_ms = SCHEDULER_DEFAULT_TARGET_MS;
+    uint64_t delay_interval_ms = SCHEDULER_DEFAULT_INTERVAL_MS;
+    const char* roots[MAX_ROOTS];
+    size_t root_count = 0;
+    size_t io_threads = IO_POOL_DEFAULT_THREADS;
+    const char* pack_path = NULL;
+    const char* catalog_path = NULL;
+    uint64_t catalog_scan_ms = CATALOG_DEFAULT_SCAN_INTERVAL_MS;
+    int option;
+    int option_index;
+    long number;
+    // an invalid number (or one out of range, e.g. a negative count) falls through to the usage
+    while ((option = getopt_long(argc, argv, "u:g:ta:k:A:T:I:r:i:p:c:S:h", long_options, &option_index)) != -1) {
+        if (option == 0 && set_socket_option(&socket_options, long_options[option_index].name, optarg) == 0) {
+            continue;
+        }
+        if (option == 'u') {
+            unix_path = optarg;
+            continue;
+        }
+        if (option == 'g') {
+            upgrade_path = optarg;
+            continue;
+        }
+        if (option == 't') {
+            takeover = 1;
+            continue;
+        }
+        if (option == 'a' && parse_number(optarg, 1, LONG_MAX, &number) == 0) {
+            max_active = (size_t)number;
+            continue;
+        }
+        if (option == 'k' && parse_number(optarg, 1, LONG_MAX, &number) == 0) {
+            max_bulk = (size_t)number;
+            continue;
+        }
+        if (option == 'A' && parse_number(optarg, 0, LONG_MAX, &number) == 0) {
+            aging_ms = (uint64_t)number;
+            continue;
+        }
+        if (option == 'T' && parse_number(optarg, 0, LONG_MAX, &number) == 0) {
+            target_delay_ms = (uint64_t)number;
+            continue;
+        }
+        if (option == 'I' && parse_number(optarg, 0, LONG_MAX, &number) == 0) {
+            delay_interval_ms = (uint64_t)number;
+            continue;
+        }
+        if (option == 'r' && root_count < MAX_ROOTS) {
+            roots[root_count++] = optarg;
+            continue;
+        }
+        if (option == 'i' && parse_number(optarg, 1, LONG_MAX, &number) == 0) {
+            io_threads = (size_t)number;
+            continue;
+        }
+        if (option == 'p') {
+            pack_path = optarg;
+            continue;
+        }
+        if (option == 'c') {
+            catalog_path = optarg;
+            continue;
+        }
+        if (option == 'S' && parse_number(optarg, CATALOG_MIN_SCAN_INTERVAL_MS, LONG_MAX, &number) == 0) {
+            catalog_scan_ms = (uint64_t)number;
+            continue;
+        }
+        print_usage(argv[0]);
+        return option == 'h' ? 0 : 1;
+    }
+    if (takeover && upgrade_path == NULL) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    // with fewer active requests allowed than bulk requests, the bulk cap is the active limit
+    max_bulk = max_bulk < max_active ? max_bulk : max_active;
+    if (scheduler_init(&scheduler, max_active, max_bulk, aging_ms) != 0) {
+        fprintf(stderr, "Invalid scheduler limits: --max-active %zu --max-bulk %zu\n", max_active, max_bulk);
+        return 1;
+    }
+    scheduler_set_admission(&scheduler, target_delay_ms, delay_interval_ms);
+    if (root_count == 0) {
+        roots[root_count++] = SERVER_FILE_PATH;
+    }
+    int storage_status = server_storage_init(roots, root_count, io_threads);
+    if (storage_status != STATUS_OK) {
+        fprintf(stderr, "***ERROR*** opening storage roots (--root, --io-threads %zu): status=%d\n", io_threads, storage_status);
+        return 1;
+    }
+    for (size_t i = 0; i < root_count; i++) {
+        printf("Serving files from %s (%zu reader thread(s))\n", roots[i], io_threads);
+    }
+    if (pack_path != NULL) {
+        int status = server_pack_open(pack_path);
+        if (status != STATUS_OK) {
+            fprintf(stderr, "***ERROR*** opening pack %s: status=%d\n", pack_path, status);
+            return 1;
+        }
+        printf("Serving %" PRIu64 " file(s) from pack %s\n", server_pack()->entry_count, pack_path);
+    }
+    if (catalog_path != NULL) {
+        int status = server_catalog_open(catalog_path, catalog_scan_ms);
+        if (status != STATUS_OK) {
+            fprintf(stderr, "***ERROR*** opening catalog %s: status=%d\n", catalog_path, status);
+            return 1;
+        }
+        size_t cataloged = 0;
+        for (size_t i = 0; i < server_storage()->root_count; i++) {
+            cataloged += catalog_size(&server_storage()->roots[i].catalog);
+        }
+        printf("Catalog %s: %zu file(s), rescanned every %" PRIu64 "ms\n", catalog_path, cataloged, catalog_scan_ms);
+    }
+    int subscriptions_enabled = 0;
+    if (pack_path == NULL) {
+        int status = notifier_start(&notifier, server_storage());
+        if (status == STATUS_OK) {
+            subscriptions_enabled = 1;
+        } else {
+            // the files are still served; clients that subscribe are told subscriptions are not available
+            fprintf(stderr, "***ERROR*** watching the storage roots for subscriptions: status=%d\n", status);
+        }
+    }
+    if (connections_init(&connections, &scheduler, subscriptions_enabled ? &notifier : NULL) != STATUS_OK) {
+        perror("eventfd");
+        return 1;
+    }
     printf("\n\nServer started\n");
-    int server_socket = bind_or_die(PORT);
-    printf("Server bound to port %d\n", PORT);
-    listen_or_die(server_socket, 1);
+    // listen on TCP and, optionally, on a unix domain socket for clients on the same host; both
+    // carry the same protocol so a connection is handled the same way regardless of where it came from
+    struct pollfd listeners[MAX_LISTENERS + 1];
+    int listener_count = 0;
+    int tcp_listener = -1;
+    int unix_listener = -1;
+    if (takeover) {
+        // zero-downtime upgrade: the running server passes us its listening sockets, so connections
+        // queued in their backlogs (and new ones) are accepted by this process without a gap
+        int received[MAX_LISTENERS];
+        int received_count = take_over_listeners(upgrade_path, received, MAX_LISTENERS);
+        if (received_count == -1) {
+            return 1;
+        }
+        for (int i = 0; i < received_count; i++) {
+            if (is_unix_socket(received[i]) && unix_listener == -1) {
+                unix_listener = received[i];
+            } else if (!is_unix_socket(received[i]) && tcp_listener == -1) {
+                tcp_listener = received[i];
+            } else {
+                close(received[i]);
+            }
+        }
+        printf("Took over %d listening socket(s) from %s\n", received_count, upgrade_path);
+    }
+    if (tcp_listener == -1) {
+        tcp_listener = bind_or_die(PORT, &socket_options);
+        listen_or_die(tcp_listener, socket_options.backlog);
+        printf("Server bound to port %d\n", PORT);
+    }
+    listeners[listener_count++] = (struct pollfd){tcp_listener, POLLIN, 0};
+    if (unix_path != NULL && unix_listener == -1) {
+        unix_listener = bind_unix_or_die(unix_path, &socket_options);
+        listen_or_die(unix_listener, socket_options.backlog);
+        printf("Server bound to unix socket %s\n", unix_path);
+    }
+    if (unix_listener != -1) {
+        listeners[listener_count++] = (struct pollfd){unix_listener, POLLIN, 0};
+    }
+    // the upgrade socket is polled along with the listeners; a connection to it starts the handoff
+    int upgrade_socket = -1;
+    if (upgrade_path != NULL) {
+        upgrade_socket = bind_unix_or_die(upgrade_path, NULL);
+        listen_or_die(upgrade_socket, 1);
+        listeners[listener_count] = (struct pollfd){upgrade_socket, POLLIN, 0};
+        printf("Listening for upgrades on %s\n", upgrade_path);
+    }
+    int poll_count = listener_count + (upgrade_socket != -1);
     // for each connection, we are going to create a new thread to handle it
     while (1) {
         printf("\n---------\nWaiting for connection\n");
-        int* client_socket = malloc(sizeof(int));
-        *client_socket = accept_connection(server_socket);
-        if (*client_socket == -1) {
+        if (poll(listeners, poll_count, -1) == -1) {
+            perror("poll");
+            continue;
+        }
+        if (upgrade_socket != -1 && (listeners[listener_count].revents & POLLIN)) {
+            printf("Handing off listening sockets to the new server\n");
+            if (hand_off_listeners(upgrade_socket, upgrade_path, listeners, listener_count) == 0) {
+                break;
+            }
+            fprintf(stderr, "***ERROR*** handing off listening sockets; continuing to serve\n");
+            upgrade_socket = bind_unix_or_die(upgrade_path, NULL);
+            listen_or_die(upgrade_socket, 1);
+            listeners[listener_count].fd = upgrade_socket;
+            continue;
+        }
+        int server_socket = -1;
+        for (int i = 0; i < listener_count && server_socket == -1; i++) {
+            if (listeners[i].revents & POLLIN) {
+                server_socket = listeners[i].fd;
+            }
+        }
+        if (server_socket == -1) {
+            continue;
+        }
+        int client_socket = accept_connection(server_socket);
+        if (client_socket == -1) {
             fprintf(stderr, "***ERROR*** accepting connection\n");
-            free(client_socket);
             continue;
         }
         printf("Connection accepted\n");
+        // the connection is stored on the heap to pass into the thread; the worker frees it
+        ClientConnection* connection = connection_register(&connections, client_socket);
+        if (connection == NULL) {
+            fprintf(stderr, "***ERROR*** registering connection\n");
+            socket_cleanup(client_socket);
+            continue;
+        }
         pthread_t thread;
-        if (pthread_create(&thread, NULL, server_worker, client_socket) != 0) {
+        if (pthread_create(&thread, NULL, connection_serve, connection) != 0) {
             fprintf(stderr, "***ERROR*** creating thread\n");
-            socket_cleanup(*client_socket);
-            free(client_socket);
+            socket_cleanup(client_socket);
+            connection_unregister(connection);
         } else {
             // from man page:
             // "The pthread_detach() function is used to indicate to the implementation that storage
@@ -82,6 +354,20 @@ int main() {
             pthread_detach(thread);  // Detach the thread to reclaim resources after it finishes
         }
     }
-    socket_cleanup(server_socket);
+    // the new server owns the listening sockets now; only close our descriptors (shutdown would stop
+    // the sockets for both processes) and leave the unix socket file in place
+    for (int i = 0; i < listener_count; i++) {
+        close(listeners[i].fd);
+    }
+    // in-flight requests are finished; idle connections are closed and their clients reconnect to
+    // the new server
+    int remaining = connections_drain(&connections, DRAIN_TIMEOUT_SECONDS);
+    if (remaining > 0) {
+        fprintf(stderr, "***ERROR*** timed out draining %d connection(s)\n", remaining);
+    }
+    // let the new server's scanner take over the catalog
+    server_catalog_close();
+    printf("Rejected %" PRIu64 " request(s) while overloaded\n", scheduler_rejected(&scheduler));
+    printf("Upgrade complete; exiting\n");
     return 0;
 }
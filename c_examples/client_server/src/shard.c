@@ -0,0 +1,73 @@
+#include "protocol.h"
+#include "file_transfer.h"
+#include "shard.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int shard_map_init(ShardMap* map, const Endpoint* servers, size_t server_count, size_t virtual_nodes) {
+    map->servers = servers;
+    map->server_count = 0;
+    map->ring = (HashRing){NULL, 0, 0};
+    if (server_count == 0) {
+        return ERROR_INVALID_DATA_SIZE;
+    }
+    char (*names)[SHARD_NAME_SIZE] = malloc(server_count * SHARD_NAME_SIZE);
+    const char** nodes = malloc(server_count * sizeof(const char*));
+    int rvalue = ERROR_MEMORY_ALLOCATION_FAILED;
+    if (names == NULL || nodes == NULL) {
+        goto error;
+    }
+    // the servers are named by address and port on the ring, so that the placement doesn't depend on their order
+    rvalue = ERROR_INVALID_DATA_SIZE;
+    for (size_t i = 0; i < server_count; i++) {
+        int length = snprintf(names[i], SHARD_NAME_SIZE, "%s:%u", servers[i].address, servers[i].port);
+        if (length < 0 || length >= SHARD_NAME_SIZE || strlen(servers[i].address) >= POOL_ADDRESS_SIZE) {
+            goto error;
+        }
+        nodes[i] = names[i];
+    }
+    rvalue = hash_ring_init(&map->ring, nodes, server_count, virtual_nodes);
+    if (rvalue != STATUS_OK) {
+        goto error;
+    }
+    map->server_count = server_count;
+
+error:
+    free(names);
+    free(nodes);
+    return rvalue;
+}
+
+void shard_map_destroy(ShardMap* map) {
+    hash_ring_destroy(&map->ring);
+    map->server_count = 0;
+}
+
+const Endpoint* shard_map_lookup(const ShardMap* map, const char* file_name) {
+    return &map->servers[hash_ring_lookup(&map->ring, file_name)];
+}
+
+/**
+ * Sends a request for `file_name` to the server it is placed on.
+ */
+static int _shard_request(const ShardMap* map, ConnectionPool* pool, const char* file_name, Response* response,
+    int (*request)(int socket, const char* file_name, Response* response)) {
+    *response = (Response)RESPONSE_INIT;
+    const Endpoint* server = shard_map_lookup(map, file_name);
+    int socket = connection_pool_checkout(pool, server->address, server->port);
+    if (socket == -1) {
+        return ERROR_SEND_FAILED;
+    }
+    int rvalue = request(socket, file_name, response);
+    connection_pool_checkin(pool, server->address, server->port, socket, connection_pool_is_reusable(rvalue));
+    return rvalue;
+}
+
+int shard_request_file_metadata(const ShardMap* map, ConnectionPool* pool, const char* file_name, Response* response) {
+    return _shard_request(map, pool, file_name, response, request_file_metadata);
+}
+
+int shard_request_file_contents(const ShardMap* map, ConnectionPool* pool, const char* file_name, Response* response) {
+    return _shard_request(map, pool, file_name, response, request_file_contents);
+}
@@ -1,11 +1,18 @@
 #include "sockets.h"
+#include "utils.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <string.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 
 // adopted from:
 // https://beej.us/guide/bgnet/source/examples/client.c
@@ -13,89 +20,341 @@
 // https://www.youtube.com/watch?v=LtXEMwSG5-8 - Socket Programming Tutorial In C For Beginners | Part 1 | Eduonix
 // https://www.youtube.com/watch?v=mStnzIEprH8 - Socket Programming Tutorial In C For Beginners | Part 2 | Eduonix
 
-int connect_socket(const char* ip_address, in_addr_t port) {
-    // AF_INET: IPv4; SOCK_STREAM: TCP; 0: default protocol
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket == -1) {
-        perror("socket");
-        exit(1);
+/**
+ * Parses a non-negative integer option value; returns -1 if the value is missing or invalid.
+ */
+static int _parse_option_value(const char* value) {
+    long parsed;
+    return parse_number(value, 0, INT32_MAX, &parsed) == 0 ? (int)parsed : -1;
+}
+
+int set_socket_option(SocketOptions* options, const char* name, const char* value) {
+    // flags
+    if (strcmp(name, "nodelay") == 0) {
+        options->tcp_nodelay = 1;
+        return 0;
     }
-    struct sockaddr_in address;
-    address.sin_family = AF_INET;
-    address.sin_port = htons(port);  // host to network short
-    // address.sin_addr.s_addr = INADDR_ANY;
+    if (strcmp(name, "cork") == 0) {
+        options->tcp_cork = 1;
+        return 0;
+    }
+    if (strcmp(name, "quickack") == 0) {
+        options->tcp_quickack = 1;
+        return 0;
+    }
+    // options with values
+    int parsed = _parse_option_value(value);
+    if (parsed == -1) {
+        return -1;
+    }
+    if (strcmp(name, "sndbuf") == 0) {
+        options->send_buffer_size = parsed;
+    } else if (strcmp(name, "rcvbuf") == 0) {
+        options->receive_buffer_size = parsed;
+    } else if (strcmp(name, "fastopen") == 0) {
+        options->tcp_fastopen = parsed;
+    } else if (strcmp(name, "busy-poll") == 0) {
+        options->busy_poll = parsed;
+    } else if (strcmp(name, "notsent-lowat") == 0) {
+        options->notsent_lowat = parsed;
+    } else if (strcmp(name, "backlog") == 0) {
+        options->backlog = parsed;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Sets an integer socket option if `value` is non-zero; returns 0 on success (or if nothing was set).
+ */
+static int _set_int_option(int socket_fd, int level, int option_name, int value, const char* description) {
+    if (value == 0) {
+        return 0;
+    }
+    if (setsockopt(socket_fd, level, option_name, &value, sizeof(value)) == -1) {
+        perror(description);
+        return -1;
+    }
+    return 0;
+}
+
+int apply_socket_options(int socket_fd, const SocketOptions* options, int listening) {
+    if (options == NULL) {
+        return 0;
+    }
+    // socket level options apply to every socket type
+    // buffer sizes must be set before connect/listen so that the TCP window scale is negotiated accordingly
+    if (_set_int_option(socket_fd, SOL_SOCKET, SO_SNDBUF, options->send_buffer_size, "setsockopt(SO_SNDBUF)") == -1
+            || _set_int_option(socket_fd, SOL_SOCKET, SO_RCVBUF, options->receive_buffer_size, "setsockopt(SO_RCVBUF)") == -1
+            || _set_int_option(socket_fd, SOL_SOCKET, SO_BUSY_POLL, options->busy_poll, "setsockopt(SO_BUSY_POLL)") == -1) {
+        return -1;
+    }
+    // the remaining options are TCP specific
+    int domain;
+    socklen_t length = sizeof(domain);
+    if (getsockopt(socket_fd, SOL_SOCKET, SO_DOMAIN, &domain, &length) == -1 || (domain != AF_INET && domain != AF_INET6)) {
+        return 0;
+    }
+    if (_set_int_option(socket_fd, IPPROTO_TCP, TCP_NODELAY, options->tcp_nodelay, "setsockopt(TCP_NODELAY)") == -1
+            || _set_int_option(socket_fd, IPPROTO_TCP, TCP_CORK, options->tcp_cork, "setsockopt(TCP_CORK)") == -1
+            || _set_int_option(socket_fd, IPPROTO_TCP, TCP_QUICKACK, options->tcp_quickack, "setsockopt(TCP_QUICKACK)") == -1
+            || _set_int_option(socket_fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, options->notsent_lowat, "setsockopt(TCP_NOTSENT_LOWAT)") == -1) {
+        return -1;
+    }
+    // from man tcp(7): TCP_FASTOPEN takes the length of the queue of pending fast open requests on a
+    // listening socket; clients opt in with TCP_FASTOPEN_CONNECT so that data sent right after
+    // `connect` goes out with the SYN
+    // fast open depends on the kernel configuration (net.ipv4.tcp_fastopen), so it is best effort
+    // and the connection falls back to a regular handshake if it can't be enabled
+    if (options->tcp_fastopen != 0) {
+        int value = listening ? options->tcp_fastopen : 1;
+        setsockopt(socket_fd, IPPROTO_TCP, listening ? TCP_FASTOPEN : TCP_FASTOPEN_CONNECT, &value, sizeof(value));
+    }
+    return 0;
+}
+
+void socket_flush(int socket_fd) {
+    int corked = 0;
+    socklen_t length = sizeof(corked);
+    if (getsockopt(socket_fd, IPPROTO_TCP, TCP_CORK, &corked, &length) == -1 || !corked) {
+        return;
+    }
+    // from man tcp(7): "If this option is cleared, the pending output is sent"; cork again afterwards
+    // so that the next response is coalesced as well
+    int value = 0;
+    setsockopt(socket_fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+    value = 1;
+    setsockopt(socket_fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+}
+
+/**
+ * Fills `address` with either a unix domain socket address (if `ip_address` starts with
+ * UNIX_ADDRESS_PREFIX) or an IPv4 address/port. Returns 0 on success, or -1 if the address is invalid.
+ */
+static int _resolve_address(const char* ip_address, in_addr_t port, struct sockaddr_storage* address, socklen_t* address_length) {
+    memset(address, 0, sizeof(*address));
+    if (strncmp(ip_address, UNIX_ADDRESS_PREFIX, strlen(UNIX_ADDRESS_PREFIX)) == 0) {
+        const char* path = ip_address + strlen(UNIX_ADDRESS_PREFIX);
+        struct sockaddr_un* unix_address = (struct sockaddr_un*)address;
+        // sun_path is a fixed size array (108 bytes on Linux) that must hold the null terminator
+        if (strlen(path) == 0 || strlen(path) >= sizeof(unix_address->sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        unix_address->sun_family = AF_UNIX;
+        strcpy(unix_address->sun_path, path);
+        *address_length = sizeof(struct sockaddr_un);
+        return 0;
+    }
+    struct sockaddr_in* inet_address = (struct sockaddr_in*)address;
+    inet_address->sin_family = AF_INET;
+    inet_address->sin_port = htons(port);  // host to network short
     // from man:  "The inet_pton() function converts a presentation format address (that is,
     // printable form as held in a character string) to network format. It returns 1 if the address
     // was valid for the specified address family, or 0 if the address was not parseable in the
     // specified address family, or -1 if some system error occurred (in which case errno will have
     // been set).  This function is presently valid for AF_INET and AF_INET6.
-    int status = inet_pton(AF_INET, ip_address, &address.sin_addr);
-    if (status <= 0) {
+    if (inet_pton(AF_INET, ip_address, &inet_address->sin_addr) <= 0) {
+        return -1;
+    }
+    *address_length = sizeof(struct sockaddr_in);
+    return 0;
+}
+
+int connect_socket(const char* ip_address, in_addr_t port, const SocketOptions* options) {
+    struct sockaddr_storage address;
+    socklen_t address_length;
+    if (_resolve_address(ip_address, port, &address, &address_length) == -1) {
         perror("inet_aton");
-        socket_cleanup(server_socket);
         exit(1);
     }
-    status = connect(server_socket, (struct sockaddr *)&address, sizeof(address));
+    // AF_INET: IPv4 / AF_UNIX: unix domain socket; SOCK_STREAM: TCP (or a stream for AF_UNIX); 0: default protocol
+    int server_socket = socket(address.ss_family, SOCK_STREAM, 0);
+    if (server_socket == -1) {
+        perror("socket");
+        exit(1);
+    }
+    if (apply_socket_options(server_socket, options, 0) == -1) {
+        socket_cleanup(server_socket);
+        return -1;
+    }
+    int status = connect(server_socket, (struct sockaddr *)&address, address_length);
     if (status == -1) {
+        // preserve errno from connect for the caller (e.g. `perror("connect")`)
+        int connect_errno = errno;
+        close(server_socket);
+        errno = connect_errno;
         return -1;
     }
     return server_socket;
 }
 
 int connect_or_die(const char* ip_address, in_addr_t port) {
-    int server_socket = connect_socket(ip_address, port);
+    int server_socket = connect_socket(ip_address, port, NULL);
     if (server_socket == -1) {
         perror("connect");
-        socket_cleanup(server_socket);
         exit(1);
     }
     return server_socket;
 }
 
-int connect_with_retry_or_die(const char* ip_address, in_addr_t port, int max_retries, int retry_delay) {
-    // AF_INET: IPv4; SOCK_STREAM: TCP; 0: default protocol
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket == -1) {
-        perror("socket");
+int connect_with_retry_or_die(const char* ip_address, in_addr_t port, int max_retries, int retry_delay, const SocketOptions* options) {
+    RetryPolicy policy = {retry_delay * 1000, retry_delay * 1000, retry_delay * 1000, 0, max_retries};
+    int server_socket;
+    int status = connect_with_deadline(ip_address, port, &policy, options, &server_socket);
+    if (status != CONNECT_OK) {
+        if (status == CONNECT_ERROR_INVALID_ADDRESS) {
+            perror("inet_aton");
+        } else {
+            perror("connect");
+        }
         exit(1);
     }
-    struct sockaddr_in address;
-    address.sin_family = AF_INET;
-    address.sin_port = htons(port);  // host to network short
-    // address.sin_addr.s_addr = INADDR_ANY;
-    // from man:  "The inet_pton() function converts a presentation format address (that is,
-    // printable form as held in a character string) to network format. It returns 1 if the address
-    // was valid for the specified address family, or 0 if the address was not parseable in the
-    // specified address family, or -1 if some system error occurred (in which case errno will have
-    // been set).  This function is presently valid for AF_INET and AF_INET6.
-    int status = inet_pton(AF_INET, ip_address, &address.sin_addr);
-    if (status <= 0) {
-        perror("inet_aton");
-        goto error_close_socket;
+    return server_socket;
+}
+
+/**
+ * Makes a single non-blocking connection attempt that is abandoned after `timeout_ms`.
+ * Returns the connected (blocking) socket, or -1 with errno set (ETIMEDOUT if the attempt timed out).
+ */
+static int _connect_attempt(const struct sockaddr_storage* address, socklen_t address_length, int timeout_ms, const SocketOptions* options) {
+    // SOCK_NONBLOCK: connect returns immediately with EINPROGRESS instead of blocking for as long as
+    // the kernel's SYN retries take (over a minute by default)
+    int server_socket = socket(address->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server_socket == -1) {
+        return -1;
     }
-    for (int i = 0; i < max_retries; i++) {
-        if (connect(server_socket, (struct sockaddr *)&address, sizeof(address)) == 0) {
-            return server_socket;
+    if (apply_socket_options(server_socket, options, 0) == -1) {
+        goto error;
+    }
+    if (connect(server_socket, (const struct sockaddr*)address, address_length) == -1) {
+        if (errno != EINPROGRESS) {
+            goto error;
         }
-        // else status is -1
-        // if the connection was refused, sleep for a while and try again
-        // otherwise, print the error and exit
-        if (errno == ECONNREFUSED) {
-            sleep(retry_delay);
+        // from man connect(2): "It is possible to select(2) or poll(2) for completion by selecting the
+        // socket for writing. [...] use getsockopt(2) to read the SO_ERROR option [...] to determine
+        // whether connect() completed successfully"
+        struct pollfd poll_fd = {server_socket, POLLOUT, 0};
+        int ready;
+        do {
+            ready = poll(&poll_fd, 1, timeout_ms);
+        } while (ready == -1 && errno == EINTR);
+        if (ready == 0) {
+            errno = ETIMEDOUT;
+            goto error;
         }
-        else {
-            perror("connect");
-            goto error_close_socket;
+        int socket_error = 0;
+        socklen_t length = sizeof(socket_error);
+        if (ready == -1 || getsockopt(server_socket, SOL_SOCKET, SO_ERROR, &socket_error, &length) == -1) {
+            goto error;
+        }
+        if (socket_error != 0) {
+            errno = socket_error;
+            goto error;
+        }
+    }
+    // the rest of the library uses blocking sockets
+    int flags = fcntl(server_socket, F_GETFL);
+    if (flags == -1 || fcntl(server_socket, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+        goto error;
+    }
+    return server_socket;
+
+error:;
+    int attempt_errno = errno;
+    close(server_socket);
+    errno = attempt_errno;
+    return -1;
+}
+
+static int _is_retryable(int error, int family) {
+    // EAGAIN: the backlog of a (non-blocking) unix domain socket is full
+    // ENOENT: the unix domain socket file doesn't exist yet (e.g. the server is restarting)
+    return error == ECONNREFUSED || error == ETIMEDOUT || error == ECONNRESET
+        || (family == AF_UNIX && (error == EAGAIN || error == ENOENT));
+}
+
+int connect_with_deadline(const char* ip_address, in_addr_t port, const RetryPolicy* policy, const SocketOptions* options, int* socket_fd) {
+    static const RetryPolicy default_policy = RETRY_POLICY_INIT;
+    if (policy == NULL) {
+        policy = &default_policy;
+    }
+    *socket_fd = -1;
+    struct sockaddr_storage address;
+    socklen_t address_length;
+    if (_resolve_address(ip_address, port, &address, &address_length) == -1) {
+        errno = EINVAL;
+        return CONNECT_ERROR_INVALID_ADDRESS;
+    }
+    // each thread gets its own seed for the jitter so that concurrent clients don't retry in lockstep
+    static _Thread_local unsigned int seed = 0;
+    if (seed == 0) {
+        seed = (unsigned int)monotonic_time_ms() ^ (unsigned int)(uintptr_t)&seed;
+    }
+
+    uint64_t start_ms = monotonic_time_ms();
+    int backoff_ms = policy->initial_backoff_ms;
+    for (int attempt = 1; ; attempt++) {
+        // a timeout of -1 makes poll wait until the kernel gives up on the connection
+        int remaining_ms = policy->attempt_timeout_ms > 0 ? policy->attempt_timeout_ms : -1;
+        if (policy->deadline_ms > 0) {
+            int until_deadline_ms = policy->deadline_ms - (int)(monotonic_time_ms() - start_ms);
+            if (until_deadline_ms <= 0) {
+                errno = ETIMEDOUT;
+                return CONNECT_ERROR_TIMEOUT;
+            }
+            if (remaining_ms == -1 || until_deadline_ms < remaining_ms) {
+                remaining_ms = until_deadline_ms;
+            }
         }
+        *socket_fd = _connect_attempt(&address, address_length, remaining_ms, options);
+        if (*socket_fd != -1) {
+            return CONNECT_OK;
+        }
+        int attempt_errno = errno;
+        if (!_is_retryable(attempt_errno, address.ss_family)) {
+            return (attempt_errno == EMFILE || attempt_errno == ENFILE || attempt_errno == ENOBUFS) ? CONNECT_ERROR_SOCKET : CONNECT_ERROR_FAILED;
+        }
+        int last_status = attempt_errno == ETIMEDOUT ? CONNECT_ERROR_TIMEOUT : CONNECT_ERROR_REFUSED;
+        if (policy->max_attempts > 0 && attempt >= policy->max_attempts) {
+            return last_status;
+        }
+        // exponential backoff with "equal jitter": sleep somewhere between half and all of the backoff
+        int delay_ms = backoff_ms / 2 + (backoff_ms > 1 ? rand_r(&seed) % (backoff_ms - backoff_ms / 2) : 0);
+        if (policy->deadline_ms > 0) {
+            int until_deadline_ms = policy->deadline_ms - (int)(monotonic_time_ms() - start_ms);
+            if (until_deadline_ms <= delay_ms) {
+                // there is no time left for another attempt after sleeping
+                errno = attempt_errno;
+                return last_status;
+            }
+        }
+        struct timespec delay = {delay_ms / 1000, (delay_ms % 1000) * 1000000L};
+        while (nanosleep(&delay, &delay) == -1 && errno == EINTR);
+        backoff_ms = backoff_ms * 2 > policy->max_backoff_ms ? policy->max_backoff_ms : backoff_ms * 2;
+        errno = attempt_errno;
     }
-    perror("connect");
+}
 
-error_close_socket:
-    socket_cleanup(server_socket);
-    exit(1);
+const char* connect_error_string(int status) {
+    switch (status) {
+        case CONNECT_OK:
+            return "connected";
+        case CONNECT_ERROR_INVALID_ADDRESS:
+            return "invalid address";
+        case CONNECT_ERROR_SOCKET:
+            return "could not create socket";
+        case CONNECT_ERROR_TIMEOUT:
+            return "connection timed out";
+        case CONNECT_ERROR_REFUSED:
+            return "connection refused";
+        default:
+            return "connection failed";
+    }
 }
 
-int bind_or_die(in_addr_t port) {
+int bind_or_die(in_addr_t port, const SocketOptions* options) {
     // AF_INET: IPv4; SOCK_STREAM: TCP; 0: default protocol
     int server_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (server_socket == -1) {
@@ -112,6 +371,11 @@ int bind_or_die(in_addr_t port) {
         socket_cleanup(server_socket);
         exit(1);
     }
+    // options set on the listening socket (e.g. buffer sizes) are inherited by accepted sockets
+    if (apply_socket_options(server_socket, options, 1) == -1) {
+        socket_cleanup(server_socket);
+        exit(1);
+    }
 
     struct sockaddr_in address;
     address.sin_family = AF_INET;
@@ -126,6 +390,36 @@ int bind_or_die(in_addr_t port) {
     return server_socket;
 }
 
+int bind_unix_or_die(const char* path, const SocketOptions* options) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) == 0 || strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "bind: invalid unix socket path `%s`\n", path);
+        exit(1);
+    }
+    strcpy(address.sun_path, path);
+    // SOCK_STREAM keeps the same byte stream semantics as TCP, so the protocol framing is unchanged
+    int server_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_socket == -1) {
+        perror("socket");
+        exit(1);
+    }
+    if (apply_socket_options(server_socket, options, 1) == -1) {
+        socket_cleanup(server_socket);
+        exit(1);
+    }
+    // the socket file is left behind when a server exits (or crashes); SO_REUSEADDR has no effect on
+    // unix domain sockets, so remove a stale file before binding
+    unlink(path);
+    if (bind(server_socket, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        perror("bind");
+        socket_cleanup(server_socket);
+        exit(1);
+    }
+    return server_socket;
+}
+
 void listen_or_die(int server_socket, int backlog) {
     int status = listen(server_socket, backlog);
     if (status == -1) {
@@ -135,8 +429,9 @@ void listen_or_die(int server_socket, int backlog) {
     }
 }
 
-int accept_or_die(int server_socket) {
-    struct sockaddr_in client_addr;
+int accept_or_die(int server_socket, const SocketOptions* options) {
+    // sockaddr_storage is large enough for any address family (e.g. AF_INET or AF_UNIX)
+    struct sockaddr_storage client_addr;
     socklen_t client_len = sizeof(client_addr);
     int client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_len);
     if (client_socket == -1) {
@@ -144,6 +439,12 @@ int accept_or_die(int server_socket) {
         socket_cleanup(server_socket);
         exit(1);
     }
+    // not every option is inherited from the listening socket (e.g. TCP_QUICKACK), so apply them again
+    if (apply_socket_options(client_socket, options, 0) == -1) {
+        socket_cleanup(client_socket);
+        socket_cleanup(server_socket);
+        exit(1);
+    }
     return client_socket;
 }
 
@@ -157,6 +458,158 @@ ssize_t receive_or_die(int socket_fd, void* buffer, size_t length) {
     return bytes_received;
 }
 
+ssize_t send_all(int socket_fd, const void* buffer, size_t length) {
+    size_t total_sent = 0;
+    while (total_sent < length) {
+        // MSG_NOSIGNAL: return EPIPE instead of raising SIGPIPE (which terminates the process) if
+        // the peer has closed the connection
+        ssize_t bytes_sent = send(socket_fd, (const uint8_t*)buffer + total_sent, length - total_sent, MSG_NOSIGNAL);
+        if (bytes_sent == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_sent <= 0) {
+            return -1;
+        }
+        total_sent += bytes_sent;
+    }
+    return total_sent;
+}
+
+ssize_t receive_all(int socket_fd, void* buffer, size_t length) {
+    // TCP is a byte stream; a single recv can return less than a full message (or part of the next
+    // one), so we keep reading until we have exactly `length` bytes
+    size_t total_received = 0;
+    while (total_received < length) {
+        ssize_t bytes_received = recv(socket_fd, (uint8_t*)buffer + total_received, length - total_received, 0);
+        if (bytes_received == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_received == 0 && total_received == 0) {
+            return 0;
+        }
+        if (bytes_received <= 0) {
+            return -1;
+        }
+        total_received += bytes_received;
+    }
+    return total_received;
+}
+
+ssize_t send_all_with_fds(int socket_fd, const void* buffer, size_t length, const int* fds, int fd_count) {
+    if (length == 0 || fd_count < 1 || fd_count > MAX_PASSED_FDS) {
+        return -1;
+    }
+    // the descriptors travel as ancillary (control) data attached to the first byte of the message;
+    // the control buffer is a union so that it is correctly aligned for struct cmsghdr
+    union {
+        char buffer[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = {(void*)buffer, length};
+    struct msghdr message = {0};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+
+    ssize_t bytes_sent;
+    do {
+        bytes_sent = sendmsg(socket_fd, &message, MSG_NOSIGNAL);
+    } while (bytes_sent == -1 && errno == EINTR);
+    if (bytes_sent <= 0) {
+        return -1;
+    }
+    // the descriptors have been sent with the first chunk; send any remaining bytes normally
+    if ((size_t)bytes_sent < length && send_all(socket_fd, (const uint8_t*)buffer + bytes_sent, length - bytes_sent) == -1) {
+        return -1;
+    }
+    return length;
+}
+
+ssize_t send_all_with_fd(int socket_fd, const void* buffer, size_t length, int fd) {
+    return send_all_with_fds(socket_fd, buffer, length, &fd, 1);
+}
+
+ssize_t receive_all_with_fds(int socket_fd, void* buffer, size_t length, int* fds, int max_fds, int* fd_count) {
+    *fd_count = 0;
+    size_t total_received = 0;
+    while (total_received < length) {
+        union {
+            char buffer[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)];
+            struct cmsghdr align;
+        } control;
+        struct iovec iov = {(uint8_t*)buffer + total_received, length - total_received};
+        struct msghdr message = {0};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control.buffer;
+        message.msg_controllen = sizeof(control.buffer);
+        // MSG_CMSG_CLOEXEC: don't leak the received descriptors into child processes
+        ssize_t bytes_received = recvmsg(socket_fd, &message, MSG_CMSG_CLOEXEC);
+        if (bytes_received == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_received == 0 && total_received == 0) {
+            return 0;
+        }
+        if (bytes_received <= 0) {
+            goto error;
+        }
+        int lost = 0;
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            int received_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (int i = 0; i < received_count; i++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                // the kernel has already installed the descriptors in our process; close any we can't return
+                if (*fd_count < max_fds) {
+                    fds[(*fd_count)++] = fd;
+                } else {
+                    close(fd);
+                    lost = 1;
+                }
+            }
+        }
+        // MSG_CTRUNC: more descriptors were sent than fit in the control buffer; the kernel dropped them
+        if (lost || (message.msg_flags & MSG_CTRUNC)) {
+            goto error;
+        }
+        total_received += bytes_received;
+    }
+    return total_received;
+
+error:
+    for (int i = 0; i < *fd_count; i++) {
+        close(fds[i]);
+    }
+    *fd_count = 0;
+    return -1;
+}
+
+ssize_t receive_all_with_fd(int socket_fd, void* buffer, size_t length, int* fd) {
+    int fd_count;
+    ssize_t bytes_received = receive_all_with_fds(socket_fd, buffer, length, fd, 1, &fd_count);
+    if (fd_count == 0) {
+        *fd = -1;
+    }
+    return bytes_received;
+}
+
+int is_unix_socket(int socket_fd) {
+    int domain;
+    socklen_t length = sizeof(domain);
+    return getsockopt(socket_fd, SOL_SOCKET, SO_DOMAIN, &domain, &length) == 0 && domain == AF_UNIX;
+}
+
 void socket_cleanup(int socket_fd) {
     if (socket_fd != -1) {
         shutdown(socket_fd, SHUT_RDWR);
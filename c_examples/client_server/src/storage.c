@@ -0,0 +1,92 @@
+#include "utils.h"
+#include "protocol.h"
+#include "storage.h"
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+int storage_init(Storage* storage, const char* const* paths, size_t root_count, size_t io_threads) {
+    storage->root_count = 0;
+    if (root_count == 0) {
+        return ERROR_INVALID_DATA_SIZE;
+    }
+    int rvalue = hash_ring_init(&storage->ring, paths, root_count, HASH_RING_DEFAULT_VIRTUAL_NODES);
+    if (rvalue != STATUS_OK) {
+        return rvalue;
+    }
+    storage->roots = calloc(root_count, sizeof(StorageRoot));
+    if (storage->roots == NULL) {
+        hash_ring_destroy(&storage->ring);
+        return ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    rvalue = STATUS_OK;
+    for (size_t i = 0; i < root_count; i++) {
+        StorageRoot* root = &storage->roots[i];
+        root->path = strdup(paths[i]);
+        if (root->path == NULL || io_pool_init(&root->io_pool, io_threads) != 0) {
+            free(root->path);
+            storage_destroy(storage);
+            return ERROR_MEMORY_ALLOCATION_FAILED;
+        }
+        if (file_cache_init(&root->cache, paths[i], FILE_CACHE_DEFAULT_CAPACITY) != 0) {
+            rvalue = ERROR_FILE_OPEN_FAILED;
+        }
+        storage->root_count++;
+    }
+    return rvalue;
+}
+
+void storage_destroy(Storage* storage) {
+    storage_close_catalogs(storage);
+    for (size_t i = 0; i < storage->root_count; i++) {
+        StorageRoot* root = &storage->roots[i];
+        io_pool_destroy(&root->io_pool);
+        file_cache_destroy(&root->cache);
+        free(root->path);
+    }
+    free(storage->roots);
+    storage->roots = NULL;
+    storage->root_count = 0;
+    hash_ring_destroy(&storage->ring);
+}
+
+StorageRoot* storage_root(const Storage* storage, const char* name) {
+    return &storage->roots[hash_ring_lookup(&storage->ring, name)];
+}
+
+int storage_open_catalogs(Storage* storage, const char* path, uint64_t scan_interval_ms) {
+    for (size_t i = 0; i < storage->root_count; i++) {
+        StorageRoot* root = &storage->roots[i];
+        char catalog_path[4096];
+        if (storage->root_count == 1) {
+            snprintf(catalog_path, sizeof(catalog_path), "%s", path);
+        } else {
+            // named after the root rather than its position, so that reordering or adding roots doesn't
+            // hand a root the catalog of another one
+            uint64_t hash = fnv1a_hash(FNV1A_OFFSET_BASIS, root->path, strlen(root->path));
+            snprintf(catalog_path, sizeof(catalog_path), "%s.%016" PRIx64, path, hash);
+        }
+        if (catalog_open(&root->catalog, catalog_path, CATALOG_DEFAULT_CAPACITY) != STATUS_OK) {
+            storage_close_catalogs(storage);
+            return ERROR_FILE_OPEN_FAILED;
+        }
+        if (catalog_start_scanner(&root->catalog, root->path, scan_interval_ms) != 0) {
+            catalog_close(&root->catalog);
+            storage_close_catalogs(storage);
+            return ERROR_FILE_OPEN_FAILED;
+        }
+        root->cataloged = 1;
+    }
+    return STATUS_OK;
+}
+
+void storage_close_catalogs(Storage* storage) {
+    for (size_t i = 0; i < storage->root_count; i++) {
+        StorageRoot* root = &storage->roots[i];
+        if (root->cataloged) {
+            catalog_close(&root->catalog);
+            root->cataloged = 0;
+        }
+    }
+}
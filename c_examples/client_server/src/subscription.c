@@ -0,0 +1,903 @@
+#include "utils.h"
+#include "sockets.h"
+#include "protocol.h"
+#include "file_transfer.h"
+#include "subscription.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+
+// written (closed after writing), renamed in or out, touched, removed; directories are watched as they
+// are created. A file that is only created is notified when it is closed after writing, so a
+// subscriber doesn't see it empty first.
+#define _WATCH_MASK (IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CREATE | IN_ONLYDIR)
+#define _EVENT_BUFFER_SIZE 16384
+
+/**
+ * Growable array of patterns.
+ */
+typedef struct {
+    char** items;
+    size_t count;
+    size_t capacity;
+} _PatternList;
+
+/**
+ * A subscribed connection. Its socket is non-blocking: what it doesn't take is queued until it is
+ * writable, and a request is collected over as many reads as it arrives in.
+ *
+ * socket: the connection, or -1 once it is closed (it is removed at the end of the loop)
+ * names: the subscribed file names, sorted
+ * prefixes: the subscribed prefixes (without the `*`)
+ * queue: the messages the socket didn't take yet (SUBSCRIPTION_QUEUE_SIZE bytes, allocated while needed)
+ * queued: the number of bytes in `queue`
+ * request: the request being received
+ * received: the number of bytes of `request` received so far
+ */
+typedef struct _Subscriber {
+    int socket;
+    _PatternList names;
+    _PatternList prefixes;
+    uint8_t* queue;
+    size_t queued;
+    uint8_t request[MAX_MESSAGE_SIZE];
+    size_t received;
+} _Subscriber;
+
+/**
+ * A connection handed over by `notifier_add_subscriber`, with its first request.
+ */
+typedef struct _PendingSubscriber {
+    int socket;
+    Header header;
+    uint8_t* payload;
+    struct _PendingSubscriber* next;
+} _PendingSubscriber;
+
+/**
+ * A watched directory.
+ *
+ * root: the index of its root
+ * path: its path relative to the root ("" for the root), or NULL if the watch descriptor isn't in use
+ * files: the names of the files in it that are served, sorted (notified as removed if the directory goes)
+ */
+typedef struct _WatchedDirectory {
+    size_t root;
+    char* path;
+    _PatternList files;
+} _WatchedDirectory;
+
+static int _compare_names(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/**
+ * Inserts a copy of the first `length` characters of `pattern` at `index`.
+ */
+static int _pattern_list_insert(_PatternList* list, size_t index, const char* pattern, size_t length) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity == 0 ? 4 : list->capacity * 2;
+        char** items = realloc(list->items, capacity * sizeof(char*));
+        if (items == NULL) {
+            return ERROR_MEMORY_ALLOCATION_FAILED;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+    char* copy = strndup(pattern, length);
+    if (copy == NULL) {
+        return ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    memmove(list->items + index + 1, list->items + index, (list->count - index) * sizeof(char*));
+    list->items[index] = copy;
+    list->count++;
+    return STATUS_OK;
+}
+
+static int _pattern_list_add(_PatternList* list, const char* pattern, size_t length) {
+    return _pattern_list_insert(list, list->count, pattern, length);
+}
+
+/**
+ * Finds `name` in a sorted list. Returns non-zero if it is there; `index` is set to its position, or to
+ * where it would be inserted.
+ */
+static int _pattern_list_find(const _PatternList* list, const char* name, size_t* index) {
+    size_t low = 0;
+    size_t high = list->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        int order = strcmp(list->items[middle], name);
+        if (order == 0) {
+            *index = middle;
+            return 1;
+        }
+        if (order < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    *index = low;
+    return 0;
+}
+
+static void _pattern_list_remove(_PatternList* list, size_t index) {
+    free(list->items[index]);
+    memmove(list->items + index, list->items + index + 1, (list->count - index - 1) * sizeof(char*));
+    list->count--;
+}
+
+static void _pattern_list_destroy(_PatternList* list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->items[i]);
+    }
+    free(list->items);
+    *list = (_PatternList){NULL, 0, 0};
+}
+
+/**
+ * Returns non-zero if `pattern` is a valid file name, or a prefix (ending in `*`) of valid file names.
+ */
+static int _valid_pattern(const char* pattern) {
+    size_t length = strnlen(pattern, FILE_CACHE_MAX_NAME);
+    if (length == 0 || length == FILE_CACHE_MAX_NAME) {
+        return 0;
+    }
+    if (pattern[length - 1] != '*') {
+        return file_cache_valid_name(pattern);
+    }
+    // a prefix is valid if a name made by completing it is (e.g. "logs/" but not "../")
+    char name[FILE_CACHE_MAX_NAME];
+    memcpy(name, pattern, length - 1);
+    name[length - 1] = 'x';
+    name[length] = '\0';
+    return file_cache_valid_name(name);
+}
+
+static void _close_subscriber(Notifier* notifier, _Subscriber* subscriber) {
+    if (subscriber->socket == -1) {
+        return;
+    }
+    socket_cleanup(subscriber->socket);
+    subscriber->socket = -1;
+    free(subscriber->queue);
+    subscriber->queue = NULL;
+    subscriber->queued = 0;
+    pthread_mutex_lock(&notifier->mutex);
+    notifier->subscriber_count--;
+    pthread_mutex_unlock(&notifier->mutex);
+}
+
+/**
+ * Returns non-zero if a failed send or receive only has to be tried again later.
+ */
+static int _would_block(void) {
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+/**
+ * Sends a message to the subscriber without blocking. What the socket doesn't take now is queued and
+ * sent when it is writable again (in order: nothing is sent directly while the queue isn't empty). A
+ * subscriber whose queue would grow past SUBSCRIPTION_QUEUE_SIZE isn't reading its notifications; it is
+ * disconnected rather than holding up the others, or growing without bounds.
+ */
+static void _send_to(Notifier* notifier, _Subscriber* subscriber, const uint8_t* data, size_t size) {
+    if (subscriber->socket == -1) {
+        return;
+    }
+    size_t sent = 0;
+    if (subscriber->queued == 0) {
+        ssize_t bytes_sent = send(subscriber->socket, data, size, MSG_NOSIGNAL);
+        if (bytes_sent == -1 && !_would_block()) {
+            _close_subscriber(notifier, subscriber);
+            return;
+        }
+        sent = bytes_sent > 0 ? (size_t)bytes_sent : 0;
+        socket_flush(subscriber->socket);
+    }
+    if (sent == size) {
+        return;
+    }
+    if (subscriber->queued + (size - sent) > SUBSCRIPTION_QUEUE_SIZE) {
+        fprintf(stderr, "Subscriber not reading notifications; disconnecting (socket=%d)\n", subscriber->socket);
+        _close_subscriber(notifier, subscriber);
+        return;
+    }
+    if (subscriber->queue == NULL && (subscriber->queue = malloc(SUBSCRIPTION_QUEUE_SIZE)) == NULL) {
+        _close_subscriber(notifier, subscriber);
+        return;
+    }
+    memcpy(subscriber->queue + subscriber->queued, data + sent, size - sent);
+    subscriber->queued += size - sent;
+}
+
+/**
+ * Sends as much of the subscriber's queue as its socket takes (it polled writable).
+ */
+static void _send_queued(Notifier* notifier, _Subscriber* subscriber) {
+    ssize_t bytes_sent = send(subscriber->socket, subscriber->queue, subscriber->queued, MSG_NOSIGNAL);
+    if (bytes_sent == -1) {
+        if (!_would_block()) {
+            _close_subscriber(notifier, subscriber);
+        }
+        return;
+    }
+    socket_flush(subscriber->socket);
+    subscriber->queued -= (size_t)bytes_sent;
+    if (subscriber->queued > 0) {
+        memmove(subscriber->queue, subscriber->queue + bytes_sent, subscriber->queued);
+    } else {
+        // most subscribers keep up; the queue is only kept while it is needed
+        free(subscriber->queue);
+        subscriber->queue = NULL;
+    }
+}
+
+/**
+ * Answers a COMMAND_SUBSCRIBE request. Returns STATUS_OK, or ERROR_SEND_FAILED if the subscriber was
+ * disconnected.
+ */
+static int _send_answer(Notifier* notifier, _Subscriber* subscriber, uint8_t status, const char* error_message) {
+    Header header = {MESSAGE_RESPONSE, COMMAND_SUBSCRIBE, 0, 0, status, 0};
+    if (error_message != NULL) {
+        header.payload_size = strlen_null_term(error_message);
+    }
+    Message message;
+    int rvalue = create_message(&header, (const uint8_t*)error_message, &message);
+    if (rvalue != STATUS_OK) {
+        destroy_message(&message);
+        return rvalue;
+    }
+    _send_to(notifier, subscriber, message.data, message.size);
+    destroy_message(&message);
+    return subscriber->socket == -1 ? ERROR_SEND_FAILED : STATUS_OK;
+}
+
+/**
+ * Adds the patterns of a COMMAND_SUBSCRIBE request to the subscriber and answers it. The patterns are
+ * only added if all of them are valid.
+ *
+ * Returns the result of sending the answer.
+ */
+static int _subscribe(Notifier* notifier, _Subscriber* subscriber, const Header* header, const uint8_t* payload) {
+    const char* patterns = (const char*)payload;
+    size_t size = header->payload_size;
+    if (size == 0 || payload == NULL || patterns[size - 1] != '\0') {
+        return _send_answer(notifier, subscriber, ERROR_INVALID_DATA_SIZE, "Expected null terminated patterns");
+    }
+    for (size_t offset = 0; offset < size; offset += strlen(patterns + offset) + 1) {
+        if (!_valid_pattern(patterns + offset)) {
+            return _send_answer(notifier, subscriber, ERROR_INVALID_FILE_NAME, "Invalid pattern");
+        }
+    }
+    for (size_t offset = 0; offset < size; offset += strlen(patterns + offset) + 1) {
+        const char* pattern = patterns + offset;
+        size_t length = strlen(pattern);
+        int rvalue = pattern[length - 1] == '*'
+            ? _pattern_list_add(&subscriber->prefixes, pattern, length - 1)
+            : _pattern_list_add(&subscriber->names, pattern, length);
+        if (rvalue != STATUS_OK) {
+            return _send_answer(notifier, subscriber, rvalue, "Out of memory");
+        }
+    }
+    qsort(subscriber->names.items, subscriber->names.count, sizeof(char*), _compare_names);
+    return _send_answer(notifier, subscriber, STATUS_OK, NULL);
+}
+
+static int _matches(const _Subscriber* subscriber, const char* name) {
+    if (subscriber->names.count > 0 && bsearch(&name, subscriber->names.items, subscriber->names.count, sizeof(char*), _compare_names) != NULL) {
+        return 1;
+    }
+    for (size_t i = 0; i < subscriber->prefixes.count; i++) {
+        if (strncmp(name, subscriber->prefixes.items[i], strlen(subscriber->prefixes.items[i])) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Removes the subscribers whose connection was closed.
+ */
+static void _remove_closed(Notifier* notifier, size_t* count) {
+    size_t kept = 0;
+    for (size_t i = 0; i < *count; i++) {
+        _Subscriber* subscriber = &notifier->subscribers[i];
+        if (subscriber->socket == -1) {
+            _pattern_list_destroy(&subscriber->names);
+            _pattern_list_destroy(&subscriber->prefixes);
+        } else {
+            // the subscribers are large (they hold a request buffer): only the ones after a gap are moved
+            if (kept != i) {
+                notifier->subscribers[kept] = *subscriber;
+            }
+            kept++;
+        }
+    }
+    *count = kept;
+}
+
+/**
+ * Sends a notification to the subscribers of `name` (or to all of them for NOTIFICATION_LOST, with an
+ * empty name). `file_stat` is NULL unless the file changed.
+ */
+static void _notify(Notifier* notifier, size_t subscriber_count, const char* name, uint8_t status, const struct stat* file_stat) {
+    size_t name_size = strlen(name) + 1;
+    uint8_t payload[FILE_CACHE_MAX_NAME + SUBSCRIPTION_NOTIFICATION_SIZE] = {0};
+    memcpy(payload, name, name_size);
+    if (file_stat != NULL) {
+        uint64_t size = htobe64((uint64_t)file_stat->st_size);
+        uint64_t seconds = htobe64((uint64_t)file_stat->st_mtim.tv_sec);
+        uint32_t nanoseconds = htonl((uint32_t)file_stat->st_mtim.tv_nsec);
+        memcpy(payload + name_size, &size, sizeof(size));
+        memcpy(payload + name_size + 8, &seconds, sizeof(seconds));
+        memcpy(payload + name_size + 16, &nanoseconds, sizeof(nanoseconds));
+    }
+    Header header = {MESSAGE_NOTIFICATION, COMMAND_SUBSCRIBE, name_size + SUBSCRIPTION_NOTIFICATION_SIZE, 0, status, 0};
+    Message message;
+    if (create_message(&header, payload, &message) != STATUS_OK) {
+        destroy_message(&message);
+        return;
+    }
+    for (size_t i = 0; i < subscriber_count; i++) {
+        _Subscriber* subscriber = &notifier->subscribers[i];
+        if (subscriber->socket == -1 || (status != ERROR_OVERLOADED && !_matches(subscriber, name))) {
+            continue;
+        }
+        _send_to(notifier, subscriber, message.data, message.size);
+    }
+    destroy_message(&message);
+}
+
+/**
+ * Notifies the current state of the entry `entry` of the watched directory `wd`, named `name`: changed if
+ * it is a file, removed if it is gone. The directory's list of files is kept up to date with it.
+ */
+static void _notify_file(Notifier* notifier, size_t subscriber_count, int wd, const char* entry, const char* name) {
+    _WatchedDirectory* directory = &notifier->directories[wd];
+    const StorageRoot* watched = &notifier->storage->roots[directory->root];
+    // a file stored in a root other than the one its name is placed on isn't served
+    if (storage_root(notifier->storage, name) != watched) {
+        return;
+    }
+    size_t index;
+    int listed = _pattern_list_find(&directory->files, entry, &index);
+    struct stat file_stat;
+    // resolved like the cache does: a symlink out of the root isn't served, so it isn't notified either
+    if (file_cache_stat(watched->cache.root_fd, name, &file_stat) == -1) {
+        if (listed) {
+            _pattern_list_remove(&directory->files, index);
+        }
+        _notify(notifier, subscriber_count, name, ERROR_FILE_NOT_FOUND, NULL);
+    } else if (S_ISREG(file_stat.st_mode)) {
+        // without memory for the name, the file isn't notified as removed if its directory goes
+        if (!listed) {
+            _pattern_list_insert(&directory->files, index, entry, strlen(entry));
+        }
+        _notify(notifier, subscriber_count, name, STATUS_OK, &file_stat);
+    }
+}
+
+/**
+ * Joins a directory path and an entry name into `name`. Returns 0 if it doesn't fit in a file name.
+ */
+static int _join(const char* directory, const char* entry, char* name) {
+    int length = snprintf(name, FILE_CACHE_MAX_NAME, "%s%s%s", directory, directory[0] != '\0' ? "/" : "", entry);
+    return length > 0 && length < FILE_CACHE_MAX_NAME;
+}
+
+/**
+ * Watches the directory `path` of root `root` and the directories below it. With `notify_files`, the
+ * files found are notified (they were moved or created in before the directory was watched).
+ *
+ * Returns STATUS_OK, ERROR_FILE_OPEN_FAILED if the directory can't be watched, or
+ * ERROR_MEMORY_ALLOCATION_FAILED.
+ */
+static int _watch(Notifier* notifier, size_t subscriber_count, size_t root, const char* path, int notify_files) {
+    char full_path[PATH_MAX];
+    const char* root_path = notifier->storage->roots[root].path;
+    int length = snprintf(full_path, sizeof(full_path), "%s%s%s", root_path, path[0] != '\0' ? "/" : "", path);
+    if (length < 0 || (size_t)length >= sizeof(full_path)) {
+        return ERROR_FILE_OPEN_FAILED;
+    }
+    int wd = inotify_add_watch(notifier->inotify_fd, full_path, _WATCH_MASK);
+    if (wd == -1) {
+        return ERROR_FILE_OPEN_FAILED;
+    }
+    if ((size_t)wd >= notifier->directory_capacity) {
+        size_t capacity = notifier->directory_capacity == 0 ? 64 : notifier->directory_capacity;
+        while (capacity <= (size_t)wd) {
+            capacity *= 2;
+        }
+        _WatchedDirectory* directories = realloc(notifier->directories, capacity * sizeof(_WatchedDirectory));
+        if (directories == NULL) {
+            inotify_rm_watch(notifier->inotify_fd, wd);
+            return ERROR_MEMORY_ALLOCATION_FAILED;
+        }
+        memset(directories + notifier->directory_capacity, 0, (capacity - notifier->directory_capacity) * sizeof(_WatchedDirectory));
+        notifier->directories = directories;
+        notifier->directory_capacity = capacity;
+    }
+    // a directory that is watched again keeps its watch descriptor; its files are listed again below
+    char* copy = strdup(path);
+    if (copy == NULL) {
+        return ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    free(notifier->directories[wd].path);
+    _pattern_list_destroy(&notifier->directories[wd].files);
+    notifier->directories[wd] = (_WatchedDirectory){root, copy, {NULL, 0, 0}};
+
+    DIR* directory = opendir(full_path);
+    if (directory == NULL) {
+        // removed already; its IN_IGNORED event releases the watch
+        return STATUS_OK;
+    }
+    int rvalue = STATUS_OK;
+    struct dirent* entry;
+    while ((entry = readdir(directory)) != NULL && rvalue != ERROR_MEMORY_ALLOCATION_FAILED) {
+        char name[FILE_CACHE_MAX_NAME];
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 || !_join(path, entry->d_name, name)) {
+            continue;
+        }
+        int type = entry->d_type;
+        struct stat entry_stat;
+        if (type == DT_UNKNOWN && fstatat(dirfd(directory), entry->d_name, &entry_stat, AT_SYMLINK_NOFOLLOW) == 0) {
+            type = S_ISDIR(entry_stat.st_mode) ? DT_DIR : S_ISREG(entry_stat.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_DIR) {
+            // a subdirectory that can't be watched (e.g. removed meanwhile) is skipped
+            if (_watch(notifier, subscriber_count, root, name, notify_files) == ERROR_MEMORY_ALLOCATION_FAILED) {
+                rvalue = ERROR_MEMORY_ALLOCATION_FAILED;
+            }
+        } else if (type == DT_REG && notify_files) {
+            _notify_file(notifier, subscriber_count, wd, entry->d_name, name);
+        } else if (type == DT_REG && storage_root(notifier->storage, name) == &notifier->storage->roots[root]) {
+            // there when the notifier started: not notified, but listed so that it is notified as removed
+            // if its directory goes (sorted below)
+            _PatternList* files = &notifier->directories[wd].files;
+            if (_pattern_list_add(files, entry->d_name, strlen(entry->d_name)) != STATUS_OK) {
+                rvalue = ERROR_MEMORY_ALLOCATION_FAILED;
+            }
+        }
+    }
+    closedir(directory);
+    if (!notify_files) {
+        _PatternList* files = &notifier->directories[wd].files;
+        qsort(files->items, files->count, sizeof(char*), _compare_names);
+    }
+    return rvalue;
+}
+
+/**
+ * Stops watching a directory that is gone (removed or moved away), and notifies its files as removed:
+ * no event comes for the files of a directory that is moved away.
+ */
+static void _release_directory(Notifier* notifier, size_t subscriber_count, size_t wd) {
+    _WatchedDirectory* directory = &notifier->directories[wd];
+    for (size_t i = 0; i < directory->files.count; i++) {
+        char name[FILE_CACHE_MAX_NAME];
+        if (_join(directory->path, directory->files.items[i], name)) {
+            _notify(notifier, subscriber_count, name, ERROR_FILE_NOT_FOUND, NULL);
+        }
+    }
+    _pattern_list_destroy(&directory->files);
+    free(directory->path);
+    directory->path = NULL;
+}
+
+/**
+ * Stops watching the directory `path` of root `root` and the directories below it (it was removed or
+ * moved away).
+ */
+static void _unwatch(Notifier* notifier, size_t subscriber_count, size_t root, const char* path) {
+    size_t length = strlen(path);
+    for (size_t wd = 0; wd < notifier->directory_capacity; wd++) {
+        _WatchedDirectory* directory = &notifier->directories[wd];
+        if (directory->path != NULL && directory->root == root && strncmp(directory->path, path, length) == 0
+            && (directory->path[length] == '\0' || directory->path[length] == '/')) {
+            inotify_rm_watch(notifier->inotify_fd, wd);
+            _release_directory(notifier, subscriber_count, wd);
+        }
+    }
+}
+
+static void _read_events(Notifier* notifier, size_t subscriber_count) {
+    uint8_t buffer[_EVENT_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length = read(notifier->inotify_fd, buffer, sizeof(buffer));
+    // the events of one read often repeat a file (e.g. written, then touched); it is notified once
+    char previous[FILE_CACHE_MAX_NAME] = "";
+    size_t previous_root = 0;
+    for (ssize_t offset = 0; offset < length; ) {
+        const struct inotify_event* event = (const struct inotify_event*)(buffer + offset);
+        offset += sizeof(struct inotify_event) + event->len;
+        if (event->mask & IN_Q_OVERFLOW) {
+            _notify(notifier, subscriber_count, "", ERROR_OVERLOADED, NULL);
+            previous[0] = '\0';
+            continue;
+        }
+        if (event->wd < 0 || (size_t)event->wd >= notifier->directory_capacity || notifier->directories[event->wd].path == NULL) {
+            continue;
+        }
+        _WatchedDirectory* directory = &notifier->directories[event->wd];
+        if (event->mask & IN_IGNORED) {
+            // the directory was removed (its files were, and were notified, before) or its file system
+            // unmounted; the files still listed are gone with it
+            _release_directory(notifier, subscriber_count, event->wd);
+            continue;
+        }
+        char name[FILE_CACHE_MAX_NAME];
+        if (event->len == 0 || !_join(directory->path, event->name, name)) {
+            continue;
+        }
+        size_t root = directory->root;
+        if (event->mask & IN_ISDIR) {
+            if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                _watch(notifier, subscriber_count, root, name, 1);
+            } else if (event->mask & (IN_MOVED_FROM | IN_DELETE)) {
+                _unwatch(notifier, subscriber_count, root, name);
+            }
+            previous[0] = '\0';
+            continue;
+        }
+        if ((event->mask & IN_CREATE) || (root == previous_root && strcmp(name, previous) == 0)) {
+            continue;
+        }
+        // the file is notified as it is now, which covers the events that follow in this read
+        _notify_file(notifier, subscriber_count, event->wd, event->name, name);
+        memcpy(previous, name, sizeof(name));
+        previous_root = root;
+    }
+}
+
+/**
+ * Handles a request that was received completely.
+ */
+static void _handle_request(Notifier* notifier, _Subscriber* subscriber) {
+    Response request = RESPONSE_INIT;
+    if (parse_message(subscriber->request, subscriber->received, &request) != STATUS_OK) {
+        destroy_response(&request);
+        _close_subscriber(notifier, subscriber);
+        return;
+    }
+    int rvalue;
+    if (request.header.message_type == MESSAGE_REQUEST && request.header.command == COMMAND_SUBSCRIBE) {
+        rvalue = _subscribe(notifier, subscriber, &request.header, request.payload);
+    } else {
+        _send_answer(notifier, subscriber, ERROR_INVALID_COMMAND, "Only COMMAND_SUBSCRIBE can be sent on a subscribed connection");
+        rvalue = ERROR_INVALID_COMMAND;
+    }
+    destroy_response(&request);
+    if (rvalue != STATUS_OK) {
+        _close_subscriber(notifier, subscriber);
+    }
+}
+
+/**
+ * Receives what arrived on a subscribed connection (or the client closing it), without blocking: a
+ * request is handled once all of it is there, however many reads that takes.
+ */
+static void _receive_requests(Notifier* notifier, _Subscriber* subscriber) {
+    while (subscriber->socket != -1) {
+        // the header first, then the payload it announces
+        size_t expected = HEADER_SIZE;
+        if (subscriber->received >= HEADER_SIZE) {
+            Header header;
+            extract_header(subscriber->request, HEADER_SIZE, &header);
+            if (header.payload_size > MAX_PAYLOAD_SIZE) {
+                _close_subscriber(notifier, subscriber);
+                return;
+            }
+            expected += header.payload_size;
+        }
+        if (subscriber->received == expected) {
+            _handle_request(notifier, subscriber);
+            subscriber->received = 0;
+            continue;
+        }
+        ssize_t bytes_received = recv(subscriber->socket, subscriber->request + subscriber->received, expected - subscriber->received, 0);
+        if (bytes_received == -1 && _would_block()) {
+            return;
+        }
+        if (bytes_received <= 0) {
+            _close_subscriber(notifier, subscriber);
+            return;
+        }
+        subscriber->received += (size_t)bytes_received;
+    }
+}
+
+/**
+ * Takes the connections handed over since the last time. Returns the new number of subscribers.
+ */
+static size_t _take_pending(Notifier* notifier, _PendingSubscriber* pending, size_t subscriber_count) {
+    while (pending != NULL) {
+        _PendingSubscriber* next = pending->next;
+        if (subscriber_count == notifier->subscriber_capacity) {
+            size_t capacity = notifier->subscriber_capacity == 0 ? 8 : notifier->subscriber_capacity * 2;
+            _Subscriber* subscribers = realloc(notifier->subscribers, capacity * sizeof(_Subscriber));
+            if (subscribers != NULL) {
+                notifier->subscribers = subscribers;
+                notifier->subscriber_capacity = capacity;
+            }
+        }
+        if (subscriber_count < notifier->subscriber_capacity) {
+            _Subscriber* subscriber = &notifier->subscribers[subscriber_count++];
+            *subscriber = (_Subscriber){.socket = pending->socket};
+            // an invalid first request leaves nothing to subscribe to
+            if (_subscribe(notifier, subscriber, &pending->header, pending->payload) != STATUS_OK
+                || (subscriber->names.count == 0 && subscriber->prefixes.count == 0)) {
+                _close_subscriber(notifier, subscriber);
+            }
+        } else {
+            _Subscriber rejected = {.socket = pending->socket};
+            _send_answer(notifier, &rejected, ERROR_MEMORY_ALLOCATION_FAILED, "Out of memory");
+            _close_subscriber(notifier, &rejected);
+        }
+        free(pending->payload);
+        free(pending);
+        pending = next;
+    }
+    return subscriber_count;
+}
+
+static void* _notifier_worker(void* arg) {
+    Notifier* notifier = (Notifier*)arg;
+    size_t subscriber_count = 0;
+    struct pollfd* fds = NULL;
+    size_t fd_capacity = 0;
+    while (1) {
+        pthread_mutex_lock(&notifier->mutex);
+        int stop = notifier->stop;
+        _PendingSubscriber* pending = notifier->pending;
+        notifier->pending = NULL;
+        pthread_mutex_unlock(&notifier->mutex);
+        subscriber_count = _take_pending(notifier, pending, subscriber_count);
+        _remove_closed(notifier, &subscriber_count);
+        if (stop) {
+            break;
+        }
+        if (subscriber_count + 2 > fd_capacity) {
+            struct pollfd* grown = realloc(fds, (subscriber_count + 2) * sizeof(struct pollfd));
+            if (grown == NULL) {
+                // try again with the next event
+                usleep(1000);
+                continue;
+            }
+            fds = grown;
+            fd_capacity = subscriber_count + 2;
+        }
+        fds[0] = (struct pollfd){notifier->inotify_fd, POLLIN, 0};
+        fds[1] = (struct pollfd){notifier->wakeup_fd, POLLIN, 0};
+        for (size_t i = 0; i < subscriber_count; i++) {
+            _Subscriber* subscriber = &notifier->subscribers[i];
+            // writable is only waited for while notifications are queued
+            fds[i + 2] = (struct pollfd){subscriber->socket, POLLIN | (subscriber->queued > 0 ? POLLOUT : 0), 0};
+        }
+        if (poll(fds, subscriber_count + 2, -1) == -1) {
+            continue;
+        }
+        if (fds[1].revents & POLLIN) {
+            eventfd_t count;
+            eventfd_read(notifier->wakeup_fd, &count);
+        }
+        if (fds[0].revents & POLLIN) {
+            _read_events(notifier, subscriber_count);
+        }
+        for (size_t i = 0; i < subscriber_count; i++) {
+            _Subscriber* subscriber = &notifier->subscribers[i];
+            // closed while notifying, if the subscriber stopped reading
+            if (subscriber->socket != -1 && subscriber->queued > 0 && (fds[i + 2].revents & POLLOUT)) {
+                _send_queued(notifier, subscriber);
+            }
+            if (subscriber->socket != -1 && (fds[i + 2].revents & ~POLLOUT) != 0) {
+                _receive_requests(notifier, subscriber);
+            }
+        }
+    }
+    for (size_t i = 0; i < subscriber_count; i++) {
+        _close_subscriber(notifier, &notifier->subscribers[i]);
+    }
+    _remove_closed(notifier, &subscriber_count);
+    free(fds);
+    return NULL;
+}
+
+int notifier_start(Notifier* notifier, const Storage* storage) {
+    notifier->storage = storage;
+    notifier->pending = NULL;
+    notifier->subscriber_count = 0;
+    notifier->stop = 0;
+    notifier->subscribers = NULL;
+    notifier->subscriber_capacity = 0;
+    notifier->directories = NULL;
+    notifier->directory_capacity = 0;
+    notifier->wakeup_fd = -1;
+    pthread_mutex_init(&notifier->mutex, NULL);
+    notifier->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    int rvalue = ERROR_FILE_OPEN_FAILED;
+    if (notifier->inotify_fd == -1) {
+        goto error;
+    }
+    notifier->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (notifier->wakeup_fd == -1) {
+        goto error;
+    }
+    for (size_t i = 0; i < storage->root_count; i++) {
+        rvalue = _watch(notifier, 0, i, "", 0);
+        if (rvalue != STATUS_OK) {
+            goto error;
+        }
+    }
+    if (pthread_create(&notifier->thread, NULL, _notifier_worker, notifier) != 0) {
+        rvalue = ERROR_MEMORY_ALLOCATION_FAILED;
+        goto error;
+    }
+    return STATUS_OK;
+
+error:
+    for (size_t wd = 0; wd < notifier->directory_capacity; wd++) {
+        free(notifier->directories[wd].path);
+        _pattern_list_destroy(&notifier->directories[wd].files);
+    }
+    free(notifier->directories);
+    notifier->directories = NULL;
+    notifier->directory_capacity = 0;
+    if (notifier->wakeup_fd != -1) {
+        close(notifier->wakeup_fd);
+    }
+    if (notifier->inotify_fd != -1) {
+        close(notifier->inotify_fd);
+    }
+    pthread_mutex_destroy(&notifier->mutex);
+    return rvalue;
+}
+
+void notifier_stop(Notifier* notifier) {
+    pthread_mutex_lock(&notifier->mutex);
+    notifier->stop = 1;
+    pthread_mutex_unlock(&notifier->mutex);
+    eventfd_write(notifier->wakeup_fd, 1);
+    pthread_join(notifier->thread, NULL);
+    free(notifier->subscribers);
+    for (size_t wd = 0; wd < notifier->directory_capacity; wd++) {
+        free(notifier->directories[wd].path);
+        _pattern_list_destroy(&notifier->directories[wd].files);
+    }
+    free(notifier->directories);
+    close(notifier->wakeup_fd);
+    close(notifier->inotify_fd);
+    pthread_mutex_destroy(&notifier->mutex);
+}
+
+int notifier_add_subscriber(Notifier* notifier, int socket, const Header* header, const uint8_t* payload) {
+    _PendingSubscriber* pending = malloc(sizeof(_PendingSubscriber));
+    uint8_t* copy = header->payload_size > 0 ? malloc(header->payload_size) : NULL;
+    if (pending == NULL || (header->payload_size > 0 && copy == NULL)) {
+        free(pending);
+        free(copy);
+        return ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    if (copy != NULL) {
+        memcpy(copy, payload, header->payload_size);
+    }
+    pending->socket = socket;
+    pending->header = *header;
+    pending->payload = copy;
+    // one thread serves all subscribers: a subscriber that doesn't read its notifications, or sends
+    // half a request, must not hold it up at all
+    int flags = fcntl(socket, F_GETFL);
+    fcntl(socket, F_SETFL, flags | O_NONBLOCK);
+    pthread_mutex_lock(&notifier->mutex);
+    pending->next = notifier->pending;
+    notifier->pending = pending;
+    notifier->subscriber_count++;
+    pthread_mutex_unlock(&notifier->mutex);
+    eventfd_write(notifier->wakeup_fd, 1);
+    return STATUS_OK;
+}
+
+size_t notifier_subscriber_count(Notifier* notifier) {
+    pthread_mutex_lock(&notifier->mutex);
+    size_t count = notifier->subscriber_count;
+    pthread_mutex_unlock(&notifier->mutex);
+    return count;
+}
+
+int send_subscribe(int socket, const char* const* patterns, size_t pattern_count) {
+    if (pattern_count == 0) {
+        return ERROR_INVALID_DATA_SIZE;
+    }
+    uint8_t payload[MAX_PAYLOAD_SIZE];
+    size_t payload_size = 0;
+    for (size_t i = 0; i < pattern_count; i++) {
+        size_t size = strlen_null_term(patterns[i]);
+        if (payload_size + size > MAX_PAYLOAD_SIZE) {
+            return ERROR_MAX_PAYLOAD_SIZE_EXCEEDED;
+        }
+        memcpy(payload + payload_size, patterns[i], size);
+        payload_size += size;
+    }
+    Header header = {MESSAGE_REQUEST, COMMAND_SUBSCRIBE, payload_size, 0, NOT_SET, 0};
+    Message message;
+    int rvalue = create_message(&header, payload, &message);
+    if (rvalue != STATUS_OK) {
+        destroy_message(&message);
+        return rvalue;
+    }
+    ssize_t bytes_sent = send_all(socket, message.data, message.size);
+    destroy_message(&message);
+    if (bytes_sent <= 0) {
+        return ERROR_SEND_FAILED;
+    }
+    socket_flush(socket);
+    return STATUS_OK;
+}
+
+int request_subscribe(int socket, const char* const* patterns, size_t pattern_count) {
+    int rvalue = send_subscribe(socket, patterns, pattern_count);
+    if (rvalue != STATUS_OK) {
+        return rvalue;
+    }
+    // nothing is notified before the first subscription is answered
+    Notification notification;
+    rvalue = receive_notification(socket, &notification);
+    if (rvalue != STATUS_OK) {
+        return rvalue;
+    }
+    return notification.kind == NOTIFICATION_SUBSCRIBED ? notification.status : ERROR_UNEXPECTED_MESSAGE_TYPE;
+}
+
+int receive_notification(int socket, Notification* notification) {
+    memset(notification, 0, sizeof(Notification));
+    uint8_t buffer[MAX_MESSAGE_SIZE];
+    ssize_t bytes_received = receive_message(socket, buffer, MAX_MESSAGE_SIZE);
+    if (bytes_received <= 0) {
+        return ERROR_RECEIVE_FAILED;
+    }
+    Header header;
+    int rvalue = extract_header(buffer, bytes_received, &header);
+    if (rvalue != STATUS_OK) {
+        return rvalue;
+    }
+    if (header.message_type == MESSAGE_RESPONSE && header.command == COMMAND_SUBSCRIBE) {
+        notification->kind = NOTIFICATION_SUBSCRIBED;
+        notification->status = header.status;
+        return STATUS_OK;
+    }
+    if (header.message_type != MESSAGE_NOTIFICATION) {
+        return ERROR_UNEXPECTED_MESSAGE_TYPE;
+    }
+    const uint8_t* payload = buffer + HEADER_SIZE;
+    size_t name_length = strnlen((const char*)payload, header.payload_size);
+    if (header.payload_size > (size_t)bytes_received - HEADER_SIZE || name_length >= FILE_CACHE_MAX_NAME
+        || header.payload_size != name_length + 1 + SUBSCRIPTION_NOTIFICATION_SIZE) {
+        return ERROR_INVALID_DATA_SIZE;
+    }
+    memcpy(notification->name, payload, name_length + 1);
+    uint64_t size;
+    uint64_t seconds;
+    uint32_t nanoseconds;
+    memcpy(&size, payload + name_length + 1, sizeof(size));
+    memcpy(&seconds, payload + name_length + 9, sizeof(seconds));
+    memcpy(&nanoseconds, payload + name_length + 17, sizeof(nanoseconds));
+    notification->size = be64toh(size);
+    notification->mtime.tv_sec = (time_t)be64toh(seconds);
+    notification->mtime.tv_nsec = (long)ntohl(nanoseconds);
+    notification->status = header.status;
+    notification->kind = header.status == STATUS_OK ? NOTIFICATION_CHANGED
+        : header.status == ERROR_FILE_NOT_FOUND ? NOTIFICATION_REMOVED : NOTIFICATION_LOST;
+    return STATUS_OK;
+}
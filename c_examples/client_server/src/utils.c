@@ -1,5 +1,8 @@
 #include "utils.h"
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 
 int utils_function() {
     return 0;
@@ -12,3 +15,38 @@ int utils_function() {
 int strlen_null_term(const char *string) {
     return strlen(string) + 1;
 }
+
+uint64_t monotonic_time_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+uint64_t monotonic_time_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+uint64_t fnv1a_hash(uint64_t hash, const void* data, size_t length) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+int parse_number(const char* value, long min, long max, long* number) {
+    if (value == NULL || *value == '\0') {
+        return -1;
+    }
+    char* end;
+    errno = 0;
+    long parsed = strtol(value, &end, 10);
+    if (*end != '\0' || errno == ERANGE || parsed < min || parsed > max) {
+        return -1;
+    }
+    *number = parsed;
+    return 0;
+}
@@ -0,0 +1,133 @@
+#include "sockets.h"
+#include "protocol.h"
+#include "file_transfer.h"
+#include "connection_pool.h"
+#include "batch.h"
+#include "test_server.h"
+#include "unity.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#define PORT 9006
+#define ADDRESS TEST_SERVER_ADDRESS
+
+TestServer server = TEST_SERVER_INIT(PORT, 0);
+char output_directory[] = "/tmp/client_server_test_batch_XXXXXX";
+
+/**
+ * Runs a batch over a fresh connection pool with the manifest `contents`.
+ */
+int run_batch(const char* contents, size_t concurrency, BatchStats* stats) {
+    ConnectionPool pool;
+    TEST_ASSERT_EQUAL_INT(0, connection_pool_init(&pool, concurrency, 10000, NULL));
+    BatchOptions options = {&pool, ADDRESS, PORT, output_directory, concurrency, 0, 0};
+    FILE* manifest = fmemopen((void*)contents, strlen(contents), "r");
+    TEST_ASSERT_NOT_NULL(manifest);
+    int rvalue = batch_fetch(&options, manifest, stats);
+    fclose(manifest);
+    connection_pool_destroy(&pool);
+    return rvalue;
+}
+
+void assert_fetched(const char* file_name) {
+    char expected_path[512];
+    char path[512];
+    snprintf(expected_path, sizeof(expected_path), "%s/%s", SERVER_FILE_PATH, file_name);
+    snprintf(path, sizeof(path), "%s/%s", output_directory, file_name);
+    FILE* expected_file = fopen(expected_path, "rb");
+    FILE* file = fopen(path, "rb");
+    TEST_ASSERT_NOT_NULL(expected_file);
+    TEST_ASSERT_NOT_NULL(file);
+    int expected;
+    do {
+        expected = fgetc(expected_file);
+        TEST_ASSERT_EQUAL_INT(expected, fgetc(file));
+    } while (expected != EOF);
+    fclose(expected_file);
+    fclose(file);
+}
+
+/**
+ * Removes the fetched files; fails if anything else (e.g. a temporary file) is left behind.
+ */
+void clean_output_directory() {
+    DIR* directory = opendir(output_directory);
+    TEST_ASSERT_NOT_NULL(directory);
+    struct dirent* entry;
+    while ((entry = readdir(directory)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        TEST_ASSERT_NULL_MESSAGE(strstr(entry->d_name, ".part"), entry->d_name);
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", output_directory, entry->d_name);
+        unlink(path);
+    }
+    closedir(directory);
+}
+
+void test__batch_fetch__fetches_files() {
+    BatchStats stats;
+    const char* manifest = "test.txt\ntest_multiple_chunks.txt\r\n\n";
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, run_batch(manifest, 2, &stats));
+    TEST_ASSERT_EQUAL_size_t(2, stats.files);
+    TEST_ASSERT_EQUAL_size_t(2, stats.fetched);
+    TEST_ASSERT_EQUAL_size_t(0, stats.failed);
+    TEST_ASSERT_GREATER_THAN_UINT64(MAX_PAYLOAD_SIZE, stats.bytes);
+    assert_fetched("test.txt");
+    assert_fetched("test_multiple_chunks.txt");
+    clean_output_directory();
+}
+
+void test__batch_fetch__counts_failures() {
+    BatchStats stats;
+    const char* manifest = "missing.txt\ntest.txt\n../test.txt\n/etc/passwd\n";
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, run_batch(manifest, 1, &stats));
+    TEST_ASSERT_EQUAL_size_t(4, stats.files);
+    TEST_ASSERT_EQUAL_size_t(1, stats.fetched);
+    TEST_ASSERT_EQUAL_size_t(3, stats.failed);
+    assert_fetched("test.txt");
+    clean_output_directory();
+}
+
+void test__batch_fetch__reuses_connections() {
+    char manifest[4096] = "";
+    for (int i = 0; i < 100; i++) {
+        strcat(manifest, i % 2 == 0 ? "test.txt\n" : "test_multiple_chunks.txt\n");
+    }
+    int connections_before = test_server_accepted(&server);
+    BatchStats stats;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, run_batch(manifest, 4, &stats));
+    TEST_ASSERT_EQUAL_size_t(100, stats.files);
+    TEST_ASSERT_EQUAL_size_t(100, stats.fetched);
+    TEST_ASSERT_EQUAL_size_t(0, stats.failed);
+    // one connection per fetching thread at most, not one per file
+    TEST_ASSERT_LESS_OR_EQUAL_INT(4, test_server_accepted(&server) - connections_before);
+    assert_fetched("test.txt");
+    assert_fetched("test_multiple_chunks.txt");
+    clean_output_directory();
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+int main(void) {
+    if (mkdtemp(output_directory) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    UNITY_BEGIN();
+    test_server_start(&server);
+
+    RUN_TEST(test__batch_fetch__fetches_files);
+    RUN_TEST(test__batch_fetch__counts_failures);
+    RUN_TEST(test__batch_fetch__reuses_connections);
+
+    test_server_stop(&server);
+    rmdir(output_directory);
+    return UNITY_END();
+}
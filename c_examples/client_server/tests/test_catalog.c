@@ -0,0 +1,289 @@
+#include "utils.h"
+#include "protocol.h"
+#include "catalog.h"
+#include "unity.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+char root[] = "/tmp/client_server_test_catalog_XXXXXX";
+char catalog_path[] = "/tmp/client_server_test_catalog_catalog_XXXXXX";
+
+void write_file(const char* name, const char* contents) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    FILE* file = fopen(path, "w");
+    TEST_ASSERT_NOT_NULL(file);
+    fputs(contents, file);
+    fclose(file);
+}
+
+/**
+ * Replaces a file atomically (the scanner never sees it half written).
+ */
+void replace_file(const char* name, const char* contents) {
+    char path[256];
+    char temporary_path[300];
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", path);
+    FILE* file = fopen(temporary_path, "w");
+    TEST_ASSERT_NOT_NULL(file);
+    fputs(contents, file);
+    fclose(file);
+    TEST_ASSERT_EQUAL_INT(0, rename(temporary_path, path));
+}
+
+void remove_file(const char* name) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    unlink(path);
+}
+
+uint64_t hash_of(const char* contents) {
+    return fnv1a_hash(FNV1A_OFFSET_BASIS, contents, strlen(contents));
+}
+
+void assert_cataloged(const Catalog* catalog, const char* name, const char* contents) {
+    CatalogEntry entry;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, catalog_lookup(catalog, name, &entry));
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    struct stat file_stat;
+    TEST_ASSERT_EQUAL_INT(0, stat(path, &file_stat));
+    TEST_ASSERT_EQUAL_UINT64(strlen(contents), entry.size);
+    TEST_ASSERT_EQUAL_UINT64(hash_of(contents), entry.hash);
+    TEST_ASSERT_EQUAL_UINT64(file_stat.st_ino, entry.inode);
+    TEST_ASSERT_EQUAL_INT64(file_stat.st_mtim.tv_sec, entry.mtime.tv_sec);
+    TEST_ASSERT_EQUAL_INT64(file_stat.st_mtim.tv_nsec, entry.mtime.tv_nsec);
+}
+
+void setUp(void) {
+    mkdir(root, 0700);
+    char directory[256];
+    snprintf(directory, sizeof(directory), "%s/directory", root);
+    mkdir(directory, 0700);
+    write_file("a.txt", "contents of a");
+    write_file("b.txt", "contents of b");
+    write_file("directory/c.txt", "contents of c");
+    // links are not followed out of the root
+    char link[256];
+    snprintf(link, sizeof(link), "%s/link", root);
+    symlink("/etc", link);
+}
+
+void tearDown(void) {
+    remove_file("a.txt");
+    remove_file("b.txt");
+    remove_file("d.txt");
+    remove_file("directory/c.txt");
+    remove_file("link");
+    char directory[256];
+    snprintf(directory, sizeof(directory), "%s/directory", root);
+    rmdir(directory);
+    unlink(catalog_path);
+}
+
+void test__catalog_lookup__before_scan() {
+    Catalog catalog;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, catalog_open(&catalog, catalog_path, 64));
+    TEST_ASSERT_EQUAL_UINT64(64, catalog.capacity);
+    CatalogEntry entry;
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_NOT_FOUND, catalog_lookup(&catalog, "a.txt", &entry));
+    TEST_ASSERT_EQUAL_size_t(0, catalog_size(&catalog));
+    catalog_close(&catalog);
+    TEST_ASSERT_NULL(catalog.data);
+}
+
+void test__catalog_scan_lookup() {
+    Catalog catalog;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, catalog_open(&catalog, catalog_path, 50));
+    TEST_ASSERT_EQUAL_UINT64(64, catalog.capacity);
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, catalog_scan(&catalog, root));
+    TEST_ASSERT_EQUAL_size_t(3, catalog_size(&catalog));
+    assert_cataloged(&catalog, "a.txt", "contents of a");
+    assert_cataloged(&catalog, "b.txt", "contents of b");
+    assert_cataloged(&catalog, "directory/c.txt", "contents of c");
+
+    CatalogEntry entry;
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_NOT_FOUND, catalog_lookup(&catalog, "c.txt", &entry));
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_NOT_FOUND, catalog_lookup(&catalog, "directory", &entry));
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_NOT_FOUND, catalog_lookup(&catalog, "link/passwd", &entry));
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_NOT_FOUND, catalog_lookup(&catalog, "", &entry));
+    catalog_close(&catalog);
+}
+
+void test__catalog_scan__updates_changed_and_removed_files() {
+    Catalog catalog;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, catalog_open(&catalog, catalog_path, 64));
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, catalog_scan(&catalog, root));
+
+    write_file("b.txt", "new contents of b");
+    remove_file("a.txt");
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, catalog_scan(&catalog, root));
+    TEST_ASSERT_EQUAL_size_t(2, catalog_size(&catalog));
+    assert_cataloged(&catalog, "b.txt", "new contents of b");
+    CatalogEntry entry;
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_NOT_FOUND, catalog_lookup(&catalog, "a.txt", &entry));
+
+    // a file that comes back is cataloged again
+    write_file("a.txt", "contents of a, again");
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, catalog_scan(&catalog, root));
+    TEST_ASSERT_EQUAL_size_t(3, catalog_size(&catalog));
+    assert_cataloged(&catalog, "a.txt", "contents of a, again");
+    catalog_close(&catalog);
+}
+
+void test__catalog_scan__unchanged_files_are_not_written() {
+    Catalog catalog;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, catalog_open(&catalog, catalog_path, 64));
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, catalog_scan(&catalog, root));
+    uint8_t* before = malloc(catalog.size);
+    TEST_ASSERT_NOT_NULL(before);
+    memcpy(before, catalog.data, catalog.size);
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, catalog_scan(&catalog, root));
+    TEST_ASSERT_TRUE(memcmp(before, catalog.data, catalog.size) == 0);
+    TEST_ASSERT_EQUAL_size_t(3, catalog_size(&catalog));
+    free(before);
+    catalog_close(&catalog);
+}
+
+void test__catalog_scan__full() {
+    // three quarters of 4 slots: one of the four files doesn't fit
+    write_file("d.txt", "contents of d");
+    Catalog catalog;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, catalog_open(&catalog, catalog_path, 4));
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, catalog_scan(&catalog, root));
+    TEST_ASSERT_EQUAL_size_t(3, catalog_size(&catalog));
+    const char* names[] = {"a.txt", "b.txt", "directory/c.txt", "d.txt"};
+    int found = 0;
+    for (int i = 0; i < 4; i++) {
+        CatalogEntry entry;
+        found += catalog_lookup(&catalog, names[i], &entry) == STATUS_OK;
+    }
+    TEST_ASSERT_EQUAL_INT(3, found);
+    catalog_close(&catalog);
+}
+
+void test__catalog_open__persists_entries() {
+    Catalog catalog;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, catalog_open(&catalog, catalog_path, 64));
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, catalog_scan(&catalog, root));
+    catalog_close(&catalog);
+
+    // no scan needed after a restart
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, catalog_open(&catalog, catalog_path, 64));
+    TEST_ASSERT_EQUAL_size_t(3, catalog_size(&catalog));
+    assert_cataloged(&catalog, "a.txt", "contents of a");
+    catalog_close(&catalog);
+
+    // a different capacity starts over
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, catalog_open(&catalog, catalog_path, 128));
+    TEST_ASSERT_EQUAL_size_t(0, catalog_size(&catalog));
+    CatalogEntry entry;
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_NOT_FOUND, catalog_lookup(&catalog, "a.txt", &entry));
+    catalog_close(&catalog);
+}
+
+void test__catalog_open__invalid_catalog() {
+    Catalog catalog;
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_OPEN_FAILED, catalog_open(&catalog, "/this/directory/does/not/exist/catalog", 64));
+
+    // not a catalog: it is recreated
+    FILE* file = fopen(catalog_path, "w");
+    fputs("this is not a catalog", file);
+    fclose(file);
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, catalog_open(&catalog, catalog_path, 64));
+    TEST_ASSERT_EQUAL_size_t(0, catalog_size(&catalog));
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, catalog_scan(&catalog, root));
+    assert_cataloged(&catalog, "a.txt", "contents of a");
+    catalog_close(&catalog);
+}
+
+typedef struct {
+    const Catalog* catalog;
+    atomic_int stop;
+    int lookups;
+    int torn;
+} LookupWorker;
+
+/**
+ * Looks up b.txt until stopped; every entry found must be one of the two versions the test writes.
+ */
+void* lookup_worker(void* arg) {
+    LookupWorker* worker = (LookupWorker*)arg;
+    while (!atomic_load(&worker->stop)) {
+        CatalogEntry entry;
+        if (catalog_lookup(worker->catalog, "b.txt", &entry) == STATUS_OK) {
+            int short_version = entry.size == strlen("contents of b") && entry.hash == hash_of("contents of b");
+            int long_version = entry.size == strlen("longer contents of b") && entry.hash == hash_of("longer contents of b");
+            worker->torn += !short_version && !long_version;
+        }
+        worker->lookups++;
+    }
+    return NULL;
+}
+
+void test__catalog_lookup__during_scans() {
+    Catalog catalog;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, catalog_open(&catalog, catalog_path, 64));
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, catalog_scan(&catalog, root));
+    LookupWorker worker = {&catalog, 0, 0, 0};
+    pthread_t thread;
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&thread, NULL, lookup_worker, &worker));
+    for (int i = 0; i < 200; i++) {
+        replace_file("b.txt", i % 2 == 0 ? "longer contents of b" : "contents of b");
+        catalog_scan(&catalog, root);
+    }
+    atomic_store(&worker.stop, 1);
+    pthread_join(thread, NULL);
+    TEST_ASSERT_GREATER_THAN_INT(0, worker.lookups);
+    TEST_ASSERT_EQUAL_INT(0, worker.torn);
+    catalog_close(&catalog);
+}
+
+void test__catalog_start_scanner() {
+    Catalog catalog;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, catalog_open(&catalog, catalog_path, 64));
+    // an interval of 0 would rescan in a busy loop
+    TEST_ASSERT_EQUAL_INT(0, catalog_start_scanner(&catalog, root, 0));
+    TEST_ASSERT_EQUAL_UINT64(CATALOG_MIN_SCAN_INTERVAL_MS, catalog.interval_ms);
+    TEST_ASSERT_EQUAL_INT(-1, catalog_start_scanner(&catalog, root, 10));
+    write_file("d.txt", "contents of d");
+    CatalogEntry entry;
+    int found = 0;
+    for (int i = 0; i < 200 && !found; i++) {
+        found = catalog_lookup(&catalog, "d.txt", &entry) == STATUS_OK;
+        usleep(10 * 1000);
+    }
+    TEST_ASSERT_TRUE(found);
+    catalog_stop_scanner(&catalog);
+    catalog_stop_scanner(&catalog);
+    assert_cataloged(&catalog, "d.txt", "contents of d");
+    catalog_close(&catalog);
+}
+
+int main(void) {
+    int catalog_fd = mkstemp(catalog_path);
+    if (mkdtemp(root) == NULL || catalog_fd == -1) {
+        perror("mkdtemp");
+        return 1;
+    }
+    close(catalog_fd);
+    UNITY_BEGIN();
+    RUN_TEST(test__catalog_lookup__before_scan);
+    RUN_TEST(test__catalog_scan_lookup);
+    RUN_TEST(test__catalog_scan__updates_changed_and_removed_files);
+    RUN_TEST(test__catalog_scan__unchanged_files_are_not_written);
+    RUN_TEST(test__catalog_scan__full);
+    RUN_TEST(test__catalog_open__persists_entries);
+    RUN_TEST(test__catalog_open__invalid_catalog);
+    RUN_TEST(test__catalog_lookup__during_scans);
+    RUN_TEST(test__catalog_start_scanner);
+    int failures = UNITY_END();
+    rmdir(root);
+    return failures;
+}
@@ -0,0 +1,225 @@
+#include "sockets.h"
+#include "protocol.h"
+#include "file_transfer.h"
+#include "scheduler.h"
+#include "connection.h"
+#include "unity.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+// how long a test waits for a response before failing
+#define RECEIVE_TIMEOUT_SECONDS 5
+#define DRAIN_TIMEOUT_SECONDS 5
+#define TEST_FILE_CONTENTS "These are the contents of test.txt\n"
+// larger than the socket buffers, so sending it waits for the client
+#define LARGE_FILE_SIZE (4 * 1024 * 1024)
+
+// the served directory, with generated files
+char server_files[] = "/tmp/client_server_test_connection_XXXXXX";
+
+Scheduler scheduler;
+Connections connections;
+int client_socket = -1;
+pthread_t worker;
+int worker_running = 0;
+
+/**
+ * Serves the server's end of a socket pair on a worker thread, the way the server serves an accepted
+ * connection. Returns the client's end.
+ */
+int serve_socket_pair(pthread_t* thread) {
+    int sockets[2];
+    TEST_ASSERT_EQUAL_INT(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+    struct timeval timeout = {RECEIVE_TIMEOUT_SECONDS, 0};
+    setsockopt(sockets[0], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    ClientConnection* connection = connection_register(&connections, sockets[1]);
+    TEST_ASSERT_NOT_NULL(connection);
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(thread, NULL, connection_serve, connection));
+    return sockets[0];
+}
+
+void serve_connection() {
+    client_socket = serve_socket_pair(&worker);
+    worker_running = 1;
+}
+
+void write_file(const char* file_name, const void* contents, size_t size) {
+    char full_path[256];
+    snprintf(full_path, sizeof(full_path), "%s/%s", server_files, file_name);
+    FILE* file = fopen(full_path, "wb");
+    if (file == NULL || fwrite(contents, 1, size, file) != size) {
+        perror(full_path);
+        exit(1);
+    }
+    fclose(file);
+}
+
+void create_server_files() {
+    if (mkdtemp(server_files) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    write_file("test.txt", TEST_FILE_CONTENTS, strlen(TEST_FILE_CONTENTS));
+    uint8_t* contents = calloc(1, LARGE_FILE_SIZE);
+    write_file("large.bin", contents, LARGE_FILE_SIZE);
+    free(contents);
+}
+
+void remove_server_files() {
+    DIR* directory = opendir(server_files);
+    if (directory == NULL) {
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(directory)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            unlinkat(dirfd(directory), entry->d_name, 0);
+        }
+    }
+    closedir(directory);
+    rmdir(server_files);
+}
+
+int request_metadata_ok() {
+    Response response = RESPONSE_INIT;
+    int status = request_file_metadata(client_socket, "test.txt", &response);
+    destroy_response(&response);
+    return status;
+}
+
+void assert_closed() {
+    uint8_t byte;
+    TEST_ASSERT_EQUAL_INT(0, recv(client_socket, &byte, sizeof(byte), 0));
+}
+
+void* drain_worker(void* arg) {
+    (void)arg;
+    return (void*)(long)connections_drain(&connections, DRAIN_TIMEOUT_SECONDS);
+}
+
+void test__connection_serve__keeps_connection_alive() {
+    serve_connection();
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT_EQUAL_INT(STATUS_OK, request_metadata_ok());
+    }
+    // the client closes the connection: it is no longer registered
+    close(client_socket);
+    client_socket = -1;
+    pthread_join(worker, NULL);
+    worker_running = 0;
+    TEST_ASSERT_EQUAL_INT(0, connections.connection_count);
+}
+
+void test__connections_drain__closes_idle_connection() {
+    serve_connection();
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, request_metadata_ok());
+    TEST_ASSERT_EQUAL_INT(0, connections_drain(&connections, DRAIN_TIMEOUT_SECONDS));
+    assert_closed();
+}
+
+void test__connections_drain__answers_request_sent_while_draining() {
+    serve_connection();
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, request_metadata_ok());
+    pthread_t drain_thread;
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&drain_thread, NULL, drain_worker, NULL));
+    // the request arrives after the connection was woken up to close, but within the grace period
+    usleep(CONNECTION_DRAIN_GRACE_MS * 1000 / 4);
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, request_metadata_ok());
+    void* remaining;
+    pthread_join(drain_thread, &remaining);
+    TEST_ASSERT_EQUAL_INT(0, (long)remaining);
+    assert_closed();
+}
+
+void test__connections_drain__answers_request_already_received() {
+    serve_connection();
+    // the request is waiting on the connection when the drain starts
+    Header header = {MESSAGE_REQUEST, COMMAND_REQUEST_METADATA, sizeof("test.txt"), 0, NOT_SET, 0};
+    Message message;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, create_message(&header, (const uint8_t*)"test.txt", &message));
+    TEST_ASSERT_EQUAL_INT64(message.size, send_all(client_socket, message.data, message.size));
+    destroy_message(&message);
+    TEST_ASSERT_EQUAL_INT(0, connections_drain(&connections, DRAIN_TIMEOUT_SECONDS));
+    uint8_t buffer[MAX_MESSAGE_SIZE];
+    ssize_t bytes_received = receive_message(client_socket, buffer, MAX_MESSAGE_SIZE);
+    Response response;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, parse_message(buffer, bytes_received, &response));
+    TEST_ASSERT_EQUAL_UINT8(MESSAGE_RESPONSE, response.header.message_type);
+    TEST_ASSERT_EQUAL_UINT8(STATUS_OK, response.header.status);
+    destroy_response(&response);
+    assert_closed();
+}
+
+void test__connection_serve__slow_client_gives_back_its_slot() {
+    // one slot: while the large file is sent to a client that doesn't receive it, the other
+    // connection's request only gets through if the slot was given back
+    Scheduler one_slot;
+    TEST_ASSERT_EQUAL_INT(0, scheduler_init(&one_slot, 1, 1, SCHEDULER_DEFAULT_AGING_MS));
+    connections.scheduler = &one_slot;
+    pthread_t slow_worker;
+    int slow_socket = serve_socket_pair(&slow_worker);
+    Header header = {MESSAGE_REQUEST, COMMAND_REQUEST_FILE, sizeof("large.bin"), 0, NOT_SET, 0};
+    Message message;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, create_message(&header, (const uint8_t*)"large.bin", &message));
+    TEST_ASSERT_EQUAL_INT64(message.size, send_all(slow_socket, message.data, message.size));
+    destroy_message(&message);
+    // the first chunk has arrived: the transfer is under way
+    uint8_t buffer[MAX_MESSAGE_SIZE];
+    TEST_ASSERT_TRUE(receive_message(slow_socket, buffer, MAX_MESSAGE_SIZE) > 0);
+
+    serve_connection();
+    int status = request_metadata_ok();
+    // the slow client goes away, which ends its transfer
+    close(slow_socket);
+    pthread_join(slow_worker, NULL);
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, status);
+    close(client_socket);
+    client_socket = -1;
+    pthread_join(worker, NULL);
+    worker_running = 0;
+    scheduler_destroy(&one_slot);
+}
+
+void setUp(void) {
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, connections_init(&connections, &scheduler, NULL));
+}
+
+void tearDown(void) {
+    // closing the client's end stops a worker that is still serving (e.g. after a failed assertion)
+    if (client_socket != -1) {
+        close(client_socket);
+        client_socket = -1;
+    }
+    if (worker_running) {
+        pthread_join(worker, NULL);
+        worker_running = 0;
+    }
+    connections_destroy(&connections);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    create_server_files();
+    const char* roots[] = {server_files};
+    if (server_storage_init(roots, 1, IO_POOL_DEFAULT_THREADS) != STATUS_OK) {
+        fprintf(stderr, "could not serve %s\n", server_files);
+        exit(1);
+    }
+    scheduler_init(&scheduler, SCHEDULER_DEFAULT_MAX_RUNNING, SCHEDULER_DEFAULT_MAX_BULK, SCHEDULER_DEFAULT_AGING_MS);
+
+    RUN_TEST(test__connection_serve__keeps_connection_alive);
+    RUN_TEST(test__connections_drain__closes_idle_connection);
+    RUN_TEST(test__connections_drain__answers_request_sent_while_draining);
+    RUN_TEST(test__connections_drain__answers_request_already_received);
+    RUN_TEST(test__connection_serve__slow_client_gives_back_its_slot);
+
+    scheduler_destroy(&scheduler);
+    remove_server_files();
+    return UNITY_END();
+}
@@ -0,0 +1,201 @@
+#include "sockets.h"
+#include "protocol.h"
+#include "file_transfer.h"
+#include "connection_pool.h"
+#include "test_server.h"
+#include "unity.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#define PORT 9003
+#define ADDRESS TEST_SERVER_ADDRESS
+#define CONCURRENT_CLIENTS 8
+#define REQUESTS_PER_CLIENT 20
+
+TestServer server = TEST_SERVER_INIT(PORT, 0);
+
+/**
+ * Returns the local (ephemeral) port of a connection. A reused connection keeps its port, while a new
+ * connection gets a different one.
+ */
+int local_port(int socket) {
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+    getsockname(socket, (struct sockaddr*)&address, &length);
+    return ntohs(address.sin_port);
+}
+
+int request_metadata_ok(int socket) {
+    Response response = RESPONSE_INIT;
+    int status = request_file_metadata(socket, "test.txt", &response);
+    destroy_response(&response);
+    return status;
+}
+
+void test__connection_pool__reuses_connection() {
+    ConnectionPool pool;
+    TEST_ASSERT_EQUAL_INT(0, connection_pool_init(&pool, 4, 10000, NULL));
+    int first_port = -1;
+    for (int i = 0; i < 5; i++) {
+        int socket = connection_pool_checkout(&pool, ADDRESS, PORT);
+        TEST_ASSERT_NOT_EQUAL(-1, socket);
+        if (first_port == -1) {
+            first_port = local_port(socket);
+        }
+        // all five requests go over the same connection
+        TEST_ASSERT_EQUAL_INT(first_port, local_port(socket));
+        int status = request_metadata_ok(socket);
+        TEST_ASSERT_EQUAL_INT(STATUS_OK, status);
+        connection_pool_checkin(&pool, ADDRESS, PORT, socket, connection_pool_is_reusable(status));
+        TEST_ASSERT_EQUAL_size_t(1, connection_pool_idle_count(&pool));
+    }
+    connection_pool_destroy(&pool);
+}
+
+void test__connection_pool__reuses_connection_after_error_response() {
+    ConnectionPool pool;
+    connection_pool_init(&pool, 4, 10000, NULL);
+
+    int socket = connection_pool_checkout(&pool, ADDRESS, PORT);
+    int port = local_port(socket);
+    Response response = RESPONSE_INIT;
+    int status = request_file_contents(socket, "file-does-not-exist", &response);
+    destroy_response(&response);
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_NOT_FOUND, status);
+    connection_pool_checkin(&pool, ADDRESS, PORT, socket, connection_pool_is_reusable(status));
+
+    socket = connection_pool_checkout(&pool, ADDRESS, PORT);
+    TEST_ASSERT_EQUAL_INT(port, local_port(socket));
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, request_metadata_ok(socket));
+    connection_pool_checkin(&pool, ADDRESS, PORT, socket, 1);
+    connection_pool_destroy(&pool);
+}
+
+void test__connection_pool__not_reusable_is_closed() {
+    ConnectionPool pool;
+    connection_pool_init(&pool, 4, 10000, NULL);
+    int socket = connection_pool_checkout(&pool, ADDRESS, PORT);
+    connection_pool_checkin(&pool, ADDRESS, PORT, socket, connection_pool_is_reusable(ERROR_RECEIVE_FAILED));
+    TEST_ASSERT_EQUAL_size_t(0, connection_pool_idle_count(&pool));
+    connection_pool_destroy(&pool);
+}
+
+void test__connection_pool__max_idle_per_address() {
+    ConnectionPool pool;
+    connection_pool_init(&pool, 2, 10000, NULL);
+    int sockets[3];
+    for (int i = 0; i < 3; i++) {
+        sockets[i] = connection_pool_checkout(&pool, ADDRESS, PORT);
+        TEST_ASSERT_NOT_EQUAL(-1, sockets[i]);
+    }
+    for (int i = 0; i < 3; i++) {
+        connection_pool_checkin(&pool, ADDRESS, PORT, sockets[i], 1);
+    }
+    TEST_ASSERT_EQUAL_size_t(2, connection_pool_idle_count(&pool));
+    connection_pool_destroy(&pool);
+}
+
+void test__connection_pool__idle_timeout() {
+    ConnectionPool pool;
+    connection_pool_init(&pool, 4, 20, NULL);
+    int socket = connection_pool_checkout(&pool, ADDRESS, PORT);
+    int port = local_port(socket);
+    connection_pool_checkin(&pool, ADDRESS, PORT, socket, 1);
+    TEST_ASSERT_EQUAL_size_t(1, connection_pool_idle_count(&pool));
+
+    struct timespec delay = {0, 50 * 1000000};
+    nanosleep(&delay, NULL);
+    socket = connection_pool_checkout(&pool, ADDRESS, PORT);
+    TEST_ASSERT_NOT_EQUAL(-1, socket);
+    // the expired connection was evicted, so a new one had to be made
+    TEST_ASSERT_EQUAL_size_t(0, connection_pool_idle_count(&pool));
+    TEST_ASSERT_NOT_EQUAL(port, local_port(socket));
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, request_metadata_ok(socket));
+    connection_pool_checkin(&pool, ADDRESS, PORT, socket, 1);
+    connection_pool_destroy(&pool);
+}
+
+void test__connection_pool__health_check_discards_closed_connection() {
+    ConnectionPool pool;
+    connection_pool_init(&pool, 4, 10000, NULL);
+    int socket = connection_pool_checkout(&pool, ADDRESS, PORT);
+    // make sure the server has accepted the connection before disconnecting its clients
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, request_metadata_ok(socket));
+    int port = local_port(socket);
+    connection_pool_checkin(&pool, ADDRESS, PORT, socket, 1);
+    test_server_disconnect_all(&server);
+
+    socket = connection_pool_checkout(&pool, ADDRESS, PORT);
+    TEST_ASSERT_NOT_EQUAL(-1, socket);
+    TEST_ASSERT_NOT_EQUAL(port, local_port(socket));
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, request_metadata_ok(socket));
+    connection_pool_checkin(&pool, ADDRESS, PORT, socket, 1);
+    connection_pool_destroy(&pool);
+}
+
+void test__connection_pool__checkout_no_server() {
+    ConnectionPool pool;
+    connection_pool_init(&pool, 4, 10000, NULL);
+    pool.retry_policy.max_attempts = 1;
+    // nothing is listening on this port
+    TEST_ASSERT_EQUAL_INT(-1, connection_pool_checkout(&pool, ADDRESS, PORT + 1));
+    connection_pool_destroy(&pool);
+}
+
+void* pool_client_worker(void* arg) {
+    ConnectionPool* pool = (ConnectionPool*)arg;
+    long failures = 0;
+    for (int i = 0; i < REQUESTS_PER_CLIENT; i++) {
+        int socket = connection_pool_checkout(pool, ADDRESS, PORT);
+        int status = socket == -1 ? ERROR_SEND_FAILED : request_metadata_ok(socket);
+        if (status != STATUS_OK) {
+            failures++;
+        }
+        connection_pool_checkin(pool, ADDRESS, PORT, socket, connection_pool_is_reusable(status));
+    }
+    return (void*)failures;
+}
+
+void test__connection_pool__concurrent_clients() {
+    ConnectionPool pool;
+    connection_pool_init(&pool, CONCURRENT_CLIENTS, 10000, NULL);
+    pthread_t threads[CONCURRENT_CLIENTS];
+    for (int i = 0; i < CONCURRENT_CLIENTS; i++) {
+        pthread_create(&threads[i], NULL, pool_client_worker, &pool);
+    }
+    long failures = 0;
+    for (int i = 0; i < CONCURRENT_CLIENTS; i++) {
+        void* thread_failures;
+        pthread_join(threads[i], &thread_failures);
+        failures += (long)thread_failures;
+    }
+    TEST_ASSERT_EQUAL_INT(0, failures);
+    TEST_ASSERT_TRUE(connection_pool_idle_count(&pool) > 0);
+    TEST_ASSERT_TRUE(connection_pool_idle_count(&pool) <= CONCURRENT_CLIENTS);
+    connection_pool_destroy(&pool);
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+int main(void) {
+    UNITY_BEGIN();
+    test_server_start(&server);
+
+    RUN_TEST(test__connection_pool__reuses_connection);
+    RUN_TEST(test__connection_pool__reuses_connection_after_error_response);
+    RUN_TEST(test__connection_pool__not_reusable_is_closed);
+    RUN_TEST(test__connection_pool__max_idle_per_address);
+    RUN_TEST(test__connection_pool__idle_timeout);
+    RUN_TEST(test__connection_pool__health_check_discards_closed_connection);
+    RUN_TEST(test__connection_pool__checkout_no_server);
+    RUN_TEST(test__connection_pool__concurrent_clients);
+
+    test_server_stop(&server);
+    return UNITY_END();
+}
@@ -0,0 +1,211 @@
+#include "delta.h"
+#include "protocol.h"
+#include "unity.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define BLOCK_SIZE DELTA_MIN_BLOCK_SIZE
+
+/**
+ * DeltaWriter that applies each payload right away, like the client does with the received chunks.
+ */
+typedef struct {
+    const uint8_t* basis;
+    size_t basis_size;
+    DeltaOutput output;
+    int payloads;
+    int last_seen;
+} ApplyContext;
+
+int apply_payload(const uint8_t* payload, size_t length, int last, void* context) {
+    ApplyContext* apply_context = (ApplyContext*)context;
+    TEST_ASSERT_FALSE(apply_context->last_seen);
+    TEST_ASSERT_TRUE(length <= MAX_PAYLOAD_SIZE);
+    apply_context->payloads++;
+    apply_context->last_seen = last;
+    return delta_apply(payload, length, apply_context->basis, apply_context->basis_size, BLOCK_SIZE, &apply_context->output);
+}
+
+uint8_t* random_bytes(size_t size, unsigned int seed) {
+    uint8_t* data = malloc(size > 0 ? size : 1);
+    for (size_t i = 0; i < size; i++) {
+        data[i] = rand_r(&seed);
+    }
+    return data;
+}
+
+/**
+ * Encodes `data` against the signatures of `basis`, applies the result to `basis`, and checks that
+ * `data` is reconstructed. Returns the context so that callers can check the copied/literal bytes.
+ */
+ApplyContext round_trip(const uint8_t* basis, size_t basis_size, const uint8_t* data, size_t size) {
+    BlockSignature* signatures;
+    size_t count;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, delta_compute_signatures(basis, basis_size, BLOCK_SIZE, &signatures, &count));
+    TEST_ASSERT_EQUAL_size_t(basis_size / BLOCK_SIZE, count);
+
+    ApplyContext context = {basis, basis_size, DELTA_OUTPUT_INIT, 0, 0};
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, delta_generate(data, size, signatures, count, BLOCK_SIZE, apply_payload, &context));
+    TEST_ASSERT_TRUE(context.last_seen);
+    TEST_ASSERT_EQUAL_size_t(size, context.output.size);
+    TEST_ASSERT_EQUAL_size_t(size, context.output.copied_bytes + context.output.literal_bytes);
+    if (size > 0) {
+        TEST_ASSERT_TRUE(memcmp(context.output.data, data, size) == 0);
+    }
+    free(signatures);
+    return context;
+}
+
+void test__delta_roll_checksum__matches_full_checksum() {
+    uint8_t* data = random_bytes(4 * BLOCK_SIZE, 1);
+    uint32_t weak = delta_weak_checksum(data, BLOCK_SIZE);
+    for (size_t offset = 1; offset + BLOCK_SIZE <= 4 * BLOCK_SIZE; offset++) {
+        weak = delta_roll_checksum(weak, data[offset - 1], data[offset + BLOCK_SIZE - 1], BLOCK_SIZE);
+        TEST_ASSERT_EQUAL_HEX32(delta_weak_checksum(data + offset, BLOCK_SIZE), weak);
+    }
+    free(data);
+}
+
+void test__delta_strong_hash() {
+    // FNV-1a test vectors
+    TEST_ASSERT_TRUE(delta_strong_hash((const uint8_t*)"", 0) == 0xcbf29ce484222325ULL);
+    TEST_ASSERT_TRUE(delta_strong_hash((const uint8_t*)"a", 1) == 0xaf63dc4c8601ec8cULL);
+}
+
+void assert_file_hash(const char* data, size_t length, const char* expected) {
+    uint8_t hash[DELTA_FILE_HASH_SIZE];
+    delta_file_hash((const uint8_t*)data, length, hash);
+    char hex[2 * DELTA_FILE_HASH_SIZE + 1];
+    for (int i = 0; i < DELTA_FILE_HASH_SIZE; i++) {
+        snprintf(hex + 2 * i, 3, "%02x", hash[i]);
+    }
+    TEST_ASSERT_EQUAL_STRING(expected, hex);
+}
+
+void test__delta_file_hash() {
+    // SHA-256 test vectors (FIPS 180-2); the last two need one and two padding blocks
+    assert_file_hash("", 0, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+    assert_file_hash("abc", 3, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    const char* two_blocks = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    assert_file_hash(two_blocks, strlen(two_blocks), "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+    const char* long_input = "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu";
+    assert_file_hash(long_input, strlen(long_input), "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1");
+}
+
+void test__delta_block_size() {
+    TEST_ASSERT_EQUAL_size_t(DELTA_MIN_BLOCK_SIZE, delta_block_size(0));
+    TEST_ASSERT_EQUAL_size_t(DELTA_MIN_BLOCK_SIZE, delta_block_size(1000));
+    TEST_ASSERT_EQUAL_size_t(1024, delta_block_size(1024 * 1024));
+    TEST_ASSERT_EQUAL_size_t(DELTA_MAX_BLOCK_SIZE, delta_block_size((size_t)1 << 40));
+}
+
+void test__delta_pack_signatures__round_trip() {
+    BlockSignature signatures[2] = {{0x01020304, 0x1122334455667788ULL}, {0xffffffff, 1}};
+    uint8_t buffer[2 * DELTA_SIGNATURE_SIZE];
+    delta_pack_signatures(signatures, 2, buffer);
+    BlockSignature unpacked[2];
+    delta_unpack_signatures(buffer, 2, unpacked);
+    for (int i = 0; i < 2; i++) {
+        TEST_ASSERT_EQUAL_HEX32(signatures[i].weak, unpacked[i].weak);
+        TEST_ASSERT_TRUE(signatures[i].strong == unpacked[i].strong);
+    }
+}
+
+void test__delta__identical_file_is_copied() {
+    size_t size = 100 * BLOCK_SIZE;
+    uint8_t* data = random_bytes(size, 2);
+    ApplyContext context = round_trip(data, size, data, size);
+    TEST_ASSERT_EQUAL_size_t(size, context.output.copied_bytes);
+    TEST_ASSERT_EQUAL_size_t(0, context.output.literal_bytes);
+    // consecutive blocks are merged into a single copy instruction
+    TEST_ASSERT_EQUAL_INT(1, context.payloads);
+    destroy_delta_output(&context.output);
+    free(data);
+}
+
+void test__delta__insertion_and_change() {
+    size_t basis_size = 64 * BLOCK_SIZE + 100;
+    uint8_t* basis = random_bytes(basis_size, 3);
+    // new version: 10 bytes inserted after block 5, and one byte changed in block 40
+    size_t size = basis_size + 10;
+    uint8_t* data = malloc(size);
+    memcpy(data, basis, 5 * BLOCK_SIZE);
+    memset(data + 5 * BLOCK_SIZE, 'x', 10);
+    memcpy(data + 5 * BLOCK_SIZE + 10, basis + 5 * BLOCK_SIZE, basis_size - 5 * BLOCK_SIZE);
+    data[40 * BLOCK_SIZE + 10 + 7] ^= 0xff;
+
+    ApplyContext context = round_trip(basis, basis_size, data, size);
+    // only the inserted bytes, the changed block, and the partial block at the end are sent
+    TEST_ASSERT_EQUAL_size_t(10 + BLOCK_SIZE + 100, context.output.literal_bytes);
+    destroy_delta_output(&context.output);
+    free(basis);
+    free(data);
+}
+
+void test__delta__empty_basis() {
+    size_t size = 3 * MAX_PAYLOAD_SIZE + 17;
+    uint8_t* data = random_bytes(size, 4);
+    ApplyContext context = round_trip(NULL, 0, data, size);
+    TEST_ASSERT_EQUAL_size_t(size, context.output.literal_bytes);
+    // literals are split across payloads
+    TEST_ASSERT_TRUE(context.payloads > 3);
+    destroy_delta_output(&context.output);
+    free(data);
+}
+
+void test__delta__empty_file() {
+    uint8_t* basis = random_bytes(4 * BLOCK_SIZE, 5);
+    ApplyContext context = round_trip(basis, 4 * BLOCK_SIZE, NULL, 0);
+    TEST_ASSERT_EQUAL_INT(1, context.payloads);
+    destroy_delta_output(&context.output);
+    free(basis);
+}
+
+void test__delta__reordered_blocks() {
+    size_t size = 8 * BLOCK_SIZE;
+    uint8_t* basis = random_bytes(size, 6);
+    uint8_t* data = malloc(size);
+    for (int i = 0; i < 8; i++) {
+        memcpy(data + i * BLOCK_SIZE, basis + (7 - i) * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    ApplyContext context = round_trip(basis, size, data, size);
+    TEST_ASSERT_EQUAL_size_t(size, context.output.copied_bytes);
+    destroy_delta_output(&context.output);
+    free(basis);
+    free(data);
+}
+
+void test__delta_apply__invalid_instructions() {
+    uint8_t basis[2 * BLOCK_SIZE] = {0};
+    DeltaOutput output = DELTA_OUTPUT_INIT;
+    // copy of blocks 1..2 when the basis only has blocks 0..1
+    uint8_t copy[] = {DELTA_INSTRUCTION_COPY, 0, 0, 0, 1, 0, 0, 0, 2};
+    TEST_ASSERT_EQUAL_INT(ERROR_INVALID_DATA_SIZE, delta_apply(copy, sizeof(copy), basis, sizeof(basis), BLOCK_SIZE, &output));
+    // literal longer than the payload
+    uint8_t literal[] = {DELTA_INSTRUCTION_LITERAL, 0, 0, 0, 5, 'a', 'b'};
+    TEST_ASSERT_EQUAL_INT(ERROR_INVALID_DATA_SIZE, delta_apply(literal, sizeof(literal), basis, sizeof(basis), BLOCK_SIZE, &output));
+    uint8_t unknown[] = {42};
+    TEST_ASSERT_EQUAL_INT(ERROR_INVALID_DATA_SIZE, delta_apply(unknown, sizeof(unknown), basis, sizeof(basis), BLOCK_SIZE, &output));
+    destroy_delta_output(&output);
+    TEST_ASSERT_NULL(output.data);
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test__delta_roll_checksum__matches_full_checksum);
+    RUN_TEST(test__delta_strong_hash);
+    RUN_TEST(test__delta_file_hash);
+    RUN_TEST(test__delta_block_size);
+    RUN_TEST(test__delta_pack_signatures__round_trip);
+    RUN_TEST(test__delta__identical_file_is_copied);
+    RUN_TEST(test__delta__insertion_and_change);
+    RUN_TEST(test__delta__empty_basis);
+    RUN_TEST(test__delta__empty_file);
+    RUN_TEST(test__delta__reordered_blocks);
+    RUN_TEST(test__delta_apply__invalid_instructions);
+    return UNITY_END();
+}
@@ -0,0 +1,290 @@
+#include "protocol.h"
+#include "file_cache.h"
+#include "unity.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+char root[] = "/tmp/client_server_test_file_cache_XXXXXX";
+
+void write_file(const char* name, const char* contents) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    FILE* file = fopen(path, "w");
+    TEST_ASSERT_NOT_NULL(file);
+    fputs(contents, file);
+    fclose(file);
+}
+
+void remove_file(const char* name) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    unlink(path);
+}
+
+/**
+ * Reads the contents of a cached file the way the server does (with pread).
+ */
+void assert_contents(CachedFile* file, const char* expected) {
+    char buffer[64] = {0};
+    TEST_ASSERT_EQUAL_INT((int)strlen(expected), pread(file->fd, buffer, sizeof(buffer) - 1, 0));
+    TEST_ASSERT_EQUAL_STRING(expected, buffer);
+    TEST_ASSERT_EQUAL_INT((int)strlen(expected), file->file_stat.st_size);
+}
+
+void test__file_cache_valid_name() {
+    TEST_ASSERT_TRUE(file_cache_valid_name("test.txt"));
+    TEST_ASSERT_TRUE(file_cache_valid_name("directory/test.txt"));
+    TEST_ASSERT_TRUE(file_cache_valid_name("..test.txt"));
+    TEST_ASSERT_FALSE(file_cache_valid_name(""));
+    TEST_ASSERT_FALSE(file_cache_valid_name("/etc/passwd"));
+    TEST_ASSERT_FALSE(file_cache_valid_name(".."));
+    TEST_ASSERT_FALSE(file_cache_valid_name("../test.txt"));
+    TEST_ASSERT_FALSE(file_cache_valid_name("directory/../../test.txt"));
+    TEST_ASSERT_FALSE(file_cache_valid_name("directory/.."));
+    char long_name[FILE_CACHE_MAX_NAME + 1];
+    memset(long_name, 'a', FILE_CACHE_MAX_NAME);
+    long_name[FILE_CACHE_MAX_NAME] = '\0';
+    TEST_ASSERT_FALSE(file_cache_valid_name(long_name));
+}
+
+void test__file_cache_acquire__invalid_names() {
+    FileCache cache;
+    TEST_ASSERT_EQUAL_INT(0, file_cache_init(&cache, root, 4));
+    CachedFile* file;
+    TEST_ASSERT_EQUAL_INT(ERROR_INVALID_FILE_NAME, file_cache_acquire(&cache, "../etc/passwd", &file));
+    TEST_ASSERT_EQUAL_INT(ERROR_INVALID_FILE_NAME, file_cache_acquire(&cache, "/etc/passwd", &file));
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_NOT_FOUND, file_cache_acquire(&cache, "missing.txt", &file));
+    // directories aren't served
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_NOT_FOUND, file_cache_acquire(&cache, ".", &file));
+    TEST_ASSERT_EQUAL_size_t(0, file_cache_size(&cache));
+    file_cache_destroy(&cache);
+}
+
+void test__file_cache_acquire__reuses_descriptor() {
+    write_file("hot.txt", "hot");
+    FileCache cache;
+    TEST_ASSERT_EQUAL_INT(0, file_cache_init(&cache, root, 4));
+    CachedFile* first;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, file_cache_acquire(&cache, "hot.txt", &first));
+    assert_contents(first, "hot");
+    file_cache_release(&cache, first);
+
+    CachedFile* second;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, file_cache_acquire(&cache, "hot.txt", &second));
+    TEST_ASSERT_EQUAL_PTR(first, second);
+    TEST_ASSERT_EQUAL_UINT64(1, cache.hits);
+    TEST_ASSERT_EQUAL_UINT64(1, cache.misses);
+    file_cache_release(&cache, second);
+    TEST_ASSERT_EQUAL_size_t(1, file_cache_size(&cache));
+    file_cache_destroy(&cache);
+    remove_file("hot.txt");
+}
+
+void test__file_cache_acquire__invalidated_on_change() {
+    write_file("changing.txt", "first");
+    FileCache cache;
+    TEST_ASSERT_EQUAL_INT(0, file_cache_init(&cache, root, 4));
+    CachedFile* file;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, file_cache_acquire(&cache, "changing.txt", &file));
+    file_cache_release(&cache, file);
+
+    // written in place: same descriptor, refreshed size
+    write_file("changing.txt", "second");
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, file_cache_acquire(&cache, "changing.txt", &file));
+    assert_contents(file, "second");
+
+    // replaced while in use: the old descriptor stays usable until it is released
+    write_file("replacement.txt", "third!");
+    char old_path[256];
+    char new_path[256];
+    snprintf(old_path, sizeof(old_path), "%s/replacement.txt", root);
+    snprintf(new_path, sizeof(new_path), "%s/changing.txt", root);
+    TEST_ASSERT_EQUAL_INT(0, rename(old_path, new_path));
+    CachedFile* replaced;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, file_cache_acquire(&cache, "changing.txt", &replaced));
+    TEST_ASSERT_NOT_EQUAL(file, replaced);
+    assert_contents(replaced, "third!");
+    assert_contents(file, "second");
+    file_cache_release(&cache, file);
+    file_cache_release(&cache, replaced);
+    TEST_ASSERT_EQUAL_size_t(1, file_cache_size(&cache));
+
+    // removed
+    remove_file("changing.txt");
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_NOT_FOUND, file_cache_acquire(&cache, "changing.txt", &file));
+    TEST_ASSERT_EQUAL_size_t(0, file_cache_size(&cache));
+    file_cache_destroy(&cache);
+}
+
+void test__file_cache_acquire__modified_while_in_use() {
+    write_file("growing.txt", "short");
+    FileCache cache;
+    TEST_ASSERT_EQUAL_INT(0, file_cache_init(&cache, root, 4));
+    CachedFile* file;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, file_cache_acquire(&cache, "growing.txt", &file));
+
+    // the stat of an entry in use isn't changed under its user; the new size comes with a new entry
+    write_file("growing.txt", "much longer");
+    CachedFile* modified;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, file_cache_acquire(&cache, "growing.txt", &modified));
+    TEST_ASSERT_NOT_EQUAL(file, modified);
+    TEST_ASSERT_EQUAL_INT64(5, file->file_stat.st_size);
+    assert_contents(modified, "much longer");
+    file_cache_release(&cache, file);
+    file_cache_release(&cache, modified);
+    TEST_ASSERT_EQUAL_size_t(1, file_cache_size(&cache));
+    file_cache_destroy(&cache);
+    remove_file("growing.txt");
+}
+
+void test__file_cache_acquire__evicts_least_recently_used() {
+    write_file("a.txt", "a");
+    write_file("b.txt", "b");
+    write_file("c.txt", "c");
+    FileCache cache;
+    TEST_ASSERT_EQUAL_INT(0, file_cache_init(&cache, root, 2));
+    CachedFile* a;
+    CachedFile* b;
+    CachedFile* c;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, file_cache_acquire(&cache, "a.txt", &a));
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, file_cache_acquire(&cache, "b.txt", &b));
+    file_cache_release(&cache, b);
+
+    // a is in use, so b is evicted even though a was used less recently
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, file_cache_acquire(&cache, "c.txt", &c));
+    TEST_ASSERT_EQUAL_size_t(2, file_cache_size(&cache));
+    TEST_ASSERT_TRUE(a->cached);
+    TEST_ASSERT_TRUE(c->cached);
+
+    // all cached files are in use: b is opened but not cached
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, file_cache_acquire(&cache, "b.txt", &b));
+    TEST_ASSERT_FALSE(b->cached);
+    assert_contents(b, "b");
+    file_cache_release(&cache, b);
+    file_cache_release(&cache, a);
+    file_cache_release(&cache, c);
+    TEST_ASSERT_EQUAL_size_t(2, file_cache_size(&cache));
+    file_cache_destroy(&cache);
+    remove_file("a.txt");
+    remove_file("b.txt");
+    remove_file("c.txt");
+}
+
+void test__file_cache_acquire__evicts_least_recently_released() {
+    write_file("a.txt", "a");
+    write_file("b.txt", "b");
+    write_file("c.txt", "c");
+    FileCache cache;
+    TEST_ASSERT_EQUAL_INT(0, file_cache_init(&cache, root, 2));
+    CachedFile* a;
+    CachedFile* b;
+    CachedFile* c;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, file_cache_acquire(&cache, "a.txt", &a));
+    file_cache_release(&cache, a);
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, file_cache_acquire(&cache, "b.txt", &b));
+    file_cache_release(&cache, b);
+    // using a again makes b the least recently used
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, file_cache_acquire(&cache, "a.txt", &a));
+    file_cache_release(&cache, a);
+
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, file_cache_acquire(&cache, "c.txt", &c));
+    file_cache_release(&cache, c);
+    TEST_ASSERT_TRUE(a->cached);
+    TEST_ASSERT_TRUE(c->cached);
+    TEST_ASSERT_EQUAL_UINT64(1, cache.hits);
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, file_cache_acquire(&cache, "a.txt", &a));
+    file_cache_release(&cache, a);
+    TEST_ASSERT_EQUAL_UINT64(2, cache.hits);
+    file_cache_destroy(&cache);
+    remove_file("a.txt");
+    remove_file("b.txt");
+    remove_file("c.txt");
+}
+
+void test__file_cache_acquire__symlink_out_of_root() {
+    // a directory next to the root, with a file that must not be served
+    char outside[128];
+    char secret[256];
+    snprintf(outside, sizeof(outside), "%s_outside", root);
+    snprintf(secret, sizeof(secret), "%s/secret.txt", outside);
+    TEST_ASSERT_EQUAL_INT(0, mkdir(outside, 0700));
+    FILE* file = fopen(secret, "w");
+    TEST_ASSERT_NOT_NULL(file);
+    fputs("secret", file);
+    fclose(file);
+    char link_path[256];
+    snprintf(link_path, sizeof(link_path), "%s/secret.txt", root);
+    TEST_ASSERT_EQUAL_INT(0, symlink(secret, link_path));
+    snprintf(link_path, sizeof(link_path), "%s/outside", root);
+    TEST_ASSERT_EQUAL_INT(0, symlink(outside, link_path));
+
+    FileCache cache;
+    TEST_ASSERT_EQUAL_INT(0, file_cache_init(&cache, root, 4));
+    CachedFile* cached;
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_NOT_FOUND, file_cache_acquire(&cache, "secret.txt", &cached));
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_NOT_FOUND, file_cache_acquire(&cache, "outside/secret.txt", &cached));
+    int fd;
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_NOT_FOUND, file_cache_open(&cache, "secret.txt", O_RDONLY, &fd));
+    struct stat file_stat;
+    TEST_ASSERT_EQUAL_INT(-1, file_cache_stat(cache.root_fd, "outside/secret.txt", &file_stat));
+    TEST_ASSERT_EQUAL_size_t(0, file_cache_size(&cache));
+    file_cache_destroy(&cache);
+
+    remove_file("secret.txt");
+    remove_file("outside");
+    unlink(secret);
+    rmdir(outside);
+}
+
+void test__file_cache_open() {
+    write_file("own.txt", "own");
+    FileCache cache;
+    TEST_ASSERT_EQUAL_INT(0, file_cache_init(&cache, root, 4));
+    int fd;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, file_cache_open(&cache, "own.txt", O_RDONLY, &fd));
+    char buffer[8] = {0};
+    TEST_ASSERT_EQUAL_INT(3, read(fd, buffer, sizeof(buffer)));
+    TEST_ASSERT_EQUAL_STRING("own", buffer);
+    close(fd);
+    TEST_ASSERT_EQUAL_size_t(0, file_cache_size(&cache));
+    TEST_ASSERT_EQUAL_INT(ERROR_INVALID_FILE_NAME, file_cache_open(&cache, "../own.txt", O_RDONLY, &fd));
+    TEST_ASSERT_EQUAL_INT(-1, fd);
+    file_cache_destroy(&cache);
+    remove_file("own.txt");
+}
+
+void test__file_cache_init__missing_root() {
+    FileCache cache;
+    TEST_ASSERT_EQUAL_INT(-1, file_cache_init(&cache, "/this/directory/does/not/exist", 4));
+    CachedFile* file;
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_NOT_FOUND, file_cache_acquire(&cache, "test.txt", &file));
+    file_cache_destroy(&cache);
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+int main(void) {
+    if (mkdtemp(root) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    UNITY_BEGIN();
+    RUN_TEST(test__file_cache_valid_name);
+    RUN_TEST(test__file_cache_acquire__invalid_names);
+    RUN_TEST(test__file_cache_acquire__reuses_descriptor);
+    RUN_TEST(test__file_cache_acquire__invalidated_on_change);
+    RUN_TEST(test__file_cache_acquire__modified_while_in_use);
+    RUN_TEST(test__file_cache_acquire__evicts_least_recently_used);
+    RUN_TEST(test__file_cache_acquire__evicts_least_recently_released);
+    RUN_TEST(test__file_cache_acquire__symlink_out_of_root);
+    RUN_TEST(test__file_cache_open);
+    RUN_TEST(test__file_cache_init__missing_root);
+    int failures = UNITY_END();
+    rmdir(root);
+    return failures;
+}
@@ -8,23 +8,37 @@
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/vfs.h>
+#include <sys/socket.h>
+#include <linux/magic.h>
 
 #define PORT 9002
 #define ADDRESS "0.0.0.0"
+#define UNIX_SOCKET_PATH "/tmp/client_server_test_file_transfer.sock"
+#define UNIX_ADDRESS UNIX_ADDRESS_PREFIX UNIX_SOCKET_PATH
 
 int server_running = 1;
 pthread_t server_thread;
+pthread_t unix_server_thread;
 pthread_mutex_t server_mutex = PTHREAD_MUTEX_INITIALIZER;
+// the server serves copies of the files in SERVER_FILE_PATH from a temporary directory, so the files
+// the tests generate never end up in the source tree
+char server_files[] = "/tmp/client_server_test_file_transfer_XXXXXX";
+const char* fixtures[] = {"test.txt", "test_multiple_chunks.txt"};
 
 /**
- * This function is a worker thread that acts as a server.
+ * This function is a worker thread that acts as a server. The argument is a pointer to the bound
+ * server socket (TCP or unix domain socket).
  */
 void* server_worker(void* arg) {
-    int server_socket = bind_or_die(PORT);
+    int server_socket = *(int*)arg;
     listen_or_die(server_socket, 1);
 
     while (1) {
-        int client_socket = accept_or_die(server_socket);
+        int client_socket = accept_or_die(server_socket, NULL);
         // after accept, check if the server is still running
         pthread_mutex_lock(&server_mutex);
         if (!server_running) {
@@ -32,23 +46,81 @@ void* server_worker(void* arg) {
             break;
         }
         pthread_mutex_unlock(&server_mutex);
+        // handle requests until the client closes the connection (like the keep-alive server)
         uint8_t buffer[MAX_MESSAGE_SIZE];
-        ssize_t bytes_received = receive_or_die(client_socket, buffer, MAX_MESSAGE_SIZE);
-        Response response;
-        int status = parse_message(buffer, bytes_received, &response);
-        if (status != STATUS_OK) {
-            fprintf(stderr, "Error parsing message\n");
-            socket_cleanup(client_socket);
-            continue;
+        ssize_t bytes_received;
+        while ((bytes_received = receive_message(client_socket, buffer, MAX_MESSAGE_SIZE)) > 0) {
+            Response response;
+            int status = parse_message(buffer, bytes_received, &response);
+            if (status != STATUS_OK) {
+                fprintf(stderr, "Error parsing message\n");
+                break;
+            }
+            handle_request(client_socket, &response.header, response.payload);
+            destroy_response(&response);
         }
-        handle_request(client_socket, &response.header, response.payload);
         socket_cleanup(client_socket);
-        destroy_response(&response);
     }
     socket_cleanup(server_socket);
     return NULL;
 }
 
+/**
+ * Copies the files in `fixtures` from SERVER_FILE_PATH into the served directory.
+ */
+void copy_fixtures() {
+    for (size_t i = 0; i < sizeof(fixtures) / sizeof(fixtures[0]); i++) {
+        char from[256];
+        char to[256];
+        snprintf(from, sizeof(from), "%s/%s", SERVER_FILE_PATH, fixtures[i]);
+        snprintf(to, sizeof(to), "%s/%s", server_files, fixtures[i]);
+        FILE* source = fopen(from, "rb");
+        FILE* destination = fopen(to, "wb");
+        if (source == NULL || destination == NULL) {
+            perror(fixtures[i]);
+            exit(1);
+        }
+        char buffer[4096];
+        size_t length;
+        while ((length = fread(buffer, 1, sizeof(buffer), source)) > 0) {
+            fwrite(buffer, 1, length, destination);
+        }
+        fclose(source);
+        fclose(destination);
+    }
+}
+
+/**
+ * Removes the served directory, with the copies and whatever a (failed) test left behind.
+ */
+void remove_server_files() {
+    DIR* directory = opendir(server_files);
+    if (directory == NULL) {
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(directory)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            unlinkat(dirfd(directory), entry->d_name, 0);
+        }
+    }
+    closedir(directory);
+    rmdir(server_files);
+}
+
+/**
+ * Builds the metadata the server is expected to send for a file: its size and ETag.
+ */
+void format_expected_metadata(const char* file_name, char* metadata, size_t metadata_size) {
+    char full_path[256];
+    snprintf(full_path, sizeof(full_path), "%s/%s", server_files, file_name);
+    struct stat file_stat;
+    TEST_ASSERT_EQUAL_INT(0, stat(full_path, &file_stat));
+    char etag[ETAG_SIZE];
+    format_etag(&file_stat, etag, sizeof(etag));
+    snprintf(metadata, metadata_size, "Size: %ld\nETag: %s", file_stat.st_size, etag);
+}
+
 void test__request_file_metadata__no_server_listening() {
     int socket = 0;
     const char* file_name = "test.txt";
@@ -81,7 +153,7 @@ void test__send_file_metadata__no_client_listening() {
 void test__request_file_metadata__file_not_exist() {
     const char* file_name = "this_file_does_not_exist.txt";
 
-    int server_socket = connect_with_retry_or_die(ADDRESS, PORT, 3, 1);
+    int server_socket = connect_with_retry_or_die(ADDRESS, PORT, 3, 1, NULL);
     Response response;
     int status = request_file_metadata(server_socket, file_name, &response);
     socket_cleanup(server_socket);
@@ -97,7 +169,7 @@ void test__request_file_metadata__file_not_exist() {
 void test__request_file_metadata__file_name_too_long() {
     char file_name[501]; memset(file_name, 'a', 500); file_name[500] = '\0';
 
-    int server_socket = connect_with_retry_or_die(ADDRESS, PORT, 3, 1);
+    int server_socket = connect_with_retry_or_die(ADDRESS, PORT, 3, 1, NULL);
     Response response;
     int status = request_file_metadata(server_socket, file_name, &response);
     socket_cleanup(server_socket);
@@ -112,10 +184,11 @@ void test__request_file_metadata__file_name_too_long() {
 
 void test__request_file_metadata__send_file_metadata__success() {
     const char* file_name = "test.txt";
-    char* expected_metadata = "Size: 35";
+    char expected_metadata[256];
+    format_expected_metadata(file_name, expected_metadata, sizeof(expected_metadata));
     uint32_t expected_payload_size = strlen_null_term(expected_metadata);
 
-    int server_socket = connect_with_retry_or_die(ADDRESS, PORT, 3, 1);
+    int server_socket = connect_with_retry_or_die(ADDRESS, PORT, 3, 1, NULL);
     Response response;
     int status = request_file_metadata(server_socket, file_name, &response);
     socket_cleanup(server_socket);
@@ -155,7 +228,7 @@ void test__send_file_contents__no_client_listening() {
 void test__request_file_contents__file_not_exist() {
     const char* file_name = "file-does-not-exist";
    
-    int server_socket = connect_with_retry_or_die(ADDRESS, PORT, 3, 1);
+    int server_socket = connect_with_retry_or_die(ADDRESS, PORT, 3, 1, NULL);
     Response response;
     int status = request_file_contents(server_socket, file_name, &response);
     socket_cleanup(server_socket);
@@ -168,10 +241,21 @@ void test__request_file_contents__file_not_exist() {
     destroy_response(&response);
 }
 
+void test__request_file_contents__outside_server_files() {
+    // the file exists, but outside of the served directory
+    int server_socket = connect_with_retry_or_die(ADDRESS, PORT, 3, 1, NULL);
+    Response response;
+    int status = request_file_contents(server_socket, "../test_file_transfer.c", &response);
+    socket_cleanup(server_socket);
+    TEST_ASSERT_EQUAL_INT(ERROR_INVALID_FILE_NAME, status);
+    TEST_ASSERT_EQUAL_UINT8(ERROR_INVALID_FILE_NAME, response.header.status);
+    destroy_response(&response);
+}
+
 void test__request_file_contents__file_name_too_long() {
     char file_name[501]; memset(file_name, 'a', 500); file_name[500] = '\0';
    
-    int server_socket = connect_with_retry_or_die(ADDRESS, PORT, 3, 1);
+    int server_socket = connect_with_retry_or_die(ADDRESS, PORT, 3, 1, NULL);
     Response response;
     int status = request_file_contents(server_socket, file_name, &response);
     socket_cleanup(server_socket);
@@ -189,7 +273,7 @@ void test__request_file_contents__send_file_contents__success() {
     const char* expected_contents = "These are the contents of test.txt\n";
     uint32_t expected_payload_size = strlen(expected_contents);
 
-    int server_socket = connect_with_retry_or_die(ADDRESS, PORT, 3, 1);
+    int server_socket = connect_with_retry_or_die(ADDRESS, PORT, 3, 1, NULL);
     Response response;
     int status = request_file_contents(server_socket, file_name, &response);
     socket_cleanup(server_socket);
@@ -208,7 +292,7 @@ void test__request_file_contents__send_file_contents__success() {
 void test__request_file_contents__send_file_contents__multiple_chunks_success() {
     char full_path[256];
     const char* file_name = "test_multiple_chunks.txt";
-    snprintf(full_path, sizeof(full_path), "%s/%s", SERVER_FILE_PATH, file_name);
+    snprintf(full_path, sizeof(full_path), "%s/%s", server_files, file_name);
 
     FILE* file = fopen(full_path, "rb");
     if (file == NULL) {
@@ -234,7 +318,7 @@ void test__request_file_contents__send_file_contents__multiple_chunks_success()
     }
 
     int expected_chunks = calculate_total_chunks(file_size);
-    int server_socket = connect_with_retry_or_die(ADDRESS, PORT, 3, 1);
+    int server_socket = connect_with_retry_or_die(ADDRESS, PORT, 3, 1, NULL);
     Response response;
     int status = request_file_contents(server_socket, file_name, &response);
     socket_cleanup(server_socket);
@@ -251,6 +335,638 @@ void test__request_file_contents__send_file_contents__multiple_chunks_success()
     free(expected_contents);
 }
 
+void test__request_file_metadata__unix_socket__success() {
+    const char* file_name = "test.txt";
+    char expected_metadata[256];
+    format_expected_metadata(file_name, expected_metadata, sizeof(expected_metadata));
+    uint32_t expected_payload_size = strlen_null_term(expected_metadata);
+
+    int server_socket = connect_with_retry_or_die(UNIX_ADDRESS, 0, 3, 1, NULL);
+    Response response;
+    int status = request_file_metadata(server_socket, file_name, &response);
+    socket_cleanup(server_socket);
+
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, status);
+    TEST_ASSERT_EQUAL_UINT32(expected_payload_size, response.header.payload_size);
+    TEST_ASSERT_TRUE(memcmp(response.payload, expected_metadata, expected_payload_size) == 0);
+    destroy_response(&response);
+}
+
+void test__request_file_contents__unix_socket__success() {
+    const char* file_name = "test.txt";
+    const char* expected_contents = "These are the contents of test.txt\n";
+    uint32_t expected_payload_size = strlen(expected_contents);
+
+    int server_socket = connect_with_retry_or_die(UNIX_ADDRESS, 0, 3, 1, NULL);
+    Response response;
+    int status = request_file_contents(server_socket, file_name, &response);
+    socket_cleanup(server_socket);
+
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, status);
+    TEST_ASSERT_EQUAL_UINT8(MESSAGE_RESPONSE, response.header.message_type);
+    TEST_ASSERT_EQUAL_UINT32(expected_payload_size, response.header.payload_size);
+    TEST_ASSERT_TRUE(memcmp(response.payload, expected_contents, expected_payload_size) == 0);
+    destroy_response(&response);
+}
+
+void test__request_file_mapping__unix_socket__success() {
+    const char* file_name = "test.txt";
+    const char* expected_contents = "These are the contents of test.txt\n";
+
+    int server_socket = connect_with_retry_or_die(UNIX_ADDRESS, 0, 3, 1, NULL);
+    MappedFile mapped_file;
+    int status = request_file_mapping(server_socket, file_name, &mapped_file);
+    socket_cleanup(server_socket);
+
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, status);
+    TEST_ASSERT_NOT_EQUAL(-1, mapped_file.fd);
+    TEST_ASSERT_EQUAL_size_t(strlen(expected_contents), mapped_file.size);
+    TEST_ASSERT_TRUE(memcmp(mapped_file.data, expected_contents, mapped_file.size) == 0);
+    destroy_mapped_file(&mapped_file);
+    TEST_ASSERT_EQUAL_INT(-1, mapped_file.fd);
+    TEST_ASSERT_NULL(mapped_file.data);
+}
+
+void test__request_file_descriptor__file_not_exist() {
+    int server_socket = connect_with_retry_or_die(UNIX_ADDRESS, 0, 3, 1, NULL);
+    Response response = RESPONSE_INIT;
+    int fd;
+    int status = request_file_descriptor(server_socket, "file-does-not-exist", &response, &fd);
+    socket_cleanup(server_socket);
+
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_NOT_FOUND, status);
+    TEST_ASSERT_EQUAL_INT(-1, fd);
+    TEST_ASSERT_EQUAL_UINT8(COMMAND_REQUEST_FILE_DESCRIPTOR, response.header.command);
+    destroy_response(&response);
+}
+
+void test__request_file_descriptor__tcp__unsupported_transport() {
+    int server_socket = connect_with_retry_or_die(ADDRESS, PORT, 3, 1, NULL);
+    Response response = RESPONSE_INIT;
+    int fd;
+    int status = request_file_descriptor(server_socket, "test.txt", &response, &fd);
+    socket_cleanup(server_socket);
+
+    TEST_ASSERT_EQUAL_INT(ERROR_UNSUPPORTED_TRANSPORT, status);
+    TEST_ASSERT_EQUAL_INT(-1, fd);
+    destroy_response(&response);
+}
+
+/**
+ * Reads a file into a newly allocated buffer; the caller frees it.
+ */
+char* read_file(const char* path, long* file_size) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+    fseek(file, 0, SEEK_END);
+    *file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* contents = malloc(*file_size + 1);
+    if (contents == NULL || fread(contents, 1, *file_size, file) != *file_size) {
+        perror("fread");
+        exit(1);
+    }
+    fclose(file);
+    return contents;
+}
+
+void assert_request_file_to_fd(const char* address, in_addr_t port, int flags) {
+    const char* file_name = "test_multiple_chunks.txt";
+    char full_path[256];
+    snprintf(full_path, sizeof(full_path), "%s/%s", server_files, file_name);
+    long expected_size;
+    char* expected_contents = read_file(full_path, &expected_size);
+
+    FILE* output = tmpfile();
+    int server_socket = connect_with_retry_or_die(address, port, 3, 1, NULL);
+    Response response;
+    int status = request_file_to_fd(server_socket, file_name, fileno(output), flags, &response);
+    socket_cleanup(server_socket);
+
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, status);
+    TEST_ASSERT_EQUAL_UINT32(expected_size, response.header.payload_size);
+    TEST_ASSERT_EQUAL_UINT32(calculate_total_chunks(expected_size), response.header.chunk_index + 1);
+    TEST_ASSERT_NULL(response.payload);
+    char* contents = malloc(expected_size + 1);
+    fseek(output, 0, SEEK_END);
+    TEST_ASSERT_EQUAL_INT(expected_size, ftell(output));
+    fseek(output, 0, SEEK_SET);
+    TEST_ASSERT_EQUAL_size_t(expected_size, fread(contents, 1, expected_size, output));
+    TEST_ASSERT_TRUE(memcmp(contents, expected_contents, expected_size) == 0);
+    free(contents);
+    free(expected_contents);
+    fclose(output);
+    destroy_response(&response);
+}
+
+void test__request_file_to_fd__success() {
+    assert_request_file_to_fd(ADDRESS, PORT, 0);
+}
+
+void test__request_file_to_fd__preallocate_and_drop_behind() {
+    assert_request_file_to_fd(ADDRESS, PORT, SINK_PREALLOCATE | SINK_DROP_BEHIND);
+}
+
+void test__request_file_to_fd__unix_socket__success() {
+    assert_request_file_to_fd(UNIX_ADDRESS, 0, SINK_PREALLOCATE);
+}
+
+void test__request_file_to_fd__file_not_exist() {
+    FILE* output = tmpfile();
+    int server_socket = connect_with_retry_or_die(ADDRESS, PORT, 3, 1, NULL);
+    Response response;
+    int status = request_file_to_fd(server_socket, "file-does-not-exist", fileno(output), 0, &response);
+    socket_cleanup(server_socket);
+
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_NOT_FOUND, status);
+    TEST_ASSERT_EQUAL_UINT8(COMMAND_REQUEST_FILE, response.header.command);
+    TEST_ASSERT_NOT_NULL(response.payload);
+    fseek(output, 0, SEEK_END);
+    TEST_ASSERT_EQUAL_INT(0, ftell(output));
+    fclose(output);
+    destroy_response(&response);
+}
+
+void test__request_file_to_fd__drop_behind_large_file() {
+    // more than two windows, so written windows are dropped while the transfer is in progress
+    const char* file_name = "generated_drop_behind_file.bin";
+    long file_size = 2 * SINK_DROP_BEHIND_WINDOW + SINK_DROP_BEHIND_WINDOW / 2 + 123;
+    char full_path[256];
+    snprintf(full_path, sizeof(full_path), "%s/%s", server_files, file_name);
+    uint8_t* expected_contents = malloc(file_size);
+    for (long i = 0; i < file_size; i++) {
+        expected_contents[i] = (uint8_t)(i * 7 + i / 4096);
+    }
+    FILE* file = fopen(full_path, "wb");
+    TEST_ASSERT_NOT_NULL(file);
+    TEST_ASSERT_EQUAL_size_t(file_size, fwrite(expected_contents, 1, file_size, file));
+    fclose(file);
+
+    FILE* output = tmpfile();
+    int server_socket = connect_with_retry_or_die(ADDRESS, PORT, 3, 1, NULL);
+    Response response;
+    int status = request_file_to_fd(server_socket, file_name, fileno(output), SINK_DROP_BEHIND, &response);
+    socket_cleanup(server_socket);
+    unlink(full_path);
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, status);
+    TEST_ASSERT_EQUAL_UINT32(file_size, response.header.payload_size);
+    destroy_response(&response);
+
+    // the written data was dropped from the page cache (tmpfs has nothing to write back, so it keeps it)
+    struct statfs file_system;
+    TEST_ASSERT_EQUAL_INT(0, fstatfs(fileno(output), &file_system));
+    if (file_system.f_type != TMPFS_MAGIC) {
+        long page_size = sysconf(_SC_PAGESIZE);
+        size_t page_count = (file_size + page_size - 1) / page_size;
+        uint8_t* mapping = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fileno(output), 0);
+        TEST_ASSERT_NOT_EQUAL(MAP_FAILED, mapping);
+        unsigned char* resident = malloc(page_count);
+        TEST_ASSERT_EQUAL_INT(0, mincore(mapping, file_size, resident));
+        size_t resident_count = 0;
+        for (size_t i = 0; i < page_count; i++) {
+            resident_count += resident[i] & 1;
+        }
+        free(resident);
+        munmap(mapping, file_size);
+        TEST_ASSERT_LESS_THAN_size_t(page_count / 4, resident_count);
+    }
+    uint8_t* contents = malloc(file_size);
+    TEST_ASSERT_EQUAL_INT64(file_size, pread(fileno(output), contents, file_size, 0));
+    TEST_ASSERT_TRUE(memcmp(contents, expected_contents, file_size) == 0);
+    free(contents);
+    free(expected_contents);
+    fclose(output);
+}
+
+void test__request_file_to_fd__truncated_on_error_mid_stream() {
+    // a server that sends the first chunk of a file, then goes away
+    int sockets[2];
+    TEST_ASSERT_EQUAL_INT(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+    uint8_t chunk[MAX_PAYLOAD_SIZE];
+    memset(chunk, 'x', sizeof(chunk));
+    Header header = {MESSAGE_RESPONSE_CHUNK, COMMAND_REQUEST_FILE, sizeof(chunk), 0, STATUS_OK, 0};
+    Message message;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, create_message(&header, chunk, &message));
+    TEST_ASSERT_EQUAL_INT64(message.size, send_all(sockets[1], message.data, message.size));
+    destroy_message(&message);
+    shutdown(sockets[1], SHUT_WR);
+
+    FILE* output = tmpfile();
+    Response response;
+    int status = request_file_to_fd(sockets[0], "test_multiple_chunks.txt", fileno(output), 0, &response);
+    close(sockets[0]);
+    close(sockets[1]);
+    TEST_ASSERT_EQUAL_INT(ERROR_RECEIVE_FAILED, status);
+    // the chunk that was written isn't left behind as if it were the file
+    fseek(output, 0, SEEK_END);
+    TEST_ASSERT_EQUAL_INT(0, ftell(output));
+    fclose(output);
+    destroy_response(&response);
+}
+
+void test__request_file_contents__pipelined_large_file() {
+    // larger than READ_AHEAD_BUFFERS * READ_AHEAD_BUFFER_SIZE and not a multiple of MAX_PAYLOAD_SIZE,
+    // so the reader wraps around the ring and the last chunk is partial
+    const char* file_name = "generated_large_file.bin";
+    long file_size = 3 * READ_AHEAD_BUFFERS * READ_AHEAD_BUFFER_SIZE + 123;
+    char full_path[256];
+    snprintf(full_path, sizeof(full_path), "%s/%s", server_files, file_name);
+    uint8_t* expected_contents = malloc(file_size);
+    for (long i = 0; i < file_size; i++) {
+        expected_contents[i] = (uint8_t)(i * 31 + i / 1024);
+    }
+    FILE* file = fopen(full_path, "wb");
+    TEST_ASSERT_NOT_NULL(file);
+    TEST_ASSERT_EQUAL_size_t(file_size, fwrite(expected_contents, 1, file_size, file));
+    fclose(file);
+
+    int server_socket = connect_with_retry_or_die(ADDRESS, PORT, 3, 1, NULL);
+    Response response;
+    int status = request_file_contents(server_socket, file_name, &response);
+    socket_cleanup(server_socket);
+    unlink(full_path);
+
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, status);
+    TEST_ASSERT_EQUAL_UINT32(file_size, response.header.payload_size);
+    TEST_ASSERT_EQUAL_UINT32(calculate_total_chunks(file_size), response.header.chunk_index + 1);
+    TEST_ASSERT_TRUE(memcmp(response.payload, expected_contents, file_size) == 0);
+    destroy_response(&response);
+    free(expected_contents);
+}
+
+void test__request_file_range__success() {
+    // the range starts in the middle of a chunk and spans several
+    const char* file_name = "generated_range_file.bin";
+    long file_size = 5 * MAX_PAYLOAD_SIZE + 77;
+    char full_path[256];
+    snprintf(full_path, sizeof(full_path), "%s/%s", server_files, file_name);
+    uint8_t* expected_contents = malloc(file_size);
+    for (long i = 0; i < file_size; i++) {
+        expected_contents[i] = (uint8_t)(i * 31 + i / 1024);
+    }
+    FILE* file = fopen(full_path, "wb");
+    TEST_ASSERT_NOT_NULL(file);
+    TEST_ASSERT_EQUAL_size_t(file_size, fwrite(expected_contents, 1, file_size, file));
+    fclose(file);
+
+    int server_socket = connect_with_retry_or_die(ADDRESS, PORT, 3, 1, NULL);
+    Response response;
+    int status = request_file_range(server_socket, file_name, 1000, 3 * MAX_PAYLOAD_SIZE, &response);
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, status);
+    TEST_ASSERT_EQUAL_UINT32(3 * MAX_PAYLOAD_SIZE, response.header.payload_size);
+    TEST_ASSERT_TRUE(memcmp(response.payload, expected_contents + 1000, 3 * MAX_PAYLOAD_SIZE) == 0);
+    destroy_response(&response);
+
+    // a range past the end of the file is cut short
+    status = request_file_range(server_socket, file_name, file_size - 100, 1000, &response);
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, status);
+    TEST_ASSERT_EQUAL_UINT32(100, response.header.payload_size);
+    TEST_ASSERT_TRUE(memcmp(response.payload, expected_contents + file_size - 100, 100) == 0);
+    destroy_response(&response);
+    socket_cleanup(server_socket);
+    unlink(full_path);
+    free(expected_contents);
+}
+
+void test__request_file_range__invalid_range() {
+    int server_socket = connect_with_retry_or_die(ADDRESS, PORT, 3, 1, NULL);
+    Response response;
+    // starts at the end of the file
+    char full_path[256];
+    snprintf(full_path, sizeof(full_path), "%s/test.txt", server_files);
+    struct stat file_stat;
+    TEST_ASSERT_EQUAL_INT(0, stat(full_path, &file_stat));
+    int status = request_file_range(server_socket, "test.txt", file_stat.st_size, 10, &response);
+    TEST_ASSERT_EQUAL_INT(ERROR_INVALID_DATA_SIZE, status);
+    TEST_ASSERT_EQUAL_UINT8(COMMAND_REQUEST_RANGE, response.header.command);
+    destroy_response(&response);
+    // the connection is still usable
+    status = request_file_range(server_socket, "test.txt", 0, 0, &response);
+    TEST_ASSERT_EQUAL_INT(ERROR_INVALID_DATA_SIZE, status);
+    destroy_response(&response);
+    status = request_file_range(server_socket, "this_file_does_not_exist.txt", 0, 10, &response);
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_NOT_FOUND, status);
+    destroy_response(&response);
+    socket_cleanup(server_socket);
+}
+
+void test__parse_file_size() {
+    uint64_t file_size;
+    TEST_ASSERT_EQUAL_INT(0, parse_file_size("Size: 1234\nETag: \"1-2-3\"", &file_size));
+    TEST_ASSERT_EQUAL_UINT64(1234, file_size);
+    TEST_ASSERT_NOT_EQUAL_INT(0, parse_file_size("ETag: \"1-2-3\"", &file_size));
+    TEST_ASSERT_NOT_EQUAL_INT(0, parse_file_size("Size: -1\n", &file_size));
+}
+
+void test__request_file_delta__modified_local_copy() {
+    const char* file_name = "test_multiple_chunks.txt";
+    char full_path[256];
+    snprintf(full_path, sizeof(full_path), "%s/%s", server_files, file_name);
+    long file_size;
+    char* expected_contents = read_file(full_path, &file_size);
+    // the local copy is out of date: a few bytes in the middle differ
+    char* basis = malloc(file_size);
+    memcpy(basis, expected_contents, file_size);
+    memcpy(basis + file_size / 2, "outdated", 8);
+
+    int server_socket = connect_with_retry_or_die(ADDRESS, PORT, 3, 1, NULL);
+    Response response;
+    DeltaOutput output;
+    int status = request_file_delta(server_socket, file_name, (uint8_t*)basis, file_size, &response, &output);
+    socket_cleanup(server_socket);
+
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, status);
+    TEST_ASSERT_EQUAL_UINT8(COMMAND_REQUEST_DELTA, response.header.command);
+    TEST_ASSERT_EQUAL_UINT32(file_size, response.header.payload_size);
+    TEST_ASSERT_EQUAL_size_t(file_size, output.size);
+    TEST_ASSERT_TRUE(memcmp(output.data, expected_contents, file_size) == 0);
+    // only the changed block and the partial block at the end are transferred
+    TEST_ASSERT_TRUE(output.literal_bytes < 2 * DELTA_MIN_BLOCK_SIZE);
+    TEST_ASSERT_TRUE(output.copied_bytes > 0);
+    destroy_delta_output(&output);
+    destroy_response(&response);
+    free(basis);
+    free(expected_contents);
+}
+
+void test__request_file_delta__no_local_copy() {
+    const char* expected_contents = "These are the contents of test.txt\n";
+    int server_socket = connect_with_retry_or_die(UNIX_ADDRESS, 0, 3, 1, NULL);
+    Response response;
+    DeltaOutput output;
+    int status = request_file_delta(server_socket, "test.txt", NULL, 0, &response, &output);
+    // the connection is at a message boundary afterwards and can be used for another request
+    Response metadata = RESPONSE_INIT;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, request_file_metadata(server_socket, "test.txt", &metadata));
+    socket_cleanup(server_socket);
+
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, status);
+    TEST_ASSERT_EQUAL_size_t(strlen(expected_contents), output.size);
+    TEST_ASSERT_EQUAL_size_t(output.size, output.literal_bytes);
+    TEST_ASSERT_TRUE(memcmp(output.data, expected_contents, output.size) == 0);
+    destroy_delta_output(&output);
+    destroy_response(&metadata);
+}
+
+void test__request_file_delta__file_not_exist() {
+    uint8_t basis[2 * DELTA_MIN_BLOCK_SIZE] = {0};
+    int server_socket = connect_with_retry_or_die(ADDRESS, PORT, 3, 1, NULL);
+    Response response;
+    DeltaOutput output;
+    int status = request_file_delta(server_socket, "file-does-not-exist", basis, sizeof(basis), &response, &output);
+    socket_cleanup(server_socket);
+
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_NOT_FOUND, status);
+    TEST_ASSERT_EQUAL_UINT8(COMMAND_REQUEST_DELTA, response.header.command);
+    TEST_ASSERT_NULL(output.data);
+    destroy_response(&response);
+}
+
+/**
+ * Sends a payload of delta instructions as a RESPONSE_CHUNK, the way the server does.
+ */
+int send_delta_chunk(const uint8_t* payload, size_t length, int last, void* context) {
+    (void)last;
+    int socket = *(int*)context;
+    Header header = {MESSAGE_RESPONSE_CHUNK, COMMAND_REQUEST_DELTA, length, 0, STATUS_OK, 0};
+    Message message;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, create_message(&header, payload, &message));
+    TEST_ASSERT_EQUAL_INT(message.size, send_all(socket, message.data, message.size));
+    destroy_message(&message);
+    return STATUS_OK;
+}
+
+void test__request_file_delta__checksum_mismatch() {
+    int pair[2];
+    TEST_ASSERT_EQUAL_INT(0, socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+    // the response is queued up front: the instructions for "new contents", and the hash of something else
+    const char* contents = "new contents";
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, delta_generate((const uint8_t*)contents, strlen(contents), NULL, 0, DELTA_MIN_BLOCK_SIZE, send_delta_chunk, &pair[1]));
+    uint8_t hash[DELTA_FILE_HASH_SIZE];
+    delta_file_hash((const uint8_t*)"old contents", strlen("old contents"), hash);
+    Header header = {MESSAGE_RESPONSE_LAST_CHUNK, COMMAND_REQUEST_DELTA, sizeof(hash), 1, STATUS_OK, 0};
+    Message message;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, create_message(&header, hash, &message));
+    TEST_ASSERT_EQUAL_INT(message.size, send_all(pair[1], message.data, message.size));
+    destroy_message(&message);
+
+    Response response;
+    DeltaOutput output;
+    int status = request_file_delta(pair[0], "test.txt", NULL, 0, &response, &output);
+    TEST_ASSERT_EQUAL_INT(ERROR_CHECKSUM_MISMATCH, status);
+    TEST_ASSERT_NULL(output.data);
+    destroy_response(&response);
+    close(pair[0]);
+    close(pair[1]);
+}
+
+void test__parse_etag() {
+    char etag[ETAG_SIZE];
+    TEST_ASSERT_EQUAL_INT(0, parse_etag("Size: 35\nETag: \"1-2.3-23\"", etag, sizeof(etag)));
+    TEST_ASSERT_EQUAL_STRING("\"1-2.3-23\"", etag);
+    TEST_ASSERT_EQUAL_INT(-1, parse_etag("Size: 35", etag, sizeof(etag)));
+    TEST_ASSERT_EQUAL_INT(-1, parse_etag("ETag: \"1-2.3-23\"", etag, 4));
+}
+
+void test__etag_version() {
+    // the inode is left out; a pack ETag has none
+    TEST_ASSERT_EQUAL_STRING("2.3-23\"", etag_version("\"1-2.3-23\""));
+    TEST_ASSERT_EQUAL_STRING(etag_version("\"1-2.3-23\""), etag_version("\"7f-2.3-23\""));
+    TEST_ASSERT_EQUAL_STRING("\"00ff-23\"", etag_version("\"00ff-23\""));
+}
+
+/**
+ * Sends a message with an empty payload.
+ */
+void send_empty_message(int socket, uint8_t message_type, uint8_t command) {
+    Header header = {message_type, command, 0, 0, NOT_SET, 0};
+    Message message;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, create_message(&header, NULL, &message));
+    TEST_ASSERT_EQUAL_INT(message.size, send_all(socket, message.data, message.size));
+    destroy_message(&message);
+}
+
+void test__reject_request() {
+    int pair[2];
+    TEST_ASSERT_EQUAL_INT(0, socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+    // a rejected delta request is followed by its block signatures, and then the next request
+    send_empty_message(pair[0], MESSAGE_REQUEST_LAST_CHUNK, COMMAND_REQUEST_DELTA);
+    send_empty_message(pair[0], MESSAGE_REQUEST, COMMAND_REQUEST_METADATA);
+
+    Header delta_request = {MESSAGE_REQUEST, COMMAND_REQUEST_DELTA, 0, 0, NOT_SET, 5};
+    TEST_ASSERT_EQUAL_INT(ERROR_OVERLOADED, reject_request(pair[1], &delta_request, ERROR_OVERLOADED, "Server overloaded"));
+
+    // the error response is sent on the stream of the request
+    uint8_t buffer[MAX_MESSAGE_SIZE];
+    ssize_t bytes_received = receive_message(pair[0], buffer, sizeof(buffer));
+    Response response;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, parse_message(buffer, bytes_received, &response));
+    TEST_ASSERT_EQUAL_UINT8(MESSAGE_RESPONSE, response.header.message_type);
+    TEST_ASSERT_EQUAL_UINT8(ERROR_OVERLOADED, response.header.status);
+    TEST_ASSERT_EQUAL_UINT32(5, response.header.stream_id);
+    TEST_ASSERT_EQUAL_STRING("Server overloaded", (char*)response.payload);
+    destroy_response(&response);
+
+    // the signatures were skipped, so the server reads the next request
+    bytes_received = receive_message(pair[1], buffer, sizeof(buffer));
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, parse_message(buffer, bytes_received, &response));
+    TEST_ASSERT_EQUAL_UINT8(MESSAGE_REQUEST, response.header.message_type);
+    TEST_ASSERT_EQUAL_UINT8(COMMAND_REQUEST_METADATA, response.header.command);
+    destroy_response(&response);
+    close(pair[0]);
+    close(pair[1]);
+}
+
+void test__request_file_contents_if_none_match__revalidation() {
+    const char* file_name = "test.txt";
+    const char* expected_contents = "These are the contents of test.txt\n";
+    int server_socket = connect_with_retry_or_die(ADDRESS, PORT, 3, 1, NULL);
+
+    // no cached copy: the contents and the current ETag are returned
+    Response response;
+    char etag[ETAG_SIZE];
+    int status = request_file_contents_if_none_match(server_socket, file_name, NULL, &response, etag);
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, status);
+    TEST_ASSERT_EQUAL_UINT32(strlen(expected_contents), response.header.payload_size);
+    TEST_ASSERT_TRUE(memcmp(response.payload, expected_contents, response.header.payload_size) == 0);
+    char expected_metadata[256];
+    format_expected_metadata(file_name, expected_metadata, sizeof(expected_metadata));
+    char expected_etag[ETAG_SIZE];
+    parse_etag(expected_metadata, expected_etag, sizeof(expected_etag));
+    TEST_ASSERT_EQUAL_STRING(expected_etag, etag);
+    destroy_response(&response);
+
+    // revalidating with the same ETag: a single small response, on the same connection
+    char current_etag[ETAG_SIZE];
+    status = request_file_contents_if_none_match(server_socket, file_name, etag, &response, current_etag);
+    TEST_ASSERT_EQUAL_INT(STATUS_NOT_MODIFIED, status);
+    TEST_ASSERT_EQUAL_UINT8(STATUS_NOT_MODIFIED, response.header.status);
+    TEST_ASSERT_EQUAL_STRING(etag, current_etag);
+    destroy_response(&response);
+
+    // an outdated ETag: the contents are sent again
+    status = request_file_contents_if_none_match(server_socket, file_name, "\"outdated\"", &response, current_etag);
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, status);
+    TEST_ASSERT_EQUAL_UINT32(strlen(expected_contents), response.header.payload_size);
+    TEST_ASSERT_EQUAL_STRING(etag, current_etag);
+    destroy_response(&response);
+    socket_cleanup(server_socket);
+}
+
+void test__request_file_contents_if_none_match__etag_changes_with_file() {
+    const char* file_name = "generated_etag_file.txt";
+    char full_path[256];
+    snprintf(full_path, sizeof(full_path), "%s/%s", server_files, file_name);
+    FILE* file = fopen(full_path, "w");
+    fputs("first version", file);
+    fclose(file);
+
+    int server_socket = connect_with_retry_or_die(ADDRESS, PORT, 3, 1, NULL);
+    Response response;
+    char etag[ETAG_SIZE];
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, request_file_contents_if_none_match(server_socket, file_name, NULL, &response, etag));
+    destroy_response(&response);
+
+    file = fopen(full_path, "a");
+    fputs(", second version", file);
+    fclose(file);
+    char current_etag[ETAG_SIZE];
+    int status = request_file_contents_if_none_match(server_socket, file_name, etag, &response, current_etag);
+    socket_cleanup(server_socket);
+    unlink(full_path);
+
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, status);
+    TEST_ASSERT_FALSE(strcmp(etag, current_etag) == 0);
+    TEST_ASSERT_TRUE(memcmp(response.payload, "first version, second version", response.header.payload_size) == 0);
+    destroy_response(&response);
+}
+
+void test__request_file_contents_if_none_match__file_not_exist() {
+    int server_socket = connect_with_retry_or_die(ADDRESS, PORT, 3, 1, NULL);
+    Response response;
+    char etag[ETAG_SIZE];
+    int status = request_file_contents_if_none_match(server_socket, "file-does-not-exist", "\"1-2.3-4\"", &response, etag);
+    socket_cleanup(server_socket);
+
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_NOT_FOUND, status);
+    TEST_ASSERT_EQUAL_STRING("", etag);
+    destroy_response(&response);
+}
+
+void test__server_pack__every_command_uses_the_pack() {
+    // the packed file only exists in the pack, not in the served directory
+    char packed_files[] = "/tmp/client_server_test_file_transfer_packed_XXXXXX";
+    TEST_ASSERT_NOT_NULL(mkdtemp(packed_files));
+    char full_path[256];
+    snprintf(full_path, sizeof(full_path), "%s/packed.bin", packed_files);
+    size_t file_size = 3 * MAX_PAYLOAD_SIZE + 11;
+    uint8_t* expected_contents = malloc(file_size);
+    for (size_t i = 0; i < file_size; i++) {
+        expected_contents[i] = (uint8_t)(i * 7 + i / 512);
+    }
+    FILE* file = fopen(full_path, "wb");
+    TEST_ASSERT_NOT_NULL(file);
+    TEST_ASSERT_EQUAL_size_t(file_size, fwrite(expected_contents, 1, file_size, file));
+    fclose(file);
+    char pack_path[256];
+    snprintf(pack_path, sizeof(pack_path), "%s.pack", packed_files);
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, pack_create(packed_files, pack_path, NULL));
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, server_pack_open(pack_path));
+    PackEntry entry;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, pack_find(server_pack(), "packed.bin", &entry));
+    char expected_etag[ETAG_SIZE];
+    pack_format_etag(&entry, expected_etag, sizeof(expected_etag));
+
+    int server_socket = connect_with_retry_or_die(UNIX_ADDRESS, 0, 3, 1, NULL);
+    Response response;
+    char etag[ETAG_SIZE];
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, request_file_metadata(server_socket, "packed.bin", &response));
+    TEST_ASSERT_EQUAL_INT(0, parse_etag((const char*)response.payload, etag, sizeof(etag)));
+    TEST_ASSERT_EQUAL_STRING(expected_etag, etag);
+    destroy_response(&response);
+
+    // a conditional fetch compares against the same ETag
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, request_file_contents_if_none_match(server_socket, "packed.bin", NULL, &response, etag));
+    TEST_ASSERT_EQUAL_STRING(expected_etag, etag);
+    TEST_ASSERT_EQUAL_UINT32(file_size, response.header.payload_size);
+    TEST_ASSERT_TRUE(memcmp(response.payload, expected_contents, file_size) == 0);
+    destroy_response(&response);
+    TEST_ASSERT_EQUAL_INT(STATUS_NOT_MODIFIED, request_file_contents_if_none_match(server_socket, "packed.bin", expected_etag, &response, etag));
+    destroy_response(&response);
+
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, request_file_range(server_socket, "packed.bin", 1000, 2000, &response));
+    TEST_ASSERT_EQUAL_UINT32(2000, response.header.payload_size);
+    TEST_ASSERT_TRUE(memcmp(response.payload, expected_contents + 1000, 2000) == 0);
+    destroy_response(&response);
+
+    uint8_t* basis = malloc(file_size);
+    memcpy(basis, expected_contents, file_size);
+    memcpy(basis + file_size / 2, "outdated", 8);
+    DeltaOutput output;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, request_file_delta(server_socket, "packed.bin", basis, file_size, &response, &output));
+    TEST_ASSERT_EQUAL_size_t(file_size, output.size);
+    TEST_ASSERT_TRUE(memcmp(output.data, expected_contents, file_size) == 0);
+    destroy_delta_output(&output);
+    destroy_response(&response);
+
+    // packed files have no descriptor to pass
+    int fd;
+    TEST_ASSERT_EQUAL_INT(ERROR_UNSUPPORTED_TRANSPORT, request_file_descriptor(server_socket, "packed.bin", &response, &fd));
+    TEST_ASSERT_EQUAL_INT(-1, fd);
+    destroy_response(&response);
+    socket_cleanup(server_socket);
+
+    server_pack_close();
+    unlink(pack_path);
+    unlink(full_path);
+    rmdir(packed_files);
+    free(basis);
+    free(expected_contents);
+}
+
 void test__calculate_total_chunks() {
     TEST_ASSERT_EQUAL_INT(1, calculate_total_chunks(1));
     TEST_ASSERT_EQUAL_INT(1, calculate_total_chunks(MAX_PAYLOAD_SIZE - 1));
@@ -265,10 +981,25 @@ void tearDown(void) {}
 
 int main(void) {
     UNITY_BEGIN();
+    if (mkdtemp(server_files) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    copy_fixtures();
+    const char* roots[] = {server_files};
+    if (server_storage_init(roots, 1, IO_POOL_DEFAULT_THREADS) != STATUS_OK) {
+        fprintf(stderr, "could not serve %s\n", server_files);
+        exit(1);
+    }
     ////
-    // start server in a separate thread
+    // start the TCP and unix domain socket servers in separate threads
     ////
-    int status = pthread_create(&server_thread, NULL, server_worker, NULL);
+    int tcp_socket = bind_or_die(PORT, NULL);
+    int unix_socket = bind_unix_or_die(UNIX_SOCKET_PATH, NULL);
+    int status = pthread_create(&server_thread, NULL, server_worker, &tcp_socket);
+    if (status == 0) {
+        status = pthread_create(&unix_server_thread, NULL, server_worker, &unix_socket);
+    }
     if (status != 0) {
         perror("pthread_create");
         exit(1);
@@ -287,8 +1018,35 @@ int main(void) {
     RUN_TEST(test__send_file_contents__file_name_too_long);
     RUN_TEST(test__send_file_contents__no_client_listening);
     RUN_TEST(test__request_file_contents__file_not_exist);
+    RUN_TEST(test__request_file_contents__outside_server_files);
     RUN_TEST(test__request_file_contents__send_file_contents__success);
     RUN_TEST(test__request_file_contents__send_file_contents__multiple_chunks_success);
+    RUN_TEST(test__request_file_metadata__unix_socket__success);
+    RUN_TEST(test__request_file_contents__unix_socket__success);
+    RUN_TEST(test__request_file_mapping__unix_socket__success);
+    RUN_TEST(test__request_file_descriptor__file_not_exist);
+    RUN_TEST(test__request_file_descriptor__tcp__unsupported_transport);
+    RUN_TEST(test__request_file_contents__pipelined_large_file);
+    RUN_TEST(test__request_file_to_fd__success);
+    RUN_TEST(test__request_file_to_fd__preallocate_and_drop_behind);
+    RUN_TEST(test__request_file_to_fd__unix_socket__success);
+    RUN_TEST(test__request_file_to_fd__file_not_exist);
+    RUN_TEST(test__request_file_to_fd__drop_behind_large_file);
+    RUN_TEST(test__request_file_to_fd__truncated_on_error_mid_stream);
+    RUN_TEST(test__request_file_range__success);
+    RUN_TEST(test__request_file_range__invalid_range);
+    RUN_TEST(test__parse_file_size);
+    RUN_TEST(test__request_file_delta__modified_local_copy);
+    RUN_TEST(test__request_file_delta__no_local_copy);
+    RUN_TEST(test__request_file_delta__file_not_exist);
+    RUN_TEST(test__request_file_delta__checksum_mismatch);
+    RUN_TEST(test__parse_etag);
+    RUN_TEST(test__etag_version);
+    RUN_TEST(test__reject_request);
+    RUN_TEST(test__request_file_contents_if_none_match__revalidation);
+    RUN_TEST(test__request_file_contents_if_none_match__etag_changes_with_file);
+    RUN_TEST(test__request_file_contents_if_none_match__file_not_exist);
+    RUN_TEST(test__server_pack__every_command_uses_the_pack);
     RUN_TEST(test__calculate_total_chunks);
     ////
     // stop the server
@@ -296,10 +1054,15 @@ int main(void) {
     pthread_mutex_lock(&server_mutex);
     server_running = 0;
     pthread_mutex_unlock(&server_mutex);
-    // send one more connection request to the server to interrupt the accept call
-    int client_socket = connect_socket(ADDRESS, PORT);
+    // send one more connection request to each server to interrupt the accept call
+    int client_socket = connect_socket(ADDRESS, PORT, NULL);
+    socket_cleanup(client_socket);
+    client_socket = connect_socket(UNIX_ADDRESS, 0, NULL);
     socket_cleanup(client_socket);
-    // wait for the server to finish cleaning up
+    // wait for the servers to finish cleaning up
     pthread_join(server_thread, NULL);
+    pthread_join(unix_server_thread, NULL);
+    unlink(UNIX_SOCKET_PATH);
+    remove_server_files();
     return UNITY_END();
 }
@@ -0,0 +1,103 @@
+#include "protocol.h"
+#include "hash_ring.h"
+#include "unity.h"
+#include <stdio.h>
+#include <string.h>
+
+#define KEY_COUNT 30000
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+}
+
+void key_name(int i, char* key, size_t key_size) {
+    snprintf(key, key_size, "directory/file_%d.txt", i);
+}
+
+void test__hash_ring_init__no_nodes() {
+    HashRing ring;
+    const char* nodes[] = {"a"};
+    TEST_ASSERT_EQUAL_INT(ERROR_INVALID_DATA_SIZE, hash_ring_init(&ring, nodes, 0, 16));
+    TEST_ASSERT_EQUAL_INT(ERROR_INVALID_DATA_SIZE, hash_ring_init(&ring, nodes, 1, 0));
+}
+
+void test__hash_ring_lookup__single_node() {
+    HashRing ring;
+    const char* nodes[] = {"/disk0"};
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, hash_ring_init(&ring, nodes, 1, HASH_RING_DEFAULT_VIRTUAL_NODES));
+    TEST_ASSERT_EQUAL_size_t(0, hash_ring_lookup(&ring, "test.txt"));
+    TEST_ASSERT_EQUAL_size_t(0, hash_ring_lookup(&ring, ""));
+    hash_ring_destroy(&ring);
+    TEST_ASSERT_NULL(ring.points);
+}
+
+void test__hash_ring_lookup__balanced() {
+    HashRing ring;
+    const char* nodes[] = {"/disk0", "/disk1", "/disk2"};
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, hash_ring_init(&ring, nodes, 3, HASH_RING_DEFAULT_VIRTUAL_NODES));
+    int counts[3] = {0};
+    for (int i = 0; i < KEY_COUNT; i++) {
+        char key[64];
+        key_name(i, key, sizeof(key));
+        counts[hash_ring_lookup(&ring, key)]++;
+    }
+    // a third each, give or take
+    for (int node = 0; node < 3; node++) {
+        TEST_ASSERT_GREATER_THAN_INT(KEY_COUNT / 4, counts[node]);
+        TEST_ASSERT_LESS_THAN_INT(KEY_COUNT / 2, counts[node]);
+    }
+    hash_ring_destroy(&ring);
+}
+
+void test__hash_ring_lookup__independent_of_node_order() {
+    HashRing ring;
+    HashRing reordered;
+    const char* nodes[] = {"/disk0", "/disk1", "/disk2"};
+    const char* reordered_nodes[] = {"/disk2", "/disk0", "/disk1"};
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, hash_ring_init(&ring, nodes, 3, HASH_RING_DEFAULT_VIRTUAL_NODES));
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, hash_ring_init(&reordered, reordered_nodes, 3, HASH_RING_DEFAULT_VIRTUAL_NODES));
+    for (int i = 0; i < 1000; i++) {
+        char key[64];
+        key_name(i, key, sizeof(key));
+        TEST_ASSERT_EQUAL_STRING(nodes[hash_ring_lookup(&ring, key)], reordered_nodes[hash_ring_lookup(&reordered, key)]);
+    }
+    hash_ring_destroy(&ring);
+    hash_ring_destroy(&reordered);
+}
+
+void test__hash_ring_lookup__adding_a_node_moves_few_keys() {
+    HashRing ring;
+    HashRing grown;
+    const char* nodes[] = {"/disk0", "/disk1", "/disk2", "/disk3"};
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, hash_ring_init(&ring, nodes, 3, HASH_RING_DEFAULT_VIRTUAL_NODES));
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, hash_ring_init(&grown, nodes, 4, HASH_RING_DEFAULT_VIRTUAL_NODES));
+    int moved = 0;
+    for (int i = 0; i < KEY_COUNT; i++) {
+        char key[64];
+        key_name(i, key, sizeof(key));
+        size_t before = hash_ring_lookup(&ring, key);
+        size_t after = hash_ring_lookup(&grown, key);
+        if (before != after) {
+            // keys only move to the new node
+            TEST_ASSERT_EQUAL_size_t(3, after);
+            moved++;
+        }
+    }
+    // about a quarter of the keys move (hash % n would move three quarters)
+    TEST_ASSERT_GREATER_THAN_INT(KEY_COUNT / 8, moved);
+    TEST_ASSERT_LESS_THAN_INT(KEY_COUNT * 2 / 5, moved);
+    hash_ring_destroy(&ring);
+    hash_ring_destroy(&grown);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test__hash_ring_init__no_nodes);
+    RUN_TEST(test__hash_ring_lookup__single_node);
+    RUN_TEST(test__hash_ring_lookup__balanced);
+    RUN_TEST(test__hash_ring_lookup__independent_of_node_order);
+    RUN_TEST(test__hash_ring_lookup__adding_a_node_moves_few_keys);
+    return UNITY_END();
+}
@@ -0,0 +1,198 @@
+#include "utils.h"
+#include "sockets.h"
+#include "protocol.h"
+#include "file_transfer.h"
+#include "connection_pool.h"
+#include "hedge.h"
+#include "test_server.h"
+#include "unity.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define ADDRESS TEST_SERVER_ADDRESS
+#define FAST_PORT 9013
+#define SLOW_PORT 9014
+// nothing listens on this port
+#define DOWN_PORT 9015
+// a replica that sheds load: it rejects every request
+#define OVERLOADED_PORT 9018
+#define SLOW_DELAY_US 500000
+#define INITIAL_DELAY_US 50000
+
+/**
+ * Serves a connection like an overloaded server: every request is rejected with ERROR_OVERLOADED.
+ */
+void serve_overloaded(int client_socket, void* context) {
+    (void)context;
+    uint8_t buffer[MAX_MESSAGE_SIZE];
+    ssize_t bytes_received;
+    while ((bytes_received = receive_message(client_socket, buffer, MAX_MESSAGE_SIZE)) > 0) {
+        Header header;
+        if (extract_header(buffer, bytes_received, &header) != STATUS_OK
+            || reject_request(client_socket, &header, ERROR_OVERLOADED, "Server overloaded") != STATUS_OK) {
+            break;
+        }
+    }
+}
+
+// the replicas: the slow one waits before each request
+TestServer servers[] = {
+    TEST_SERVER_INIT(FAST_PORT, 0),
+    TEST_SERVER_INIT(SLOW_PORT, SLOW_DELAY_US),
+    {OVERLOADED_PORT, 0, serve_overloaded, NULL, 0, PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, {0}},
+};
+ConnectionPool pool;
+
+void test__hedged_client_init__invalid() {
+    HedgedClient client;
+    Endpoint replicas[] = {{ADDRESS, FAST_PORT}};
+    TEST_ASSERT_EQUAL_INT(ERROR_INVALID_DATA_SIZE, hedged_client_init(&client, &pool, replicas, 0, 95, INITIAL_DELAY_US));
+    TEST_ASSERT_EQUAL_INT(ERROR_INVALID_DATA_SIZE, hedged_client_init(&client, &pool, replicas, 1, 0, INITIAL_DELAY_US));
+    TEST_ASSERT_EQUAL_INT(ERROR_INVALID_DATA_SIZE, hedged_client_init(&client, &pool, replicas, 1, 101, INITIAL_DELAY_US));
+}
+
+void test__hedged_request__fast_primary_not_hedged() {
+    HedgedClient client;
+    Endpoint replicas[] = {{ADDRESS, FAST_PORT}, {ADDRESS, SLOW_PORT}};
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, hedged_client_init(&client, &pool, replicas, 2, 95, INITIAL_DELAY_US));
+    Response response;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, hedged_request_file_contents(&client, "test.txt", &response));
+    TEST_ASSERT_GREATER_THAN_UINT32(0, response.header.payload_size);
+    destroy_response(&response);
+    HedgeStats stats;
+    hedged_client_stats(&client, &stats);
+    TEST_ASSERT_EQUAL_UINT64(1, stats.requests);
+    TEST_ASSERT_EQUAL_UINT64(0, stats.hedged);
+    hedged_client_destroy(&client);
+}
+
+void test__hedged_request__slow_primary_hedged() {
+    HedgedClient client;
+    Endpoint replicas[] = {{ADDRESS, SLOW_PORT}, {ADDRESS, FAST_PORT}};
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, hedged_client_init(&client, &pool, replicas, 2, 95, INITIAL_DELAY_US));
+    uint64_t start_us = monotonic_time_us();
+    Response response;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, hedged_request_file_contents(&client, "test_multiple_chunks.txt", &response));
+    uint64_t elapsed_us = monotonic_time_us() - start_us;
+    TEST_ASSERT_GREATER_THAN_UINT32(MAX_PAYLOAD_SIZE, response.header.payload_size);
+    destroy_response(&response);
+    // answered by the hedge, without waiting for the slow replica
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT64(INITIAL_DELAY_US, elapsed_us);
+    TEST_ASSERT_LESS_THAN_UINT64(SLOW_DELAY_US, elapsed_us);
+    HedgeStats stats;
+    hedged_client_stats(&client, &stats);
+    TEST_ASSERT_EQUAL_UINT64(1, stats.hedged);
+    TEST_ASSERT_EQUAL_UINT64(1, stats.hedge_wins);
+    // the cancelled request to the slow replica is finished before the client is released
+    hedged_client_destroy(&client);
+}
+
+void test__hedged_request__primary_down() {
+    HedgedClient client;
+    Endpoint replicas[] = {{ADDRESS, DOWN_PORT}, {ADDRESS, FAST_PORT}};
+    // the hedge is sent as soon as the primary fails, not after the delay
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, hedged_client_init(&client, &pool, replicas, 2, 95, 10 * SLOW_DELAY_US));
+    uint64_t start_us = monotonic_time_us();
+    Response response;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, hedged_request_file_metadata(&client, "test.txt", &response));
+    TEST_ASSERT_LESS_THAN_UINT64(SLOW_DELAY_US, monotonic_time_us() - start_us);
+    destroy_response(&response);
+    // a server's error is an answer: not hedged
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_NOT_FOUND, hedged_request_file_metadata(&client, "missing.txt", &response));
+    destroy_response(&response);
+    HedgeStats stats;
+    hedged_client_stats(&client, &stats);
+    TEST_ASSERT_EQUAL_UINT64(2, stats.requests);
+    TEST_ASSERT_EQUAL_UINT64(1, stats.hedged);
+    TEST_ASSERT_EQUAL_UINT64(1, stats.hedge_wins);
+    TEST_ASSERT_EQUAL_UINT64(0, stats.failed);
+    hedged_client_destroy(&client);
+}
+
+void test__hedged_request__primary_overloaded() {
+    HedgedClient client;
+    Endpoint replicas[] = {{ADDRESS, OVERLOADED_PORT}, {ADDRESS, FAST_PORT}};
+    // the rejection is not an answer: the hedge is sent at once, not after the delay
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, hedged_client_init(&client, &pool, replicas, 2, 95, 10 * SLOW_DELAY_US));
+    uint64_t start_us = monotonic_time_us();
+    Response response;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, hedged_request_file_metadata(&client, "test.txt", &response));
+    TEST_ASSERT_LESS_THAN_UINT64(SLOW_DELAY_US, monotonic_time_us() - start_us);
+    destroy_response(&response);
+    HedgeStats stats;
+    hedged_client_stats(&client, &stats);
+    TEST_ASSERT_EQUAL_UINT64(1, stats.hedged);
+    TEST_ASSERT_EQUAL_UINT64(1, stats.hedge_wins);
+    TEST_ASSERT_EQUAL_UINT64(0, stats.failed);
+    // and its (short) latency doesn't count towards the hedge delay
+    TEST_ASSERT_EQUAL_UINT64(0, client.latency_count);
+    hedged_client_destroy(&client);
+
+    // with no other replica, the caller gets the rejection
+    Endpoint only[] = {{ADDRESS, OVERLOADED_PORT}};
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, hedged_client_init(&client, &pool, only, 1, 95, INITIAL_DELAY_US));
+    TEST_ASSERT_EQUAL_INT(ERROR_OVERLOADED, hedged_request_file_metadata(&client, "test.txt", &response));
+    destroy_response(&response);
+    hedged_client_stats(&client, &stats);
+    TEST_ASSERT_EQUAL_UINT64(1, stats.failed);
+    TEST_ASSERT_EQUAL_UINT64(0, client.latency_count);
+    hedged_client_destroy(&client);
+}
+
+void test__hedged_request__no_replica_answers() {
+    HedgedClient client;
+    Endpoint replicas[] = {{ADDRESS, DOWN_PORT}};
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, hedged_client_init(&client, &pool, replicas, 1, 95, INITIAL_DELAY_US));
+    Response response;
+    TEST_ASSERT_EQUAL_INT(ERROR_SEND_FAILED, hedged_request_file_contents(&client, "test.txt", &response));
+    HedgeStats stats;
+    hedged_client_stats(&client, &stats);
+    TEST_ASSERT_EQUAL_UINT64(1, stats.failed);
+    hedged_client_destroy(&client);
+}
+
+void test__hedged_client_delay__follows_latencies() {
+    HedgedClient client;
+    Endpoint replicas[] = {{ADDRESS, FAST_PORT}};
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, hedged_client_init(&client, &pool, replicas, 1, 50, INITIAL_DELAY_US));
+    TEST_ASSERT_EQUAL_UINT64(INITIAL_DELAY_US, hedged_client_delay_us(&client));
+    for (int i = 0; i < HEDGE_MIN_SAMPLES; i++) {
+        Response response;
+        TEST_ASSERT_EQUAL_INT(STATUS_OK, hedged_request_file_metadata(&client, "test.txt", &response));
+        destroy_response(&response);
+    }
+    // the median of local requests is far below the initial delay
+    uint64_t delay_us = hedged_client_delay_us(&client);
+    TEST_ASSERT_GREATER_THAN_UINT64(0, delay_us);
+    TEST_ASSERT_LESS_THAN_UINT64(INITIAL_DELAY_US, delay_us);
+    hedged_client_destroy(&client);
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+int main(void) {
+    UNITY_BEGIN();
+    for (size_t i = 0; i < sizeof(servers) / sizeof(servers[0]); i++) {
+        test_server_start(&servers[i]);
+    }
+    connection_pool_init(&pool, 4, 10000, NULL);
+    pool.retry_policy.max_attempts = 1;
+
+    RUN_TEST(test__hedged_client_init__invalid);
+    RUN_TEST(test__hedged_request__fast_primary_not_hedged);
+    RUN_TEST(test__hedged_request__slow_primary_hedged);
+    RUN_TEST(test__hedged_request__primary_down);
+    RUN_TEST(test__hedged_request__primary_overloaded);
+    RUN_TEST(test__hedged_request__no_replica_answers);
+    RUN_TEST(test__hedged_client_delay__follows_latencies);
+
+    connection_pool_destroy(&pool);
+    for (size_t i = 0; i < sizeof(servers) / sizeof(servers[0]); i++) {
+        test_server_stop(&servers[i]);
+    }
+    return UNITY_END();
+}
@@ -0,0 +1,152 @@
+#include "io_pool.h"
+#include "unity.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#define FILE_SIZE (256 * 1024)
+#define JOB_COUNT 64
+#define JOB_SIZE (FILE_SIZE / JOB_COUNT)
+
+char file_path[] = "/tmp/client_server_test_io_pool_XXXXXX";
+int fd = -1;
+
+uint8_t expected_byte(size_t offset) {
+    return (uint8_t)(offset * 31 + offset / 251);
+}
+
+void setUp(void) {
+    fd = open(file_path, O_RDONLY);
+}
+
+void tearDown(void) {
+    close(fd);
+}
+
+void test__io_pool_init__no_threads() {
+    IoPool pool;
+    TEST_ASSERT_EQUAL_INT(-1, io_pool_init(&pool, 0));
+}
+
+void test__io_pool_read() {
+    IoPool pool;
+    TEST_ASSERT_EQUAL_INT(0, io_pool_init(&pool, 2));
+    uint8_t buffer[100];
+    TEST_ASSERT_EQUAL_INT(0, io_pool_read(&pool, fd, buffer, sizeof(buffer), 1000));
+    for (size_t i = 0; i < sizeof(buffer); i++) {
+        TEST_ASSERT_EQUAL_UINT8(expected_byte(1000 + i), buffer[i]);
+    }
+    // past the end of the file, and a bad descriptor
+    TEST_ASSERT_EQUAL_INT(-1, io_pool_read(&pool, fd, buffer, sizeof(buffer), FILE_SIZE - 10));
+    TEST_ASSERT_EQUAL_INT(-1, io_pool_read(&pool, -1, buffer, sizeof(buffer), 0));
+    io_pool_destroy(&pool);
+}
+
+void test__io_pool_submit__many_jobs() {
+    IoPool pool;
+    TEST_ASSERT_EQUAL_INT(0, io_pool_init(&pool, 4));
+    uint8_t* buffer = malloc(FILE_SIZE);
+    TEST_ASSERT_NOT_NULL(buffer);
+    IoJob jobs[JOB_COUNT];
+    // submitted in reverse order; each job fills its own part of the buffer
+    for (int i = JOB_COUNT - 1; i >= 0; i--) {
+        jobs[i] = (IoJob){.fd = fd, .buffer = buffer + i * JOB_SIZE, .length = JOB_SIZE, .offset = i * JOB_SIZE};
+        io_pool_submit(&pool, &jobs[i]);
+    }
+    for (int i = 0; i < JOB_COUNT; i++) {
+        io_pool_wait(&pool, &jobs[i]);
+        TEST_ASSERT_EQUAL_INT(0, jobs[i].result);
+    }
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        TEST_ASSERT_EQUAL_UINT8(expected_byte(i), buffer[i]);
+    }
+    io_pool_destroy(&pool);
+    free(buffer);
+}
+
+void test__io_pool_destroy__finishes_queued_jobs() {
+    IoPool pool;
+    TEST_ASSERT_EQUAL_INT(0, io_pool_init(&pool, 1));
+    uint8_t buffers[JOB_COUNT][16];
+    IoJob jobs[JOB_COUNT];
+    for (int i = 0; i < JOB_COUNT; i++) {
+        jobs[i] = (IoJob){.fd = fd, .buffer = buffers[i], .length = sizeof(buffers[i]), .offset = i};
+        io_pool_submit(&pool, &jobs[i]);
+    }
+    io_pool_destroy(&pool);
+    for (int i = 0; i < JOB_COUNT; i++) {
+        TEST_ASSERT_TRUE(jobs[i].done);
+        TEST_ASSERT_EQUAL_INT(0, jobs[i].result);
+        TEST_ASSERT_EQUAL_UINT8(expected_byte(i), buffers[i][0]);
+    }
+}
+
+void test__io_pool_submit_async__completions() {
+    IoPool pool;
+    TEST_ASSERT_EQUAL_INT(0, io_pool_init(&pool, 4));
+    IoCompletionQueue completions;
+    TEST_ASSERT_EQUAL_INT(0, io_completion_queue_init(&completions));
+    TEST_ASSERT_NULL(io_completion_queue_pop(&completions));
+    uint8_t buffers[JOB_COUNT][JOB_SIZE];
+    IoJob jobs[JOB_COUNT];
+    for (int i = 0; i < JOB_COUNT; i++) {
+        // the last job reads past the end of the file
+        off_t offset = i == JOB_COUNT - 1 ? FILE_SIZE - 1 : i * JOB_SIZE;
+        jobs[i] = (IoJob){.fd = fd, .buffer = buffers[i], .length = JOB_SIZE, .offset = offset};
+        io_pool_submit_async(&pool, &jobs[i], &completions);
+    }
+    int completed[JOB_COUNT] = {0};
+    for (int count = 0; count < JOB_COUNT;) {
+        struct pollfd poll_fd = {completions.event_fd, POLLIN, 0};
+        TEST_ASSERT_EQUAL_INT(1, poll(&poll_fd, 1, 5000));
+        IoJob* job;
+        while ((job = io_completion_queue_pop(&completions)) != NULL) {
+            int i = job - jobs;
+            TEST_ASSERT_FALSE(completed[i]);
+            completed[i] = 1;
+            count++;
+            if (i == JOB_COUNT - 1) {
+                TEST_ASSERT_EQUAL_INT(-1, job->result);
+            } else {
+                TEST_ASSERT_EQUAL_INT(0, job->result);
+                TEST_ASSERT_EQUAL_UINT8(expected_byte(i * JOB_SIZE), buffers[i][0]);
+                TEST_ASSERT_EQUAL_UINT8(expected_byte((i + 1) * JOB_SIZE - 1), buffers[i][JOB_SIZE - 1]);
+            }
+        }
+    }
+    // all taken: the eventfd is no longer readable
+    struct pollfd poll_fd = {completions.event_fd, POLLIN, 0};
+    TEST_ASSERT_EQUAL_INT(0, poll(&poll_fd, 1, 0));
+    io_pool_destroy(&pool);
+    io_completion_queue_destroy(&completions);
+}
+
+int main(void) {
+    int file_fd = mkstemp(file_path);
+    if (file_fd == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+    uint8_t* contents = malloc(FILE_SIZE);
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        contents[i] = expected_byte(i);
+    }
+    if (contents == NULL || write(file_fd, contents, FILE_SIZE) != FILE_SIZE) {
+        perror("write");
+        return 1;
+    }
+    free(contents);
+    close(file_fd);
+    UNITY_BEGIN();
+    RUN_TEST(test__io_pool_init__no_threads);
+    RUN_TEST(test__io_pool_read);
+    RUN_TEST(test__io_pool_submit__many_jobs);
+    RUN_TEST(test__io_pool_destroy__finishes_queued_jobs);
+    RUN_TEST(test__io_pool_submit_async__completions);
+    int failures = UNITY_END();
+    unlink(file_path);
+    return failures;
+}
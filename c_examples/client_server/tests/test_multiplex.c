@@ -0,0 +1,270 @@
+#include "utils.h"
+#include "sockets.h"
+#include "protocol.h"
+#include "file_transfer.h"
+#include "multiplex.h"
+#include "scheduler.h"
+#include "connection.h"
+#include "unity.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#define LARGE_FILE_NAME "large.bin"
+#define LARGE_FILE_SIZE (2 * 1024 * 1024 + 17)
+#define SMALL_FILE_NAME "small.bin"
+#define SMALL_FILE_SIZE 4778
+#define TEST_FILE_CONTENTS "These are the contents of test.txt\n"
+// how long a test waits for a response before failing
+#define RECEIVE_TIMEOUT_SECONDS 5
+
+// the served directory, with generated files
+char server_files[] = "/tmp/client_server_test_multiplex_XXXXXX";
+uint8_t* large_file_contents;
+
+Scheduler scheduler;
+Connections connections;
+int client_socket = -1;
+// the server's end of the connection, until the worker takes it over
+int server_socket = -1;
+pthread_t worker;
+int worker_running = 0;
+
+/**
+ * Opens a connection: a socket pair whose server end is served once `start_serving` is called.
+ */
+void open_connection() {
+    int sockets[2];
+    TEST_ASSERT_EQUAL_INT(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+    struct timeval timeout = {RECEIVE_TIMEOUT_SECONDS, 0};
+    setsockopt(sockets[0], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    client_socket = sockets[0];
+    server_socket = sockets[1];
+}
+
+/**
+ * Serves the server's end of the connection on a worker thread, the way the server serves an
+ * accepted connection.
+ */
+void start_serving() {
+    ClientConnection* connection = connection_register(&connections, server_socket);
+    TEST_ASSERT_NOT_NULL(connection);
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&worker, NULL, connection_serve, connection));
+    server_socket = -1;
+    worker_running = 1;
+}
+
+void write_file(const char* file_name, const void* contents, size_t size) {
+    char full_path[256];
+    snprintf(full_path, sizeof(full_path), "%s/%s", server_files, file_name);
+    FILE* file = fopen(full_path, "wb");
+    if (file == NULL || fwrite(contents, 1, size, file) != size) {
+        perror(full_path);
+        exit(1);
+    }
+    fclose(file);
+}
+
+void create_server_files() {
+    if (mkdtemp(server_files) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    large_file_contents = malloc(LARGE_FILE_SIZE);
+    for (long i = 0; i < LARGE_FILE_SIZE; i++) {
+        large_file_contents[i] = (uint8_t)(i * 7 + i / 4096);
+    }
+    write_file(LARGE_FILE_NAME, large_file_contents, LARGE_FILE_SIZE);
+    write_file(SMALL_FILE_NAME, large_file_contents, SMALL_FILE_SIZE);
+    write_file("test.txt", TEST_FILE_CONTENTS, strlen(TEST_FILE_CONTENTS));
+}
+
+void remove_server_files() {
+    DIR* directory = opendir(server_files);
+    if (directory != NULL) {
+        struct dirent* entry;
+        while ((entry = readdir(directory)) != NULL) {
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+                unlinkat(dirfd(directory), entry->d_name, 0);
+            }
+        }
+        closedir(directory);
+        rmdir(server_files);
+    }
+    free(large_file_contents);
+}
+
+void test__multiplexed__metadata_overtakes_large_file() {
+    open_connection();
+    start_serving();
+    MultiplexedConnection connection;
+    multiplexed_connection_init(&connection, client_socket);
+    uint32_t file_stream;
+    uint32_t metadata_stream;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, multiplexed_request(&connection, COMMAND_REQUEST_FILE, LARGE_FILE_NAME, &file_stream));
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, multiplexed_request(&connection, COMMAND_REQUEST_METADATA, "test.txt", &metadata_stream));
+    TEST_ASSERT_NOT_EQUAL(0, file_stream);
+    TEST_ASSERT_NOT_EQUAL(file_stream, metadata_stream);
+    TEST_ASSERT_EQUAL_size_t(2, multiplexed_pending_count(&connection));
+
+    // the metadata was requested second but doesn't wait for the 2 MiB in front of it
+    uint32_t stream_id;
+    Response response;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, multiplexed_receive(&connection, &stream_id, &response));
+    TEST_ASSERT_EQUAL_UINT32(metadata_stream, stream_id);
+    TEST_ASSERT_EQUAL_UINT8(COMMAND_REQUEST_METADATA, response.header.command);
+    TEST_ASSERT_TRUE(strncmp((const char*)response.payload, "Size: 35\n", strlen("Size: 35\n")) == 0);
+    destroy_response(&response);
+
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, multiplexed_receive(&connection, &stream_id, &response));
+    TEST_ASSERT_EQUAL_UINT32(file_stream, stream_id);
+    TEST_ASSERT_EQUAL_UINT32(LARGE_FILE_SIZE, response.header.payload_size);
+    TEST_ASSERT_TRUE(memcmp(response.payload, large_file_contents, LARGE_FILE_SIZE) == 0);
+    destroy_response(&response);
+    TEST_ASSERT_EQUAL_size_t(0, multiplexed_pending_count(&connection));
+
+    multiplexed_connection_destroy(&connection);
+}
+
+void test__multiplexed__small_file_finishes_first() {
+    open_connection();
+    MultiplexedConnection connection;
+    multiplexed_connection_init(&connection, client_socket);
+    uint32_t large_stream;
+    uint32_t small_stream;
+    // both requests are waiting before the connection is served, so the server starts both transfers
+    // before it sends the first chunk. With one reader thread, the small file is read before the
+    // second part of the large file: it finishes after a few rounds, the large file after 2049.
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, multiplexed_request(&connection, COMMAND_REQUEST_FILE, LARGE_FILE_NAME, &large_stream));
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, multiplexed_request(&connection, COMMAND_REQUEST_FILE, SMALL_FILE_NAME, &small_stream));
+    start_serving();
+
+    uint32_t stream_id;
+    Response response;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, multiplexed_receive(&connection, &stream_id, &response));
+    TEST_ASSERT_EQUAL_UINT32(small_stream, stream_id);
+    TEST_ASSERT_EQUAL_UINT32(SMALL_FILE_SIZE, response.header.payload_size);
+    TEST_ASSERT_TRUE(memcmp(response.payload, large_file_contents, SMALL_FILE_SIZE) == 0);
+    destroy_response(&response);
+
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, multiplexed_receive(&connection, &stream_id, &response));
+    TEST_ASSERT_EQUAL_UINT32(large_stream, stream_id);
+    TEST_ASSERT_EQUAL_UINT32(LARGE_FILE_SIZE, response.header.payload_size);
+    TEST_ASSERT_TRUE(memcmp(response.payload, large_file_contents, LARGE_FILE_SIZE) == 0);
+    destroy_response(&response);
+
+    multiplexed_connection_destroy(&connection);
+}
+
+void test__multiplexed__error_on_one_stream() {
+    open_connection();
+    start_serving();
+    MultiplexedConnection connection;
+    multiplexed_connection_init(&connection, client_socket);
+    uint32_t missing_stream;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, multiplexed_request(&connection, COMMAND_REQUEST_FILE, "this_file_does_not_exist.txt", &missing_stream));
+
+    uint32_t stream_id;
+    Response response;
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_NOT_FOUND, multiplexed_receive(&connection, &stream_id, &response));
+    TEST_ASSERT_EQUAL_UINT32(missing_stream, stream_id);
+    TEST_ASSERT_EQUAL_UINT8(ERROR_FILE_NOT_FOUND, response.header.status);
+    destroy_response(&response);
+
+    // the connection is still usable, on a stream and without one
+    uint32_t file_stream;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, multiplexed_request(&connection, COMMAND_REQUEST_FILE, "test.txt", &file_stream));
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, multiplexed_receive(&connection, &stream_id, &response));
+    TEST_ASSERT_EQUAL_UINT32(file_stream, stream_id);
+    TEST_ASSERT_EQUAL_UINT32(35, response.header.payload_size);
+    destroy_response(&response);
+
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, request_file_contents(client_socket, "test.txt", &response));
+    TEST_ASSERT_EQUAL_UINT32(0, response.header.stream_id);
+    TEST_ASSERT_EQUAL_UINT32(35, response.header.payload_size);
+    destroy_response(&response);
+
+    multiplexed_connection_destroy(&connection);
+}
+
+void test__multiplexed_receive__chunk_beyond_announced_size() {
+    open_connection();
+    MultiplexedConnection connection;
+    multiplexed_connection_init(&connection, client_socket);
+    uint32_t stream_id;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, multiplexed_request(&connection, COMMAND_REQUEST_FILE, "test.txt", &stream_id));
+    // the server end answers by hand: a file of 4 bytes, followed by a chunk of 5
+    uint64_t network_size = htobe64(4);
+    Header size_header = {MESSAGE_RESPONSE_SIZE, COMMAND_REQUEST_FILE, sizeof(network_size), 0, STATUS_OK, stream_id};
+    Header chunk_header = {MESSAGE_RESPONSE_LAST_CHUNK, COMMAND_REQUEST_FILE, 5, 0, STATUS_OK, stream_id};
+    Message message;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, create_message(&size_header, (const uint8_t*)&network_size, &message));
+    TEST_ASSERT_EQUAL_INT(message.size, send_all(server_socket, message.data, message.size));
+    destroy_message(&message);
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, create_message(&chunk_header, (const uint8_t*)"12345", &message));
+    TEST_ASSERT_EQUAL_INT(message.size, send_all(server_socket, message.data, message.size));
+    destroy_message(&message);
+
+    uint32_t received_stream;
+    Response response = RESPONSE_INIT;
+    TEST_ASSERT_EQUAL_INT(ERROR_INVALID_DATA_SIZE, multiplexed_receive(&connection, &received_stream, &response));
+    multiplexed_connection_destroy(&connection);
+}
+
+void test__multiplexed_request__unsupported_command() {
+    MultiplexedConnection connection;
+    multiplexed_connection_init(&connection, -1);
+    uint32_t stream_id;
+    TEST_ASSERT_EQUAL_INT(ERROR_INVALID_COMMAND, multiplexed_request(&connection, COMMAND_REQUEST_DELTA, "test.txt", &stream_id));
+    TEST_ASSERT_EQUAL_size_t(0, multiplexed_pending_count(&connection));
+    multiplexed_connection_destroy(&connection);
+}
+
+void setUp(void) {
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, connections_init(&connections, &scheduler, NULL));
+}
+
+void tearDown(void) {
+    // closing the client's end stops a worker that is still serving (e.g. after a failed assertion)
+    if (client_socket != -1) {
+        close(client_socket);
+        client_socket = -1;
+    }
+    if (server_socket != -1) {
+        close(server_socket);
+        server_socket = -1;
+    }
+    if (worker_running) {
+        pthread_join(worker, NULL);
+        worker_running = 0;
+    }
+    connections_destroy(&connections);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    create_server_files();
+    // one reader thread: reads finish in the order they were queued
+    const char* roots[] = {server_files};
+    if (server_storage_init(roots, 1, 1) != STATUS_OK) {
+        fprintf(stderr, "could not serve %s\n", server_files);
+        exit(1);
+    }
+    scheduler_init(&scheduler, SCHEDULER_DEFAULT_MAX_RUNNING, SCHEDULER_DEFAULT_MAX_BULK, SCHEDULER_DEFAULT_AGING_MS);
+
+    RUN_TEST(test__multiplexed__metadata_overtakes_large_file);
+    RUN_TEST(test__multiplexed__small_file_finishes_first);
+    RUN_TEST(test__multiplexed__error_on_one_stream);
+    RUN_TEST(test__multiplexed_receive__chunk_beyond_announced_size);
+    RUN_TEST(test__multiplexed_request__unsupported_command);
+
+    scheduler_destroy(&scheduler);
+    remove_server_files();
+    return UNITY_END();
+}
@@ -0,0 +1,149 @@
+#include "protocol.h"
+#include "packfile.h"
+#include "unity.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+char root[] = "/tmp/client_server_test_packfile_XXXXXX";
+char pack_path[] = "/tmp/client_server_test_packfile_pack_XXXXXX";
+
+void write_file(const char* name, const char* contents) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    FILE* file = fopen(path, "w");
+    TEST_ASSERT_NOT_NULL(file);
+    fputs(contents, file);
+    fclose(file);
+}
+
+void remove_file(const char* name) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    unlink(path);
+}
+
+void assert_packed(const Pack* pack, const char* name, const char* contents) {
+    PackEntry entry;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, pack_find(pack, name, &entry));
+    TEST_ASSERT_EQUAL_STRING(name, entry.name);
+    TEST_ASSERT_EQUAL_UINT64(strlen(contents), entry.size);
+    TEST_ASSERT_TRUE(memcmp(pack->data + entry.offset, contents, entry.size) == 0);
+}
+
+void setUp(void) {
+    mkdir(root, 0700);
+    char directory[256];
+    snprintf(directory, sizeof(directory), "%s/directory", root);
+    mkdir(directory, 0700);
+    write_file("b.txt", "contents of b");
+    write_file("a.txt", "contents of a");
+    write_file("empty.txt", "");
+    write_file("directory/c.txt", "contents of c");
+    // links are not followed out of the root
+    char link[256];
+    snprintf(link, sizeof(link), "%s/link", root);
+    symlink("/etc", link);
+}
+
+void tearDown(void) {
+    remove_file("a.txt");
+    remove_file("b.txt");
+    remove_file("empty.txt");
+    remove_file("directory/c.txt");
+    remove_file("link");
+    char directory[256];
+    snprintf(directory, sizeof(directory), "%s/directory", root);
+    rmdir(directory);
+    unlink(pack_path);
+}
+
+void test__pack_create_open_find() {
+    uint64_t entry_count;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, pack_create(root, pack_path, &entry_count));
+    TEST_ASSERT_EQUAL_UINT64(4, entry_count);
+
+    Pack pack;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, pack_open(&pack, pack_path));
+    TEST_ASSERT_EQUAL_UINT64(4, pack.entry_count);
+    assert_packed(&pack, "a.txt", "contents of a");
+    assert_packed(&pack, "b.txt", "contents of b");
+    assert_packed(&pack, "empty.txt", "");
+    assert_packed(&pack, "directory/c.txt", "contents of c");
+
+    PackEntry entry;
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_NOT_FOUND, pack_find(&pack, "c.txt", &entry));
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_NOT_FOUND, pack_find(&pack, "link/passwd", &entry));
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_NOT_FOUND, pack_find(&pack, "", &entry));
+    pack_close(&pack);
+    TEST_ASSERT_NULL(pack.data);
+}
+
+void test__pack_format_etag__depends_on_contents() {
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, pack_create(root, pack_path, NULL));
+    Pack pack;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, pack_open(&pack, pack_path));
+    PackEntry a;
+    PackEntry b;
+    pack_find(&pack, "a.txt", &a);
+    pack_find(&pack, "b.txt", &b);
+    char etag_a[64];
+    char etag_b[64];
+    pack_format_etag(&a, etag_a, sizeof(etag_a));
+    pack_format_etag(&b, etag_b, sizeof(etag_b));
+    TEST_ASSERT_FALSE(strcmp(etag_a, etag_b) == 0);
+    pack_close(&pack);
+
+    // the same contents give the same ETag, even in a new pack
+    remove_file("b.txt");
+    write_file("b.txt", "contents of a");
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, pack_create(root, pack_path, NULL));
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, pack_open(&pack, pack_path));
+    pack_find(&pack, "b.txt", &b);
+    pack_format_etag(&b, etag_b, sizeof(etag_b));
+    TEST_ASSERT_EQUAL_STRING(etag_a, etag_b);
+    pack_close(&pack);
+}
+
+void test__pack_open__invalid_pack() {
+    Pack pack;
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_OPEN_FAILED, pack_open(&pack, "/this/pack/does/not/exist"));
+
+    // not a pack
+    FILE* file = fopen(pack_path, "w");
+    fputs("this is not a pack, but it is longer than a pack header", file);
+    fclose(file);
+    TEST_ASSERT_EQUAL_INT(ERROR_INVALID_DATA_SIZE, pack_open(&pack, pack_path));
+    TEST_ASSERT_NULL(pack.data);
+
+    // a truncated pack: the index points past the end
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, pack_create(root, pack_path, NULL));
+    struct stat file_stat;
+    stat(pack_path, &file_stat);
+    TEST_ASSERT_EQUAL_INT(0, truncate(pack_path, file_stat.st_size - 10));
+    TEST_ASSERT_EQUAL_INT(ERROR_INVALID_DATA_SIZE, pack_open(&pack, pack_path));
+}
+
+void test__pack_create__missing_root() {
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_OPEN_FAILED, pack_create("/this/directory/does/not/exist", pack_path, NULL));
+    TEST_ASSERT_EQUAL_INT(-1, access(pack_path, F_OK));
+}
+
+int main(void) {
+    int pack_fd = mkstemp(pack_path);
+    if (mkdtemp(root) == NULL || pack_fd == -1) {
+        perror("mkdtemp");
+        return 1;
+    }
+    close(pack_fd);
+    UNITY_BEGIN();
+    RUN_TEST(test__pack_create_open_find);
+    RUN_TEST(test__pack_format_etag__depends_on_contents);
+    RUN_TEST(test__pack_open__invalid_pack);
+    RUN_TEST(test__pack_create__missing_root);
+    int failures = UNITY_END();
+    rmdir(root);
+    return failures;
+}
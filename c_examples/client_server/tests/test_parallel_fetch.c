@@ -0,0 +1,220 @@
+#include "sockets.h"
+#include "protocol.h"
+#include "file_transfer.h"
+#include "parallel_fetch.h"
+#include "test_server.h"
+#include "unity.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define ADDRESS TEST_SERVER_ADDRESS
+#define FAST_PORT 9007
+#define SLOW_PORT 9008
+// nothing listens on this port
+#define DOWN_PORT 9009
+// replicas whose copy of the large file has another inode, or another mtime
+#define MOVED_PORT 9016
+#define STALE_PORT 9017
+#define LARGE_FILE_NAME "test_parallel_fetch.bin"
+#define LARGE_FILE_SIZE (4 * 1024 * 1024 + 12345)
+
+/**
+ * How a replica's copy of the large file differs from the original.
+ */
+typedef struct {
+    ino_t inode_offset;
+    time_t mtime_offset;
+} StatChange;
+
+StatChange moved = {1, 0};
+StatChange stale = {0, -60};
+
+/**
+ * Serves a connection like the default test server, except that the metadata of every file is the
+ * stat of the large file, changed by `context` (a StatChange).
+ */
+void serve_changed_metadata(int client_socket, void* context) {
+    const StatChange* change = (const StatChange*)context;
+    uint8_t buffer[MAX_MESSAGE_SIZE];
+    ssize_t bytes_received;
+    while ((bytes_received = receive_message(client_socket, buffer, MAX_MESSAGE_SIZE)) > 0) {
+        Response request;
+        if (parse_message(buffer, bytes_received, &request) != STATUS_OK) {
+            break;
+        }
+        if (request.header.command == COMMAND_REQUEST_METADATA) {
+            struct stat file_stat;
+            TEST_ASSERT_EQUAL_INT(0, stat(SERVER_FILE_PATH "/" LARGE_FILE_NAME, &file_stat));
+            file_stat.st_ino += change->inode_offset;
+            file_stat.st_mtim.tv_sec += change->mtime_offset;
+            char etag[ETAG_SIZE];
+            format_etag(&file_stat, etag, sizeof(etag));
+            char metadata[256];
+            snprintf(metadata, sizeof(metadata), "Size: %ld\nETag: %s", file_stat.st_size, etag);
+            Header header = {MESSAGE_RESPONSE, COMMAND_REQUEST_METADATA, strlen(metadata) + 1, 0, STATUS_OK, 0};
+            Message message;
+            TEST_ASSERT_EQUAL_INT(STATUS_OK, create_message(&header, (const uint8_t*)metadata, &message));
+            send_all(client_socket, message.data, message.size);
+            destroy_message(&message);
+        } else {
+            handle_request(client_socket, &request.header, request.payload);
+        }
+        destroy_response(&request);
+    }
+}
+
+// the replicas: the slow one waits before each request
+TestServer servers[] = {
+    TEST_SERVER_INIT(FAST_PORT, 0),
+    TEST_SERVER_INIT(SLOW_PORT, 50000),
+    {MOVED_PORT, 0, serve_changed_metadata, &moved, 0, PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, {0}},
+    {STALE_PORT, 0, serve_changed_metadata, &stale, 0, PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, {0}},
+};
+char output_path[] = "/tmp/client_server_test_parallel_fetch_XXXXXX";
+int output_fd;
+RetryPolicy policy = {1000, 10, 100, 2000, 1};
+
+/**
+ * Writes a file of LARGE_FILE_SIZE bytes of a pattern to the server directory.
+ */
+void create_large_file() {
+    FILE* file = fopen(SERVER_FILE_PATH "/" LARGE_FILE_NAME, "wb");
+    TEST_ASSERT_NOT_NULL(file);
+    for (long i = 0; i < LARGE_FILE_SIZE; i++) {
+        fputc((int)(i * 31 % 251), file);
+    }
+    fclose(file);
+}
+
+/**
+ * Checks that the output file is a copy of the large file.
+ */
+void assert_fetched_large_file() {
+    TEST_ASSERT_EQUAL_INT64(LARGE_FILE_SIZE, lseek(output_fd, 0, SEEK_END));
+    uint8_t* contents = malloc(LARGE_FILE_SIZE);
+    TEST_ASSERT_NOT_NULL(contents);
+    TEST_ASSERT_EQUAL_INT64(LARGE_FILE_SIZE, pread(output_fd, contents, LARGE_FILE_SIZE, 0));
+    for (long i = 0; i < LARGE_FILE_SIZE; i++) {
+        if (contents[i] != (uint8_t)(i * 31 % 251)) {
+            free(contents);
+            TEST_FAIL_MESSAGE("the fetched file differs from the original");
+        }
+    }
+    free(contents);
+}
+
+void test__parallel_fetch__fetches_from_all_replicas() {
+    Replica replicas[] = {{{ADDRESS, FAST_PORT}, 0, 0}, {{ADDRESS, FAST_PORT}, 0, 0}, {{ADDRESS, SLOW_PORT}, 0, 0}};
+    uint64_t file_size;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, parallel_fetch(replicas, 3, &policy, NULL, LARGE_FILE_NAME, output_fd, &file_size));
+    TEST_ASSERT_EQUAL_UINT64(LARGE_FILE_SIZE, file_size);
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT_EQUAL_INT(STATUS_OK, replicas[i].status);
+        TEST_ASSERT_GREATER_THAN_UINT64(0, replicas[i].bytes);
+    }
+    TEST_ASSERT_EQUAL_UINT64(LARGE_FILE_SIZE, replicas[0].bytes + replicas[1].bytes + replicas[2].bytes);
+    assert_fetched_large_file();
+}
+
+void test__parallel_fetch__fast_replica_steals_work() {
+    Replica replicas[] = {{{ADDRESS, SLOW_PORT}, 0, 0}, {{ADDRESS, FAST_PORT}, 0, 0}};
+    uint64_t file_size;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, parallel_fetch(replicas, 2, &policy, NULL, LARGE_FILE_NAME, output_fd, &file_size));
+    // the fast replica takes over part of the slow replica's half
+    TEST_ASSERT_GREATER_THAN_UINT64(LARGE_FILE_SIZE / 2 + PARALLEL_FETCH_REQUEST_SIZE, replicas[1].bytes);
+    TEST_ASSERT_EQUAL_UINT64(LARGE_FILE_SIZE, replicas[0].bytes + replicas[1].bytes);
+    assert_fetched_large_file();
+}
+
+void test__parallel_fetch__takes_over_from_failed_replica() {
+    Replica replicas[] = {{{ADDRESS, DOWN_PORT}, 0, 0}, {{ADDRESS, FAST_PORT}, 0, 0}};
+    uint64_t file_size;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, parallel_fetch(replicas, 2, &policy, NULL, LARGE_FILE_NAME, output_fd, &file_size));
+    TEST_ASSERT_NOT_EQUAL_INT(STATUS_OK, replicas[0].status);
+    TEST_ASSERT_EQUAL_UINT64(0, replicas[0].bytes);
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, replicas[1].status);
+    TEST_ASSERT_EQUAL_UINT64(LARGE_FILE_SIZE, replicas[1].bytes);
+    assert_fetched_large_file();
+}
+
+void test__parallel_fetch__ignores_inode() {
+    // a copy on another host has another inode, but the same mtime and size
+    Replica replicas[] = {{{ADDRESS, FAST_PORT}, 0, 0}, {{ADDRESS, MOVED_PORT}, 0, 0}};
+    uint64_t file_size;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, parallel_fetch(replicas, 2, &policy, NULL, LARGE_FILE_NAME, output_fd, &file_size));
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, replicas[1].status);
+    TEST_ASSERT_GREATER_THAN_UINT64(0, replicas[1].bytes);
+    assert_fetched_large_file();
+}
+
+void test__parallel_fetch__drops_replica_with_other_version() {
+    // the stale replica is in the minority, even though it is asked first
+    Replica replicas[] = {{{ADDRESS, STALE_PORT}, 0, 0}, {{ADDRESS, FAST_PORT}, 0, 0}, {{ADDRESS, SLOW_PORT}, 0, 0}};
+    uint64_t file_size;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, parallel_fetch(replicas, 3, &policy, NULL, LARGE_FILE_NAME, output_fd, &file_size));
+    TEST_ASSERT_EQUAL_INT(ERROR_VERSION_MISMATCH, replicas[0].status);
+    TEST_ASSERT_EQUAL_UINT64(0, replicas[0].bytes);
+    TEST_ASSERT_EQUAL_UINT64(LARGE_FILE_SIZE, replicas[1].bytes + replicas[2].bytes);
+    assert_fetched_large_file();
+}
+
+void test__parallel_fetch__small_file() {
+    Replica replicas[] = {{{ADDRESS, FAST_PORT}, 0, 0}, {{ADDRESS, SLOW_PORT}, 0, 0}};
+    uint64_t file_size;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, parallel_fetch(replicas, 2, &policy, NULL, "test.txt", output_fd, &file_size));
+    TEST_ASSERT_EQUAL_UINT64(file_size, replicas[0].bytes + replicas[1].bytes);
+    TEST_ASSERT_EQUAL_INT64(file_size, lseek(output_fd, 0, SEEK_END));
+}
+
+void test__parallel_fetch__file_not_found() {
+    Replica replicas[] = {{{ADDRESS, FAST_PORT}, 0, 0}, {{ADDRESS, SLOW_PORT}, 0, 0}};
+    uint64_t file_size;
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_NOT_FOUND, parallel_fetch(replicas, 2, &policy, NULL, "missing.txt", output_fd, &file_size));
+}
+
+void test__parallel_fetch__no_replica_reachable() {
+    Replica replicas[] = {{{ADDRESS, DOWN_PORT}, 0, 0}};
+    uint64_t file_size;
+    TEST_ASSERT_EQUAL_INT(ERROR_SEND_FAILED, parallel_fetch(replicas, 1, &policy, NULL, LARGE_FILE_NAME, output_fd, &file_size));
+}
+
+void setUp(void) {
+    TEST_ASSERT_EQUAL_INT(0, ftruncate(output_fd, 0));
+}
+
+void tearDown(void) {}
+
+int main(void) {
+    output_fd = mkstemp(output_path);
+    if (output_fd == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+    UNITY_BEGIN();
+    create_large_file();
+    for (size_t i = 0; i < sizeof(servers) / sizeof(servers[0]); i++) {
+        test_server_start(&servers[i]);
+    }
+
+    RUN_TEST(test__parallel_fetch__fetches_from_all_replicas);
+    RUN_TEST(test__parallel_fetch__fast_replica_steals_work);
+    RUN_TEST(test__parallel_fetch__takes_over_from_failed_replica);
+    RUN_TEST(test__parallel_fetch__ignores_inode);
+    RUN_TEST(test__parallel_fetch__drops_replica_with_other_version);
+    RUN_TEST(test__parallel_fetch__small_file);
+    RUN_TEST(test__parallel_fetch__file_not_found);
+    RUN_TEST(test__parallel_fetch__no_replica_reachable);
+
+    for (size_t i = 0; i < sizeof(servers) / sizeof(servers[0]); i++) {
+        test_server_stop(&servers[i]);
+    }
+    unlink(SERVER_FILE_PATH "/" LARGE_FILE_NAME);
+    close(output_fd);
+    unlink(output_path);
+    return UNITY_END();
+}
@@ -4,15 +4,16 @@
 #include <string.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
+#include <pthread.h>
 
 void test__header_size_matches_last_offset_plus_one() {
-    TEST_ASSERT_EQUAL_INT(HEADER_SIZE, HEADER_OFFSET_STATUS + 1);
+    TEST_ASSERT_EQUAL_INT(HEADER_SIZE, HEADER_OFFSET_STREAM_ID + sizeof(uint32_t));
 }
 
 void test__create_parse_message() {
     uint8_t payload[] = {'f', 'o', 'o', 'b', 'a', 'r'};
     uint32_t expected_payload_size = sizeof(payload);
-    Header header = {MESSAGE_REQUEST, COMMAND_REQUEST_FILE, expected_payload_size, 0, NOT_SET};
+    Header header = {MESSAGE_REQUEST, COMMAND_REQUEST_FILE, expected_payload_size, 0, NOT_SET, 7};
     Message message;
 
     int rvalue = create_message(&header, payload, &message);
@@ -23,6 +24,7 @@ void test__create_parse_message() {
     TEST_ASSERT_EQUAL_UINT32(htonl(expected_payload_size), *(uint32_t *)(message.data + HEADER_OFFSET_PAYLOAD_SIZE));
     TEST_ASSERT_EQUAL_UINT32(htonl(0), *(uint32_t *)(message.data + HEADER_OFFSET_CHUNK_INDEX));
     TEST_ASSERT_EQUAL_UINT8(NOT_SET, message.data[HEADER_OFFSET_STATUS]);
+    TEST_ASSERT_EQUAL_UINT32(htonl(7), *(uint32_t *)(message.data + HEADER_OFFSET_STREAM_ID));
     // check payload is correctly copied into the message
     TEST_ASSERT_TRUE(memcmp(message.data + HEADER_SIZE, payload, expected_payload_size) == 0);
     
@@ -34,6 +36,7 @@ void test__create_parse_message() {
     TEST_ASSERT_EQUAL_UINT32(expected_payload_size, response.header.payload_size);
     TEST_ASSERT_EQUAL_UINT32(0, response.header.chunk_index);
     TEST_ASSERT_EQUAL_UINT8(NOT_SET, response.header.status);
+    TEST_ASSERT_EQUAL_UINT32(7, response.header.stream_id);
     // check that the payload is correctly parsed/returned in the response
     TEST_ASSERT_TRUE(memcmp(response.payload, payload, expected_payload_size) == 0);
 
@@ -41,6 +44,21 @@ void test__create_parse_message() {
     destroy_response(&response);
 }
 
+void test__encode_extract_header() {
+    Header header = {MESSAGE_RESPONSE_CHUNK, COMMAND_REQUEST_DELTA, 0x01020304, 0xa0b0c0d0, STATUS_OK, 0xffffffff};
+    uint8_t data[HEADER_SIZE];
+    encode_header(&header, data);
+    Header extracted;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, extract_header(data, sizeof(data), &extracted));
+    TEST_ASSERT_EQUAL_UINT8(header.message_type, extracted.message_type);
+    TEST_ASSERT_EQUAL_UINT8(header.command, extracted.command);
+    TEST_ASSERT_EQUAL_UINT32(header.payload_size, extracted.payload_size);
+    TEST_ASSERT_EQUAL_UINT32(header.chunk_index, extracted.chunk_index);
+    TEST_ASSERT_EQUAL_UINT8(header.status, extracted.status);
+    TEST_ASSERT_EQUAL_UINT32(header.stream_id, extracted.stream_id);
+    TEST_ASSERT_EQUAL_INT(ERROR_INVALID_DATA_SIZE, extract_header(data, HEADER_SIZE - 1, &extracted));
+}
+
 void test__create_parse_message__max_payload_size() {
     uint8_t payload[MAX_PAYLOAD_SIZE];
     memset(payload, 'a', MAX_PAYLOAD_SIZE);  // fill payload with 'a'
@@ -93,6 +111,66 @@ void test__parse_message__invalid_data_size() {
     TEST_ASSERT_EQUAL_INT(ERROR_INVALID_DATA_SIZE, rvalue);
 }
 
+void test__message_buffers_are_reused() {
+    message_buffer_trim();
+    Header header = {MESSAGE_RESPONSE_CHUNK, COMMAND_REQUEST_FILE, 4, 0, STATUS_OK, 0};
+    const uint8_t payload[4] = {1, 2, 3, 4};
+    Message message;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, create_message(&header, payload, &message));
+    uint8_t* data = message.data;
+    destroy_message(&message);
+    TEST_ASSERT_EQUAL_size_t(1, message_buffer_cached());
+
+    // the released buffer is handed out again, both for messages and for parsed payloads
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, create_message(&header, payload, &message));
+    TEST_ASSERT_EQUAL_PTR(data, message.data);
+    TEST_ASSERT_EQUAL_size_t(0, message_buffer_cached());
+    Response response;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, parse_message(message.data, message.size, &response));
+    TEST_ASSERT_TRUE(response.pooled);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(payload, response.payload, 4);
+    destroy_message(&message);
+    destroy_response(&response);
+    TEST_ASSERT_EQUAL_size_t(2, message_buffer_cached());
+
+    message_buffer_trim();
+    TEST_ASSERT_EQUAL_size_t(0, message_buffer_cached());
+}
+
+void test__message_buffer_cache_is_bounded() {
+    uint8_t* buffers[MESSAGE_BUFFER_CACHE_SIZE + 1];
+    for (int i = 0; i < MESSAGE_BUFFER_CACHE_SIZE + 1; i++) {
+        buffers[i] = message_buffer_acquire();
+        TEST_ASSERT_NOT_NULL(buffers[i]);
+    }
+    for (int i = 0; i < MESSAGE_BUFFER_CACHE_SIZE + 1; i++) {
+        message_buffer_release(buffers[i]);
+    }
+    TEST_ASSERT_EQUAL_size_t(MESSAGE_BUFFER_CACHE_SIZE, message_buffer_cached());
+    message_buffer_trim();
+}
+
+void* release_buffer_worker(void* arg) {
+    message_buffer_release((uint8_t*)arg);
+    size_t* cached = malloc(sizeof(size_t));
+    *cached = message_buffer_cached();
+    // the buffer is freed when this thread exits
+    return cached;
+}
+
+void test__message_buffer__released_on_another_thread() {
+    message_buffer_trim();
+    uint8_t* buffer = message_buffer_acquire();
+    pthread_t thread;
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&thread, NULL, release_buffer_worker, buffer));
+    size_t* cached;
+    pthread_join(thread, (void**)&cached);
+    // the buffer went to the cache of the thread that released it, not to ours
+    TEST_ASSERT_EQUAL_size_t(1, *cached);
+    TEST_ASSERT_EQUAL_size_t(0, message_buffer_cached());
+    free(cached);
+}
+
 void setUp(void) {}
 void tearDown(void) {}
 
@@ -100,8 +178,12 @@ int main(void) {
     UNITY_BEGIN();
     RUN_TEST(test__header_size_matches_last_offset_plus_one);
     RUN_TEST(test__create_parse_message);
+    RUN_TEST(test__encode_extract_header);
     RUN_TEST(test__create_parse_message__max_payload_size);
     RUN_TEST(test__create_message__exceed_max_payload_size);
     RUN_TEST(test__parse_message__invalid_data_size);
+    RUN_TEST(test__message_buffers_are_reused);
+    RUN_TEST(test__message_buffer_cache_is_bounded);
+    RUN_TEST(test__message_buffer__released_on_another_thread);
     return UNITY_END();
 }
@@ -0,0 +1,247 @@
+#include "utils.h"
+#include "protocol.h"
+#include "scheduler.h"
+#include "unity.h"
+#include <time.h>
+#include <pthread.h>
+
+#define MAX_WAITERS 8
+
+/**
+ * The order in which waiter threads were granted a slot.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    int order[MAX_WAITERS];
+    int count;
+} GrantLog;
+
+typedef struct {
+    Scheduler* scheduler;
+    GrantLog* log;
+    int id;
+    int priority_class;
+} Waiter;
+
+void sleep_ms(long milliseconds) {
+    struct timespec delay = {milliseconds / 1000, (milliseconds % 1000) * 1000000L};
+    nanosleep(&delay, NULL);
+}
+
+/**
+ * Acquires a slot, records that it was granted, and releases it right away.
+ */
+void* waiter_worker(void* arg) {
+    Waiter* waiter = (Waiter*)arg;
+    SchedulerTicket ticket;
+    scheduler_acquire(waiter->scheduler, &ticket, waiter->priority_class);
+    pthread_mutex_lock(&waiter->log->mutex);
+    waiter->log->order[waiter->log->count++] = waiter->id;
+    pthread_mutex_unlock(&waiter->log->mutex);
+    scheduler_release(waiter->scheduler, &ticket);
+    return NULL;
+}
+
+/**
+ * Starts a waiter thread and returns once it is queued in the scheduler.
+ */
+void start_waiter(pthread_t* thread, Waiter* waiter) {
+    size_t queued = scheduler_queued(waiter->scheduler, waiter->priority_class);
+    pthread_create(thread, NULL, waiter_worker, waiter);
+    while (scheduler_queued(waiter->scheduler, waiter->priority_class) == queued) {
+        sleep_ms(1);
+    }
+}
+
+void test__scheduler_init__invalid_limits() {
+    Scheduler scheduler;
+    TEST_ASSERT_EQUAL_INT(-1, scheduler_init(&scheduler, 0, 1, 0));
+    TEST_ASSERT_EQUAL_INT(-1, scheduler_init(&scheduler, 2, 0, 0));
+    TEST_ASSERT_EQUAL_INT(-1, scheduler_init(&scheduler, 2, 3, 0));
+}
+
+void test__scheduler_classify() {
+    TEST_ASSERT_EQUAL_INT(SCHEDULER_CLASS_INTERACTIVE, scheduler_classify(COMMAND_REQUEST_METADATA, 1L << 40));
+    TEST_ASSERT_EQUAL_INT(SCHEDULER_CLASS_INTERACTIVE, scheduler_classify(COMMAND_REQUEST_FILE_DESCRIPTOR, 1L << 40));
+    TEST_ASSERT_EQUAL_INT(SCHEDULER_CLASS_INTERACTIVE, scheduler_classify(COMMAND_REQUEST_FILE, SCHEDULER_SMALL_FILE_SIZE));
+    TEST_ASSERT_EQUAL_INT(SCHEDULER_CLASS_BULK, scheduler_classify(COMMAND_REQUEST_FILE, SCHEDULER_SMALL_FILE_SIZE + 1));
+    TEST_ASSERT_EQUAL_INT(SCHEDULER_CLASS_BULK, scheduler_classify(COMMAND_REQUEST_DELTA, SCHEDULER_SMALL_FILE_SIZE + 1));
+    // unknown size: the request ends with a quick error response
+    TEST_ASSERT_EQUAL_INT(SCHEDULER_CLASS_INTERACTIVE, scheduler_classify(COMMAND_REQUEST_FILE, -1));
+}
+
+void test__scheduler__interactive_runs_before_bulk() {
+    Scheduler scheduler;
+    TEST_ASSERT_EQUAL_INT(0, scheduler_init(&scheduler, 1, 1, 10000));
+    GrantLog log = {PTHREAD_MUTEX_INITIALIZER, {0}, 0};
+    // hold the only slot so that the others queue up
+    SchedulerTicket holder;
+    scheduler_acquire(&scheduler, &holder, SCHEDULER_CLASS_BULK);
+
+    Waiter waiters[3] = {
+        {&scheduler, &log, 0, SCHEDULER_CLASS_BULK},
+        {&scheduler, &log, 1, SCHEDULER_CLASS_INTERACTIVE},
+        {&scheduler, &log, 2, SCHEDULER_CLASS_INTERACTIVE},
+    };
+    pthread_t threads[3];
+    for (int i = 0; i < 3; i++) {
+        start_waiter(&threads[i], &waiters[i]);
+    }
+    scheduler_release(&scheduler, &holder);
+    for (int i = 0; i < 3; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    // the bulk request arrived first but runs last; interactive requests keep their arrival order
+    TEST_ASSERT_EQUAL_INT(3, log.count);
+    TEST_ASSERT_EQUAL_INT(1, log.order[0]);
+    TEST_ASSERT_EQUAL_INT(2, log.order[1]);
+    TEST_ASSERT_EQUAL_INT(0, log.order[2]);
+    scheduler_destroy(&scheduler);
+}
+
+void test__scheduler__aged_bulk_runs_first() {
+    Scheduler scheduler;
+    TEST_ASSERT_EQUAL_INT(0, scheduler_init(&scheduler, 1, 1, 20));
+    GrantLog log = {PTHREAD_MUTEX_INITIALIZER, {0}, 0};
+    SchedulerTicket holder;
+    scheduler_acquire(&scheduler, &holder, SCHEDULER_CLASS_INTERACTIVE);
+
+    Waiter bulk = {&scheduler, &log, 0, SCHEDULER_CLASS_BULK};
+    Waiter interactive = {&scheduler, &log, 1, SCHEDULER_CLASS_INTERACTIVE};
+    pthread_t threads[2];
+    start_waiter(&threads[0], &bulk);
+    sleep_ms(40);
+    start_waiter(&threads[1], &interactive);
+    scheduler_release(&scheduler, &holder);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+    // the bulk request waited longer than aging_ms, so it is not starved by the interactive one
+    TEST_ASSERT_EQUAL_INT(0, log.order[0]);
+    TEST_ASSERT_EQUAL_INT(1, log.order[1]);
+    scheduler_destroy(&scheduler);
+}
+
+void test__scheduler__bulk_cap_leaves_slots_for_interactive() {
+    Scheduler scheduler;
+    TEST_ASSERT_EQUAL_INT(0, scheduler_init(&scheduler, 3, 1, 0));
+    GrantLog log = {PTHREAD_MUTEX_INITIALIZER, {0}, 0};
+    SchedulerTicket bulk_ticket;
+    scheduler_acquire(&scheduler, &bulk_ticket, SCHEDULER_CLASS_BULK);
+
+    // a second bulk request waits even though two slots are free...
+    Waiter bulk = {&scheduler, &log, 0, SCHEDULER_CLASS_BULK};
+    pthread_t thread;
+    start_waiter(&thread, &bulk);
+    sleep_ms(20);
+    TEST_ASSERT_EQUAL_size_t(1, scheduler_queued(&scheduler, SCHEDULER_CLASS_BULK));
+    TEST_ASSERT_EQUAL_INT(0, log.count);
+
+    // ...which interactive requests get right away
+    SchedulerTicket interactive_tickets[2];
+    scheduler_acquire(&scheduler, &interactive_tickets[0], SCHEDULER_CLASS_INTERACTIVE);
+    scheduler_acquire(&scheduler, &interactive_tickets[1], SCHEDULER_CLASS_INTERACTIVE);
+    scheduler_release(&scheduler, &interactive_tickets[0]);
+    scheduler_release(&scheduler, &interactive_tickets[1]);
+    TEST_ASSERT_EQUAL_size_t(1, scheduler_queued(&scheduler, SCHEDULER_CLASS_BULK));
+
+    // the waiting bulk request runs once the first one is done
+    scheduler_release(&scheduler, &bulk_ticket);
+    pthread_join(thread, NULL);
+    TEST_ASSERT_EQUAL_INT(1, log.count);
+    TEST_ASSERT_EQUAL_size_t(0, scheduler_queued(&scheduler, SCHEDULER_CLASS_BULK));
+    scheduler_destroy(&scheduler);
+}
+
+void test__scheduler__standing_queue_is_rejected() {
+    Scheduler scheduler;
+    TEST_ASSERT_EQUAL_INT(0, scheduler_init(&scheduler, 1, 1, 10000));
+    scheduler_set_admission(&scheduler, 10, 30);
+    GrantLog log = {PTHREAD_MUTEX_INITIALIZER, {0}, 0};
+    SchedulerTicket holder;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, scheduler_acquire(&scheduler, &holder, SCHEDULER_CLASS_INTERACTIVE));
+
+    // a request that waits longer than the target is a short burst, not overload (yet)
+    Waiter first = {&scheduler, &log, 0, SCHEDULER_CLASS_INTERACTIVE};
+    Waiter second = {&scheduler, &log, 1, SCHEDULER_CLASS_INTERACTIVE};
+    pthread_t threads[2];
+    start_waiter(&threads[0], &first);
+    sleep_ms(20);
+    start_waiter(&threads[1], &second);
+    TEST_ASSERT_FALSE(scheduler_overloaded(&scheduler, SCHEDULER_CLASS_INTERACTIVE));
+
+    // the waiting time stayed above the target for a whole interval: new requests are rejected right away
+    sleep_ms(40);
+    SchedulerTicket rejected;
+    TEST_ASSERT_EQUAL_INT(ERROR_OVERLOADED, scheduler_acquire(&scheduler, &rejected, SCHEDULER_CLASS_INTERACTIVE));
+    TEST_ASSERT_TRUE(scheduler_overloaded(&scheduler, SCHEDULER_CLASS_INTERACTIVE));
+    TEST_ASSERT_EQUAL_size_t(2, scheduler_queued(&scheduler, SCHEDULER_CLASS_INTERACTIVE));
+
+    // requests that were already admitted still run
+    scheduler_release(&scheduler, &holder);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+    TEST_ASSERT_EQUAL_INT(2, log.count);
+
+    // once the queue has drained, a request that doesn't wait ends the overload
+    SchedulerTicket ticket;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, scheduler_acquire(&scheduler, &ticket, SCHEDULER_CLASS_INTERACTIVE));
+    TEST_ASSERT_FALSE(scheduler_overloaded(&scheduler, SCHEDULER_CLASS_INTERACTIVE));
+    scheduler_release(&scheduler, &ticket);
+    TEST_ASSERT_EQUAL_UINT64(1, scheduler_rejected(&scheduler));
+    scheduler_destroy(&scheduler);
+}
+
+void test__scheduler__classes_are_admitted_separately() {
+    Scheduler scheduler;
+    TEST_ASSERT_EQUAL_INT(0, scheduler_init(&scheduler, 2, 1, 10000));
+    scheduler_set_admission(&scheduler, 10, 30);
+    GrantLog log = {PTHREAD_MUTEX_INITIALIZER, {0}, 0};
+    SchedulerTicket bulk_holder;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, scheduler_acquire(&scheduler, &bulk_holder, SCHEDULER_CLASS_BULK));
+
+    // a standing bulk queue, while interactive requests keep running right away
+    Waiter first = {&scheduler, &log, 0, SCHEDULER_CLASS_BULK};
+    Waiter second = {&scheduler, &log, 1, SCHEDULER_CLASS_BULK};
+    pthread_t threads[2];
+    start_waiter(&threads[0], &first);
+    sleep_ms(20);
+    start_waiter(&threads[1], &second);
+    for (int i = 0; i < 4; i++) {
+        sleep_ms(10);
+        SchedulerTicket interactive;
+        TEST_ASSERT_EQUAL_INT(STATUS_OK, scheduler_acquire(&scheduler, &interactive, SCHEDULER_CLASS_INTERACTIVE));
+        scheduler_release(&scheduler, &interactive);
+    }
+
+    // the interactive requests that didn't wait don't hide the standing bulk queue
+    SchedulerTicket rejected;
+    TEST_ASSERT_EQUAL_INT(ERROR_OVERLOADED, scheduler_acquire(&scheduler, &rejected, SCHEDULER_CLASS_BULK));
+    TEST_ASSERT_TRUE(scheduler_overloaded(&scheduler, SCHEDULER_CLASS_BULK));
+    TEST_ASSERT_FALSE(scheduler_overloaded(&scheduler, SCHEDULER_CLASS_INTERACTIVE));
+    // and the bulk queue doesn't get interactive requests rejected
+    SchedulerTicket interactive;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, scheduler_acquire(&scheduler, &interactive, SCHEDULER_CLASS_INTERACTIVE));
+    scheduler_release(&scheduler, &interactive);
+    TEST_ASSERT_EQUAL_UINT64(1, scheduler_rejected(&scheduler));
+
+    scheduler_release(&scheduler, &bulk_holder);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+    TEST_ASSERT_EQUAL_INT(2, log.count);
+    scheduler_destroy(&scheduler);
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test__scheduler_init__invalid_limits);
+    RUN_TEST(test__scheduler_classify);
+    RUN_TEST(test__scheduler__interactive_runs_before_bulk);
+    RUN_TEST(test__scheduler__aged_bulk_runs_first);
+    RUN_TEST(test__scheduler__bulk_cap_leaves_slots_for_interactive);
+    RUN_TEST(test__scheduler__standing_queue_is_rejected);
+    RUN_TEST(test__scheduler__classes_are_admitted_separately);
+    return UNITY_END();
+}
@@ -0,0 +1,128 @@
+#include "test_server.h"
+#include "protocol.h"
+#include "file_transfer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef struct {
+    TestServer* server;
+    int client_socket;
+    int slot;
+} _Connection;
+
+/**
+ * Handles requests on a keep-alive connection until the client closes it.
+ */
+static void _serve_requests(TestServer* server, int client_socket) {
+    uint8_t buffer[MAX_MESSAGE_SIZE];
+    ssize_t bytes_received;
+    while ((bytes_received = receive_message(client_socket, buffer, MAX_MESSAGE_SIZE)) > 0) {
+        Response response;
+        if (parse_message(buffer, bytes_received, &response) != STATUS_OK) {
+            break;
+        }
+        pthread_mutex_lock(&server->mutex);
+        server->requests++;
+        pthread_mutex_unlock(&server->mutex);
+        usleep(server->delay_us);
+        handle_request(client_socket, &response.header, response.payload);
+        destroy_response(&response);
+    }
+}
+
+static void* _connection_worker(void* arg) {
+    _Connection connection = *(_Connection*)arg;
+    free(arg);
+    TestServer* server = connection.server;
+    if (server->serve != NULL) {
+        server->serve(connection.client_socket, server->context);
+    } else {
+        _serve_requests(server, connection.client_socket);
+    }
+    pthread_mutex_lock(&server->mutex);
+    if (server->sockets[connection.slot] == connection.client_socket) {
+        server->sockets[connection.slot] = -1;
+    }
+    pthread_mutex_unlock(&server->mutex);
+    close(connection.client_socket);
+    return NULL;
+}
+
+static void* _server_worker(void* arg) {
+    TestServer* server = (TestServer*)arg;
+    int server_socket = bind_or_die(server->port, NULL);
+    listen_or_die(server_socket, 16);
+    while (1) {
+        int client_socket = accept_or_die(server_socket, NULL);
+        pthread_mutex_lock(&server->mutex);
+        if (!server->running) {
+            pthread_mutex_unlock(&server->mutex);
+            socket_cleanup(client_socket);
+            break;
+        }
+        int slot = server->accepted % TEST_SERVER_MAX_CONNECTIONS;
+        server->sockets[slot] = client_socket;
+        server->accepted++;
+        pthread_mutex_unlock(&server->mutex);
+
+        _Connection* connection = malloc(sizeof(_Connection));
+        *connection = (_Connection){server, client_socket, slot};
+        pthread_t thread;
+        pthread_create(&thread, NULL, _connection_worker, connection);
+        pthread_detach(thread);
+    }
+    socket_cleanup(server_socket);
+    return NULL;
+}
+
+void test_server_start(TestServer* server) {
+    server->running = 1;
+    for (int i = 0; i < TEST_SERVER_MAX_CONNECTIONS; i++) {
+        server->sockets[i] = -1;
+    }
+    if (pthread_create(&server->thread, NULL, _server_worker, server) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+    // wait for the server to start listening
+    int socket = connect_with_retry_or_die(TEST_SERVER_ADDRESS, server->port, 3, 1, NULL);
+    socket_cleanup(socket);
+}
+
+void test_server_stop(TestServer* server) {
+    pthread_mutex_lock(&server->mutex);
+    server->running = 0;
+    pthread_mutex_unlock(&server->mutex);
+    // send one more connection request to the server to interrupt the accept call
+    int socket = connect_socket(TEST_SERVER_ADDRESS, server->port, NULL);
+    socket_cleanup(socket);
+    pthread_join(server->thread, NULL);
+}
+
+int test_server_accepted(TestServer* server) {
+    pthread_mutex_lock(&server->mutex);
+    int accepted = server->accepted;
+    pthread_mutex_unlock(&server->mutex);
+    return accepted;
+}
+
+int test_server_requests(TestServer* server) {
+    pthread_mutex_lock(&server->mutex);
+    int requests = server->requests;
+    pthread_mutex_unlock(&server->mutex);
+    return requests;
+}
+
+void test_server_disconnect_all(TestServer* server) {
+    pthread_mutex_lock(&server->mutex);
+    for (int i = 0; i < TEST_SERVER_MAX_CONNECTIONS; i++) {
+        if (server->sockets[i] != -1) {
+            shutdown(server->sockets[i], SHUT_RDWR);
+        }
+    }
+    pthread_mutex_unlock(&server->mutex);
+    // give the kernel a moment to deliver the FIN to the client side
+    struct timespec delay = {0, 20 * 1000000};
+    nanosleep(&delay, NULL);
+}
@@ -0,0 +1,72 @@
+/*
+ * An in-process server for the tests of the client side modules (connection pool, batch, replicas,
+ * shards, ...): it listens on a TCP port and serves each connection on its own thread.
+ */
+#ifndef TEST_SERVER_H
+#define TEST_SERVER_H
+
+#include "sockets.h"
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define TEST_SERVER_ADDRESS "127.0.0.1"
+// the most connections `test_server_disconnect_all` keeps track of
+#define TEST_SERVER_MAX_CONNECTIONS 64
+
+/**
+ * @brief A test server.
+ *
+ * port: the port it listens on
+ * delay_us: how long it waits before handling each request (to make a replica slow)
+ * serve: serves a connection until it is closed (NULL: a keep-alive loop of `handle_request`)
+ * context: passed to `serve`
+ * thread: the thread that accepts the connections
+ * mutex: protects the members below it
+ * running: zero once `test_server_stop` was called
+ * accepted: the number of connections accepted
+ * requests: the number of requests handled (by the default `serve` only)
+ * sockets: the open connections, or -1 (indexed by the accept count, modulo TEST_SERVER_MAX_CONNECTIONS)
+ */
+typedef struct {
+    in_addr_t port;
+    useconds_t delay_us;
+    void (*serve)(int client_socket, void* context);
+    void* context;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    int running;
+    int accepted;
+    int requests;
+    int sockets[TEST_SERVER_MAX_CONNECTIONS];
+} TestServer;
+
+#define TEST_SERVER_INIT(port, delay_us) {port, delay_us, NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, {0}}
+
+/**
+ * @brief Starts the server and waits until it accepts connections. Exits the process if it can't.
+ */
+void test_server_start(TestServer* server);
+
+/**
+ * @brief Stops accepting connections. Connections that are still open are served until they close.
+ */
+void test_server_stop(TestServer* server);
+
+/**
+ * @brief Returns the number of connections accepted so far.
+ */
+int test_server_accepted(TestServer* server);
+
+/**
+ * @brief Returns the number of requests handled so far.
+ */
+int test_server_requests(TestServer* server);
+
+/**
+ * @brief Shuts down all open connections (like a keep-alive timeout or a restart would), and gives the
+ * clients a moment to see it.
+ */
+void test_server_disconnect_all(TestServer* server);
+
+#endif // TEST_SERVER_H
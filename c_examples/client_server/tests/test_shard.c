@@ -0,0 +1,153 @@
+#include "sockets.h"
+#include "protocol.h"
+#include "file_transfer.h"
+#include "connection_pool.h"
+#include "shard.h"
+#include "test_server.h"
+#include "unity.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define ADDRESS TEST_SERVER_ADDRESS
+#define FIRST_PORT 9010
+#define SECOND_PORT 9011
+// nothing listens on this port
+#define DOWN_PORT 9012
+#define KEY_COUNT 20000
+
+TestServer servers[] = {TEST_SERVER_INIT(FIRST_PORT, 0), TEST_SERVER_INIT(SECOND_PORT, 0)};
+
+void key_name(int i, char* key, size_t key_size) {
+    snprintf(key, key_size, "directory/file_%d.txt", i);
+}
+
+void test__shard_map_init__invalid_servers() {
+    ShardMap map;
+    Endpoint servers[] = {{ADDRESS, FIRST_PORT}};
+    TEST_ASSERT_EQUAL_INT(ERROR_INVALID_DATA_SIZE, shard_map_init(&map, servers, 0, HASH_RING_DEFAULT_VIRTUAL_NODES));
+    char long_address[POOL_ADDRESS_SIZE + 1];
+    memset(long_address, 'a', POOL_ADDRESS_SIZE);
+    long_address[POOL_ADDRESS_SIZE] = '\0';
+    servers[0].address = long_address;
+    TEST_ASSERT_EQUAL_INT(ERROR_INVALID_DATA_SIZE, shard_map_init(&map, servers, 1, HASH_RING_DEFAULT_VIRTUAL_NODES));
+}
+
+void test__shard_map_lookup__independent_of_server_order() {
+    Endpoint servers[] = {{"10.0.0.1", 9002}, {"10.0.0.2", 9002}, {"10.0.0.1", 9003}};
+    Endpoint reordered_servers[] = {{"10.0.0.1", 9003}, {"10.0.0.1", 9002}, {"10.0.0.2", 9002}};
+    ShardMap map;
+    ShardMap reordered;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, shard_map_init(&map, servers, 3, HASH_RING_DEFAULT_VIRTUAL_NODES));
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, shard_map_init(&reordered, reordered_servers, 3, HASH_RING_DEFAULT_VIRTUAL_NODES));
+    int counts[3] = {0};
+    for (int i = 0; i < KEY_COUNT; i++) {
+        char key[64];
+        key_name(i, key, sizeof(key));
+        const Endpoint* server = shard_map_lookup(&map, key);
+        const Endpoint* reordered_server = shard_map_lookup(&reordered, key);
+        TEST_ASSERT_EQUAL_STRING(server->address, reordered_server->address);
+        TEST_ASSERT_EQUAL_UINT(server->port, reordered_server->port);
+        counts[server - servers]++;
+    }
+    // servers on the same host are told apart by their port
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT_GREATER_THAN_INT(KEY_COUNT / 4, counts[i]);
+        TEST_ASSERT_LESS_THAN_INT(KEY_COUNT / 2, counts[i]);
+    }
+    shard_map_destroy(&map);
+    shard_map_destroy(&reordered);
+}
+
+void test__shard_map_lookup__adding_a_server_moves_few_files() {
+    Endpoint servers[] = {{"10.0.0.1", 9002}, {"10.0.0.2", 9002}, {"10.0.0.3", 9002}, {"10.0.0.4", 9002}};
+    ShardMap before;
+    ShardMap after;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, shard_map_init(&before, servers, 3, HASH_RING_DEFAULT_VIRTUAL_NODES));
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, shard_map_init(&after, servers, 4, HASH_RING_DEFAULT_VIRTUAL_NODES));
+    int moved = 0;
+    for (int i = 0; i < KEY_COUNT; i++) {
+        char key[64];
+        key_name(i, key, sizeof(key));
+        const Endpoint* old_server = shard_map_lookup(&before, key);
+        const Endpoint* new_server = shard_map_lookup(&after, key);
+        if (old_server != new_server) {
+            // files only move to the new server
+            TEST_ASSERT_EQUAL_PTR(&servers[3], new_server);
+            moved++;
+        }
+    }
+    // about a quarter of the files
+    TEST_ASSERT_GREATER_THAN_INT(KEY_COUNT / 8, moved);
+    TEST_ASSERT_LESS_THAN_INT(KEY_COUNT * 3 / 8, moved);
+    shard_map_destroy(&before);
+    shard_map_destroy(&after);
+}
+
+void test__shard_request__routes_to_placed_server() {
+    Endpoint shard_servers[] = {{ADDRESS, FIRST_PORT}, {ADDRESS, SECOND_PORT}};
+    ShardMap map;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, shard_map_init(&map, shard_servers, 2, HASH_RING_DEFAULT_VIRTUAL_NODES));
+    ConnectionPool pool;
+    TEST_ASSERT_EQUAL_INT(0, connection_pool_init(&pool, 1, 10000, NULL));
+    int expected[2] = {test_server_requests(&servers[0]), test_server_requests(&servers[1])};
+
+    Response response;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, shard_request_file_contents(&map, &pool, "test.txt", &response));
+    destroy_response(&response);
+    expected[shard_map_lookup(&map, "test.txt") - shard_servers]++;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, shard_request_file_metadata(&map, &pool, "test_multiple_chunks.txt", &response));
+    destroy_response(&response);
+    expected[shard_map_lookup(&map, "test_multiple_chunks.txt") - shard_servers]++;
+    // the files that aren't on the servers are still asked for at the server they would be placed on
+    for (int i = 0; i < 50; i++) {
+        char key[64];
+        key_name(i, key, sizeof(key));
+        TEST_ASSERT_EQUAL_INT(ERROR_FILE_NOT_FOUND, shard_request_file_metadata(&map, &pool, key, &response));
+        destroy_response(&response);
+        expected[shard_map_lookup(&map, key) - shard_servers]++;
+    }
+    TEST_ASSERT_EQUAL_INT(expected[0], test_server_requests(&servers[0]));
+    TEST_ASSERT_EQUAL_INT(expected[1], test_server_requests(&servers[1]));
+    // a connection per server, reused
+    TEST_ASSERT_EQUAL_size_t(2, connection_pool_idle_count(&pool));
+    connection_pool_destroy(&pool);
+    shard_map_destroy(&map);
+}
+
+void test__shard_request__server_down() {
+    Endpoint shard_servers[] = {{ADDRESS, DOWN_PORT}};
+    ShardMap map;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, shard_map_init(&map, shard_servers, 1, HASH_RING_DEFAULT_VIRTUAL_NODES));
+    ConnectionPool pool;
+    TEST_ASSERT_EQUAL_INT(0, connection_pool_init(&pool, 1, 10000, NULL));
+    pool.retry_policy.max_attempts = 1;
+    Response response;
+    TEST_ASSERT_EQUAL_INT(ERROR_SEND_FAILED, shard_request_file_contents(&map, &pool, "test.txt", &response));
+    destroy_response(&response);
+    connection_pool_destroy(&pool);
+    shard_map_destroy(&map);
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+int main(void) {
+    UNITY_BEGIN();
+    for (size_t i = 0; i < sizeof(servers) / sizeof(servers[0]); i++) {
+        test_server_start(&servers[i]);
+    }
+
+    RUN_TEST(test__shard_map_init__invalid_servers);
+    RUN_TEST(test__shard_map_lookup__independent_of_server_order);
+    RUN_TEST(test__shard_map_lookup__adding_a_server_moves_few_files);
+    RUN_TEST(test__shard_request__routes_to_placed_server);
+    RUN_TEST(test__shard_request__server_down);
+
+    for (size_t i = 0; i < sizeof(servers) / sizeof(servers[0]); i++) {
+        test_server_stop(&servers[i]);
+    }
+    return UNITY_END();
+}
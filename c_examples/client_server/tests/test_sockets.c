@@ -0,0 +1,196 @@
+#include "sockets.h"
+#include "utils.h"
+#include "unity.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define PORT 9004
+#define ADDRESS "127.0.0.1"
+#define UNIX_SOCKET_PATH "/tmp/client_server_test_sockets.sock"
+
+/**
+ * Binds and listens on PORT after a delay (in milliseconds), accepts one connection, and closes it.
+ */
+void* delayed_server_worker(void* arg) {
+    int delay_ms = *(int*)arg;
+    struct timespec delay = {delay_ms / 1000, (delay_ms % 1000) * 1000000L};
+    nanosleep(&delay, NULL);
+    int server_socket = bind_or_die(PORT, NULL);
+    listen_or_die(server_socket, 1);
+    int client_socket = accept_or_die(server_socket, NULL);
+    socket_cleanup(client_socket);
+    socket_cleanup(server_socket);
+    return NULL;
+}
+
+void test__set_socket_option() {
+    SocketOptions options = SOCKET_OPTIONS_INIT;
+    TEST_ASSERT_EQUAL_INT(0, set_socket_option(&options, "nodelay", NULL));
+    TEST_ASSERT_EQUAL_INT(0, set_socket_option(&options, "sndbuf", "65536"));
+    TEST_ASSERT_EQUAL_INT(0, set_socket_option(&options, "backlog", "128"));
+    TEST_ASSERT_EQUAL_INT(1, options.tcp_nodelay);
+    TEST_ASSERT_EQUAL_INT(65536, options.send_buffer_size);
+    TEST_ASSERT_EQUAL_INT(128, options.backlog);
+    TEST_ASSERT_EQUAL_INT(-1, set_socket_option(&options, "sndbuf", "abc"));
+    TEST_ASSERT_EQUAL_INT(-1, set_socket_option(&options, "sndbuf", "-1"));
+    TEST_ASSERT_EQUAL_INT(-1, set_socket_option(&options, "rcvbuf", NULL));
+    TEST_ASSERT_EQUAL_INT(-1, set_socket_option(&options, "does-not-exist", "1"));
+}
+
+void test__connect_with_deadline__invalid_address() {
+    int socket;
+    int status = connect_with_deadline("not-an-ip-address", PORT, NULL, NULL, &socket);
+    TEST_ASSERT_EQUAL_INT(CONNECT_ERROR_INVALID_ADDRESS, status);
+    TEST_ASSERT_EQUAL_INT(-1, socket);
+}
+
+void test__connect_with_deadline__refused_max_attempts() {
+    RetryPolicy policy = {100, 5, 20, 0, 3};
+    int socket;
+    uint64_t start = monotonic_time_ms();
+    int status = connect_with_deadline(ADDRESS, PORT, &policy, NULL, &socket);
+    uint64_t elapsed = monotonic_time_ms() - start;
+    TEST_ASSERT_EQUAL_INT(CONNECT_ERROR_REFUSED, status);
+    TEST_ASSERT_EQUAL_INT(-1, socket);
+    TEST_ASSERT_EQUAL_INT(ECONNREFUSED, errno);
+    // two backoffs of at most 5ms and 10ms
+    TEST_ASSERT_TRUE(elapsed < 200);
+}
+
+void test__connect_with_deadline__refused_respects_deadline() {
+    RetryPolicy policy = {100, 10, 40, 150, 0};
+    int socket;
+    uint64_t start = monotonic_time_ms();
+    int status = connect_with_deadline(ADDRESS, PORT, &policy, NULL, &socket);
+    uint64_t elapsed = monotonic_time_ms() - start;
+    TEST_ASSERT_TRUE(status == CONNECT_ERROR_REFUSED || status == CONNECT_ERROR_TIMEOUT);
+    TEST_ASSERT_EQUAL_INT(-1, socket);
+    TEST_ASSERT_TRUE(elapsed <= 200);
+}
+
+void test__connect_with_deadline__server_starts_late() {
+    int delay_ms = 100;
+    pthread_t server_thread;
+    pthread_create(&server_thread, NULL, delayed_server_worker, &delay_ms);
+
+    RetryPolicy policy = {100, 5, 20, 2000, 0};
+    int socket;
+    uint64_t start = monotonic_time_ms();
+    int status = connect_with_deadline(ADDRESS, PORT, &policy, NULL, &socket);
+    uint64_t elapsed = monotonic_time_ms() - start;
+    TEST_ASSERT_EQUAL_INT(CONNECT_OK, status);
+    TEST_ASSERT_NOT_EQUAL(-1, socket);
+    // with a maximum backoff of 20ms we connect shortly after the server starts listening
+    TEST_ASSERT_TRUE(elapsed >= 100);
+    TEST_ASSERT_TRUE(elapsed < 500);
+    socket_cleanup(socket);
+    pthread_join(server_thread, NULL);
+}
+
+void test__connect_with_deadline__unix_socket_missing() {
+    unlink(UNIX_SOCKET_PATH);
+    RetryPolicy policy = {100, 5, 10, 50, 0};
+    int socket;
+    int status = connect_with_deadline(UNIX_ADDRESS_PREFIX UNIX_SOCKET_PATH, 0, &policy, NULL, &socket);
+    TEST_ASSERT_TRUE(status == CONNECT_ERROR_REFUSED || status == CONNECT_ERROR_TIMEOUT);
+    TEST_ASSERT_EQUAL_INT(-1, socket);
+}
+
+void test__connect_with_deadline__unix_socket_success() {
+    int server_socket = bind_unix_or_die(UNIX_SOCKET_PATH, NULL);
+    listen_or_die(server_socket, 1);
+    int socket;
+    int status = connect_with_deadline(UNIX_ADDRESS_PREFIX UNIX_SOCKET_PATH, 0, NULL, NULL, &socket);
+    TEST_ASSERT_EQUAL_INT(CONNECT_OK, status);
+    TEST_ASSERT_TRUE(is_unix_socket(socket));
+    socket_cleanup(socket);
+    socket_cleanup(server_socket);
+    unlink(UNIX_SOCKET_PATH);
+}
+
+void test__send_all_with_fds__multiple_descriptors() {
+    int pair[2];
+    TEST_ASSERT_EQUAL_INT(0, socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+    int tcp_socket = bind_or_die(PORT, NULL);
+    int unix_socket = bind_unix_or_die(UNIX_SOCKET_PATH, NULL);
+    int fds[] = {tcp_socket, unix_socket};
+    uint8_t count = 2;
+    TEST_ASSERT_EQUAL_INT(sizeof(count), send_all_with_fds(pair[0], &count, sizeof(count), fds, 2));
+
+    uint8_t received_count = 0;
+    int received[MAX_PASSED_FDS];
+    int fd_count = 0;
+    TEST_ASSERT_EQUAL_INT(sizeof(received_count), receive_all_with_fds(pair[1], &received_count, sizeof(received_count), received, MAX_PASSED_FDS, &fd_count));
+    TEST_ASSERT_EQUAL_INT(2, received_count);
+    TEST_ASSERT_EQUAL_INT(2, fd_count);
+    // the descriptors are new but refer to the same sockets, in the same order
+    TEST_ASSERT_FALSE(is_unix_socket(received[0]));
+    TEST_ASSERT_TRUE(is_unix_socket(received[1]));
+    for (int i = 0; i < fd_count; i++) {
+        close(received[i]);
+    }
+    close(tcp_socket);
+    close(unix_socket);
+    close(pair[0]);
+    close(pair[1]);
+    unlink(UNIX_SOCKET_PATH);
+}
+
+void test__receive_all_with_fds__too_many_descriptors() {
+    int pair[2];
+    TEST_ASSERT_EQUAL_INT(0, socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+    int fds[] = {pair[0], pair[1]};
+    uint8_t byte = 1;
+    int received[MAX_PASSED_FDS];
+    int fd_count = 0;
+    // more than the caller can take
+    TEST_ASSERT_EQUAL_INT(sizeof(byte), send_all_with_fds(pair[0], &byte, sizeof(byte), fds, 2));
+    TEST_ASSERT_EQUAL_INT(-1, receive_all_with_fds(pair[1], &byte, sizeof(byte), received, 1, &fd_count));
+    TEST_ASSERT_EQUAL_INT(0, fd_count);
+
+    // more than fit in the control buffer (MSG_CTRUNC)
+    union {
+        char buffer[CMSG_SPACE(sizeof(int) * (MAX_PASSED_FDS + 1))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {&byte, sizeof(byte)};
+    struct msghdr message = {0};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * (MAX_PASSED_FDS + 1));
+    for (int i = 0; i < MAX_PASSED_FDS + 1; i++) {
+        memcpy(CMSG_DATA(cmsg) + i * sizeof(int), &pair[0], sizeof(int));
+    }
+    TEST_ASSERT_EQUAL_INT(sizeof(byte), sendmsg(pair[0], &message, 0));
+    TEST_ASSERT_EQUAL_INT(-1, receive_all_with_fds(pair[1], &byte, sizeof(byte), received, MAX_PASSED_FDS, &fd_count));
+    TEST_ASSERT_EQUAL_INT(0, fd_count);
+    close(pair[0]);
+    close(pair[1]);
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test__set_socket_option);
+    RUN_TEST(test__connect_with_deadline__invalid_address);
+    RUN_TEST(test__connect_with_deadline__refused_max_attempts);
+    RUN_TEST(test__connect_with_deadline__refused_respects_deadline);
+    RUN_TEST(test__connect_with_deadline__server_starts_late);
+    RUN_TEST(test__connect_with_deadline__unix_socket_missing);
+    RUN_TEST(test__connect_with_deadline__unix_socket_success);
+    RUN_TEST(test__send_all_with_fds__multiple_descriptors);
+    RUN_TEST(test__receive_all_with_fds__too_many_descriptors);
+    return UNITY_END();
+}
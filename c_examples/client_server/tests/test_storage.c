@@ -0,0 +1,150 @@
+#include "utils.h"
+#include "protocol.h"
+#include "storage.h"
+#include "unity.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#define FILE_COUNT 32
+
+char first_root[] = "/tmp/client_server_test_storage_XXXXXX";
+char second_root[] = "/tmp/client_server_test_storage_XXXXXX";
+char catalog_path[] = "/tmp/client_server_test_storage_catalog_XXXXXX";
+
+void file_name(int i, char* name, size_t name_size) {
+    snprintf(name, name_size, "file_%d.txt", i);
+}
+
+void write_file(const char* root, const char* name, const char* contents) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    FILE* file = fopen(path, "w");
+    TEST_ASSERT_NOT_NULL(file);
+    fputs(contents, file);
+    fclose(file);
+}
+
+void remove_file(const char* root, const char* name) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    unlink(path);
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test__storage_init__no_roots() {
+    Storage storage;
+    TEST_ASSERT_EQUAL_INT(ERROR_INVALID_DATA_SIZE, storage_init(&storage, NULL, 0, 1));
+}
+
+void test__storage_root__files_are_found_on_their_root() {
+    const char* paths[] = {first_root, second_root};
+    Storage storage;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, storage_init(&storage, paths, 2, 2));
+    int placed[2] = {0};
+    for (int i = 0; i < FILE_COUNT; i++) {
+        char name[32];
+        file_name(i, name, sizeof(name));
+        StorageRoot* root = storage_root(&storage, name);
+        TEST_ASSERT_EQUAL_PTR(root, storage_root(&storage, name));
+        write_file(root->path, name, name);
+        placed[root == &storage.roots[1]]++;
+    }
+    // both roots get some of the files
+    TEST_ASSERT_GREATER_THAN_INT(0, placed[0]);
+    TEST_ASSERT_GREATER_THAN_INT(0, placed[1]);
+
+    for (int i = 0; i < FILE_COUNT; i++) {
+        char name[32];
+        file_name(i, name, sizeof(name));
+        StorageRoot* root = storage_root(&storage, name);
+        StorageRoot* other = root == &storage.roots[0] ? &storage.roots[1] : &storage.roots[0];
+        CachedFile* file;
+        TEST_ASSERT_EQUAL_INT(STATUS_OK, file_cache_acquire(&root->cache, name, &file));
+        char buffer[32] = {0};
+        TEST_ASSERT_EQUAL_INT(0, io_pool_read(&root->io_pool, file->fd, (uint8_t*)buffer, strlen(name), 0));
+        TEST_ASSERT_EQUAL_STRING(name, buffer);
+        file_cache_release(&root->cache, file);
+        TEST_ASSERT_EQUAL_INT(ERROR_FILE_NOT_FOUND, file_cache_acquire(&other->cache, name, &file));
+    }
+    storage_destroy(&storage);
+    for (int i = 0; i < FILE_COUNT; i++) {
+        char name[32];
+        file_name(i, name, sizeof(name));
+        remove_file(first_root, name);
+        remove_file(second_root, name);
+    }
+}
+
+void test__storage_init__missing_root() {
+    const char* paths[] = {first_root, "/tmp/client_server_test_storage_missing"};
+    Storage storage;
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_OPEN_FAILED, storage_init(&storage, paths, 2, 1));
+    TEST_ASSERT_EQUAL_size_t(2, storage.root_count);
+    write_file(first_root, "test.txt", "test");
+    StorageRoot* root = storage_root(&storage, "test.txt");
+    CachedFile* file;
+    int expected = root == &storage.roots[0] ? STATUS_OK : ERROR_FILE_NOT_FOUND;
+    int rvalue = file_cache_acquire(&root->cache, "test.txt", &file);
+    TEST_ASSERT_EQUAL_INT(expected, rvalue);
+    if (rvalue == STATUS_OK) {
+        file_cache_release(&root->cache, file);
+    }
+    storage_destroy(&storage);
+    remove_file(first_root, "test.txt");
+}
+
+void test__storage_open_catalogs__one_per_root() {
+    const char* paths[] = {first_root, second_root};
+    Storage storage;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, storage_init(&storage, paths, 2, 1));
+    write_file(storage_root(&storage, "test.txt")->path, "test.txt", "test");
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, storage_open_catalogs(&storage, catalog_path, 1000));
+    for (size_t i = 0; i < storage.root_count; i++) {
+        TEST_ASSERT_TRUE(storage.roots[i].cataloged);
+    }
+    StorageRoot* root = storage_root(&storage, "test.txt");
+    CatalogEntry entry;
+    // the scanners fill the catalogs in the background
+    int rvalue = ERROR_FILE_NOT_FOUND;
+    for (int attempt = 0; attempt < 500 && rvalue != STATUS_OK; attempt++) {
+        rvalue = catalog_lookup(&root->catalog, "test.txt", &entry);
+        usleep(10000);
+    }
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, rvalue);
+    TEST_ASSERT_EQUAL_UINT64(4, entry.size);
+    StorageRoot* other = root == &storage.roots[0] ? &storage.roots[1] : &storage.roots[0];
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_NOT_FOUND, catalog_lookup(&other->catalog, "test.txt", &entry));
+    storage_destroy(&storage);
+    remove_file(first_root, "test.txt");
+    remove_file(second_root, "test.txt");
+    // each catalog is named after its root
+    for (int i = 0; i < 2; i++) {
+        char path[128];
+        uint64_t hash = fnv1a_hash(FNV1A_OFFSET_BASIS, paths[i], strlen(paths[i]));
+        snprintf(path, sizeof(path), "%s.%016" PRIx64, catalog_path, hash);
+        TEST_ASSERT_EQUAL_INT(0, unlink(path));
+    }
+}
+
+int main(void) {
+    if (mkdtemp(first_root) == NULL || mkdtemp(second_root) == NULL || mkdtemp(catalog_path) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    // only the name is needed; the catalogs are created next to it
+    rmdir(catalog_path);
+    UNITY_BEGIN();
+    RUN_TEST(test__storage_init__no_roots);
+    RUN_TEST(test__storage_root__files_are_found_on_their_root);
+    RUN_TEST(test__storage_init__missing_root);
+    RUN_TEST(test__storage_open_catalogs__one_per_root);
+    int failures = UNITY_END();
+    rmdir(first_root);
+    rmdir(second_root);
+    return failures;
+}
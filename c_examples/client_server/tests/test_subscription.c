@@ -0,0 +1,280 @@
+#include "sockets.h"
+#include "protocol.h"
+#include "file_transfer.h"
+#include "storage.h"
+#include "subscription.h"
+#include "unity.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+// how long a test waits for a notification before failing
+#define RECEIVE_TIMEOUT_SECONDS 2
+
+char root[] = "/tmp/test_subscription_XXXXXX";
+Storage storage;
+Notifier notifier;
+
+/**
+ * Subscribes a new connection to `patterns`, the way the server does: the request is received on the
+ * server's end of a socket pair, which is then handed to the notifier. Returns the client's end.
+ */
+int subscribe(const char* const* patterns, size_t pattern_count, int* status) {
+    int sockets[2];
+    TEST_ASSERT_EQUAL_INT(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+    struct timeval timeout = {RECEIVE_TIMEOUT_SECONDS, 0};
+    setsockopt(sockets[0], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, send_subscribe(sockets[0], patterns, pattern_count));
+    uint8_t buffer[MAX_MESSAGE_SIZE];
+    ssize_t bytes_received = receive_message(sockets[1], buffer, MAX_MESSAGE_SIZE);
+    Response request;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, parse_message(buffer, bytes_received, &request));
+    TEST_ASSERT_EQUAL_UINT8(COMMAND_SUBSCRIBE, request.header.command);
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, notifier_add_subscriber(&notifier, sockets[1], &request.header, request.payload));
+    destroy_response(&request);
+    Notification notification;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, receive_notification(sockets[0], &notification));
+    TEST_ASSERT_EQUAL_INT(NOTIFICATION_SUBSCRIBED, notification.kind);
+    *status = notification.status;
+    return sockets[0];
+}
+
+void path_of(const char* name, char* path, size_t path_size) {
+    snprintf(path, path_size, "%s/%s", root, name);
+}
+
+void write_file(const char* name, const char* contents) {
+    char path[512];
+    path_of(name, path, sizeof(path));
+    FILE* file = fopen(path, "w");
+    TEST_ASSERT_NOT_NULL(file);
+    fputs(contents, file);
+    fclose(file);
+}
+
+void remove_file(const char* name) {
+    char path[512];
+    path_of(name, path, sizeof(path));
+    remove(path);
+}
+
+void wait_for_subscribers(size_t expected) {
+    for (int i = 0; i < 200 && notifier_subscriber_count(&notifier) != expected; i++) {
+        usleep(10000);
+    }
+    TEST_ASSERT_EQUAL_size_t(expected, notifier_subscriber_count(&notifier));
+}
+
+void test__subscribe__invalid_patterns() {
+    TEST_ASSERT_EQUAL_INT(ERROR_INVALID_DATA_SIZE, send_subscribe(-1, NULL, 0));
+    const char* patterns[] = {"valid.txt", "../outside.txt"};
+    int status;
+    int client = subscribe(patterns, 2, &status);
+    TEST_ASSERT_EQUAL_INT(ERROR_INVALID_FILE_NAME, status);
+    // nothing was subscribed: the connection is closed
+    Notification notification;
+    TEST_ASSERT_EQUAL_INT(ERROR_RECEIVE_FAILED, receive_notification(client, &notification));
+    close(client);
+    wait_for_subscribers(0);
+}
+
+void test__notification__file_written_and_removed() {
+    const char* patterns[] = {"watched.txt"};
+    int status;
+    int client = subscribe(patterns, 1, &status);
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, status);
+    // not subscribed to: not notified
+    write_file("other.txt", "other");
+    write_file("watched.txt", "hello");
+    Notification notification;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, receive_notification(client, &notification));
+    TEST_ASSERT_EQUAL_INT(NOTIFICATION_CHANGED, notification.kind);
+    TEST_ASSERT_EQUAL_STRING("watched.txt", notification.name);
+    TEST_ASSERT_EQUAL_UINT64(5, notification.size);
+    char path[512];
+    path_of("watched.txt", path, sizeof(path));
+    struct stat file_stat;
+    TEST_ASSERT_EQUAL_INT(0, stat(path, &file_stat));
+    TEST_ASSERT_EQUAL_INT64(file_stat.st_mtim.tv_sec, notification.mtime.tv_sec);
+    TEST_ASSERT_EQUAL_INT64(file_stat.st_mtim.tv_nsec, notification.mtime.tv_nsec);
+
+    remove_file("other.txt");
+    remove_file("watched.txt");
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, receive_notification(client, &notification));
+    TEST_ASSERT_EQUAL_INT(NOTIFICATION_REMOVED, notification.kind);
+    TEST_ASSERT_EQUAL_STRING("watched.txt", notification.name);
+    close(client);
+    wait_for_subscribers(0);
+}
+
+void test__notification__prefix_in_new_directory() {
+    const char* patterns[] = {"logs/*"};
+    int status;
+    int client = subscribe(patterns, 1, &status);
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, status);
+    char path[512];
+    path_of("logs", path, sizeof(path));
+    TEST_ASSERT_EQUAL_INT(0, mkdir(path, 0755));
+    // the file may be written before the new directory is watched; it is notified either way
+    write_file("logs/first.log", "1");
+    write_file("logs/second.log", "22");
+    Notification notification;
+    do {
+        TEST_ASSERT_EQUAL_INT(STATUS_OK, receive_notification(client, &notification));
+        TEST_ASSERT_EQUAL_INT(NOTIFICATION_CHANGED, notification.kind);
+        TEST_ASSERT_EQUAL_INT(0, strncmp(notification.name, "logs/", 5));
+    } while (strcmp(notification.name, "logs/second.log") != 0);
+    TEST_ASSERT_EQUAL_UINT64(2, notification.size);
+    close(client);
+    remove_file("logs/first.log");
+    remove_file("logs/second.log");
+    rmdir(path);
+    wait_for_subscribers(0);
+}
+
+void test__subscribe__more_patterns_on_connection() {
+    const char* first[] = {"first.txt"};
+    const char* second[] = {"second.txt"};
+    int status;
+    int client = subscribe(first, 1, &status);
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, status);
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, send_subscribe(client, second, 1));
+    Notification notification;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, receive_notification(client, &notification));
+    TEST_ASSERT_EQUAL_INT(NOTIFICATION_SUBSCRIBED, notification.kind);
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, notification.status);
+    write_file("second.txt", "2");
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, receive_notification(client, &notification));
+    TEST_ASSERT_EQUAL_INT(NOTIFICATION_CHANGED, notification.kind);
+    TEST_ASSERT_EQUAL_STRING("second.txt", notification.name);
+    TEST_ASSERT_EQUAL_size_t(1, notifier_subscriber_count(&notifier));
+    close(client);
+    remove_file("second.txt");
+    wait_for_subscribers(0);
+}
+
+void test__subscriber__other_request_closes_connection() {
+    const char* patterns[] = {"*"};
+    int status;
+    int client = subscribe(patterns, 1, &status);
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, status);
+    Response response;
+    TEST_ASSERT_EQUAL_INT(ERROR_INVALID_COMMAND, request_file_metadata(client, "test.txt", &response));
+    destroy_response(&response);
+    Notification notification;
+    TEST_ASSERT_EQUAL_INT(ERROR_RECEIVE_FAILED, receive_notification(client, &notification));
+    close(client);
+    wait_for_subscribers(0);
+}
+
+void test__notification__directory_moved_away() {
+    const char* patterns[] = {"album/*"};
+    int status;
+    int client = subscribe(patterns, 1, &status);
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, status);
+    char path[512];
+    path_of("album", path, sizeof(path));
+    TEST_ASSERT_EQUAL_INT(0, mkdir(path, 0755));
+    path_of("album/inner", path, sizeof(path));
+    TEST_ASSERT_EQUAL_INT(0, mkdir(path, 0755));
+    write_file("album/a.jpg", "a");
+    write_file("album/inner/b.jpg", "b");
+    // once both are notified, the notifier knows they are there
+    int changed = 0;
+    Notification notification;
+    while (changed != 3) {
+        TEST_ASSERT_EQUAL_INT(STATUS_OK, receive_notification(client, &notification));
+        TEST_ASSERT_EQUAL_INT(NOTIFICATION_CHANGED, notification.kind);
+        changed |= strcmp(notification.name, "album/a.jpg") == 0 ? 1 : strcmp(notification.name, "album/inner/b.jpg") == 0 ? 2 : 0;
+    }
+
+    // no event comes for the files of a directory that is moved: they are notified as removed
+    char moved[512];
+    path_of("album", path, sizeof(path));
+    path_of("moved", moved, sizeof(moved));
+    TEST_ASSERT_EQUAL_INT(0, rename(path, moved));
+    int removed = 0;
+    while (removed != 3) {
+        TEST_ASSERT_EQUAL_INT(STATUS_OK, receive_notification(client, &notification));
+        if (notification.kind == NOTIFICATION_REMOVED) {
+            removed |= strcmp(notification.name, "album/a.jpg") == 0 ? 1 : strcmp(notification.name, "album/inner/b.jpg") == 0 ? 2 : 0;
+        }
+    }
+    close(client);
+    remove_file("moved/inner/b.jpg");
+    remove_file("moved/a.jpg");
+    remove_file("moved/inner");
+    remove_file("moved");
+    wait_for_subscribers(0);
+}
+
+void test__subscriber__not_reading_is_disconnected() {
+    const char* slow_patterns[] = {"slow-*"};
+    const char* other_patterns[] = {"other.txt"};
+    int status;
+    int slow = subscribe(slow_patterns, 1, &status);
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, status);
+    int other = subscribe(other_patterns, 1, &status);
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, status);
+    // the slow subscriber never reads: once its socket buffer and its queue are full, it is dropped
+    char name[FILE_CACHE_MAX_NAME];
+    char padding[201];
+    memset(padding, 'x', sizeof(padding) - 1);
+    padding[sizeof(padding) - 1] = '\0';
+    int written = 0;
+    for (; written < 10000 && notifier_subscriber_count(&notifier) == 2; written++) {
+        snprintf(name, sizeof(name), "slow-%s-%05d", padding, written);
+        write_file(name, "x");
+        if (written % 100 == 99) {
+            usleep(10000);
+        }
+    }
+    wait_for_subscribers(1);
+    // the other subscriber wasn't held up
+    write_file("other.txt", "other");
+    Notification notification;
+    TEST_ASSERT_EQUAL_INT(STATUS_OK, receive_notification(other, &notification));
+    TEST_ASSERT_EQUAL_INT(NOTIFICATION_CHANGED, notification.kind);
+    TEST_ASSERT_EQUAL_STRING("other.txt", notification.name);
+    close(slow);
+    close(other);
+    for (int i = 0; i < written; i++) {
+        snprintf(name, sizeof(name), "slow-%s-%05d", padding, i);
+        remove_file(name);
+    }
+    remove_file("other.txt");
+    wait_for_subscribers(0);
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+int main(void) {
+    UNITY_BEGIN();
+    if (mkdtemp(root) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    const char* paths[] = {root};
+    if (storage_init(&storage, paths, 1, 1) != STATUS_OK || notifier_start(&notifier, &storage) != STATUS_OK) {
+        fprintf(stderr, "could not watch %s\n", root);
+        exit(1);
+    }
+
+    RUN_TEST(test__subscribe__invalid_patterns);
+    RUN_TEST(test__notification__file_written_and_removed);
+    RUN_TEST(test__notification__prefix_in_new_directory);
+    RUN_TEST(test__subscribe__more_patterns_on_connection);
+    RUN_TEST(test__subscriber__other_request_closes_connection);
+    RUN_TEST(test__notification__directory_moved_away);
+    RUN_TEST(test__subscriber__not_reading_is_disconnected);
+
+    notifier_stop(&notifier);
+    storage_destroy(&storage);
+    rmdir(root);
+    return UNITY_END();
+}
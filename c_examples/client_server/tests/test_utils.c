@@ -1,6 +1,8 @@
 #include "utils.h"
 #include "unity.h"
 #include <string.h>
+#include <limits.h>
+#include <time.h>
 
 void test_strlen_null_term() {
     TEST_ASSERT_EQUAL_INT(strlen_null_term((char*)""), 1);
@@ -8,11 +10,40 @@ void test_strlen_null_term() {
     TEST_ASSERT_EQUAL_INT(strlen_null_term((char*)"123456"), strlen((char*)"123456") + 1);
 }
 
+void test_monotonic_time_ms() {
+    uint64_t start = monotonic_time_ms();
+    struct timespec delay = {0, 20 * 1000000};  // 20ms
+    nanosleep(&delay, NULL);
+    uint64_t elapsed = monotonic_time_ms() - start;
+    TEST_ASSERT_TRUE(elapsed >= 20);
+    TEST_ASSERT_TRUE(elapsed < 1000);
+}
+
+void test_parse_number() {
+    long number = 0;
+    TEST_ASSERT_EQUAL_INT(0, parse_number("42", 1, 100, &number));
+    TEST_ASSERT_EQUAL_INT64(42, number);
+    TEST_ASSERT_EQUAL_INT(0, parse_number("1", 1, 100, &number));
+    TEST_ASSERT_EQUAL_INT(0, parse_number("100", 1, 100, &number));
+    // rejected values leave the number as it was
+    TEST_ASSERT_EQUAL_INT(-1, parse_number("0", 1, 100, &number));
+    TEST_ASSERT_EQUAL_INT(-1, parse_number("101", 1, 100, &number));
+    TEST_ASSERT_EQUAL_INT(-1, parse_number("-1", 0, LONG_MAX, &number));
+    TEST_ASSERT_EQUAL_INT(-1, parse_number("abc", 0, 100, &number));
+    TEST_ASSERT_EQUAL_INT(-1, parse_number("12abc", 0, 100, &number));
+    TEST_ASSERT_EQUAL_INT(-1, parse_number("", 0, 100, &number));
+    TEST_ASSERT_EQUAL_INT(-1, parse_number(NULL, 0, 100, &number));
+    TEST_ASSERT_EQUAL_INT(-1, parse_number("99999999999999999999999", 0, LONG_MAX, &number));
+    TEST_ASSERT_EQUAL_INT64(100, number);
+}
+
 void setUp(void) {}
 void tearDown(void) {}
 
 int main(void) {
     UNITY_BEGIN();
     RUN_TEST(test_strlen_null_term);
+    RUN_TEST(test_monotonic_time_ms);
+    RUN_TEST(test_parse_number);
     return UNITY_END();
 }